@@ -27,6 +27,20 @@
 #include <string.h>
 #include "gstcolorspaceorc.h"
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* Bands start at multiples of this many lines, which keeps the chroma lines
+ * of all subsampled formats and the halftone dither pattern aligned */
+#define SLICE_ALIGN 8
+
+struct _ColorspaceSlice
+{
+  ColorspaceConvert convert;
+  guint8 *dest;
+  const guint8 *src;
+};
 
 static void colorspace_convert_generic (ColorspaceConvert * convert,
     guint8 * dest, const guint8 * src);
@@ -35,6 +49,7 @@ static void colorspace_convert_lookup_getput (ColorspaceConvert * convert);
 static void colorspace_dither_none (ColorspaceConvert * convert, int j);
 static void colorspace_dither_verterr (ColorspaceConvert * convert, int j);
 static void colorspace_dither_halftone (ColorspaceConvert * convert, int j);
+static void colorspace_bands_set_width (ColorspaceBands * bands, int width);
 
 
 ColorspaceConvert *
@@ -107,8 +122,6 @@ colorspace_convert_new (GstVideoFormat to_format, ColorSpaceColorSpec to_spec,
   colorspace_convert_lookup_fastpath (convert);
   colorspace_convert_lookup_getput (convert);
 
-  convert->tmpline = g_malloc (sizeof (guint8) * (width + 8) * 4);
-  convert->tmpline16 = g_malloc (sizeof (guint16) * (width + 8) * 4);
   convert->errline = g_malloc (sizeof (guint16) * width * 4);
 
   if (to_format == GST_VIDEO_FORMAT_RGB8_PALETTED) {
@@ -140,8 +153,6 @@ void
 colorspace_convert_free (ColorspaceConvert * convert)
 {
   g_free (convert->palette);
-  g_free (convert->tmpline);
-  g_free (convert->tmpline16);
   g_free (convert->errline);
 
   g_free (convert);
@@ -187,11 +198,189 @@ colorspace_convert_get_palette (ColorspaceConvert * convert)
   return convert->palette;
 }
 
+/* Sets up the converter of a slice for the lines [y, y + height) of the
+ * frame, with the temporary lines of the slice */
+static void
+colorspace_convert_setup_slice (ColorspaceConvert * convert,
+    ColorspaceSlice * slice, guint8 * dest, const guint8 * src, int y,
+    int height)
+{
+  ColorspaceConvert *c = &slice->convert;
+  guint8 *tmpline = c->tmpline;
+  guint16 *tmpline16 = c->tmpline16;
+  int i;
+
+  memcpy (c, convert, sizeof (ColorspaceConvert));
+  c->tmpline = tmpline;
+  c->tmpline16 = tmpline16;
+  c->height = height;
+
+  for (i = 0; i < 4; i++) {
+    c->dest_offset[i] += c->dest_stride[i] *
+        gst_video_format_get_component_height (convert->to_format, i, y);
+    c->src_offset[i] += c->src_stride[i] *
+        gst_video_format_get_component_height (convert->from_format, i, y);
+  }
+
+  slice->dest = dest;
+  slice->src = src;
+}
+
 void
 colorspace_convert_convert (ColorspaceConvert * convert,
-    guint8 * dest, const guint8 * src)
+    ColorspaceBands * bands, guint8 * dest, const guint8 * src)
+{
+  int i, lines, n_slices;
+
+  colorspace_bands_set_width (bands, convert->width);
+
+  /* The error of the vertical error dithering is carried from line to line */
+  if (bands->n_threads < 2 || convert->dither16 == colorspace_dither_verterr) {
+    colorspace_convert_setup_slice (convert, &bands->slices[0], dest, src, 0,
+        convert->height);
+    bands->slices[0].convert.convert (&bands->slices[0].convert, dest, src);
+    return;
+  }
+
+  lines = (convert->height + bands->n_threads - 1) / bands->n_threads;
+  lines = (lines + SLICE_ALIGN - 1) / SLICE_ALIGN * SLICE_ALIGN;
+  n_slices = (convert->height + lines - 1) / lines;
+
+  for (i = 0; i < n_slices; i++)
+    colorspace_convert_setup_slice (convert, &bands->slices[i], dest, src,
+        i * lines, MIN (lines, convert->height - i * lines));
+
+  bands->n_pending = n_slices - 1;
+  for (i = 1; i < n_slices; i++)
+    g_thread_pool_push (bands->pool, &bands->slices[i], NULL);
+
+  bands->slices[0].convert.convert (&bands->slices[0].convert, dest, src);
+
+  g_mutex_lock (bands->lock);
+  while (bands->n_pending > 0)
+    g_cond_wait (bands->cond, bands->lock);
+  g_mutex_unlock (bands->lock);
+}
+
+ColorspaceBands *
+colorspace_bands_new (void)
+{
+  ColorspaceBands *bands;
+
+  bands = g_new0 (ColorspaceBands, 1);
+  bands->n_threads = 1;
+  bands->slices = g_new0 (ColorspaceSlice, 1);
+  bands->lock = g_mutex_new ();
+  bands->cond = g_cond_new ();
+
+  return bands;
+}
+
+static void
+colorspace_bands_free_slices (ColorspaceBands * bands)
+{
+  int i;
+
+  if (bands->pool) {
+    g_thread_pool_free (bands->pool, FALSE, TRUE);
+    bands->pool = NULL;
+  }
+
+  for (i = 0; i < bands->n_threads; i++) {
+    g_free (bands->slices[i].convert.tmpline);
+    g_free (bands->slices[i].convert.tmpline16);
+  }
+  g_free (bands->slices);
+  bands->slices = NULL;
+}
+
+void
+colorspace_bands_free (ColorspaceBands * bands)
 {
-  convert->convert (convert, dest, src);
+  colorspace_bands_free_slices (bands);
+  g_mutex_free (bands->lock);
+  g_cond_free (bands->cond);
+
+  g_free (bands);
+}
+
+/* Makes the temporary lines of the slices big enough for @width pixels,
+ * they only ever grow */
+static void
+colorspace_bands_set_width (ColorspaceBands * bands, int width)
+{
+  int i;
+
+  if (width <= bands->width)
+    return;
+
+  for (i = 0; i < bands->n_threads; i++) {
+    ColorspaceConvert *c = &bands->slices[i].convert;
+
+    c->tmpline = g_realloc (c->tmpline, sizeof (guint8) * (width + 8) * 4);
+    c->tmpline16 = g_realloc (c->tmpline16,
+        sizeof (guint16) * (width + 8) * 4);
+  }
+  bands->width = width;
+}
+
+static void
+colorspace_bands_slice_func (ColorspaceSlice * slice, ColorspaceBands * bands)
+{
+  slice->convert.convert (&slice->convert, slice->dest, slice->src);
+
+  g_mutex_lock (bands->lock);
+  if (--bands->n_pending == 0)
+    g_cond_signal (bands->cond);
+  g_mutex_unlock (bands->lock);
+}
+
+static int
+colorspace_get_n_processors (void)
+{
+#if defined (HAVE_UNISTD_H) && defined (_SC_NPROCESSORS_ONLN)
+  long n = sysconf (_SC_NPROCESSORS_ONLN);
+
+  if (n > 0)
+    return MIN (n, 64);
+#endif
+  return 1;
+}
+
+/* Converts frames in up to n_threads horizontal bands, 0 uses one thread
+ * per processor. The band of the calling thread is converted in place, the
+ * others by a pool of n_threads - 1 persistent threads */
+void
+colorspace_bands_set_n_threads (ColorspaceBands * bands, int n_threads)
+{
+  GError *err = NULL;
+  int width = bands->width;
+
+  if (n_threads <= 0)
+    n_threads = colorspace_get_n_processors ();
+  n_threads = MAX (n_threads, 1);
+
+  if (n_threads == bands->n_threads)
+    return;
+
+  colorspace_bands_free_slices (bands);
+  bands->n_threads = 1;
+  bands->width = 0;
+
+  if (n_threads > 1) {
+    bands->pool =
+        g_thread_pool_new ((GFunc) colorspace_bands_slice_func, bands,
+        n_threads - 1, TRUE, &err);
+    if (bands->pool == NULL) {
+      GST_WARNING ("failed to create thread pool: %s", err->message);
+      g_error_free (err);
+    } else {
+      bands->n_threads = n_threads;
+    }
+  }
+
+  bands->slices = g_new0 (ColorspaceSlice, bands->n_threads);
+  colorspace_bands_set_width (bands, width);
 }
 
 /* Line conversion to AYUV */
@@ -1399,141 +1588,35 @@ static const ColorspaceLine lines[] = {
       putline16_r210}
 };
 
-static void
-matrix_rgb_to_yuv_bt470_6 (ColorspaceConvert * convert)
-{
-  int i;
-  int r, g, b;
-  int y, u, v;
-  guint8 *tmpline = convert->tmpline;
-
-  for (i = 0; i < convert->width; i++) {
-    r = tmpline[i * 4 + 1];
-    g = tmpline[i * 4 + 2];
-    b = tmpline[i * 4 + 3];
-
-    y = (66 * r + 129 * g + 25 * b + 4096) >> 8;
-    u = (-38 * r - 74 * g + 112 * b + 32768) >> 8;
-    v = (112 * r - 94 * g - 18 * b + 32768) >> 8;
-
-    tmpline[i * 4 + 1] = CLAMP (y, 0, 255);
-    tmpline[i * 4 + 2] = CLAMP (u, 0, 255);
-    tmpline[i * 4 + 3] = CLAMP (v, 0, 255);
-  }
-}
-
-static void
-matrix_rgb_to_yuv_bt709 (ColorspaceConvert * convert)
-{
-  int i;
-  int r, g, b;
-  int y, u, v;
-  guint8 *tmpline = convert->tmpline;
-
-  for (i = 0; i < convert->width; i++) {
-    r = tmpline[i * 4 + 1];
-    g = tmpline[i * 4 + 2];
-    b = tmpline[i * 4 + 3];
-
-    y = (47 * r + 157 * g + 16 * b + 4096) >> 8;
-    u = (-26 * r - 87 * g + 112 * b + 32768) >> 8;
-    v = (112 * r - 102 * g - 10 * b + 32768) >> 8;
-
-    tmpline[i * 4 + 1] = CLAMP (y, 0, 255);
-    tmpline[i * 4 + 2] = CLAMP (u, 0, 255);
-    tmpline[i * 4 + 3] = CLAMP (v, 0, 255);
-  }
-}
-
-static void
-matrix_yuv_bt470_6_to_rgb (ColorspaceConvert * convert)
-{
-  int i;
-  int r, g, b;
-  int y, u, v;
-  guint8 *tmpline = convert->tmpline;
-
-  for (i = 0; i < convert->width; i++) {
-    y = tmpline[i * 4 + 1];
-    u = tmpline[i * 4 + 2];
-    v = tmpline[i * 4 + 3];
-
-    r = (298 * y + 409 * v - 57068) >> 8;
-    g = (298 * y - 100 * u - 208 * v + 34707) >> 8;
-    b = (298 * y + 516 * u - 70870) >> 8;
-
-    tmpline[i * 4 + 1] = CLAMP (r, 0, 255);
-    tmpline[i * 4 + 2] = CLAMP (g, 0, 255);
-    tmpline[i * 4 + 3] = CLAMP (b, 0, 255);
-  }
-}
-
-static void
-matrix_yuv_bt709_to_rgb (ColorspaceConvert * convert)
-{
-  int i;
-  int r, g, b;
-  int y, u, v;
-  guint8 *tmpline = convert->tmpline;
-
-  for (i = 0; i < convert->width; i++) {
-    y = tmpline[i * 4 + 1];
-    u = tmpline[i * 4 + 2];
-    v = tmpline[i * 4 + 3];
-
-    r = (298 * y + 459 * v - 63514) >> 8;
-    g = (298 * y - 55 * u - 136 * v + 19681) >> 8;
-    b = (298 * y + 541 * u - 73988) >> 8;
-
-    tmpline[i * 4 + 1] = CLAMP (r, 0, 255);
-    tmpline[i * 4 + 2] = CLAMP (g, 0, 255);
-    tmpline[i * 4 + 3] = CLAMP (b, 0, 255);
-  }
-}
-
-static void
-matrix_yuv_bt709_to_yuv_bt470_6 (ColorspaceConvert * convert)
+/* The matrices of 8 bit samples are tables of the products of each
+ * coefficient with all sample values, with the offset added to the first
+ * column */
+struct _ColorspaceMatrixTable
 {
-  int i;
-  int r, g, b;
-  int y, u, v;
-  guint8 *tmpline = convert->tmpline;
-
-  for (i = 0; i < convert->width; i++) {
-    y = tmpline[i * 4 + 1];
-    u = tmpline[i * 4 + 2];
-    v = tmpline[i * 4 + 3];
-
-    r = (256 * y + 25 * u + 49 * v - 9536) >> 8;
-    g = (253 * u - 28 * v + 3958) >> 8;
-    b = (-19 * u + 252 * v + 2918) >> 8;
-
-    tmpline[i * 4 + 1] = CLAMP (r, 0, 255);
-    tmpline[i * 4 + 2] = CLAMP (g, 0, 255);
-    tmpline[i * 4 + 3] = CLAMP (b, 0, 255);
-  }
-}
+  gint32 lut[3][3][256];
+};
 
 static void
-matrix_yuv_bt470_6_to_yuv_bt709 (ColorspaceConvert * convert)
+matrix_lut (ColorspaceConvert * convert)
 {
   int i;
-  int r, g, b;
-  int y, u, v;
+  int a, b, c;
+  int x, y, z;
   guint8 *tmpline = convert->tmpline;
+  const ColorspaceMatrixTable *t = convert->matrix_table;
 
   for (i = 0; i < convert->width; i++) {
-    y = tmpline[i * 4 + 1];
-    u = tmpline[i * 4 + 2];
-    v = tmpline[i * 4 + 3];
+    a = tmpline[i * 4 + 1];
+    b = tmpline[i * 4 + 2];
+    c = tmpline[i * 4 + 3];
 
-    r = (256 * y - 30 * u - 53 * v + 10600) >> 8;
-    g = (261 * u + 29 * v - 4367) >> 8;
-    b = (19 * u + 262 * v - 3289) >> 8;
+    x = (t->lut[0][0][a] + t->lut[0][1][b] + t->lut[0][2][c]) >> 8;
+    y = (t->lut[1][0][a] + t->lut[1][1][b] + t->lut[1][2][c]) >> 8;
+    z = (t->lut[2][0][a] + t->lut[2][1][b] + t->lut[2][2][c]) >> 8;
 
-    tmpline[i * 4 + 1] = CLAMP (r, 0, 255);
-    tmpline[i * 4 + 2] = CLAMP (g, 0, 255);
-    tmpline[i * 4 + 3] = CLAMP (b, 0, 255);
+    tmpline[i * 4 + 1] = CLAMP (x, 0, 255);
+    tmpline[i * 4 + 2] = CLAMP (y, 0, 255);
+    tmpline[i * 4 + 3] = CLAMP (z, 0, 255);
   }
 }
 
@@ -1689,6 +1772,64 @@ matrix16_identity (ColorspaceConvert * convert)
 
 
 
+typedef struct
+{
+  ColorSpaceColorSpec from_spec;
+  ColorSpaceColorSpec to_spec;
+  gint coeff[3][3];
+  gint offset[3];
+  void (*matrix16) (ColorspaceConvert * convert);
+} ColorspaceMatrix;
+
+static const ColorspaceMatrix matrices[] = {
+  {COLOR_SPEC_RGB, COLOR_SPEC_YUV_BT470_6,
+        {{66, 129, 25}, {-38, -74, 112}, {112, -94, -18}},
+      {4096, 32768, 32768}, matrix16_rgb_to_yuv_bt470_6},
+  {COLOR_SPEC_RGB, COLOR_SPEC_YUV_BT709,
+        {{47, 157, 16}, {-26, -87, 112}, {112, -102, -10}},
+      {4096, 32768, 32768}, matrix16_rgb_to_yuv_bt709},
+  {COLOR_SPEC_YUV_BT470_6, COLOR_SPEC_RGB,
+        {{298, 0, 409}, {298, -100, -208}, {298, 516, 0}},
+      {-57068, 34707, -70870}, matrix16_yuv_bt470_6_to_rgb},
+  {COLOR_SPEC_YUV_BT709, COLOR_SPEC_RGB,
+        {{298, 0, 459}, {298, -55, -136}, {298, 541, 0}},
+      {-63514, 19681, -73988}, matrix16_yuv_bt709_to_rgb},
+  {COLOR_SPEC_YUV_BT709, COLOR_SPEC_YUV_BT470_6,
+        {{256, 25, 49}, {0, 253, -28}, {0, -19, 252}},
+      {-9536, 3958, 2918}, matrix16_yuv_bt709_to_yuv_bt470_6},
+  {COLOR_SPEC_YUV_BT470_6, COLOR_SPEC_YUV_BT709,
+        {{256, -30, -53}, {0, 261, 29}, {0, 19, 262}},
+      {10600, -4367, -3289}, matrix16_yuv_bt470_6_to_yuv_bt709}
+};
+
+/* Built on first use and shared by all converters */
+static GStaticMutex matrix_tables_lock = G_STATIC_MUTEX_INIT;
+static ColorspaceMatrixTable *matrix_tables[G_N_ELEMENTS (matrices)];
+
+static const ColorspaceMatrixTable *
+colorspace_get_matrix_table (int n)
+{
+  const ColorspaceMatrix *m = &matrices[n];
+  ColorspaceMatrixTable *t;
+  int i, j, v;
+
+  g_static_mutex_lock (&matrix_tables_lock);
+  t = matrix_tables[n];
+  if (t == NULL) {
+    t = g_new (ColorspaceMatrixTable, 1);
+    for (i = 0; i < 3; i++) {
+      for (j = 0; j < 3; j++) {
+        for (v = 0; v < 256; v++)
+          t->lut[i][j][v] = m->coeff[i][j] * v + (j == 0 ? m->offset[i] : 0);
+      }
+    }
+    matrix_tables[n] = t;
+  }
+  g_static_mutex_unlock (&matrix_tables_lock);
+
+  return t;
+}
+
 static void
 colorspace_convert_lookup_getput (ColorspaceConvert * convert)
 {
@@ -1721,33 +1862,20 @@ colorspace_convert_lookup_getput (ColorspaceConvert * convert)
     convert->putline16 = putline16_convert;
   }
 
-  if (convert->from_spec == convert->to_spec) {
-    convert->matrix = matrix_identity;
-    convert->matrix16 = matrix16_identity;
-  } else if (convert->from_spec == COLOR_SPEC_RGB
-      && convert->to_spec == COLOR_SPEC_YUV_BT470_6) {
-    convert->matrix = matrix_rgb_to_yuv_bt470_6;
-    convert->matrix16 = matrix16_rgb_to_yuv_bt470_6;
-  } else if (convert->from_spec == COLOR_SPEC_RGB
-      && convert->to_spec == COLOR_SPEC_YUV_BT709) {
-    convert->matrix = matrix_rgb_to_yuv_bt709;
-    convert->matrix16 = matrix16_rgb_to_yuv_bt709;
-  } else if (convert->from_spec == COLOR_SPEC_YUV_BT470_6
-      && convert->to_spec == COLOR_SPEC_RGB) {
-    convert->matrix = matrix_yuv_bt470_6_to_rgb;
-    convert->matrix16 = matrix16_yuv_bt470_6_to_rgb;
-  } else if (convert->from_spec == COLOR_SPEC_YUV_BT709
-      && convert->to_spec == COLOR_SPEC_RGB) {
-    convert->matrix = matrix_yuv_bt709_to_rgb;
-    convert->matrix16 = matrix16_yuv_bt709_to_rgb;
-  } else if (convert->from_spec == COLOR_SPEC_YUV_BT709
-      && convert->to_spec == COLOR_SPEC_YUV_BT470_6) {
-    convert->matrix = matrix_yuv_bt709_to_yuv_bt470_6;
-    convert->matrix16 = matrix16_yuv_bt709_to_yuv_bt470_6;
-  } else if (convert->from_spec == COLOR_SPEC_YUV_BT470_6
-      && convert->to_spec == COLOR_SPEC_YUV_BT709) {
-    convert->matrix = matrix_yuv_bt470_6_to_yuv_bt709;
-    convert->matrix16 = matrix16_yuv_bt470_6_to_yuv_bt709;
+  convert->matrix = matrix_identity;
+  convert->matrix16 = matrix16_identity;
+  convert->matrix_table = NULL;
+  if (convert->from_spec == convert->to_spec)
+    return;
+
+  for (i = 0; i < G_N_ELEMENTS (matrices); i++) {
+    if (matrices[i].from_spec == convert->from_spec &&
+        matrices[i].to_spec == convert->to_spec) {
+      convert->matrix = matrix_lut;
+      convert->matrix16 = matrices[i].matrix16;
+      convert->matrix_table = colorspace_get_matrix_table (i);
+      break;
+    }
   }
 }
 
@@ -1801,21 +1929,22 @@ colorspace_dither_verterr (ColorspaceConvert * convert, int j)
   }
 }
 
+static const guint16 halftone[8][8] = {
+  {0, 128, 32, 160, 8, 136, 40, 168},
+  {192, 64, 224, 96, 200, 72, 232, 104},
+  {48, 176, 16, 144, 56, 184, 24, 152},
+  {240, 112, 208, 80, 248, 120, 216, 88},
+  {12, 240, 44, 172, 4, 132, 36, 164},
+  {204, 76, 236, 108, 196, 68, 228, 100},
+  {60, 188, 28, 156, 52, 180, 20, 148},
+  {252, 142, 220, 92, 244, 116, 212, 84}
+};
+
 static void
 colorspace_dither_halftone (ColorspaceConvert * convert, int j)
 {
   int i;
   guint16 *tmpline = convert->tmpline16;
-  static guint16 halftone[8][8] = {
-    {0, 128, 32, 160, 8, 136, 40, 168},
-    {192, 64, 224, 96, 200, 72, 232, 104},
-    {48, 176, 16, 144, 56, 184, 24, 152},
-    {240, 112, 208, 80, 248, 120, 216, 88},
-    {12, 240, 44, 172, 4, 132, 36, 164},
-    {204, 76, 236, 108, 196, 68, 228, 100},
-    {60, 188, 28, 156, 52, 180, 20, 148},
-    {252, 142, 220, 92, 244, 116, 212, 84}
-  };
 
   for (i = 0; i < convert->width * 4; i++) {
     tmpline[i] += halftone[(i >> 2) & 7][j & 7];
@@ -2211,6 +2340,365 @@ convert_Y444_AYUV (ColorspaceConvert * convert, guint8 * dest,
       convert->src_stride[2], convert->width, convert->height);
 }
 
+/* Fused fastpaths for 10 bit formats. These unpack, convert and pack in a
+ * single pass without 16 bit temporary lines. When reducing to 8 bit they
+ * apply the halftone dither, error diffusion falls back to the generic
+ * path */
+
+/* 10 bit sample to 8 bit, with a dither value of the 16 bit range */
+#define TO_8BIT(v,d) ((guint8) (MIN (((v) << 6) + (d), 0xffff) >> 8))
+
+static void
+colorspace_dither_line (ColorspaceConvert * convert, int j, guint16 * d)
+{
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    if (convert->dither16 == colorspace_dither_halftone)
+      d[i] = halftone[i][j & 7];
+    else
+      d[i] = 0;
+  }
+}
+
+static inline void
+unpack_v210 (const guint8 * p, guint16 * y, guint16 * u, guint16 * v)
+{
+  guint32 a0, a1, a2, a3;
+
+  a0 = GST_READ_UINT32_LE (p + 0);
+  a1 = GST_READ_UINT32_LE (p + 4);
+  a2 = GST_READ_UINT32_LE (p + 8);
+  a3 = GST_READ_UINT32_LE (p + 12);
+
+  u[0] = (a0 >> 0) & 0x3ff;
+  y[0] = (a0 >> 10) & 0x3ff;
+  v[0] = (a0 >> 20) & 0x3ff;
+  y[1] = (a1 >> 0) & 0x3ff;
+
+  u[1] = (a1 >> 10) & 0x3ff;
+  y[2] = (a1 >> 20) & 0x3ff;
+  v[1] = (a2 >> 0) & 0x3ff;
+  y[3] = (a2 >> 10) & 0x3ff;
+
+  u[2] = (a2 >> 20) & 0x3ff;
+  y[4] = (a3 >> 0) & 0x3ff;
+  v[2] = (a3 >> 10) & 0x3ff;
+  y[5] = (a3 >> 20) & 0x3ff;
+}
+
+static inline void
+pack_v210 (guint8 * p, const guint16 * y, const guint16 * u,
+    const guint16 * v)
+{
+  GST_WRITE_UINT32_LE (p + 0, u[0] | (y[0] << 10) | (v[0] << 20));
+  GST_WRITE_UINT32_LE (p + 4, y[1] | (u[1] << 10) | (y[2] << 20));
+  GST_WRITE_UINT32_LE (p + 8, v[1] | (y[3] << 10) | (u[2] << 20));
+  GST_WRITE_UINT32_LE (p + 12, y[4] | (v[2] << 10) | (y[5] << 20));
+}
+
+static void
+convert_v210_UYVY (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j, k;
+  guint16 d[8];
+
+  if (convert->dither16 == colorspace_dither_verterr) {
+    colorspace_convert_generic (convert, dest, src);
+    return;
+  }
+
+  for (j = 0; j < convert->height; j++) {
+    const guint8 *srcline = FRAME_GET_LINE (src, 0, j);
+    guint8 *destline = FRAME_GET_LINE (dest, 0, j);
+
+    colorspace_dither_line (convert, j, d);
+    for (i = 0; i < convert->width; i += 6) {
+      guint16 y[6], u[3], v[3];
+
+      unpack_v210 (srcline + (i / 6) * 16, y, u, v);
+      for (k = 0; k < 3 && i + 2 * k < convert->width; k++) {
+        int x = i + 2 * k;
+
+        destline[x * 2 + 0] = TO_8BIT (u[k], d[x & 7]);
+        destline[x * 2 + 1] = TO_8BIT (y[2 * k], d[x & 7]);
+        destline[x * 2 + 2] = TO_8BIT (v[k], d[x & 7]);
+        destline[x * 2 + 3] = TO_8BIT (y[2 * k + 1], d[(x + 1) & 7]);
+      }
+    }
+  }
+}
+
+static void
+convert_v210_I420 (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j, k;
+  guint16 d0[8], d1[8];
+
+  if (convert->dither16 == colorspace_dither_verterr) {
+    colorspace_convert_generic (convert, dest, src);
+    return;
+  }
+
+  for (j = 0; j < convert->height; j += 2) {
+    gboolean second = (j + 1 < convert->height);
+    const guint8 *srcline0 = FRAME_GET_LINE (src, 0, j);
+    const guint8 *srcline1 = FRAME_GET_LINE (src, 0, second ? j + 1 : j);
+    guint8 *ydest0 = FRAME_GET_LINE (dest, 0, j);
+    guint8 *ydest1 = FRAME_GET_LINE (dest, 0, j + 1);
+    guint8 *udest = FRAME_GET_LINE (dest, 1, j >> 1);
+    guint8 *vdest = FRAME_GET_LINE (dest, 2, j >> 1);
+
+    colorspace_dither_line (convert, j, d0);
+    colorspace_dither_line (convert, j + 1, d1);
+    for (i = 0; i < convert->width; i += 6) {
+      guint16 y0[6], u0[3], v0[3];
+      guint16 y1[6], u1[3], v1[3];
+
+      unpack_v210 (srcline0 + (i / 6) * 16, y0, u0, v0);
+      unpack_v210 (srcline1 + (i / 6) * 16, y1, u1, v1);
+      for (k = 0; k < 6 && i + k < convert->width; k++) {
+        ydest0[i + k] = TO_8BIT (y0[k], d0[(i + k) & 7]);
+        if (second)
+          ydest1[i + k] = TO_8BIT (y1[k], d1[(i + k) & 7]);
+      }
+      /* Chroma of both lines averaged, dithered like the first luma line */
+      for (k = 0; k < 3 && i + 2 * k < convert->width; k++) {
+        int x = i + 2 * k;
+
+        udest[x / 2] = TO_8BIT ((u0[k] + u1[k] + 1) >> 1, d0[x & 7]);
+        vdest[x / 2] = TO_8BIT ((v0[k] + v1[k] + 1) >> 1, d0[x & 7]);
+      }
+    }
+  }
+}
+
+static void
+convert_v210_AYUV (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j, k;
+  guint16 d[8];
+
+  if (convert->dither16 == colorspace_dither_verterr) {
+    colorspace_convert_generic (convert, dest, src);
+    return;
+  }
+
+  for (j = 0; j < convert->height; j++) {
+    const guint8 *srcline = FRAME_GET_LINE (src, 0, j);
+    guint8 *destline = FRAME_GET_LINE (dest, 0, j);
+
+    colorspace_dither_line (convert, j, d);
+    for (i = 0; i < convert->width; i += 6) {
+      guint16 y[6], u[3], v[3];
+
+      unpack_v210 (srcline + (i / 6) * 16, y, u, v);
+      for (k = 0; k < 6 && i + k < convert->width; k++) {
+        int x = i + k;
+
+        destline[x * 4 + 0] = 0xff;
+        destline[x * 4 + 1] = TO_8BIT (y[k], d[x & 7]);
+        destline[x * 4 + 2] = TO_8BIT (u[k >> 1], d[x & 7]);
+        destline[x * 4 + 3] = TO_8BIT (v[k >> 1], d[x & 7]);
+      }
+    }
+  }
+}
+
+static void
+convert_v210_v216 (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j, k;
+
+  for (j = 0; j < convert->height; j++) {
+    const guint8 *srcline = FRAME_GET_LINE (src, 0, j);
+    guint8 *destline = FRAME_GET_LINE (dest, 0, j);
+
+    for (i = 0; i < convert->width; i += 6) {
+      guint16 y[6], u[3], v[3];
+
+      unpack_v210 (srcline + (i / 6) * 16, y, u, v);
+      for (k = 0; k < 3 && i + 2 * k < convert->width; k++) {
+        guint8 *p = destline + (i / 2 + k) * 8;
+
+        GST_WRITE_UINT16_LE (p + 0, u[k] << 6);
+        GST_WRITE_UINT16_LE (p + 2, y[2 * k] << 6);
+        GST_WRITE_UINT16_LE (p + 4, v[k] << 6);
+        GST_WRITE_UINT16_LE (p + 6, y[2 * k + 1] << 6);
+      }
+    }
+  }
+}
+
+/* Pixels after the end of the line repeat the last one in the v210 blocks */
+
+static void
+convert_UYVY_v210 (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j, k;
+  int last = convert->width - 1;
+
+  for (j = 0; j < convert->height; j++) {
+    const guint8 *srcline = FRAME_GET_LINE (src, 0, j);
+    guint8 *destline = FRAME_GET_LINE (dest, 0, j);
+
+    for (i = 0; i < convert->width; i += 6) {
+      guint16 y[6], u[3], v[3];
+
+      for (k = 0; k < 6; k++)
+        y[k] = srcline[MIN (i + k, last) * 2 + 1] << 2;
+      for (k = 0; k < 3; k++) {
+        int x = MIN (i + 2 * k, last) & ~1;
+
+        u[k] = srcline[x * 2 + 0] << 2;
+        v[k] = srcline[x * 2 + 2] << 2;
+      }
+      pack_v210 (destline + (i / 6) * 16, y, u, v);
+    }
+  }
+}
+
+static void
+convert_I420_v210 (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j, k;
+  int last = convert->width - 1;
+
+  for (j = 0; j < convert->height; j++) {
+    const guint8 *ysrc = FRAME_GET_LINE (src, 0, j);
+    const guint8 *usrc = FRAME_GET_LINE (src, 1, j >> 1);
+    const guint8 *vsrc = FRAME_GET_LINE (src, 2, j >> 1);
+    guint8 *destline = FRAME_GET_LINE (dest, 0, j);
+
+    for (i = 0; i < convert->width; i += 6) {
+      guint16 y[6], u[3], v[3];
+
+      for (k = 0; k < 6; k++)
+        y[k] = ysrc[MIN (i + k, last)] << 2;
+      for (k = 0; k < 3; k++) {
+        int x = MIN (i + 2 * k, last) >> 1;
+
+        u[k] = usrc[x] << 2;
+        v[k] = vsrc[x] << 2;
+      }
+      pack_v210 (destline + (i / 6) * 16, y, u, v);
+    }
+  }
+}
+
+static void
+convert_AYUV_v210 (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j, k;
+  int last = convert->width - 1;
+
+  for (j = 0; j < convert->height; j++) {
+    const guint8 *srcline = FRAME_GET_LINE (src, 0, j);
+    guint8 *destline = FRAME_GET_LINE (dest, 0, j);
+
+    for (i = 0; i < convert->width; i += 6) {
+      guint16 y[6], u[3], v[3];
+
+      for (k = 0; k < 6; k++)
+        y[k] = srcline[MIN (i + k, last) * 4 + 1] << 2;
+      for (k = 0; k < 3; k++) {
+        int x0 = MIN (i + 2 * k, last);
+        int x1 = MIN (i + 2 * k + 1, last);
+
+        u[k] = (srcline[x0 * 4 + 2] + srcline[x1 * 4 + 2]) << 1;
+        v[k] = (srcline[x0 * 4 + 3] + srcline[x1 * 4 + 3]) << 1;
+      }
+      pack_v210 (destline + (i / 6) * 16, y, u, v);
+    }
+  }
+}
+
+static void
+convert_v216_v210 (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j, k;
+  int last = convert->width - 1;
+
+  for (j = 0; j < convert->height; j++) {
+    const guint8 *srcline = FRAME_GET_LINE (src, 0, j);
+    guint8 *destline = FRAME_GET_LINE (dest, 0, j);
+
+    for (i = 0; i < convert->width; i += 6) {
+      guint16 y[6], u[3], v[3];
+
+      for (k = 0; k < 6; k++) {
+        int x = MIN (i + k, last);
+
+        y[k] = GST_READ_UINT16_LE (srcline + (x >> 1) * 8 + 2 + (x & 1) * 4)
+            >> 6;
+      }
+      for (k = 0; k < 3; k++) {
+        int x = MIN (i + 2 * k, last) >> 1;
+
+        u[k] = GST_READ_UINT16_LE (srcline + x * 8 + 0) >> 6;
+        v[k] = GST_READ_UINT16_LE (srcline + x * 8 + 4) >> 6;
+      }
+      pack_v210 (destline + (i / 6) * 16, y, u, v);
+    }
+  }
+}
+
+static void
+convert_r210_ARGB (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j;
+  guint16 d[8];
+
+  if (convert->dither16 == colorspace_dither_verterr) {
+    colorspace_convert_generic (convert, dest, src);
+    return;
+  }
+
+  for (j = 0; j < convert->height; j++) {
+    const guint8 *srcline = FRAME_GET_LINE (src, 0, j);
+    guint8 *destline = FRAME_GET_LINE (dest, 0, j);
+
+    colorspace_dither_line (convert, j, d);
+    for (i = 0; i < convert->width; i++) {
+      guint32 x = GST_READ_UINT32_BE (srcline + i * 4);
+
+      destline[i * 4 + 0] = 0xff;
+      destline[i * 4 + 1] = TO_8BIT ((x >> 20) & 0x3ff, d[i & 7]);
+      destline[i * 4 + 2] = TO_8BIT ((x >> 10) & 0x3ff, d[i & 7]);
+      destline[i * 4 + 3] = TO_8BIT (x & 0x3ff, d[i & 7]);
+    }
+  }
+}
+
+static void
+convert_ARGB_r210 (ColorspaceConvert * convert, guint8 * dest,
+    const guint8 * src)
+{
+  int i, j;
+
+  for (j = 0; j < convert->height; j++) {
+    const guint8 *srcline = FRAME_GET_LINE (src, 0, j);
+    guint8 *destline = FRAME_GET_LINE (dest, 0, j);
+
+    for (i = 0; i < convert->width; i++) {
+      guint32 x;
+
+      x = (srcline[i * 4 + 1] << 22) | (srcline[i * 4 + 2] << 12) |
+          (srcline[i * 4 + 3] << 2);
+      GST_WRITE_UINT32_BE (destline + i * 4, x);
+    }
+  }
+}
+
 #if G_BYTE_ORDER == G_LITTLE_ENDIAN
 static void
 convert_AYUV_ARGB (ColorspaceConvert * convert, guint8 * dest,
@@ -2362,6 +2850,33 @@ static const ColorspaceTransform transforms[] = {
   {GST_VIDEO_FORMAT_Y444, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_Y42B,
       COLOR_SPEC_NONE, TRUE, convert_Y444_Y42B},
 
+  {GST_VIDEO_FORMAT_v210, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_I420,
+      COLOR_SPEC_NONE, TRUE, convert_v210_I420},
+  {GST_VIDEO_FORMAT_v210, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_UYVY,
+      COLOR_SPEC_NONE, TRUE, convert_v210_UYVY},
+  {GST_VIDEO_FORMAT_v210, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_AYUV,
+      COLOR_SPEC_NONE, TRUE, convert_v210_AYUV},
+  {GST_VIDEO_FORMAT_v210, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_v216,
+      COLOR_SPEC_NONE, TRUE, convert_v210_v216},
+
+  {GST_VIDEO_FORMAT_I420, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_v210,
+      COLOR_SPEC_NONE, TRUE, convert_I420_v210},
+  {GST_VIDEO_FORMAT_UYVY, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_v210,
+      COLOR_SPEC_NONE, TRUE, convert_UYVY_v210},
+  {GST_VIDEO_FORMAT_AYUV, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_v210,
+      COLOR_SPEC_NONE, TRUE, convert_AYUV_v210},
+  {GST_VIDEO_FORMAT_v216, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_v210,
+      COLOR_SPEC_NONE, TRUE, convert_v216_v210},
+
+  {GST_VIDEO_FORMAT_r210, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_ARGB,
+      COLOR_SPEC_NONE, TRUE, convert_r210_ARGB},
+  {GST_VIDEO_FORMAT_r210, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_xRGB,
+      COLOR_SPEC_NONE, TRUE, convert_r210_ARGB},  /* alias */
+  {GST_VIDEO_FORMAT_ARGB, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_r210,
+      COLOR_SPEC_NONE, TRUE, convert_ARGB_r210},
+  {GST_VIDEO_FORMAT_xRGB, COLOR_SPEC_NONE, GST_VIDEO_FORMAT_r210,
+      COLOR_SPEC_NONE, TRUE, convert_ARGB_r210},  /* alias */
+
 #if G_BYTE_ORDER == G_LITTLE_ENDIAN
   {GST_VIDEO_FORMAT_AYUV, COLOR_SPEC_YUV_BT470_6, GST_VIDEO_FORMAT_ARGB,
       COLOR_SPEC_RGB, FALSE, convert_AYUV_ARGB},
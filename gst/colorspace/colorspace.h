@@ -25,7 +25,10 @@
 G_BEGIN_DECLS
 
 typedef struct _ColorspaceConvert ColorspaceConvert;
+typedef struct _ColorspaceBands ColorspaceBands;
 typedef struct _ColorspaceFrame ColorspaceComponent;
+typedef struct _ColorspaceSlice ColorspaceSlice;
+typedef struct _ColorspaceMatrixTable ColorspaceMatrixTable;
 
 typedef enum {
   COLOR_SPEC_NONE = 0,
@@ -71,6 +74,7 @@ struct _ColorspaceConvert {
   void (*getline) (ColorspaceConvert *convert, guint8 *dest, const guint8 *src, int j);
   void (*putline) (ColorspaceConvert *convert, guint8 *dest, const guint8 *src, int j);
   void (*matrix) (ColorspaceConvert *convert);
+  const ColorspaceMatrixTable *matrix_table;
 
   void (*getline16) (ColorspaceConvert *convert, guint16 *dest, const guint8 *src, int j);
   void (*putline16) (ColorspaceConvert *convert, guint8 *dest, const guint16 *src, int j);
@@ -78,6 +82,18 @@ struct _ColorspaceConvert {
   void (*dither16) (ColorspaceConvert *convert, int j);
 };
 
+/* Threads and temporary lines to convert frames in horizontal bands. They
+ * don't depend on the conversion, so they are kept across converters */
+struct _ColorspaceBands {
+  int n_threads;
+  int width;
+  ColorspaceSlice *slices;
+  GThreadPool *pool;
+  GMutex *lock;
+  GCond *cond;
+  int n_pending;
+};
+
 ColorspaceConvert * colorspace_convert_new (GstVideoFormat to_format,
     ColorSpaceColorSpec from_spec, GstVideoFormat from_format,
     ColorSpaceColorSpec to_spec, int width, int height);
@@ -89,7 +105,11 @@ void colorspace_convert_set_palette (ColorspaceConvert *convert,
 const guint32 * colorspace_convert_get_palette (ColorspaceConvert *convert);
 void colorspace_convert_free (ColorspaceConvert * convert);
 void colorspace_convert_convert (ColorspaceConvert * convert,
-    guint8 *dest, const guint8 *src);
+    ColorspaceBands * bands, guint8 *dest, const guint8 *src);
+
+ColorspaceBands * colorspace_bands_new (void);
+void colorspace_bands_set_n_threads (ColorspaceBands * bands, int n_threads);
+void colorspace_bands_free (ColorspaceBands * bands);
 
 
 G_END_DECLS
@@ -49,7 +49,8 @@ GST_DEBUG_CATEGORY (colorspace_performance);
 enum
 {
   PROP_0,
-  PROP_DITHER
+  PROP_DITHER,
+  PROP_N_THREADS
 };
 
 #define CSP_VIDEO_CAPS						\
@@ -252,10 +253,6 @@ gst_csp_set_caps (GstBaseTransform * btrans, GstCaps * incaps,
 
   space = GST_CSP (btrans);
 
-  if (space->convert) {
-    colorspace_convert_free (space->convert);
-  }
-
   /* input caps */
 
   ret = gst_video_format_parse_caps (incaps, &in_format, &in_width, &in_height);
@@ -329,6 +326,19 @@ gst_csp_set_caps (GstBaseTransform * btrans, GstCaps * incaps,
       in_interlaced != out_interlaced)
     goto format_mismatch;
 
+  /* Renegotiating the same conversion keeps the converter */
+  if (space->convert && space->from_format == in_format &&
+      space->from_spec == in_spec && space->to_format == out_format &&
+      space->to_spec == out_spec && space->width == in_width &&
+      space->height == in_height) {
+    GST_DEBUG_OBJECT (space, "keeping converter");
+  } else {
+    if (space->convert)
+      colorspace_convert_free (space->convert);
+    space->convert = colorspace_convert_new (out_format, out_spec, in_format,
+        in_spec, in_width, in_height);
+  }
+
   space->from_format = in_format;
   space->from_spec = in_spec;
   space->to_format = out_format;
@@ -337,8 +347,6 @@ gst_csp_set_caps (GstBaseTransform * btrans, GstCaps * incaps,
   space->height = in_height;
   space->interlaced = in_interlaced;
 
-  space->convert = colorspace_convert_new (out_format, out_spec, in_format,
-      in_spec, in_width, in_height);
   if (space->convert) {
     colorspace_convert_set_interlaced (space->convert, in_interlaced);
   }
@@ -441,6 +449,7 @@ gst_csp_finalize (GObject * obj)
   if (space->convert) {
     colorspace_convert_free (space->convert);
   }
+  colorspace_bands_free (space->bands);
 
   G_OBJECT_CLASS (parent_class)->finalize (obj);
 
@@ -472,6 +481,12 @@ gst_csp_class_init (GstCspClass * klass)
           dither_method_get_type (), DITHER_NONE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_N_THREADS,
+      g_param_spec_uint ("n-threads", "Threads",
+          "Number of threads converting horizontal bands of each frame "
+          "(0 = one per processor)", 0, 64, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
 }
 
 static void
@@ -479,6 +494,8 @@ gst_csp_init (GstCsp * space, GstCspClass * klass)
 {
   space->from_format = GST_VIDEO_FORMAT_UNKNOWN;
   space->to_format = GST_VIDEO_FORMAT_UNKNOWN;
+  /* The band threads outlive the converters of renegotiated caps */
+  space->bands = colorspace_bands_new ();
 }
 
 void
@@ -494,6 +511,9 @@ gst_csp_set_property (GObject * object, guint property_id,
     case PROP_DITHER:
       csp->dither = g_value_get_enum (value);
       break;
+    case PROP_N_THREADS:
+      csp->n_threads = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -513,6 +533,9 @@ gst_csp_get_property (GObject * object, guint property_id,
     case PROP_DITHER:
       g_value_set_enum (value, csp->dither);
       break;
+    case PROP_N_THREADS:
+      g_value_set_uint (value, csp->n_threads);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -551,9 +574,10 @@ gst_csp_transform (GstBaseTransform * btrans, GstBuffer * inbuf,
     goto unknown_format;
 
   colorspace_convert_set_dither (space->convert, space->dither);
+  colorspace_bands_set_n_threads (space->bands, space->n_threads);
 
-  colorspace_convert_convert (space->convert, GST_BUFFER_DATA (outbuf),
-      GST_BUFFER_DATA (inbuf));
+  colorspace_convert_convert (space->convert, space->bands,
+      GST_BUFFER_DATA (outbuf), GST_BUFFER_DATA (inbuf));
 
   /* baseclass copies timestamps */
   GST_DEBUG ("from %d -> to %d done", space->from_format, space->to_format);
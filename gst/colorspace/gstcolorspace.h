@@ -56,7 +56,9 @@ struct _GstCsp {
   ColorSpaceColorSpec to_spec;
 
   ColorspaceConvert *convert;
+  ColorspaceBands *bands;
   gboolean dither;
+  guint n_threads;
 };
 
 struct _GstCspClass
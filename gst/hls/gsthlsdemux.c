@@ -42,6 +42,7 @@
 #include <string.h>
 #include <gst/base/gsttypefindhelper.h>
 #include "gsthlsdemux.h"
+#include "gsthls-marshal.h"
 
 static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
     GST_PAD_SRC,
@@ -67,14 +68,29 @@ enum
 
   PROP_FRAGMENTS_CACHE,
   PROP_BITRATE_SWITCH_TOLERANCE,
+  PROP_MAX_DOWNLOADS,
+  PROP_PREFETCH_WINDOW,
+  PROP_BANDWIDTH_ESTIMATE,
+  PROP_BUFFER_LEVEL,
+  PROP_CURRENT_BITRATE,
   PROP_LAST
 };
 
+enum
+{
+  SIGNAL_SELECT_BITRATE,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
 static const float update_interval_factor[] = { 1, 0.5, 1.5, 3 };
 
 #define DEFAULT_FRAGMENTS_CACHE 3
 #define DEFAULT_FAILED_COUNT 3
 #define DEFAULT_BITRATE_SWITCH_TOLERANCE 0.4
+#define DEFAULT_MAX_DOWNLOADS 2
+#define DEFAULT_PREFETCH_WINDOW 0
 
 /* GObject */
 static void gst_hls_demux_set_property (GObject * object, guint prop_id,
@@ -100,20 +116,25 @@ static gboolean gst_hls_demux_fetcher_sink_event (GstPad * pad,
     GstEvent * event);
 static void gst_hls_demux_loop (GstHLSDemux * demux);
 static void gst_hls_demux_stop (GstHLSDemux * demux);
-static void gst_hls_demux_stop_fetcher (GstHLSDemux * demux,
-    gboolean cancelled);
+static void gst_hls_demux_stop_fetchers (GstHLSDemux * demux,
+    gboolean dispose);
+static gboolean gst_hls_demux_seek (GstHLSDemux * demux, GstEvent * event);
 static gboolean gst_hls_demux_start_update (GstHLSDemux * demux);
 static gboolean gst_hls_demux_cache_fragments (GstHLSDemux * demux);
 static gboolean gst_hls_demux_schedule (GstHLSDemux * demux);
 static gboolean gst_hls_demux_switch_playlist (GstHLSDemux * demux);
-static gboolean gst_hls_demux_get_next_fragment (GstHLSDemux * demux,
-    gboolean retry);
+static gint gst_hls_demux_select_bitrate (GstHLSDemux * demux,
+    guint64 bandwidth, guint64 buffer_level, gint current_bitrate);
+static GstClockTime gst_hls_demux_get_buffer_level (GstHLSDemux * demux);
+static void gst_hls_demux_schedule_downloads (GstHLSDemux * demux);
 static gboolean gst_hls_demux_update_playlist (GstHLSDemux * demux,
     gboolean retry);
 static void gst_hls_demux_reset (GstHLSDemux * demux, gboolean dispose);
 static gboolean gst_hls_demux_set_location (GstHLSDemux * demux,
     const gchar * uri);
 static gchar *gst_hls_src_buf_to_utf8_playlist (gchar * string, guint size);
+static void gst_hls_fetcher_free (GstHLSFetcher * fetcher);
+static void gst_hls_fragment_free (GstHLSFragment * fragment);
 
 static void
 _do_init (GType type)
@@ -149,29 +170,33 @@ gst_hls_demux_dispose (GObject * obj)
 {
   GstHLSDemux *demux = GST_HLS_DEMUX (obj);
 
-  g_cond_free (demux->fetcher_cond);
-  g_mutex_free (demux->fetcher_lock);
-
-  g_cond_free (demux->thread_cond);
-  g_mutex_free (demux->thread_lock);
+  gst_hls_demux_stop_fetchers (demux, TRUE);
 
-  if (GST_TASK_STATE (demux->task) != GST_TASK_STOPPED) {
-    gst_task_stop (demux->task);
-    gst_task_join (demux->task);
-  }
   gst_object_unref (demux->task);
   g_static_rec_mutex_free (&demux->task_lock);
 
-  gst_object_unref (demux->fetcher_bus);
-  gst_object_unref (demux->fetcherpad);
-
   gst_hls_demux_reset (demux, TRUE);
+  g_queue_free (demux->queue);
+
+  g_ptr_array_foreach (demux->fetchers, (GFunc) gst_hls_fetcher_free, NULL);
+  g_ptr_array_free (demux->fetchers, TRUE);
 
-  gst_object_unref (demux->download);
+  g_cond_free (demux->fetcher_cond);
+  g_mutex_free (demux->fetcher_lock);
 
   G_OBJECT_CLASS (parent_class)->dispose (obj);
 }
 
+static gboolean
+gst_hls_demux_select_accumulator (GSignalInvocationHint * ihint,
+    GValue * return_accu, const GValue * handler_return, gpointer data)
+{
+  g_value_copy (handler_return, return_accu);
+
+  /* the first handler decides */
+  return FALSE;
+}
+
 static void
 gst_hls_demux_class_init (GstHLSDemuxClass * klass)
 {
@@ -194,11 +219,62 @@ gst_hls_demux_class_init (GstHLSDemuxClass * klass)
   g_object_class_install_property (gobject_class, PROP_BITRATE_SWITCH_TOLERANCE,
       g_param_spec_float ("bitrate-switch-tolerance",
           "Bitrate switch tolerance",
-          "Tolerance with respect of the fragment duration to switch to "
-          "a different bitrate if the client is too slow/fast.",
+          "Fraction of the estimated bandwidth kept as a margin when "
+          "selecting the bitrate of the next fragments.",
           0, 1, DEFAULT_BITRATE_SWITCH_TOLERANCE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_MAX_DOWNLOADS,
+      g_param_spec_uint ("max-downloads", "Maximum downloads",
+          "Maximum number of fragments downloaded at the same time",
+          1, 16, DEFAULT_MAX_DOWNLOADS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PREFETCH_WINDOW,
+      g_param_spec_uint64 ("prefetch-window", "Prefetch window",
+          "Duration of the fragments to download ahead of playback, in "
+          "nanoseconds (0 = as many fragments as fragments-cache)",
+          0, G_MAXUINT64, DEFAULT_PREFETCH_WINDOW,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_BANDWIDTH_ESTIMATE,
+      g_param_spec_uint64 ("bandwidth-estimate", "Bandwidth estimate",
+          "Bandwidth estimated from the last downloads, in bits per second "
+          "(0 = unknown)", 0, G_MAXUINT64, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_BUFFER_LEVEL,
+      g_param_spec_uint64 ("buffer-level", "Buffer level",
+          "Duration of the downloaded fragments not pushed yet, in "
+          "nanoseconds", 0, G_MAXUINT64, 0,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CURRENT_BITRATE,
+      g_param_spec_int ("current-bitrate", "Current bitrate",
+          "Bitrate of the variant the fragments are downloaded from",
+          0, G_MAXINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  /**
+   * GstHLSDemux::select-bitrate:
+   * @hlsdemux: the hlsdemux
+   * @bandwidth: the estimated bandwidth, in bits per second
+   * @buffer_level: the duration of the downloaded fragments not pushed yet
+   * @current_bitrate: the bitrate of the current variant
+   *
+   * Emitted after each fragment download to select the variant of the next
+   * ones: the variant with the highest bitrate not above the returned one is
+   * used, or the lowest one. The first handler decides, which lets an
+   * application replace the default policy.
+   */
+  signals[SIGNAL_SELECT_BITRATE] = g_signal_new ("select-bitrate",
+      G_TYPE_FROM_CLASS (klass), G_SIGNAL_RUN_LAST,
+      G_STRUCT_OFFSET (GstHLSDemuxClass, select_bitrate),
+      gst_hls_demux_select_accumulator, NULL,
+      __gst_hls_marshal_INT__UINT64_UINT64_INT, G_TYPE_INT, 3,
+      G_TYPE_UINT64, G_TYPE_UINT64, G_TYPE_INT);
+
+  klass->select_bitrate = gst_hls_demux_select_bitrate;
+
   gstelement_class->change_state =
       GST_DEBUG_FUNCPTR (gst_hls_demux_change_state);
 }
@@ -223,26 +299,13 @@ gst_hls_demux_init (GstHLSDemux * demux, GstHLSDemuxClass * klass)
   gst_pad_set_element_private (demux->srcpad, demux);
   gst_element_add_pad (GST_ELEMENT (demux), demux->srcpad);
 
-  /* fetcher pad */
-  demux->fetcherpad =
-      gst_pad_new_from_static_template (&fetchertemplate, "sink");
-  gst_pad_set_chain_function (demux->fetcherpad,
-      GST_DEBUG_FUNCPTR (gst_hls_demux_fetcher_chain));
-  gst_pad_set_event_function (demux->fetcherpad,
-      GST_DEBUG_FUNCPTR (gst_hls_demux_fetcher_sink_event));
-  gst_pad_set_element_private (demux->fetcherpad, demux);
-  gst_pad_activate_push (demux->fetcherpad, TRUE);
-
   /* Properties */
   demux->fragments_cache = DEFAULT_FRAGMENTS_CACHE;
   demux->bitrate_switch_tol = DEFAULT_BITRATE_SWITCH_TOLERANCE;
+  demux->max_downloads = DEFAULT_MAX_DOWNLOADS;
+  demux->prefetch_window = DEFAULT_PREFETCH_WINDOW;
 
-  demux->download = gst_adapter_new ();
-  demux->fetcher_bus = gst_bus_new ();
-  gst_bus_set_sync_handler (demux->fetcher_bus,
-      gst_hls_demux_fetcher_bus_handler, demux);
-  demux->thread_cond = g_cond_new ();
-  demux->thread_lock = g_mutex_new ();
+  demux->fetchers = g_ptr_array_new ();
   demux->fetcher_cond = g_cond_new ();
   demux->fetcher_lock = g_mutex_new ();
   demux->queue = g_queue_new ();
@@ -264,6 +327,18 @@ gst_hls_demux_set_property (GObject * object, guint prop_id,
     case PROP_BITRATE_SWITCH_TOLERANCE:
       demux->bitrate_switch_tol = g_value_get_float (value);
       break;
+    case PROP_MAX_DOWNLOADS:
+      g_mutex_lock (demux->fetcher_lock);
+      demux->max_downloads = g_value_get_uint (value);
+      g_cond_broadcast (demux->fetcher_cond);
+      g_mutex_unlock (demux->fetcher_lock);
+      break;
+    case PROP_PREFETCH_WINDOW:
+      g_mutex_lock (demux->fetcher_lock);
+      demux->prefetch_window = g_value_get_uint64 (value);
+      g_cond_broadcast (demux->fetcher_cond);
+      g_mutex_unlock (demux->fetcher_lock);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -283,6 +358,27 @@ gst_hls_demux_get_property (GObject * object, guint prop_id, GValue * value,
     case PROP_BITRATE_SWITCH_TOLERANCE:
       g_value_set_float (value, demux->bitrate_switch_tol);
       break;
+    case PROP_MAX_DOWNLOADS:
+      g_value_set_uint (value, demux->max_downloads);
+      break;
+    case PROP_PREFETCH_WINDOW:
+      g_value_set_uint64 (value, demux->prefetch_window);
+      break;
+    case PROP_BANDWIDTH_ESTIMATE:
+      g_mutex_lock (demux->fetcher_lock);
+      g_value_set_uint64 (value, demux->bandwidth);
+      g_mutex_unlock (demux->fetcher_lock);
+      break;
+    case PROP_BUFFER_LEVEL:
+      g_mutex_lock (demux->fetcher_lock);
+      g_value_set_uint64 (value, gst_hls_demux_get_buffer_level (demux));
+      g_mutex_unlock (demux->fetcher_lock);
+      break;
+    case PROP_CURRENT_BITRATE:
+      g_mutex_lock (demux->fetcher_lock);
+      g_value_set_int (value, demux->current_bitrate);
+      g_mutex_unlock (demux->fetcher_lock);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -299,6 +395,10 @@ gst_hls_demux_change_state (GstElement * element, GstStateChange transition)
     case GST_STATE_CHANGE_NULL_TO_READY:
       gst_hls_demux_reset (demux, FALSE);
       break;
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* unblock the task and the downloads */
+      gst_hls_demux_stop (demux);
+      break;
     default:
       break;
   }
@@ -307,8 +407,8 @@ gst_hls_demux_change_state (GstElement * element, GstStateChange transition)
 
   switch (transition) {
     case GST_STATE_CHANGE_PAUSED_TO_READY:
-      demux->cancelled = TRUE;
-      g_cond_signal (demux->fetcher_cond);
+      gst_hls_demux_stop_fetchers (demux, TRUE);
+      gst_hls_demux_reset (demux, FALSE);
       break;
     default:
       break;
@@ -319,11 +419,14 @@ gst_hls_demux_change_state (GstElement * element, GstStateChange transition)
 static gboolean
 gst_hls_demux_src_event (GstPad * pad, GstEvent * event)
 {
+  GstHLSDemux *demux = GST_HLS_DEMUX (gst_pad_get_element_private (pad));
+  gboolean ret;
+
   switch (event->type) {
-      /* FIXME: ignore seek event for the moment */
     case GST_EVENT_SEEK:
+      ret = gst_hls_demux_seek (demux, event);
       gst_event_unref (event);
-      return FALSE;
+      return ret;
     default:
       break;
   }
@@ -428,17 +531,15 @@ gst_hls_demux_src_query (GstPad * pad, GstQuery * query)
       break;
     case GST_QUERY_SEEKING:{
       GstFormat fmt;
-      gint stop = -1;
+      GstClockTime start, stop;
 
+      /* live playlists can be seeked in the window of fragments available */
       gst_query_parse_seeking (query, &fmt, NULL, NULL, NULL);
-      if (fmt == GST_FORMAT_TIME) {
-        GstClockTime duration;
-
-        duration = gst_m3u8_client_get_duration (hlsdemux->client);
-        if (GST_CLOCK_TIME_IS_VALID (duration) && duration > 0)
-          stop = duration;
-      }
-      gst_query_set_seeking (query, fmt, FALSE, 0, stop);
+      if (fmt == GST_FORMAT_TIME && hlsdemux->client &&
+          gst_m3u8_client_get_seek_range (hlsdemux->client, &start, &stop))
+        gst_query_set_seeking (query, fmt, TRUE, start, stop);
+      else
+        gst_query_set_seeking (query, fmt, FALSE, 0, -1);
       ret = TRUE;
       break;
     }
@@ -455,14 +556,17 @@ gst_hls_demux_src_query (GstPad * pad, GstQuery * query)
 static gboolean
 gst_hls_demux_fetcher_sink_event (GstPad * pad, GstEvent * event)
 {
-  GstHLSDemux *demux = GST_HLS_DEMUX (gst_pad_get_element_private (pad));
+  GstHLSFetcher *fetcher = gst_pad_get_element_private (pad);
+  GstHLSDemux *demux = fetcher->demux;
 
   switch (event->type) {
     case GST_EVENT_EOS:{
       GST_DEBUG_OBJECT (demux, "Got EOS on the fetcher pad");
       /* signal we have fetched the URI */
-      if (!demux->cancelled)
-        g_cond_signal (demux->fetcher_cond);
+      g_mutex_lock (demux->fetcher_lock);
+      fetcher->done = TRUE;
+      g_cond_broadcast (demux->fetcher_cond);
+      g_mutex_unlock (demux->fetcher_lock);
     }
     default:
       break;
@@ -490,21 +594,23 @@ gst_hls_demux_chain (GstPad * pad, GstBuffer * buf)
 static GstFlowReturn
 gst_hls_demux_fetcher_chain (GstPad * pad, GstBuffer * buf)
 {
-  GstHLSDemux *demux = GST_HLS_DEMUX (gst_pad_get_element_private (pad));
+  GstHLSFetcher *fetcher = gst_pad_get_element_private (pad);
 
   /* The source element can be an http source element. In case we get a 404,
    * the html response will be sent downstream and the adapter
    * will not be null, which might make us think that the request proceed
    * successfully. But it will also post an error message in the bus that
-   * is handled synchronously and that will set demux->fetcher_error to TRUE,
+   * is handled synchronously and that will set fetcher->error to TRUE,
    * which is used to discard this buffer with the html response. */
-  if (demux->fetcher_error) {
+  if (fetcher->error) {
+    gst_buffer_unref (buf);
     goto done;
   }
 
-  GST_LOG_OBJECT (demux, "The uri fetcher received a new buffer of size %u",
+  GST_LOG_OBJECT (fetcher->demux,
+      "The uri fetcher received a new buffer of size %u",
       GST_BUFFER_SIZE (buf));
-  gst_adapter_push (demux->download, buf);
+  gst_adapter_push (fetcher->download, buf);
 
 done:
   {
@@ -513,81 +619,108 @@ done:
 }
 
 static void
-gst_hls_demux_stop_fetcher (GstHLSDemux * demux, gboolean cancelled)
+gst_hls_fragment_free (GstHLSFragment * fragment)
 {
-  GstPad *pad;
-
-  /* When the fetcher is stopped while it's downloading, we will get an EOS that
-   * unblocks the fetcher thread and tries to stop it again from that thread.
-   * Here we check if the fetcher as already been stopped before continuing */
-  if (demux->fetcher == NULL || demux->stopping_fetcher)
-    return;
-
-  GST_DEBUG_OBJECT (demux, "Stopping fetcher.");
-  demux->stopping_fetcher = TRUE;
-  /* set the element state to NULL */
-  gst_element_set_state (demux->fetcher, GST_STATE_NULL);
-  gst_element_get_state (demux->fetcher, NULL, NULL, GST_CLOCK_TIME_NONE);
-  /* unlink it from the internal pad */
-  pad = gst_pad_get_peer (demux->fetcherpad);
-  if (pad) {
-    gst_pad_unlink (pad, demux->fetcherpad);
-    gst_object_unref (pad);
-  }
-  /* and finally unref it */
-  gst_object_unref (demux->fetcher);
-  demux->fetcher = NULL;
-
-  /* if we stopped it to cancell a download, free the cached buffer */
-  if (cancelled && !gst_adapter_available (demux->download)) {
-    gst_adapter_clear (demux->download);
-    /* signal the fetcher thread that the download has finished/cancelled */
-    g_cond_signal (demux->fetcher_cond);
-  }
+  g_free (fragment->uri);
+  if (fragment->buffer)
+    gst_buffer_unref (fragment->buffer);
+  g_slice_free (GstHLSFragment, fragment);
 }
 
 static void
 gst_hls_demux_stop (GstHLSDemux * demux)
 {
-  gst_hls_demux_stop_fetcher (demux, TRUE);
+  /* wake up the task and the updates thread if they are waiting for a
+   * download */
+  g_mutex_lock (demux->fetcher_lock);
+  demux->cancelled = TRUE;
+  g_cond_broadcast (demux->fetcher_cond);
+  g_mutex_unlock (demux->fetcher_lock);
+
   if (GST_TASK_STATE (demux->task) != GST_TASK_STOPPED)
     gst_task_stop (demux->task);
-  g_cond_signal (demux->thread_cond);
 }
 
 static void
 gst_hls_demux_loop (GstHLSDemux * demux)
 {
+  GstHLSFragment *fragment;
   GstBuffer *buf;
   GstFlowReturn ret;
 
   /* Loop for the source pad task. The task is started when we have
    * received the main playlist from the source element. It tries first to
-   * cache the first fragments and then it waits until it has more data in the
-   * queue. This task is woken up when we push a new fragment to the queue or
-   * when we reached the end of the playlist  */
+   * cache the first fragments and then it waits until the fragment at the
+   * head of the queue is downloaded. This task is woken up when a download
+   * finishes, when we reached the end of the playlist or when the downloads
+   * are cancelled */
 
   if (G_UNLIKELY (demux->need_cache)) {
     if (!gst_hls_demux_cache_fragments (demux))
       goto cache_error;
 
-    /* we can start now the updates thread */
-    gst_hls_demux_start_update (demux);
     GST_INFO_OBJECT (demux, "First fragments cached successfully");
   }
 
-  if (g_queue_is_empty (demux->queue)) {
-    if (demux->end_of_playlist)
+  g_mutex_lock (demux->fetcher_lock);
+  while (!demux->cancelled) {
+    fragment = g_queue_peek_head (demux->queue);
+    if (fragment && fragment->complete)
+      break;
+    if (!fragment && demux->end_of_playlist) {
+      g_mutex_unlock (demux->fetcher_lock);
       goto end_of_playlist;
+    }
+    g_cond_wait (demux->fetcher_cond, demux->fetcher_lock);
+  }
 
-    GST_TASK_WAIT (demux->task);
-    /* If the queue is still empty check again if it's the end of the
-     * playlist in case we reached it after beeing woken up */
-    if (g_queue_is_empty (demux->queue) && demux->end_of_playlist)
-      goto end_of_playlist;
+  if (demux->cancelled) {
+    g_mutex_unlock (demux->fetcher_lock);
+    goto cancelled;
+  }
+
+  /* the updates thread can start the next download now */
+  fragment = g_queue_pop_head (demux->queue);
+  g_cond_broadcast (demux->fetcher_cond);
+  g_mutex_unlock (demux->fetcher_lock);
+
+  buf = fragment->buffer;
+  fragment->buffer = NULL;
+  if (buf == NULL) {
+    GST_ELEMENT_ERROR (demux, RESOURCE, READ,
+        ("Could not fetch the next fragment"), ("URI: \"%s\"",
+            fragment->uri));
+    gst_hls_fragment_free (fragment);
+    goto cancelled;
+  }
+
+  GST_BUFFER_TIMESTAMP (buf) = fragment->timestamp;
+  GST_BUFFER_DURATION (buf) = fragment->duration;
+
+  if (G_UNLIKELY (demux->input_caps == NULL)) {
+    demux->input_caps = gst_type_find_helper_for_buffer (NULL, buf, NULL);
+    if (demux->input_caps) {
+      gst_pad_set_caps (demux->srcpad, demux->input_caps);
+      GST_INFO_OBJECT (demux, "Input source caps: %" GST_PTR_FORMAT,
+          demux->input_caps);
+    }
+  }
+
+  if (G_UNLIKELY (demux->need_segment)) {
+    GST_DEBUG_OBJECT (demux, "Sending newsegment from %" GST_TIME_FORMAT,
+        GST_TIME_ARGS (fragment->timestamp));
+    gst_pad_push_event (demux->srcpad, gst_event_new_new_segment (FALSE, 1.0,
+            GST_FORMAT_TIME, fragment->timestamp, -1, fragment->timestamp));
+    demux->need_segment = FALSE;
+    fragment->discont = TRUE;
+  }
+
+  if (fragment->discont) {
+    GST_DEBUG_OBJECT (demux, "Marking fragment as discontinuous");
+    GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DISCONT);
   }
+  gst_hls_fragment_free (fragment);
 
-  buf = g_queue_pop_head (demux->queue);
   ret = gst_pad_push (demux->srcpad, buf);
   if (ret != GST_FLOW_OK)
     goto error;
@@ -604,8 +737,15 @@ end_of_playlist:
 
 cache_error:
   {
-    GST_ELEMENT_ERROR (demux, RESOURCE, NOT_FOUND,
-        ("Could not cache the first fragments"), NULL);
+    if (!demux->cancelled)
+      GST_ELEMENT_ERROR (demux, RESOURCE, NOT_FOUND,
+          ("Could not cache the first fragments"), NULL);
+    gst_hls_demux_stop (demux);
+    return;
+  }
+
+cancelled:
+  {
     gst_hls_demux_stop (demux);
     return;
   }
@@ -622,49 +762,233 @@ static GstBusSyncReply
 gst_hls_demux_fetcher_bus_handler (GstBus * bus,
     GstMessage * message, gpointer data)
 {
-  GstHLSDemux *demux = GST_HLS_DEMUX (data);
+  GstHLSFetcher *fetcher = data;
+  GstHLSDemux *demux = fetcher->demux;
 
   if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR) {
-    demux->fetcher_error = TRUE;
-    g_cond_signal (demux->fetcher_cond);
+    g_mutex_lock (demux->fetcher_lock);
+    fetcher->error = TRUE;
+    fetcher->done = TRUE;
+    g_cond_broadcast (demux->fetcher_cond);
+    g_mutex_unlock (demux->fetcher_lock);
   }
 
   gst_message_unref (message);
   return GST_BUS_DROP;
 }
 
+static GstHLSFetcher *
+gst_hls_fetcher_new (GstHLSDemux * demux)
+{
+  GstHLSFetcher *fetcher = g_slice_new0 (GstHLSFetcher);
+
+  fetcher->demux = demux;
+
+  fetcher->pad = gst_pad_new_from_static_template (&fetchertemplate, "sink");
+  gst_pad_set_chain_function (fetcher->pad,
+      GST_DEBUG_FUNCPTR (gst_hls_demux_fetcher_chain));
+  gst_pad_set_event_function (fetcher->pad,
+      GST_DEBUG_FUNCPTR (gst_hls_demux_fetcher_sink_event));
+  gst_pad_set_element_private (fetcher->pad, fetcher);
+  gst_pad_activate_push (fetcher->pad, TRUE);
+
+  fetcher->bus = gst_bus_new ();
+  gst_bus_set_sync_handler (fetcher->bus, gst_hls_demux_fetcher_bus_handler,
+      fetcher);
+  fetcher->download = gst_adapter_new ();
+
+  return fetcher;
+}
+
+/* Disposes the source element, aborting its download if any */
+static void
+gst_hls_fetcher_reset_src (GstHLSFetcher * fetcher)
+{
+  GstPad *pad;
+
+  if (fetcher->src == NULL)
+    return;
+
+  GST_DEBUG_OBJECT (fetcher->demux, "Disposing fetcher for %s",
+      fetcher->protocol);
+  gst_element_set_state (fetcher->src, GST_STATE_NULL);
+  gst_element_get_state (fetcher->src, NULL, NULL, GST_CLOCK_TIME_NONE);
+  /* unlink it from the internal pad */
+  pad = gst_pad_get_peer (fetcher->pad);
+  if (pad) {
+    gst_pad_unlink (pad, fetcher->pad);
+    gst_object_unref (pad);
+  }
+  /* and finally unref it */
+  gst_object_unref (fetcher->src);
+  fetcher->src = NULL;
+  g_free (fetcher->protocol);
+  fetcher->protocol = NULL;
+}
+
+static void
+gst_hls_fetcher_free (GstHLSFetcher * fetcher)
+{
+  gst_hls_fetcher_reset_src (fetcher);
+  gst_object_unref (fetcher->pad);
+  gst_object_unref (fetcher->bus);
+  g_object_unref (fetcher->download);
+  g_slice_free (GstHLSFetcher, fetcher);
+}
+
+/* Starts downloading @uri. The fetcher must have been reserved with
+ * gst_hls_demux_get_fetcher() and the fetcher lock must not be held, as the
+ * source element takes it from its streaming thread */
 static gboolean
-gst_hls_demux_make_fetcher (GstHLSDemux * demux, const gchar * uri)
+gst_hls_fetcher_start (GstHLSFetcher * fetcher, const gchar * uri)
 {
+  GstHLSDemux *demux = fetcher->demux;
+  GstStateChangeReturn ret;
+  gchar *protocol;
   GstPad *pad;
 
   if (!gst_uri_is_valid (uri))
     return FALSE;
 
-  GST_DEBUG_OBJECT (demux, "Creating fetcher for the URI:%s", uri);
-  demux->fetcher = gst_element_make_from_uri (GST_URI_SRC, uri, NULL);
-  if (!demux->fetcher)
-    return FALSE;
+  protocol = gst_uri_get_protocol (uri);
+  if (fetcher->src && g_strcmp0 (protocol, fetcher->protocol) != 0)
+    gst_hls_fetcher_reset_src (fetcher);
+
+  if (fetcher->src == NULL) {
+    GST_DEBUG_OBJECT (demux, "Creating fetcher for the URI:%s", uri);
+    fetcher->src = gst_element_make_from_uri (GST_URI_SRC, uri, NULL);
+    if (!fetcher->src) {
+      g_free (protocol);
+      return FALSE;
+    }
+    fetcher->protocol = protocol;
 
-  demux->fetcher_error = FALSE;
-  demux->stopping_fetcher = FALSE;
-  gst_element_set_bus (GST_ELEMENT (demux->fetcher), demux->fetcher_bus);
+    gst_element_set_bus (GST_ELEMENT (fetcher->src), fetcher->bus);
 
-  g_object_set (G_OBJECT (demux->fetcher), "location", uri, NULL);
-  pad = gst_element_get_static_pad (demux->fetcher, "src");
-  if (pad) {
-    gst_pad_link (pad, demux->fetcherpad);
-    gst_object_unref (pad);
+    pad = gst_element_get_static_pad (fetcher->src, "src");
+    if (pad) {
+      gst_pad_link (pad, fetcher->pad);
+      gst_object_unref (pad);
+    }
+  } else {
+    GST_DEBUG_OBJECT (demux, "Reusing fetcher for the URI:%s", uri);
+    g_free (protocol);
+  }
+
+  fetcher->done = FALSE;
+  fetcher->error = FALSE;
+  gst_adapter_clear (fetcher->download);
+  g_get_current_time (&fetcher->start);
+
+  g_object_set (G_OBJECT (fetcher->src), "location", uri, NULL);
+  ret = gst_element_set_state (fetcher->src, GST_STATE_PLAYING);
+  if (ret == GST_STATE_CHANGE_FAILURE) {
+    GST_WARNING_OBJECT (demux, "Error changing state of the fetcher element");
+    gst_hls_fetcher_reset_src (fetcher);
+    return FALSE;
   }
+
   return TRUE;
 }
 
+/* Stops the download and returns the downloaded data, or NULL if it failed
+ * or didn't finish. The source element is kept for the next download unless
+ * it had an error. Must be called without the fetcher lock */
+static GstBuffer *
+gst_hls_fetcher_finish (GstHLSFetcher * fetcher)
+{
+  GstBuffer *buf = NULL;
+  guint avail;
+
+  if (fetcher->error) {
+    gst_hls_fetcher_reset_src (fetcher);
+  } else if (fetcher->src) {
+    gst_element_set_state (fetcher->src, GST_STATE_READY);
+    gst_element_get_state (fetcher->src, NULL, NULL, GST_CLOCK_TIME_NONE);
+  }
+
+  avail = gst_adapter_available (fetcher->download);
+  if (fetcher->done && !fetcher->error && avail)
+    buf = gst_adapter_take_buffer (fetcher->download, avail);
+  gst_adapter_clear (fetcher->download);
+
+  return buf;
+}
+
+/* Called with the fetcher lock, returns an idle fetcher reserved for a new
+ * download, preferably one that already has a source element */
+static GstHLSFetcher *
+gst_hls_demux_get_fetcher (GstHLSDemux * demux)
+{
+  GstHLSFetcher *fetcher = NULL;
+  guint i;
+
+  for (i = 0; i < demux->fetchers->len; i++) {
+    GstHLSFetcher *f = g_ptr_array_index (demux->fetchers, i);
+
+    if (f->busy)
+      continue;
+    if (fetcher == NULL || (f->src && fetcher->src == NULL))
+      fetcher = f;
+  }
+
+  if (fetcher == NULL) {
+    fetcher = gst_hls_fetcher_new (demux);
+    g_ptr_array_add (demux->fetchers, fetcher);
+  }
+
+  fetcher->busy = TRUE;
+  return fetcher;
+}
+
+/* Stops the task, the updates thread and all the downloads. The source
+ * elements of the idle fetchers are kept for the next downloads unless
+ * @dispose is TRUE */
+static void
+gst_hls_demux_stop_fetchers (GstHLSDemux * demux, gboolean dispose)
+{
+  guint i;
+
+  gst_hls_demux_stop (demux);
+  gst_task_join (demux->task);
+
+  if (demux->updates_thread) {
+    g_thread_join (demux->updates_thread);
+    demux->updates_thread = NULL;
+  }
+
+  for (i = 0; i < demux->fetchers->len; i++) {
+    GstHLSFetcher *fetcher = g_ptr_array_index (demux->fetchers, i);
+
+    if (dispose || fetcher->busy)
+      gst_hls_fetcher_reset_src (fetcher);
+    gst_adapter_clear (fetcher->download);
+    fetcher->fragment = NULL;
+    fetcher->busy = FALSE;
+  }
+}
+
+/* Frees the queued fragments, the downloads must be stopped */
+static void
+gst_hls_demux_flush_queue (GstHLSDemux * demux)
+{
+  while (!g_queue_is_empty (demux->queue)) {
+    GstHLSFragment *fragment = g_queue_pop_head (demux->queue);
+    gst_hls_fragment_free (fragment);
+  }
+  g_queue_clear (demux->queue);
+}
+
 static void
 gst_hls_demux_reset (GstHLSDemux * demux, gboolean dispose)
 {
   demux->need_cache = TRUE;
-  demux->thread_return = FALSE;
-  demux->accumulated_delay = 0;
+  demux->need_segment = TRUE;
+  demux->n_samples = 0;
+  demux->next_sample = 0;
+  demux->last_sample = 0;
+  demux->bandwidth = 0;
+  demux->current_bitrate = 0;
   demux->end_of_playlist = FALSE;
   demux->cancelled = FALSE;
 
@@ -678,8 +1002,6 @@ gst_hls_demux_reset (GstHLSDemux * demux, gboolean dispose)
     demux->playlist = NULL;
   }
 
-  gst_adapter_clear (demux->download);
-
   if (demux->client)
     gst_m3u8_client_free (demux->client);
 
@@ -687,11 +1009,76 @@ gst_hls_demux_reset (GstHLSDemux * demux, gboolean dispose)
     demux->client = gst_m3u8_client_new ("");
   }
 
-  while (!g_queue_is_empty (demux->queue)) {
-    GstBuffer *buf = g_queue_pop_head (demux->queue);
-    gst_buffer_unref (buf);
+  gst_hls_demux_flush_queue (demux);
+}
+
+static gboolean
+gst_hls_demux_seek (GstHLSDemux * demux, GstEvent * event)
+{
+  GstFormat format;
+  GstSeekFlags flags;
+  GstSeekType start_type, stop_type;
+  gint64 start, stop;
+  gdouble rate;
+  GstClockTime timestamp, range_start, range_stop;
+
+  gst_event_parse_seek (event, &rate, &format, &flags, &start_type, &start,
+      &stop_type, &stop);
+
+  if (format != GST_FORMAT_TIME || rate != 1.0 ||
+      start_type != GST_SEEK_TYPE_SET) {
+    GST_WARNING_OBJECT (demux, "Only seeks in time to a position and "
+        "with rate 1.0 are supported");
+    return FALSE;
   }
-  g_queue_clear (demux->queue);
+
+  /* the playlists are only known once the first fragments are cached */
+  if (demux->need_cache) {
+    GST_WARNING_OBJECT (demux, "Can't seek before the playback started");
+    return FALSE;
+  }
+
+  /* Stopping the task waits for the fragment being pushed, which only
+   * returns once downstream is flushed */
+  if (!(flags & GST_SEEK_FLAG_FLUSH)) {
+    GST_WARNING_OBJECT (demux, "Only flushing seeks are supported");
+    return FALSE;
+  }
+
+  /* check that there is a fragment to restart from before dropping the
+   * queued ones */
+  if (!gst_m3u8_client_get_seek_range (demux->client, &range_start,
+          &range_stop)) {
+    GST_WARNING_OBJECT (demux, "No fragment to seek to");
+    return FALSE;
+  }
+
+  GST_DEBUG_OBJECT (demux, "Seeking to %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (start));
+
+  gst_pad_push_event (demux->srcpad, gst_event_new_flush_start ());
+
+  /* stop pushing and abort the downloads in progress, the source elements of
+   * the idle fetchers are kept */
+  gst_hls_demux_stop_fetchers (demux, FALSE);
+  gst_hls_demux_flush_queue (demux);
+  demux->end_of_playlist = FALSE;
+  demux->cancelled = FALSE;
+
+  /* the playlist only gets updated by the updates thread, which is stopped
+   * now, so this finds a fragment like the check above */
+  gst_m3u8_client_seek (demux->client, start, &timestamp);
+  demux->need_segment = TRUE;
+
+  gst_pad_push_event (demux->srcpad, gst_event_new_flush_stop ());
+
+  /* restart from the fragment of the position, without caching fragments
+   * again so that the playback restarts as soon as it's downloaded */
+  if (!gst_hls_demux_start_update (demux))
+    return FALSE;
+  gst_task_start (demux->task);
+
+  return TRUE;
 }
 
 static gboolean
@@ -704,79 +1091,239 @@ gst_hls_demux_set_location (GstHLSDemux * demux, const gchar * uri)
   return TRUE;
 }
 
+/* Called with the fetcher lock, returns whether a fragment download finished
+ * and wasn't handled yet */
 static gboolean
-gst_hls_demux_update_thread (GstHLSDemux * demux)
+gst_hls_demux_has_finished_download (GstHLSDemux * demux)
 {
-  /* Loop for the updates. It's started when the first fragments are cached and
-   * schedules the next update of the playlist (for lives sources) and the next
-   * update of fragments. When a new fragment is downloaded, it compares the
-   * download time with the next scheduled update to check if we can or should
-   * switch to a different bitrate */
-
-  g_mutex_lock (demux->thread_lock);
-  while (TRUE) {
-    /* block until the next scheduled update or the signal to quit this thread */
-    if (g_cond_timed_wait (demux->thread_cond, demux->thread_lock,
-            &demux->next_update)) {
-      goto quit;
-    }
+  guint i;
 
-    /* update the playlist for live sources */
-    if (gst_m3u8_client_is_live (demux->client)) {
-      if (!gst_hls_demux_update_playlist (demux, TRUE)) {
-        GST_ERROR_OBJECT (demux, "Could not update the playlist");
-        goto quit;
-      }
-    }
+  for (i = 0; i < demux->fetchers->len; i++) {
+    GstHLSFetcher *fetcher = g_ptr_array_index (demux->fetchers, i);
 
-    /* schedule the next update */
-    gst_hls_demux_schedule (demux);
+    if (fetcher->fragment && fetcher->done)
+      return TRUE;
+  }
 
-    /* if it's a live source and the playlist couldn't be updated, there aren't
-     * more fragments in the playlist, so we just wait for the next schedulled
-     * update */
-    if (gst_m3u8_client_is_live (demux->client) &&
-        demux->client->update_failed_count > 0) {
-      GST_WARNING_OBJECT (demux,
-          "The playlist hasn't been updated, failed count is %d",
-          demux->client->update_failed_count);
+  return FALSE;
+}
+
+/* Called with the fetcher lock, adds a download of @bytes between @start and
+ * @end to the bandwidth estimate */
+static void
+gst_hls_demux_add_bandwidth_sample (GstHLSDemux * demux, guint64 bytes,
+    GstClockTime start, GstClockTime end)
+{
+  guint64 total_bytes = 0;
+  GstClockTime total_time = 0;
+  guint i;
+
+  /* Downloads running at the same time share the bandwidth, so only count
+   * the time since the previous one finished: the samples then add up to
+   * the time during which something was being downloaded */
+  if (demux->last_sample > start)
+    start = demux->last_sample;
+  if (end < start)
+    end = start;
+  demux->last_sample = end;
+
+  demux->sample_bytes[demux->next_sample] = bytes;
+  demux->sample_time[demux->next_sample] = end - start;
+  demux->next_sample = (demux->next_sample + 1) %
+      GST_HLS_DEMUX_BANDWIDTH_SAMPLES;
+  if (demux->n_samples < GST_HLS_DEMUX_BANDWIDTH_SAMPLES)
+    demux->n_samples++;
+
+  /* This is the harmonic mean of the rates of the samples weighted by their
+   * size, so a single fast download doesn't make the estimate jump */
+  for (i = 0; i < demux->n_samples; i++) {
+    total_bytes += demux->sample_bytes[i];
+    total_time += demux->sample_time[i];
+  }
+
+  if (total_time > 0)
+    demux->bandwidth = gst_util_uint64_scale (total_bytes * 8, GST_SECOND,
+        total_time);
+
+  GST_DEBUG_OBJECT (demux, "Estimated bandwidth: %" G_GUINT64_FORMAT
+      " bits/s", demux->bandwidth);
+}
+
+/* Called with the fetcher lock, returns the duration of the downloaded
+ * fragments that weren't pushed yet */
+static GstClockTime
+gst_hls_demux_get_buffer_level (GstHLSDemux * demux)
+{
+  GstClockTime level = 0;
+  GList *walk;
+
+  for (walk = demux->queue->head; walk; walk = walk->next) {
+    GstHLSFragment *fragment = walk->data;
+
+    if (fragment->complete && fragment->buffer)
+      level += fragment->duration;
+  }
+
+  return level;
+}
+
+/* Called with the fetcher lock, completes the fragments whose download
+ * finished and gives their fetcher back to the pool */
+static void
+gst_hls_demux_reap_downloads (GstHLSDemux * demux)
+{
+  guint i;
+
+  for (i = 0; i < demux->fetchers->len; i++) {
+    GstHLSFetcher *fetcher = g_ptr_array_index (demux->fetchers, i);
+    GstHLSFragment *fragment = fetcher->fragment;
+    GstClockTime start, end;
+    GstBuffer *buf;
+    GTimeVal now;
+
+    if (fragment == NULL || !fetcher->done)
       continue;
-    }
 
-    /* fetch the next fragment */
-    if (!gst_hls_demux_get_next_fragment (demux, TRUE)) {
-      if (!demux->end_of_playlist && !demux->cancelled)
-        GST_ERROR_OBJECT (demux, "Could not fetch the next fragment");
-      goto quit;
+    g_mutex_unlock (demux->fetcher_lock);
+    buf = gst_hls_fetcher_finish (fetcher);
+    g_mutex_lock (demux->fetcher_lock);
+
+    g_get_current_time (&now);
+    start = GST_TIMEVAL_TO_TIME (fetcher->start);
+    end = GST_TIMEVAL_TO_TIME (now);
+
+    fragment->buffer = buf;
+    fragment->complete = TRUE;
+    fragment->fetcher = NULL;
+    fetcher->fragment = NULL;
+    fetcher->busy = FALSE;
+    g_cond_broadcast (demux->fetcher_cond);
+
+    if (buf == NULL) {
+      GST_WARNING_OBJECT (demux, "Could not fetch the fragment %s",
+          fragment->uri);
+      continue;
     }
 
+    GST_INFO_OBJECT (demux, "Fetched fragment %s (%u bytes) in %"
+        GST_TIME_FORMAT, fragment->uri, GST_BUFFER_SIZE (buf),
+        GST_TIME_ARGS (end - start));
+    gst_hls_demux_add_bandwidth_sample (demux, GST_BUFFER_SIZE (buf), start,
+        end);
+
     /* try to switch to another bitrate if needed */
+    g_mutex_unlock (demux->fetcher_lock);
     gst_hls_demux_switch_playlist (demux);
+    g_mutex_lock (demux->fetcher_lock);
   }
+}
 
-quit:
-  {
-    g_mutex_unlock (demux->thread_lock);
-    return TRUE;
+static gboolean
+gst_hls_demux_update_thread (GstHLSDemux * demux)
+{
+  /* Loop for the updates. It's started when the first playlists are fetched,
+   * keeps the prefetch window filled with fragment downloads and schedules
+   * the next update of the playlist (for lives sources). When a fragment is
+   * downloaded, it updates the bandwidth estimate and selects the bitrate of
+   * the next fragments */
+
+  g_mutex_lock (demux->fetcher_lock);
+  while (!demux->cancelled) {
+    GTimeVal now;
+
+    gst_hls_demux_reap_downloads (demux);
+
+    /* update the playlist for live sources */
+    g_get_current_time (&now);
+    if (gst_m3u8_client_is_live (demux->client) &&
+        GST_TIMEVAL_TO_TIME (now) >= GST_TIMEVAL_TO_TIME (demux->next_update)) {
+      gboolean updated;
+
+      g_mutex_unlock (demux->fetcher_lock);
+      updated = gst_hls_demux_update_playlist (demux, TRUE);
+      /* schedule the next update */
+      gst_hls_demux_schedule (demux);
+      g_mutex_lock (demux->fetcher_lock);
+
+      if (!updated) {
+        if (!demux->cancelled) {
+          GST_ELEMENT_ERROR (demux, RESOURCE, NOT_FOUND,
+              ("Could not update the playlist"), NULL);
+          demux->cancelled = TRUE;
+          g_cond_broadcast (demux->fetcher_cond);
+        }
+        break;
+      }
+
+      /* if the playlist couldn't be updated, there aren't more fragments in
+       * the playlist, so we just wait for the next schedulled update */
+      if (demux->client->update_failed_count > 0)
+        GST_WARNING_OBJECT (demux,
+            "The playlist hasn't been updated, failed count is %d",
+            demux->client->update_failed_count);
+    }
+
+    /* fetch the next fragments */
+    gst_hls_demux_schedule_downloads (demux);
+
+    /* block until a download finishes, a fragment is pushed, the next
+     * scheduled update or the signal to quit this thread */
+    if (demux->cancelled || gst_hls_demux_has_finished_download (demux))
+      continue;
+    if (gst_m3u8_client_is_live (demux->client))
+      g_cond_timed_wait (demux->fetcher_cond, demux->fetcher_lock,
+          &demux->next_update);
+    else
+      g_cond_wait (demux->fetcher_cond, demux->fetcher_lock);
   }
+  g_mutex_unlock (demux->fetcher_lock);
+
+  return TRUE;
 }
 
 static gboolean
 gst_hls_demux_start_update (GstHLSDemux * demux)
 {
-  GError *error;
+  GError *error = NULL;
 
   /* creates a new thread for the updates */
   demux->updates_thread = g_thread_create (
       (GThreadFunc) gst_hls_demux_update_thread, demux, TRUE, &error);
-  return (error != NULL);
+  if (error) {
+    GST_ERROR_OBJECT (demux, "Could not start the updates thread: %s",
+        error->message);
+    g_error_free (error);
+    return FALSE;
+  }
+  return TRUE;
 }
 
+/* Called with the fetcher lock, returns whether the first fragments are
+ * downloaded, or whether there is no need to wait for them anymore */
 static gboolean
-gst_hls_demux_cache_fragments (GstHLSDemux * demux)
+gst_hls_demux_is_cached (GstHLSDemux * demux)
 {
-  gint i;
+  GList *walk;
+  guint n = 0;
+
+  for (walk = demux->queue->head; walk; walk = walk->next) {
+    GstHLSFragment *fragment = walk->data;
 
+    if (!fragment->complete)
+      return FALSE;
+    /* let the task report the error */
+    if (fragment->buffer == NULL)
+      return TRUE;
+    if (++n >= demux->fragments_cache - 1)
+      return TRUE;
+  }
+
+  return demux->end_of_playlist;
+}
+
+static gboolean
+gst_hls_demux_cache_fragments (GstHLSDemux * demux)
+{
   /* Start parsing the main playlist */
   gst_m3u8_client_set_current (demux->client, demux->client->main);
 
@@ -793,6 +1340,7 @@ gst_hls_demux_cache_fragments (GstHLSDemux * demux)
   if (gst_m3u8_client_has_variant_playlist (demux->client)) {
     GstM3U8 *child = demux->client->main->lists->data;
     gst_m3u8_client_set_current (demux->client, child);
+    demux->current_bitrate = child->bandwidth;
     if (!gst_hls_demux_update_playlist (demux, FALSE)) {
       GST_ERROR_OBJECT (demux, "Could not fetch the child playlist %s",
           child->uri);
@@ -803,57 +1351,58 @@ gst_hls_demux_cache_fragments (GstHLSDemux * demux)
   /* If it's a live source, set the sequence number to the end of the list
    * and substract the 'fragmets_cache' to start from the last fragment*/
   if (gst_m3u8_client_is_live (demux->client)) {
-    demux->client->sequence += g_list_length (demux->client->current->files);
+    GST_M3U8_CLIENT_LOCK (demux->client);
+    demux->client->sequence += demux->client->current->files->len;
     if (demux->client->sequence >= demux->fragments_cache)
       demux->client->sequence -= demux->fragments_cache;
     else
       demux->client->sequence = 0;
-  }
-
-  /* Cache the first fragments */
-  for (i = 0; i < demux->fragments_cache - 1; i++) {
-    if (!gst_hls_demux_get_next_fragment (demux, FALSE)) {
-      if (!demux->cancelled)
-        GST_ERROR_OBJECT (demux, "Error caching the first fragments");
-      return FALSE;
-    }
-    /* make sure we stop caching fragments if something cancelled it */
-    if (demux->cancelled)
-      return FALSE;
+    GST_M3U8_CLIENT_UNLOCK (demux->client);
   }
 
   g_get_current_time (&demux->next_update);
 
+  /* Start the downloads and wait for the first fragments */
+  if (!gst_hls_demux_start_update (demux))
+    return FALSE;
+
+  g_mutex_lock (demux->fetcher_lock);
+  while (!demux->cancelled && !gst_hls_demux_is_cached (demux))
+    g_cond_wait (demux->fetcher_cond, demux->fetcher_lock);
+  g_mutex_unlock (demux->fetcher_lock);
+
+  /* make sure we stop caching fragments if something cancelled it */
+  if (demux->cancelled)
+    return FALSE;
+
   demux->need_cache = FALSE;
   return TRUE;
 }
 
-static gboolean
+/* Downloads @uri with a fetcher of the pool, blocking until it's done */
+static GstBuffer *
 gst_hls_demux_fetch_location (GstHLSDemux * demux, const gchar * uri)
 {
-  GstStateChangeReturn ret;
-  gboolean bret = FALSE;
+  GstHLSFetcher *fetcher;
+  GstBuffer *buf = NULL;
 
   g_mutex_lock (demux->fetcher_lock);
+  fetcher = gst_hls_demux_get_fetcher (demux);
+  g_mutex_unlock (demux->fetcher_lock);
 
-  if (!gst_hls_demux_make_fetcher (demux, uri)) {
+  if (!gst_hls_fetcher_start (fetcher, uri))
     goto uri_error;
-  }
-
-  ret = gst_element_set_state (demux->fetcher, GST_STATE_PLAYING);
-  if (ret == GST_STATE_CHANGE_FAILURE)
-    goto state_change_error;
 
   /* wait until we have fetched the uri */
   GST_DEBUG_OBJECT (demux, "Waiting to fetch the URI");
-  g_cond_wait (demux->fetcher_cond, demux->fetcher_lock);
-
-  gst_hls_demux_stop_fetcher (demux, FALSE);
+  g_mutex_lock (demux->fetcher_lock);
+  while (!fetcher->done && !demux->cancelled)
+    g_cond_wait (demux->fetcher_cond, demux->fetcher_lock);
+  g_mutex_unlock (demux->fetcher_lock);
 
-  if (gst_adapter_available (demux->download)) {
+  buf = gst_hls_fetcher_finish (fetcher);
+  if (buf)
     GST_INFO_OBJECT (demux, "URI fetched successfully");
-    bret = TRUE;
-  }
   goto quit;
 
 uri_error:
@@ -861,22 +1410,15 @@ uri_error:
     GST_ELEMENT_ERROR (demux, RESOURCE, OPEN_READ,
         ("Could not create an element to fetch the given URI."), ("URI: \"%s\"",
             uri));
-    bret = FALSE;
-    goto quit;
-  }
-
-state_change_error:
-  {
-    GST_ELEMENT_ERROR (demux, CORE, STATE_CHANGE,
-        ("Error changing state of the fetcher element."), NULL);
-    bret = FALSE;
     goto quit;
   }
 
 quit:
   {
+    g_mutex_lock (demux->fetcher_lock);
+    fetcher->busy = FALSE;
     g_mutex_unlock (demux->fetcher_lock);
-    return bret;
+    return buf;
   }
 }
 
@@ -897,19 +1439,18 @@ gst_hls_src_buf_to_utf8_playlist (gchar * data, guint size)
 static gboolean
 gst_hls_demux_update_playlist (GstHLSDemux * demux, gboolean retry)
 {
-  const guint8 *data;
+  GstBuffer *buf;
   gchar *playlist;
-  guint avail;
 
   GST_INFO_OBJECT (demux, "Updating the playlist %s",
       demux->client->current->uri);
-  if (!gst_hls_demux_fetch_location (demux, demux->client->current->uri))
+  buf = gst_hls_demux_fetch_location (demux, demux->client->current->uri);
+  if (buf == NULL)
     return FALSE;
 
-  avail = gst_adapter_available (demux->download);
-  data = gst_adapter_peek (demux->download, avail);
-  playlist = gst_hls_src_buf_to_utf8_playlist ((gchar *) data, avail);
-  gst_adapter_clear (demux->download);
+  playlist = gst_hls_src_buf_to_utf8_playlist ((gchar *) GST_BUFFER_DATA (buf),
+      GST_BUFFER_SIZE (buf));
+  gst_buffer_unref (buf);
   if (playlist == NULL) {
     GST_WARNING_OBJECT (demux, "Couldn't not validate playlist encoding");
     return FALSE;
@@ -919,15 +1460,11 @@ gst_hls_demux_update_playlist (GstHLSDemux * demux, gboolean retry)
 }
 
 static gboolean
-gst_hls_demux_change_playlist (GstHLSDemux * demux, gboolean is_fast)
+gst_hls_demux_change_playlist (GstHLSDemux * demux, GList * list,
+    guint64 bandwidth, GstClockTime buffer_level)
 {
-  GList *list;
   GstStructure *s;
-
-  if (is_fast)
-    list = g_list_next (demux->client->main->lists);
-  else
-    list = g_list_previous (demux->client->main->lists);
+  gint old_bitrate = demux->client->current->bandwidth;
 
   /* Don't do anything else if the playlist is the same */
   if (!list || list->data == demux->client->current)
@@ -937,12 +1474,19 @@ gst_hls_demux_change_playlist (GstHLSDemux * demux, gboolean is_fast)
 
   gst_m3u8_client_set_current (demux->client, demux->client->main->lists->data);
   gst_hls_demux_update_playlist (demux, TRUE);
-  GST_INFO_OBJECT (demux, "Client is %s, switching to bitrate %d",
-      is_fast ? "fast" : "slow", demux->client->current->bandwidth);
+  GST_INFO_OBJECT (demux, "Estimated bandwidth is %" G_GUINT64_FORMAT
+      " bits/s, switching from bitrate %d to %d", bandwidth, old_bitrate,
+      demux->client->current->bandwidth);
+
+  g_mutex_lock (demux->fetcher_lock);
+  demux->current_bitrate = demux->client->current->bandwidth;
+  g_mutex_unlock (demux->fetcher_lock);
 
   s = gst_structure_new ("playlist",
       "uri", G_TYPE_STRING, demux->client->current->uri,
-      "bitrate", G_TYPE_INT, demux->client->current->bandwidth, NULL);
+      "bitrate", G_TYPE_INT, demux->client->current->bandwidth,
+      "bandwidth-estimate", G_TYPE_UINT64, bandwidth,
+      "buffer-level", G_TYPE_UINT64, buffer_level, NULL);
   gst_element_post_message (GST_ELEMENT_CAST (demux),
       gst_message_new_element (GST_OBJECT_CAST (demux), s));
 
@@ -977,80 +1521,155 @@ gst_hls_demux_schedule (GstHLSDemux * demux)
   return TRUE;
 }
 
+/* Default handler of the select-bitrate signal */
+static gint
+gst_hls_demux_select_bitrate (GstHLSDemux * demux, guint64 bandwidth,
+    guint64 buffer_level, gint current_bitrate)
+{
+  GstClockTime target_duration;
+  guint64 usable;
+
+  /* keep a margin for the variations of the bandwidth */
+  usable = bandwidth * (1.0 - demux->bitrate_switch_tol);
+
+  /* switch up only with a fragment ahead, so that an estimate that turns out
+   * to be wrong doesn't stall the playback */
+  target_duration = demux->client->current->targetduration * GST_SECOND;
+  if (usable > current_bitrate && buffer_level < target_duration)
+    return current_bitrate;
+
+  /* switch down only when the current bitrate doesn't fit with half the
+   * margin either, so that an estimate close to the bitrate of a variant
+   * doesn't make the selection oscillate */
+  if (usable < current_bitrate &&
+      bandwidth * (1.0 - demux->bitrate_switch_tol / 2) >= current_bitrate)
+    return current_bitrate;
+
+  return MIN (usable, G_MAXINT);
+}
+
+/* Returns the variant with the highest bitrate not above @bitrate, or the
+ * lowest one */
+static GList *
+gst_hls_demux_find_variant (GstHLSDemux * demux, gint bitrate)
+{
+  GList *walk, *list;
+
+  /* the variants are sorted by bitrate */
+  list = g_list_first (demux->client->main->lists);
+  for (walk = list; walk; walk = walk->next) {
+    if (((GstM3U8 *) walk->data)->bandwidth <= bitrate)
+      list = walk;
+  }
+
+  return list;
+}
+
 static gboolean
 gst_hls_demux_switch_playlist (GstHLSDemux * demux)
 {
-  GTimeVal now;
-  gint64 diff, limit;
+  guint64 bandwidth;
+  GstClockTime buffer_level;
+  gint current_bitrate, bitrate = 0;
 
-  g_get_current_time (&now);
   if (!demux->client->main->lists)
     return TRUE;
 
-  /* compare the time when the fragment was downloaded with the time when it was
-   * scheduled */
-  diff = (GST_TIMEVAL_TO_TIME (demux->next_update) - GST_TIMEVAL_TO_TIME (now));
-  limit = demux->client->current->targetduration * GST_SECOND *
-      demux->bitrate_switch_tol;
-
-  /* if we are on time switch to a higher bitrate */
-  if (diff > limit) {
-    gst_hls_demux_change_playlist (demux, TRUE);
-  } else if (diff < 0) {
-    /* if the client is too slow wait until it has accumulated a certain delay to
-     * switch to a lower bitrate */
-    demux->accumulated_delay -= diff;
-    if (demux->accumulated_delay >= limit) {
-      gst_hls_demux_change_playlist (demux, FALSE);
-    } else if (demux->accumulated_delay < 0) {
-      demux->accumulated_delay = 0;
-    }
-  }
-  return TRUE;
+  g_mutex_lock (demux->fetcher_lock);
+  bandwidth = demux->bandwidth;
+  buffer_level = gst_hls_demux_get_buffer_level (demux);
+  current_bitrate = demux->current_bitrate;
+  g_mutex_unlock (demux->fetcher_lock);
+
+  if (bandwidth == 0)
+    return TRUE;
+
+  g_signal_emit (demux, signals[SIGNAL_SELECT_BITRATE], 0, bandwidth,
+      buffer_level, current_bitrate, &bitrate);
+  GST_LOG_OBJECT (demux, "Selected bitrate %d for a bandwidth of %"
+      G_GUINT64_FORMAT " bits/s and a buffer level of %" GST_TIME_FORMAT,
+      bitrate, bandwidth, GST_TIME_ARGS (buffer_level));
+
+  return gst_hls_demux_change_playlist (demux,
+      gst_hls_demux_find_variant (demux, bitrate), bandwidth, buffer_level);
 }
 
-static gboolean
-gst_hls_demux_get_next_fragment (GstHLSDemux * demux, gboolean retry)
+/* Called with the fetcher lock, returns the duration of the queued fragments
+ * and the number of fragments being downloaded */
+static GstClockTime
+gst_hls_demux_get_queued (GstHLSDemux * demux, guint * n_downloads)
 {
-  GstBuffer *buf;
-  guint avail;
-  const gchar *next_fragment_uri;
-  GstClockTime duration;
-  gboolean discont;
-
-  if (!gst_m3u8_client_get_next_fragment (demux->client, &discont,
-          &next_fragment_uri, &duration)) {
-    GST_INFO_OBJECT (demux, "This playlist doesn't contain more fragments");
-    demux->end_of_playlist = TRUE;
-    GST_TASK_SIGNAL (demux->task);
-    return FALSE;
-  }
+  GstClockTime duration = 0;
+  GList *walk;
 
-  GST_INFO_OBJECT (demux, "Fetching next fragment %s", next_fragment_uri);
+  *n_downloads = 0;
+  for (walk = demux->queue->head; walk; walk = walk->next) {
+    GstHLSFragment *fragment = walk->data;
 
-  if (!gst_hls_demux_fetch_location (demux, next_fragment_uri))
-    return FALSE;
+    duration += fragment->duration;
+    if (!fragment->complete)
+      (*n_downloads)++;
+  }
 
-  avail = gst_adapter_available (demux->download);
-  buf = gst_adapter_take_buffer (demux->download, avail);
-  GST_BUFFER_DURATION (buf) = duration;
+  return duration;
+}
 
-  if (G_UNLIKELY (demux->input_caps == NULL)) {
-    demux->input_caps = gst_type_find_helper_for_buffer (NULL, buf, NULL);
-    if (demux->input_caps) {
-      gst_pad_set_caps (demux->srcpad, demux->input_caps);
-      GST_INFO_OBJECT (demux, "Input source caps: %" GST_PTR_FORMAT,
-          demux->input_caps);
+/* Called with the fetcher lock, starts downloading the next fragments until
+ * the prefetch window is full or max-downloads fragments are being
+ * downloaded */
+static void
+gst_hls_demux_schedule_downloads (GstHLSDemux * demux)
+{
+  while (!demux->cancelled && !demux->end_of_playlist) {
+    GstHLSFragment *fragment;
+    GstHLSFetcher *fetcher;
+    gchar *next_fragment_uri;
+    GstClockTime timestamp, duration, queued;
+    gboolean discont, started;
+    guint n_downloads;
+
+    queued = gst_hls_demux_get_queued (demux, &n_downloads);
+    if (n_downloads >= demux->max_downloads)
+      break;
+    if (demux->prefetch_window > 0) {
+      if (queued >= demux->prefetch_window)
+        break;
+    } else if (g_queue_get_length (demux->queue) >= demux->fragments_cache) {
+      break;
     }
-  }
 
-  if (discont) {
-    GST_DEBUG_OBJECT (demux, "Marking fragment as discontinuous");
-    GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DISCONT);
-  }
+    if (!gst_m3u8_client_get_next_fragment (demux->client, &discont,
+            &next_fragment_uri, &duration, &timestamp)) {
+      /* live playlists get new fragments with the next update */
+      if (!gst_m3u8_client_is_live (demux->client)) {
+        GST_INFO_OBJECT (demux, "This playlist doesn't contain more fragments");
+        demux->end_of_playlist = TRUE;
+        g_cond_broadcast (demux->fetcher_cond);
+      }
+      break;
+    }
 
-  g_queue_push_tail (demux->queue, buf);
-  GST_TASK_SIGNAL (demux->task);
-  gst_adapter_clear (demux->download);
-  return TRUE;
+    GST_INFO_OBJECT (demux, "Fetching next fragment %s", next_fragment_uri);
+
+    fragment = g_slice_new0 (GstHLSFragment);
+    fragment->uri = next_fragment_uri;
+    fragment->timestamp = timestamp;
+    fragment->duration = duration;
+    fragment->discont = discont;
+    g_queue_push_tail (demux->queue, fragment);
+
+    fetcher = gst_hls_demux_get_fetcher (demux);
+    fetcher->fragment = fragment;
+    fragment->fetcher = fetcher;
+
+    g_mutex_unlock (demux->fetcher_lock);
+    started = gst_hls_fetcher_start (fetcher, fragment->uri);
+    g_mutex_lock (demux->fetcher_lock);
+
+    /* the fragment will be reaped as failed */
+    if (!started) {
+      fetcher->error = TRUE;
+      fetcher->done = TRUE;
+    }
+  }
 }
@@ -41,6 +41,45 @@ G_BEGIN_DECLS
   (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_HLS_DEMUX))
 typedef struct _GstHLSDemux GstHLSDemux;
 typedef struct _GstHLSDemuxClass GstHLSDemuxClass;
+typedef struct _GstHLSFetcher GstHLSFetcher;
+typedef struct _GstHLSFragment GstHLSFragment;
+
+/* Number of downloads the bandwidth is estimated from */
+#define GST_HLS_DEMUX_BANDWIDTH_SAMPLES 8
+
+/* A fragment of the playlist, queued in playback order from the moment its
+ * download starts until it's pushed */
+struct _GstHLSFragment
+{
+  gchar *uri;
+  GstClockTime timestamp;
+  GstClockTime duration;
+  gboolean discont;
+
+  gboolean complete;            /* Whether the download finished */
+  GstBuffer *buffer;            /* Downloaded data, NULL if it failed */
+  GstHLSFetcher *fetcher;       /* Fetcher downloading it, if not complete */
+};
+
+/* A source element downloading one URI at a time. It's kept in READY between
+ * downloads and reused for the next URI with the same protocol. This only
+ * saves creating the element, the source closes its connection in READY */
+struct _GstHLSFetcher
+{
+  GstHLSDemux *demux;
+
+  GstElement *src;
+  gchar *protocol;              /* Protocol handled by src */
+  GstPad *pad;                  /* Internal pad linked to the src pad */
+  GstBus *bus;
+  GstAdapter *download;
+
+  gboolean busy;                /* Reserved for a download */
+  gboolean done;                /* Got EOS or an error */
+  gboolean error;
+  GTimeVal start;               /* When the download started */
+  GstHLSFragment *fragment;     /* Fragment downloaded, NULL for playlists */
+};
 
 /**
  * GstHLSDemux:
@@ -58,40 +97,45 @@ struct _GstHLSDemux
   GstBuffer *playlist;
   GstCaps *input_caps;
   GstM3U8Client *client;        /* M3U8 client */
-  GQueue *queue;                /* Queue storing the fetched fragments */
+  GQueue *queue;                /* Queue of GstHLSFragment downloading or downloaded */
   gboolean need_cache;          /* Wheter we need to cache some fragments before starting to push data */
+  gboolean need_segment;        /* Whether a newsegment must be pushed before the next fragment */
   gboolean end_of_playlist;
 
 
   /* Properties */
   guint fragments_cache;        /* number of fragments needed to be cached to start playing */
-  gfloat bitrate_switch_tol;    /* tolerance with respect to the fragment duration to switch the bitarate*/
+  gfloat bitrate_switch_tol;    /* fraction of the estimated bandwidth kept as a margin when selecting a bitrate */
+  guint max_downloads;          /* number of fragments downloaded at the same time */
+  guint64 prefetch_window;      /* duration of the fragments downloaded ahead, 0 for fragments_cache fragments */
 
   /* Updates thread */
-  GThread *updates_thread;      /* Thread handling the playlist and fragments updates */
-  GMutex *thread_lock;          /* Thread lock */
-  GCond *thread_cond;           /* Signals the thread to quit */
-  gboolean thread_return;       /* Instructs the thread to return after the thread_quit condition is meet */
+  GThread *updates_thread;      /* Thread handling the playlist updates and scheduling the downloads */
   GTimeVal next_update;         /* Time of the next update */
-  gint64 accumulated_delay;     /* Delay accumulated fetching fragments, used to decide a playlist switch */
-
-  /* Fragments fetcher */
-  GstElement *fetcher;
-  GstBus *fetcher_bus;
-  GstPad *fetcherpad;
-  GMutex *fetcher_lock;
-  GCond *fetcher_cond;
-  GTimeVal *timeout;
-  gboolean fetcher_error;
-  gboolean stopping_fetcher;
-  gboolean cancelled;
-  GstAdapter *download;
 
+  /* Bandwidth estimation, protected by the fetcher lock */
+  guint64 sample_bytes[GST_HLS_DEMUX_BANDWIDTH_SAMPLES];
+  GstClockTime sample_time[GST_HLS_DEMUX_BANDWIDTH_SAMPLES];
+  guint n_samples;              /* Number of valid samples */
+  guint next_sample;            /* Index of the oldest sample */
+  GstClockTime last_sample;     /* When the last download finished */
+  guint64 bandwidth;            /* Estimated bandwidth in bits/s, 0 if unknown */
+  gint current_bitrate;         /* Bandwidth of the current variant */
+
+  /* Fragments fetchers */
+  GPtrArray *fetchers;          /* Pool of GstHLSFetcher */
+  GMutex *fetcher_lock;         /* Protects the fetchers and the queue */
+  GCond *fetcher_cond;          /* Signals a finished download, a pushed fragment or a cancellation */
+  gboolean cancelled;
 };
 
 struct _GstHLSDemuxClass
 {
   GstElementClass parent_class;
+
+  /* signals */
+  gint (*select_bitrate) (GstHLSDemux * demux, guint64 bandwidth,
+      guint64 buffer_level, gint current_bitrate);
 };
 
 GType gst_hls_demux_get_type (void);
@@ -42,6 +42,8 @@ gst_m3u8_new (void)
   GstM3U8 *m3u8;
 
   m3u8 = g_new0 (GstM3U8, 1);
+  m3u8->files =
+      g_ptr_array_new_with_free_func ((GDestroyNotify) gst_m3u8_media_file_free);
 
   return m3u8;
 }
@@ -65,8 +67,7 @@ gst_m3u8_free (GstM3U8 * self)
   g_free (self->allowcache);
   g_free (self->codecs);
 
-  g_list_foreach (self->files, (GFunc) gst_m3u8_media_file_free, NULL);
-  g_list_free (self->files);
+  g_ptr_array_free (self->files, TRUE);
 
   g_free (self->last_data);
   g_list_foreach (self->lists, (GFunc) gst_m3u8_free, NULL);
@@ -179,8 +180,32 @@ gst_m3u8_compare_playlist_by_bitrate (gconstpointer a, gconstpointer b)
   return ((GstM3U8 *) (a))->bandwidth - ((GstM3U8 *) (b))->bandwidth;
 }
 
+/* Returns the first media file whose sequence number is not lower than
+ * @sequence, or NULL */
+static GstM3U8MediaFile *
+gst_m3u8_find_file (GstM3U8 * self, gint sequence)
+{
+  GstM3U8MediaFile *first;
+
+  if (self->files->len == 0)
+    return NULL;
+
+  /* the sequence numbers of the media files are contiguous */
+  first = g_ptr_array_index (self->files, 0);
+  if (sequence <= (gint) first->sequence)
+    return first;
+  if (sequence - first->sequence >= self->files->len)
+    return NULL;
+
+  return g_ptr_array_index (self->files, sequence - first->sequence);
+}
+
 /*
  * @data: a m3u8 playlist text data, taking ownership
+ *
+ * The media files are identified by their sequence number, so on updates of
+ * a live playlist only the new entries are parsed and added and the ones that
+ * went out of the playlist are dropped.
  */
 static gboolean
 gst_m3u8_update (GstM3U8 * self, gchar * data, gboolean * updated)
@@ -189,6 +214,10 @@ gst_m3u8_update (GstM3U8 * self, gchar * data, gboolean * updated)
   gchar *title, *end;
 //  gboolean discontinuity;
   GstM3U8 *list;
+  GstM3U8MediaFile *file;
+  guint sequence, first_sequence, n_known, playlist_sequence;
+  GstClockTime timestamp;
+  gboolean checked;
 
   g_return_val_if_fail (self != NULL, FALSE);
   g_return_val_if_fail (data != NULL, FALSE);
@@ -213,15 +242,28 @@ gst_m3u8_update (GstM3U8 * self, gchar * data, gboolean * updated)
   g_free (self->last_data);
   self->last_data = data;
 
-  if (self->files) {
-    g_list_foreach (self->files, (GFunc) gst_m3u8_media_file_free, NULL);
-    g_list_free (self->files);
-    self->files = NULL;
+  /* the media files we already have, from first_sequence */
+  n_known = self->files->len;
+  first_sequence = 0;
+  if (n_known > 0)
+    first_sequence =
+        GST_M3U8_MEDIA_FILE (g_ptr_array_index (self->files, 0))->sequence;
+  checked = FALSE;
+  playlist_sequence = 0;
+  self->restarted = (n_known == 0);
+
+  /* the new media files follow the known ones in time, even if some were
+   * missed */
+  timestamp = 0;
+  if (n_known > 0) {
+    file = g_ptr_array_index (self->files, n_known - 1);
+    timestamp = file->timestamp + file->duration * GST_SECOND;
   }
 
   list = NULL;
   duration = -1;
   title = NULL;
+  sequence = 0;
   data += 7;
   while (TRUE) {
     end = g_utf8_strchr (data, -1, '\n');       /* FIXME: support \r\n */
@@ -234,6 +276,30 @@ gst_m3u8_update (GstM3U8 * self, gchar * data, gboolean * updated)
         goto next_line;
       }
 
+      if (list == NULL) {
+        /* If the first media file doesn't follow the ones we have, the
+         * sequence was restarted or we missed some updates: start over */
+        if (!checked && n_known > 0 && (sequence < first_sequence ||
+                sequence > first_sequence + n_known)) {
+          GST_DEBUG ("Sequence %u doesn't follow %u-%u, dropping all media "
+              "files", sequence, first_sequence, first_sequence + n_known - 1);
+          g_ptr_array_set_size (self->files, 0);
+          n_known = 0;
+          self->restarted = TRUE;
+        }
+        if (!checked)
+          playlist_sequence = sequence;
+        checked = TRUE;
+
+        /* skip the media files we already have */
+        if (n_known > 0 && sequence < first_sequence + n_known) {
+          duration = -1;
+          title = NULL;
+          sequence++;
+          goto next_line;
+        }
+      }
+
       if (!gst_uri_is_valid (data)) {
         gchar *slash;
         if (!self->uri) {
@@ -264,13 +330,14 @@ gst_m3u8_update (GstM3U8 * self, gchar * data, gboolean * updated)
         }
         list = NULL;
       } else {
-        GstM3U8MediaFile *file;
         file =
-            gst_m3u8_media_file_new (data, title, duration,
-            self->mediasequence++);
+            gst_m3u8_media_file_new (data, g_strdup (title), duration,
+            sequence++);
+        file->timestamp = timestamp;
+        timestamp += duration * GST_SECOND;
         duration = -1;
         title = NULL;
-        self->files = g_list_append (self->files, file);
+        g_ptr_array_add (self->files, file);
       }
 
     } else if (g_str_has_prefix (data, "#EXT-X-ENDLIST")) {
@@ -315,7 +382,7 @@ gst_m3u8_update (GstM3U8 * self, gchar * data, gboolean * updated)
         self->targetduration = val;
     } else if (g_str_has_prefix (data, "#EXT-X-MEDIA-SEQUENCE:")) {
       if (int_from_string (data + 22, &data, &val))
-        self->mediasequence = val;
+        sequence = val;
     } else if (g_str_has_prefix (data, "#EXT-X-DISCONTINUITY")) {
       /* discontinuity = TRUE; */
     } else if (g_str_has_prefix (data, "#EXT-X-PROGRAM-DATE-TIME:")) {
@@ -335,10 +402,9 @@ gst_m3u8_update (GstM3U8 * self, gchar * data, gboolean * updated)
       if (!data || *data != ',')
         goto next_line;
       data = g_utf8_next_char (data);
-      if (data != end) {
-        g_free (title);
-        title = g_strdup (data);
-      }
+      /* only copied if the media file is new */
+      if (data != end)
+        title = data;
     } else {
       GST_LOG ("Ignored line: %s", data);
     }
@@ -349,6 +415,18 @@ gst_m3u8_update (GstM3U8 * self, gchar * data, gboolean * updated)
     data = g_utf8_next_char (end);      /* skip \n */
   }
 
+  /* drop the media files that went out of the playlist */
+  if (checked && self->files->len > 0) {
+    file = g_ptr_array_index (self->files, 0);
+    if (playlist_sequence > file->sequence) {
+      GST_DEBUG ("Dropping media files %u-%u", file->sequence,
+          playlist_sequence - 1);
+      g_ptr_array_remove_range (self->files, 0,
+          MIN (playlist_sequence - file->sequence, self->files->len));
+    }
+  }
+  self->mediasequence = sequence;
+
   /* redorder playlists by bitrate */
   if (self->lists)
     self->lists =
@@ -358,6 +436,61 @@ gst_m3u8_update (GstM3U8 * self, gchar * data, gboolean * updated)
   return TRUE;
 }
 
+/*
+ * Shifts the timestamps of the media files so that the media file @sequence
+ * starts at @timestamp. The media sequence numbers are shared by all the
+ * variants of a stream, so this keeps the timeline continuous when
+ * switching between them. If @sequence is not in the playlist and @estimate
+ * is TRUE its position is estimated from the target duration, otherwise
+ * nothing is done.
+ */
+static void
+gst_m3u8_rebase (GstM3U8 * self, guint sequence, GstClockTime timestamp,
+    gboolean estimate)
+{
+  GstM3U8MediaFile *first, *last, *file;
+  GstClockTimeDiff shift;
+  GstClockTime start;
+  guint i;
+
+  if (self->files->len == 0 || !GST_CLOCK_TIME_IS_VALID (timestamp))
+    return;
+
+  first = g_ptr_array_index (self->files, 0);
+  last = g_ptr_array_index (self->files, self->files->len - 1);
+
+  file = gst_m3u8_find_file (self, sequence);
+  if (file && file->sequence == sequence) {
+    start = file->timestamp;
+  } else if (sequence == last->sequence + 1) {
+    start = last->timestamp + last->duration * GST_SECOND;
+  } else if (estimate) {
+    start = first->timestamp;
+    if (sequence > first->sequence)
+      start += (guint64) (sequence - first->sequence) *
+          self->targetduration * GST_SECOND;
+    else
+      timestamp += (guint64) (first->sequence - sequence) *
+          self->targetduration * GST_SECOND;
+  } else {
+    return;
+  }
+
+  shift = GST_CLOCK_DIFF (start, timestamp);
+  /* don't go before 0 */
+  if (shift < 0 && (GstClockTime) (-shift) > first->timestamp)
+    shift = -(GstClockTimeDiff) first->timestamp;
+  if (shift == 0)
+    return;
+
+  GST_DEBUG ("Shifting the media files of %s by %" G_GINT64_FORMAT,
+      self->uri, shift);
+  for (i = 0; i < self->files->len; i++) {
+    file = g_ptr_array_index (self->files, i);
+    file->timestamp += shift;
+  }
+}
+
 GstM3U8Client *
 gst_m3u8_client_new (const gchar * uri)
 {
@@ -369,7 +502,9 @@ gst_m3u8_client_new (const gchar * uri)
   client->main = gst_m3u8_new ();
   client->current = NULL;
   client->sequence = -1;
+  client->sequence_timestamp = GST_CLOCK_TIME_NONE;
   client->update_failed_count = 0;
+  client->lock = g_mutex_new ();
   gst_m3u8_set_uri (client->main, g_strdup (uri));
 
   return client;
@@ -381,6 +516,7 @@ gst_m3u8_client_free (GstM3U8Client * self)
   g_return_if_fail (self != NULL);
 
   gst_m3u8_free (self->main);
+  g_mutex_free (self->lock);
   g_free (self);
 }
 
@@ -389,10 +525,16 @@ gst_m3u8_client_set_current (GstM3U8Client * self, GstM3U8 * m3u8)
 {
   g_return_if_fail (self != NULL);
 
+  GST_M3U8_CLIENT_LOCK (self);
   if (m3u8 != self->current) {
     self->current = m3u8;
     self->update_failed_count = 0;
+    /* carry the timeline over, the playlist might be stale and is only
+     * aligned if it still has the next media file */
+    if (self->sequence >= 0)
+      gst_m3u8_rebase (m3u8, self->sequence, self->sequence_timestamp, FALSE);
   }
+  GST_M3U8_CLIENT_UNLOCK (self);
 }
 
 gboolean
@@ -400,19 +542,27 @@ gst_m3u8_client_update (GstM3U8Client * self, gchar * data)
 {
   GstM3U8 *m3u8;
   gboolean updated = FALSE;
+  gboolean ret = FALSE;
 
   g_return_val_if_fail (self != NULL, FALSE);
 
+  GST_M3U8_CLIENT_LOCK (self);
   m3u8 = self->current ? self->current : self->main;
 
   if (!gst_m3u8_update (m3u8, data, &updated))
-    return FALSE;
+    goto out;
 
   if (!updated) {
     self->update_failed_count++;
-    return FALSE;
+    goto out;
   }
 
+  /* a playlist parsed from scratch (first use of a variant, or one that
+   * was not updated for too long) starts at 0, align it on the timeline
+   * of the fragments already played */
+  if (m3u8->restarted && self->sequence >= 0)
+    gst_m3u8_rebase (m3u8, self->sequence, self->sequence_timestamp, TRUE);
+
   /* select the first playlist, for now */
   if (!self->current) {
     if (self->main->lists) {
@@ -422,48 +572,123 @@ gst_m3u8_client_update (GstM3U8Client * self, gchar * data)
     }
   }
 
-  if (m3u8->files && self->sequence == -1) {
+  if (m3u8->files->len > 0 && self->sequence == -1) {
     self->sequence =
-        GST_M3U8_MEDIA_FILE (g_list_first (m3u8->files)->data)->sequence;
+        GST_M3U8_MEDIA_FILE (g_ptr_array_index (m3u8->files, 0))->sequence;
     GST_DEBUG ("Setting first sequence at %d", self->sequence);
   }
+  ret = TRUE;
 
-  return TRUE;
-}
-
-static gboolean
-_find_next (GstM3U8MediaFile * file, GstM3U8Client * client)
-{
-  GST_DEBUG ("Found fragment %d", file->sequence);
-  if (file->sequence >= client->sequence)
-    return FALSE;
-  return TRUE;
+out:
+  GST_M3U8_CLIENT_UNLOCK (self);
+  return ret;
 }
 
 gboolean
 gst_m3u8_client_get_next_fragment (GstM3U8Client * client,
-    gboolean * discontinuity, const gchar ** uri, GstClockTime * duration)
+    gboolean * discontinuity, gchar ** uri, GstClockTime * duration,
+    GstClockTime * timestamp)
 {
-  GList *l;
   GstM3U8MediaFile *file;
 
   g_return_val_if_fail (client != NULL, FALSE);
   g_return_val_if_fail (client->current != NULL, FALSE);
   g_return_val_if_fail (discontinuity != NULL, FALSE);
 
+  GST_M3U8_CLIENT_LOCK (client);
   GST_DEBUG ("Looking for fragment %d", client->sequence);
-  l = g_list_find_custom (client->current->files, client,
-      (GCompareFunc) _find_next);
-  if (l == NULL)
+  file = gst_m3u8_find_file (client->current, client->sequence);
+  if (file == NULL) {
+    GST_M3U8_CLIENT_UNLOCK (client);
     return FALSE;
-
-  file = GST_M3U8_MEDIA_FILE (l->data);
+  }
 
   *discontinuity = client->sequence != file->sequence;
   client->sequence = file->sequence + 1;
+  client->sequence_timestamp = file->timestamp + file->duration * GST_SECOND;
 
-  *uri = file->uri;
+  /* the media file can be dropped by the next update */
+  *uri = g_strdup (file->uri);
   *duration = file->duration * GST_SECOND;
+  *timestamp = file->timestamp;
+  GST_M3U8_CLIENT_UNLOCK (client);
+  return TRUE;
+}
+
+/*
+ * Makes the fragment containing @position the next one, with a binary search
+ * on the timestamps of the media files. Positions out of the playlist are
+ * clamped to its first or last fragment, which happens with live playlists
+ * whose window moved. @timestamp is set to the start of the fragment.
+ */
+gboolean
+gst_m3u8_client_seek (GstM3U8Client * client, GstClockTime position,
+    GstClockTime * timestamp)
+{
+  GPtrArray *files;
+  GstM3U8MediaFile *file;
+  guint low, high;
+
+  g_return_val_if_fail (client != NULL, FALSE);
+  g_return_val_if_fail (client->current != NULL, FALSE);
+  g_return_val_if_fail (timestamp != NULL, FALSE);
+
+  GST_M3U8_CLIENT_LOCK (client);
+  files = client->current->files;
+  if (files->len == 0) {
+    GST_M3U8_CLIENT_UNLOCK (client);
+    return FALSE;
+  }
+
+  /* find the last file starting before the position */
+  low = 0;
+  high = files->len - 1;
+  while (low < high) {
+    guint mid = low + (high - low + 1) / 2;
+
+    file = g_ptr_array_index (files, mid);
+    if (file->timestamp <= position)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+
+  file = g_ptr_array_index (files, low);
+  GST_DEBUG ("Seeking to %" GST_TIME_FORMAT ", fragment %d at %"
+      GST_TIME_FORMAT, GST_TIME_ARGS (position), file->sequence,
+      GST_TIME_ARGS (file->timestamp));
+
+  client->sequence = file->sequence;
+  client->sequence_timestamp = file->timestamp;
+  *timestamp = file->timestamp;
+  GST_M3U8_CLIENT_UNLOCK (client);
+  return TRUE;
+}
+
+/* Returns the time range covered by the current playlist, which for live
+ * playlists is the window of the fragments still available */
+gboolean
+gst_m3u8_client_get_seek_range (GstM3U8Client * client, GstClockTime * start,
+    GstClockTime * stop)
+{
+  GPtrArray *files;
+  GstM3U8MediaFile *first, *last;
+
+  g_return_val_if_fail (client != NULL, FALSE);
+
+  GST_M3U8_CLIENT_LOCK (client);
+  if (client->current == NULL || client->current->files->len == 0) {
+    GST_M3U8_CLIENT_UNLOCK (client);
+    return FALSE;
+  }
+
+  files = client->current->files;
+  first = g_ptr_array_index (files, 0);
+  last = g_ptr_array_index (files, files->len - 1);
+
+  *start = first->timestamp;
+  *stop = last->timestamp + last->duration * GST_SECOND;
+  GST_M3U8_CLIENT_UNLOCK (client);
   return TRUE;
 }
 
@@ -480,11 +705,16 @@ gst_m3u8_client_get_duration (GstM3U8Client * client)
 
   g_return_val_if_fail (client != NULL, GST_CLOCK_TIME_NONE);
 
+  GST_M3U8_CLIENT_LOCK (client);
   /* We can only get the duration for on-demand streams */
-  if (!client->current->endlist)
+  if (!client->current || !client->current->endlist) {
+    GST_M3U8_CLIENT_UNLOCK (client);
     return GST_CLOCK_TIME_NONE;
+  }
 
-  g_list_foreach (client->current->files, (GFunc) _sum_duration, &duration);
+  g_ptr_array_foreach (client->current->files, (GFunc) _sum_duration,
+      &duration);
+  GST_M3U8_CLIENT_UNLOCK (client);
   return duration * GST_SECOND;
 }
 
@@ -31,6 +31,9 @@ typedef struct _GstM3U8Client GstM3U8Client;
 
 #define GST_M3U8_MEDIA_FILE(f) ((GstM3U8MediaFile*)f)
 
+#define GST_M3U8_CLIENT_LOCK(c) g_mutex_lock ((c)->lock)
+#define GST_M3U8_CLIENT_UNLOCK(c) g_mutex_unlock ((c)->lock)
+
 struct _GstM3U8
 {
   gchar *uri;
@@ -45,13 +48,15 @@ struct _GstM3U8
   gchar *codecs;
   gint width;
   gint height;
-  GList *files;
+  GPtrArray *files;             /* GstM3U8MediaFile, by sequence number */
 
   /*< private > */
   gchar *last_data;
   GList *lists;                 /* list of GstM3U8 from the main playlist */
   GstM3U8 *parent;              /* main playlist (if any) */
-  guint mediasequence;          /* EXT-X-MEDIA-SEQUENCE & increased with new media file */
+  guint mediasequence;          /* sequence of the next media file */
+  gboolean restarted;           /* media files parsed from scratch on the
+                                 * last update */
 };
 
 struct _GstM3U8MediaFile
@@ -60,6 +65,7 @@ struct _GstM3U8MediaFile
   gint duration;
   gchar *uri;
   guint sequence;               /* the sequence nb of this file */
+  GstClockTime timestamp;       /* sum of the durations of the previous files */
 };
 
 struct _GstM3U8Client
@@ -68,6 +74,10 @@ struct _GstM3U8Client
   GstM3U8 *current;
   guint update_failed_count;
   gint sequence;                /* the next sequence for this client */
+  GstClockTime sequence_timestamp;      /* start of the next sequence, the
+                                         * variants are aligned on it */
+  GMutex *lock;                 /* protects the media files of the playlists,
+                                 * which get updated from another thread */
 };
 
 
@@ -76,7 +86,12 @@ void gst_m3u8_client_free (GstM3U8Client * client);
 gboolean gst_m3u8_client_update (GstM3U8Client * client, gchar * data);
 void gst_m3u8_client_set_current (GstM3U8Client * client, GstM3U8 * m3u8);
 gboolean gst_m3u8_client_get_next_fragment (GstM3U8Client * client,
-    gboolean * discontinuity, const gchar ** uri, GstClockTime * duration);
+    gboolean * discontinuity, gchar ** uri, GstClockTime * duration,
+    GstClockTime * timestamp);
+gboolean gst_m3u8_client_seek (GstM3U8Client * client, GstClockTime position,
+    GstClockTime * timestamp);
+gboolean gst_m3u8_client_get_seek_range (GstM3U8Client * client,
+    GstClockTime * start, GstClockTime * stop);
 GstClockTime gst_m3u8_client_get_duration (GstM3U8Client * client);
 const gchar *gst_m3u8_client_get_uri(GstM3U8Client * client);
 gboolean gst_m3u8_client_has_variant_playlist(GstM3U8Client * client);
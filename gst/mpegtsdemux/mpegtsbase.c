@@ -50,6 +50,7 @@ static GQuark QUARK_PID;
 static GQuark QUARK_PCR_PID;
 static GQuark QUARK_STREAMS;
 static GQuark QUARK_STREAM_TYPE;
+static GQuark QUARK_DESCRIPTORS;
 
 static GstStaticPadTemplate sink_template = GST_STATIC_PAD_TEMPLATE ("sink",
     GST_PAD_SINK,
@@ -156,6 +157,7 @@ _extra_init (GType type)
   QUARK_PCR_PID = g_quark_from_string ("pcr-pid");
   QUARK_STREAMS = g_quark_from_string ("streams");
   QUARK_STREAM_TYPE = g_quark_from_string ("stream-type");
+  QUARK_DESCRIPTORS = g_quark_from_string ("descriptors");
 }
 
 static void
@@ -188,11 +190,12 @@ static void
 mpegts_base_reset (MpegTSBase * base)
 {
   mpegts_packetizer_clear (base->packetizer);
-  memset (base->is_pes, 0, 8192);
-  memset (base->known_psi, 0, 8192);
+  mpegts_packetizer_reset_pid_filter (base->packetizer);
+  memset (base->is_pes, 0, 1024);
+  memset (base->known_psi, 0, 1024);
 
   /* PAT */
-  base->known_psi[0] = TRUE;
+  MPEGTS_BIT_SET (base->known_psi, 0);
 
   /* FIXME : Commenting the Following lines is to be in sync with the following
    * commit
@@ -226,8 +229,8 @@ mpegts_base_init (MpegTSBase * base, MpegTSBaseClass * klass)
   base->programs = g_hash_table_new_full (g_direct_hash, g_direct_equal,
       NULL, (GDestroyNotify) mpegts_base_free_program);
 
-  base->is_pes = g_new0 (gboolean, 8192);
-  base->known_psi = g_new0 (gboolean, 8192);
+  base->is_pes = g_new0 (guint8, 1024);
+  base->known_psi = g_new0 (guint8, 1024);
   mpegts_base_reset (base);
   base->program_size = sizeof (MpegTSBaseProgram);
   base->stream_size = sizeof (MpegTSBaseStream);
@@ -291,33 +294,40 @@ mpegts_base_get_property (GObject * object, guint prop_id,
   }
 }
 
+/* Looks for a descriptor in the "descriptors" GValueArray of @info without
+ * copying the array. Returns a copy of the descriptor or NULL. */
+static guint8 *
+mpegts_get_descriptor_from_structure (const GstStructure * info, guint8 tag)
+{
+  const GValue *value;
+  GValueArray *descriptors;
+  guint i;
+
+  if (G_UNLIKELY (info == NULL))
+    return NULL;
+
+  value = gst_structure_id_get_value (info, QUARK_DESCRIPTORS);
+  if (value == NULL)
+    return NULL;
+
+  descriptors = (GValueArray *) g_value_get_boxed (value);
+  for (i = 0; i < descriptors->n_values; i++) {
+    GString *desc = (GString *) g_value_get_boxed (&descriptors->values[i]);
+
+    if (DESC_TAG (desc->str) == tag)
+      return g_memdup (desc->str, desc->len + 1);
+  }
+
+  return NULL;
+}
+
 /* returns NULL if no matching descriptor found *
  * otherwise returns a descriptor that needs to *
  * be freed */
 guint8 *
 mpegts_get_descriptor_from_stream (MpegTSBaseStream * stream, guint8 tag)
 {
-  GValueArray *descriptors = NULL;
-  GstStructure *stream_info = stream->stream_info;
-  guint8 *retval = NULL;
-  int i;
-
-  gst_structure_get (stream_info, "descriptors", G_TYPE_VALUE_ARRAY,
-      &descriptors, NULL);
-  if (descriptors) {
-    for (i = 0; i < descriptors->n_values; i++) {
-      GValue *value = g_value_array_get_nth (descriptors, i);
-      GString *desc = g_value_dup_boxed (value);
-      if (DESC_TAG (desc->str) == tag) {
-        retval = (guint8 *) desc->str;
-        g_string_free (desc, FALSE);
-        break;
-      } else
-        g_string_free (desc, FALSE);
-    }
-    g_value_array_free (descriptors);
-  }
-  return retval;
+  return mpegts_get_descriptor_from_structure (stream->stream_info, tag);
 }
 
 /* returns NULL if no matching descriptor found *
@@ -326,30 +336,10 @@ mpegts_get_descriptor_from_stream (MpegTSBaseStream * stream, guint8 tag)
 guint8 *
 mpegts_get_descriptor_from_program (MpegTSBaseProgram * program, guint8 tag)
 {
-  GValueArray *descriptors = NULL;
-  GstStructure *program_info;
-  guint8 *retval = NULL;
-  int i;
-
   if (G_UNLIKELY (program == NULL))
     return NULL;
-  program_info = program->pmt_info;
-  gst_structure_get (program_info, "descriptors", G_TYPE_VALUE_ARRAY,
-      &descriptors, NULL);
-  if (descriptors) {
-    for (i = 0; i < descriptors->n_values; i++) {
-      GValue *value = g_value_array_get_nth (descriptors, i);
-      GString *desc = g_value_dup_boxed (value);
-      if (DESC_TAG (desc->str) == tag) {
-        retval = (guint8 *) desc->str;
-        g_string_free (desc, FALSE);
-        break;
-      } else
-        g_string_free (desc, FALSE);
-    }
-    g_value_array_free (descriptors);
-  }
-  return retval;
+
+  return mpegts_get_descriptor_from_structure (program->pmt_info, tag);
 }
 
 MpegTSBaseProgram *
@@ -421,14 +411,14 @@ mpegts_base_deactivate_program (MpegTSBase * base, MpegTSBaseProgram * program)
 static void
 mpegts_base_free_program (MpegTSBaseProgram * program)
 {
-  guint i;
+  GList *tmp;
 
   if (program->pmt_info)
     gst_structure_free (program->pmt_info);
 
-  for (i = 0; i < 0x2000; i++)
-    if (program->streams[i])
-      mpegts_base_free_stream (program->streams[i]);
+  for (tmp = program->stream_list; tmp; tmp = tmp->next)
+    mpegts_base_free_stream ((MpegTSBaseStream *) tmp->data);
+  g_list_free (program->stream_list);
   g_free (program->streams);
 
   if (program->tags)
@@ -464,12 +454,24 @@ mpegts_base_program_add_stream (MpegTSBase * base,
   GST_DEBUG ("pid:0x%04x, stream_type:0x%03x, stream_info:%" GST_PTR_FORMAT,
       pid, stream_type, stream_info);
 
+  /* The PCR pid is usually also carried by one of the streams, in which
+   * case the new stream replaces the one added for the PCR */
+  if (program->streams[pid]) {
+    GST_DEBUG ("Replacing existing stream for pid 0x%04x", pid);
+    if (klass->stream_removed)
+      klass->stream_removed (base, program->streams[pid]);
+    program->stream_list =
+        g_list_remove (program->stream_list, program->streams[pid]);
+    mpegts_base_free_stream (program->streams[pid]);
+  }
+
   stream = g_malloc0 (base->stream_size);
   stream->pid = pid;
   stream->stream_type = stream_type;
   stream->stream_info = stream_info;
 
   program->streams[pid] = stream;
+  program->stream_list = g_list_append (program->stream_list, stream);
 
   if (klass->stream_added)
     klass->stream_added (base, stream, program);
@@ -488,12 +490,17 @@ mpegts_base_program_remove_stream (MpegTSBase * base,
     MpegTSBaseProgram * program, guint16 pid)
 {
   MpegTSBaseClass *klass = GST_MPEGTS_BASE_GET_CLASS (base);
+  MpegTSBaseStream *stream = program->streams[pid];
+
+  if (G_UNLIKELY (stream == NULL))
+    return;
 
   /* If subclass needs it, inform it of the stream we are about to remove */
   if (klass->stream_removed)
-    klass->stream_removed (base, program->streams[pid]);
+    klass->stream_removed (base, stream);
 
-  mpegts_base_free_stream (program->streams[pid]);
+  program->stream_list = g_list_remove (program->stream_list, stream);
+  mpegts_base_free_stream (stream);
   program->streams[pid] = NULL;
 }
 
@@ -521,11 +528,11 @@ mpegts_base_deactivate_pmt (MpegTSBase * base, MpegTSBaseProgram * program)
       gst_structure_id_get (stream, QUARK_PID, G_TYPE_UINT, &pid,
           QUARK_STREAM_TYPE, G_TYPE_UINT, &stream_type, NULL);
       mpegts_base_program_remove_stream (base, program, (guint16) pid);
-      base->is_pes[pid] = FALSE;
+      MPEGTS_BIT_UNSET (base->is_pes, pid);
     }
     /* remove pcr stream */
     mpegts_base_program_remove_stream (base, program, program->pcr_pid);
-    base->is_pes[program->pcr_pid] = FALSE;
+    MPEGTS_BIT_UNSET (base->is_pes, program->pcr_pid);
   }
 }
 
@@ -544,11 +551,11 @@ mpegts_base_is_psi (MpegTSBase * base, MpegTSPacketizerPacket * packet)
     0x72, 0x73, 0x7E, 0x7F, TABLE_ID_UNSET
   };
 
-  if (base->known_psi[packet->pid])
+  if (MPEGTS_BIT_IS_SET (base->known_psi, packet->pid))
     retval = TRUE;
 
   /* check is it is a pes pid */
-  if (base->is_pes[packet->pid])
+  if (MPEGTS_BIT_IS_SET (base->is_pes, packet->pid))
     return FALSE;
 
   if (!retval) {
@@ -586,6 +593,9 @@ mpegts_base_is_psi (MpegTSBase * base, MpegTSPacketizerPacket * packet)
   return retval;
 }
 
+/* The mpegts_base_apply_* functions take ownership of the structure and
+ * post it in an element message, parsed sections are never copied just
+ * for posting them */
 static void
 mpegts_base_apply_pat (MpegTSBase * base, GstStructure * pat_info)
 {
@@ -604,10 +614,6 @@ mpegts_base_apply_pat (MpegTSBase * base, GstStructure * pat_info)
 
   GST_INFO_OBJECT (base, "PAT %" GST_PTR_FORMAT, pat_info);
 
-  gst_element_post_message (GST_ELEMENT_CAST (base),
-      gst_message_new_element (GST_OBJECT (base),
-          gst_structure_copy (pat_info)));
-
   programs = gst_structure_id_get_value (pat_info, QUARK_PROGRAMS);
   /* activate the new table */
   for (i = 0; i < gst_value_list_get_size (programs); ++i) {
@@ -625,14 +631,14 @@ mpegts_base_apply_pat (MpegTSBase * base, GstStructure * pat_info)
           /* FIXME: when this happens it may still be pmt pid of another
            * program, so setting to False may make it go through expensive
            * path in is_psi unnecessarily */
-          base->known_psi[program->pmt_pid] = FALSE;
+          MPEGTS_BIT_UNSET (base->known_psi, program->pmt_pid);
         }
 
         program->pmt_pid = pid;
-        base->known_psi[pid] = TRUE;
+        MPEGTS_BIT_SET (base->known_psi, pid);
       }
     } else {
-      base->known_psi[pid] = TRUE;
+      MPEGTS_BIT_SET (base->known_psi, pid);
       program = mpegts_base_add_program (base, program_number, pid);
     }
     program->patcount += 1;
@@ -672,7 +678,7 @@ mpegts_base_apply_pat (MpegTSBase * base, GstStructure * pat_info)
       /* FIXME: when this happens it may still be pmt pid of another
        * program, so setting to False may make it go through expensive
        * path in is_psi unnecessarily */
-      base->known_psi[pid] = TRUE;
+      MPEGTS_BIT_SET (base->known_psi, pid);
       mpegts_packetizer_remove_stream (base->packetizer, pid);
     }
 
@@ -681,6 +687,9 @@ mpegts_base_apply_pat (MpegTSBase * base, GstStructure * pat_info)
 #if 0
   mpegts_base_sync_program_pads (base);
 #endif
+
+  gst_element_post_message (GST_ELEMENT_CAST (base),
+      gst_message_new_element (GST_OBJECT (base), pat_info));
 }
 
 static void
@@ -702,13 +711,13 @@ mpegts_base_apply_pmt (MpegTSBase * base,
     GST_WARNING ("Got pmt without pat first. Returning");
     /* remove the stream since we won't get another PMT otherwise */
     mpegts_packetizer_remove_stream (base->packetizer, pmt_pid);
+    gst_structure_free (pmt_info);
     return;
   }
 
   gst_structure_id_get (pmt_info,
       QUARK_PROGRAM_NUMBER, G_TYPE_UINT, &program_number,
       QUARK_PCR_PID, G_TYPE_UINT, &pcr_pid, NULL);
-  new_streams = gst_structure_id_get_value (pmt_info, QUARK_STREAMS);
 
   program = mpegts_base_get_program (base, program_number);
   if (program) {
@@ -719,16 +728,18 @@ mpegts_base_apply_pmt (MpegTSBase * base,
     program->pmt_info = NULL;
   } else {
     /* no PAT?? */
-    base->known_psi[pmt_pid] = TRUE;
-    program = mpegts_base_add_program (base, program_number, pid);
+    MPEGTS_BIT_SET (base->known_psi, pmt_pid);
+    program = mpegts_base_add_program (base, program_number, pmt_pid);
   }
 
   /* activate new pmt */
   program->pmt_info = gst_structure_copy (pmt_info);
+  /* the streams keep pointers to their stream_info, use the copy we keep */
+  new_streams = gst_structure_id_get_value (program->pmt_info, QUARK_STREAMS);
   program->pmt_pid = pmt_pid;
   program->pcr_pid = pcr_pid;
   mpegts_base_program_add_stream (base, program, (guint16) pcr_pid, -1, NULL);
-  base->is_pes[pcr_pid] = TRUE;
+  MPEGTS_BIT_SET (base->is_pes, pcr_pid);
 
   for (i = 0; i < gst_value_list_get_size (new_streams); ++i) {
     value = gst_value_list_get_value (new_streams, i);
@@ -736,7 +747,7 @@ mpegts_base_apply_pmt (MpegTSBase * base,
 
     gst_structure_id_get (stream, QUARK_PID, G_TYPE_UINT, &pid,
         QUARK_STREAM_TYPE, G_TYPE_UINT, &stream_type, NULL);
-    base->is_pes[pid] = TRUE;
+    MPEGTS_BIT_SET (base->is_pes, pid);
     mpegts_base_program_add_stream (base, program,
         (guint16) pid, (guint8) stream_type, stream);
 
@@ -749,8 +760,7 @@ mpegts_base_apply_pmt (MpegTSBase * base,
   GST_DEBUG_OBJECT (base, "new pmt %" GST_PTR_FORMAT, pmt_info);
 
   gst_element_post_message (GST_ELEMENT_CAST (base),
-      gst_message_new_element (GST_OBJECT (base),
-          gst_structure_copy (pmt_info)));
+      gst_message_new_element (GST_OBJECT (base), pmt_info));
 }
 
 static void
@@ -760,8 +770,7 @@ mpegts_base_apply_nit (MpegTSBase * base,
   GST_DEBUG_OBJECT (base, "NIT %" GST_PTR_FORMAT, nit_info);
 
   gst_element_post_message (GST_ELEMENT_CAST (base),
-      gst_message_new_element (GST_OBJECT (base),
-          gst_structure_copy (nit_info)));
+      gst_message_new_element (GST_OBJECT (base), nit_info));
 }
 
 static void
@@ -773,8 +782,7 @@ mpegts_base_apply_sdt (MpegTSBase * base,
   mpegts_base_get_tags_from_sdt (base, sdt_info);
 
   gst_element_post_message (GST_ELEMENT_CAST (base),
-      gst_message_new_element (GST_OBJECT (base),
-          gst_structure_copy (sdt_info)));
+      gst_message_new_element (GST_OBJECT (base), sdt_info));
 }
 
 static void
@@ -786,21 +794,19 @@ mpegts_base_apply_eit (MpegTSBase * base,
   mpegts_base_get_tags_from_eit (base, eit_info);
 
   gst_element_post_message (GST_ELEMENT_CAST (base),
-      gst_message_new_element (GST_OBJECT (base),
-          gst_structure_copy (eit_info)));
+      gst_message_new_element (GST_OBJECT (base), eit_info));
 }
 
 static void
 mpegts_base_apply_tdt (MpegTSBase * base,
     guint16 tdt_pid, GstStructure * tdt_info)
 {
-  gst_element_post_message (GST_ELEMENT_CAST (base),
-      gst_message_new_element (GST_OBJECT (base),
-          gst_structure_copy (tdt_info)));
-
   GST_MPEGTS_BASE_GET_CLASS (base)->push_event (base,
       gst_event_new_custom (GST_EVENT_CUSTOM_DOWNSTREAM,
           gst_structure_copy (tdt_info)));
+
+  gst_element_post_message (GST_ELEMENT_CAST (base),
+      gst_message_new_element (GST_OBJECT (base), tdt_info));
 }
 
 
@@ -917,9 +923,6 @@ mpegts_base_handle_psi (MpegTSBase * base, MpegTSPacketizerSection * section)
       break;
   }
 
-  if (structure)
-    gst_structure_free (structure);
-
   return res;
 }
 
@@ -1047,47 +1050,65 @@ mpegts_base_chain (GstPad * pad, GstBuffer * buf)
   gboolean based;
   MpegTSPacketizerPacketReturn pret;
   MpegTSPacketizer2 *packetizer;
+  MpegTSPacketizerBatch batch;
   MpegTSPacketizerPacket packet;
+  guint i;
 
   base = GST_MPEGTS_BASE (gst_object_get_parent (GST_OBJECT (pad)));
   packetizer = base->packetizer;
 
   mpegts_packetizer_push (base->packetizer, buf);
-  while (((pret =
-              mpegts_packetizer_next_packet (base->packetizer,
-                  &packet)) != PACKET_NEED_MORE) && res == GST_FLOW_OK) {
-    if (G_UNLIKELY (pret == PACKET_BAD))
-      /* bad header, skip the packet */
-      goto next;
-
-    /* base PSI data */
-    if (packet.payload != NULL && mpegts_base_is_psi (base, &packet)) {
-      MpegTSPacketizerSection section;
-      based = mpegts_packetizer_push_section (packetizer, &packet, &section);
-      if (G_UNLIKELY (!based))
-        /* bad section data */
-        goto next;
+  while (res == GST_FLOW_OK &&
+      mpegts_packetizer_next_batch (packetizer, &batch) != PACKET_NEED_MORE) {
+    for (i = 0; i < batch.n_packets && res == GST_FLOW_OK; i++) {
+      MpegTSPacketizerPacketHeader *header = &batch.headers[i];
+
+      /* Discard packets which are neither PES nor (potential) PSI before
+       * creating a buffer for them. This must match what mpegts_base_is_psi
+       * would decide below. */
+      if (!MPEGTS_BIT_IS_SET (base->is_pes, header->pid) &&
+          (!(header->adaptation_field_control & 0x01) ||
+              (!MPEGTS_BIT_IS_SET (base->known_psi, header->pid) &&
+                  !header->payload_unit_start_indicator &&
+                  packetizer->streams[header->pid] == NULL)))
+        continue;
 
-      if (G_LIKELY (section.complete)) {
-        /* section complete */
-        based = mpegts_base_handle_psi (base, &section);
-        gst_buffer_unref (section.buffer);
+      pret = mpegts_packetizer_batch_get_packet (packetizer, &batch, i,
+          &packet);
+      if (G_UNLIKELY (pret == PACKET_BAD))
+        /* bad header, skip the packet */
+        goto next;
 
+      /* base PSI data */
+      if (packet.payload != NULL && mpegts_base_is_psi (base, &packet)) {
+        MpegTSPacketizerSection section;
+        based = mpegts_packetizer_push_section (packetizer, &packet, &section);
         if (G_UNLIKELY (!based))
-          /* bad PSI table */
+          /* bad section data */
           goto next;
-      }
-      /* we need to push section packet downstream */
-      res = mpegts_base_push (base, &packet, &section);
 
-    } else if (base->is_pes[packet.pid]) {
-      /* push the packet downstream */
-      res = mpegts_base_push (base, &packet, NULL);
-    } else
-      gst_buffer_unref (packet.buffer);
+        if (G_LIKELY (section.complete)) {
+          /* section complete */
+          based = mpegts_base_handle_psi (base, &section);
+          gst_buffer_unref (section.buffer);
 
-  next:
-    mpegts_packetizer_clear_packet (base->packetizer, &packet);
+          if (G_UNLIKELY (!based))
+            /* bad PSI table */
+            goto next;
+        }
+        /* we need to push section packet downstream */
+        res = mpegts_base_push (base, &packet, &section);
+
+      } else if (MPEGTS_BIT_IS_SET (base->is_pes, packet.pid)) {
+        /* push the packet downstream */
+        res = mpegts_base_push (base, &packet, NULL);
+      } else
+        gst_buffer_unref (packet.buffer);
+
+    next:
+      mpegts_packetizer_clear_packet (base->packetizer, &packet);
+    }
+    mpegts_packetizer_clear_batch (packetizer, &batch);
   }
 
   gst_object_unref (base);
@@ -1200,6 +1221,69 @@ error:
   }
 }
 
+/* Handles a seek @event received on the source @pad. Takes ownership of
+ * @event */
+gboolean
+mpegts_base_handle_seek_event (MpegTSBase * base, GstPad * pad,
+    GstEvent * event)
+{
+  MpegTSBaseClass *klass = GST_MPEGTS_BASE_GET_CLASS (base);
+  GstFlowReturn ret = GST_FLOW_ERROR;
+  GstSeekFlags flags;
+  GstFormat format;
+  gdouble rate;
+  guint64 offset;
+  gboolean flush;
+  GstEvent *flush_event;
+
+  /* In push mode upstream might be able to handle it */
+  if (GST_PAD_ACTIVATE_MODE (base->sinkpad) != GST_ACTIVATE_PULL ||
+      klass->seek == NULL || base->mode == BASE_MODE_SCANNING)
+    return gst_pad_push_event (base->sinkpad, event);
+
+  gst_event_parse_seek (event, &rate, &format, &flags, NULL, NULL, NULL,
+      NULL);
+  if (format != GST_FORMAT_TIME) {
+    GST_DEBUG_OBJECT (base, "Can only seek in TIME format");
+    gst_event_unref (event);
+    return FALSE;
+  }
+
+  GST_DEBUG_OBJECT (base, "seek event, rate: %f", rate);
+
+  flush = (flags & GST_SEEK_FLAG_FLUSH) == GST_SEEK_FLAG_FLUSH;
+  if (flush) {
+    flush_event = gst_event_new_flush_start ();
+    klass->push_event (base, flush_event);
+    gst_event_unref (flush_event);
+  } else
+    gst_pad_pause_task (base->sinkpad);
+
+  /* wait for the streaming thread to stop */
+  GST_PAD_STREAM_LOCK (base->sinkpad);
+
+  if (flush) {
+    flush_event = gst_event_new_flush_stop ();
+    klass->push_event (base, flush_event);
+    gst_event_unref (flush_event);
+  }
+
+  mpegts_packetizer_clear (base->packetizer);
+  ret = klass->seek (base, event, &offset);
+  if (ret == GST_FLOW_OK) {
+    GST_DEBUG_OBJECT (base, "Resuming from offset %" G_GUINT64_FORMAT, offset);
+    /* clear() reset the packetizer to 0, keep packet offsets absolute */
+    base->seek_offset = base->packetizer->offset = offset;
+  } else
+    GST_WARNING_OBJECT (base, "seek failed %s", gst_flow_get_name (ret));
+
+  gst_pad_start_task (base->sinkpad, (GstTaskFunction) mpegts_base_loop, base);
+  GST_PAD_STREAM_UNLOCK (base->sinkpad);
+
+  gst_event_unref (event);
+  return ret == GST_FLOW_OK;
+}
+
 static gboolean
 mpegts_base_sink_activate (GstPad * pad)
 {
@@ -63,7 +63,10 @@ struct _MpegTSBaseProgram
   guint16 pmt_pid;
   guint16 pcr_pid;
   GstStructure *pmt_info;
+  /* streams indexed by pid */
   MpegTSBaseStream **streams;
+  /* the same streams as a list, to iterate over them */
+  GList *stream_list;
   gint patcount;
 
   /* Pending Tags for the program */
@@ -101,10 +104,10 @@ struct _MpegTSBase {
   GstStructure *pat;
   MpegTSPacketizer2 *packetizer;
 
-  /* arrays that say whether a pid is a known psi pid or a pes pid
-   * FIXME: Make these bit arrays so we can make them 8 times smaller */
-  gboolean *known_psi;
-  gboolean *is_pes;
+  /* bit arrays (one bit per pid) that say whether a pid is a known psi pid
+   * or a pes pid, see MPEGTS_BIT_IS_SET() */
+  guint8 *known_psi;
+  guint8 *is_pes;
 
   gboolean disposed;
 
@@ -139,6 +142,10 @@ struct _MpegTSBaseClass {
   /* find_timestamps is called to find PCR */
  GstFlowReturn (*find_timestamps) (MpegTSBase * base, guint64 initoff, guint64 *offset);
 
+  /* seek is called with the sinkpad STREAM_LOCK held (pull mode only) to
+   * configure the seek and get the offset to resume pulling from */
+  GstFlowReturn (*seek) (MpegTSBase * base, GstEvent * event, guint64 *offset);
+
   /* signals */
   void (*pat_info) (GstStructure *pat);
   void (*pmt_info) (GstStructure *pmt);
@@ -164,6 +171,7 @@ gboolean mpegts_base_handle_psi (MpegTSBase * base, MpegTSPacketizerSection * se
 void mpegts_base_program_remove_stream (MpegTSBase * base, MpegTSBaseProgram * program, guint16 pid);
 
 void mpegts_base_remove_program(MpegTSBase *base, gint program_number);
+gboolean mpegts_base_handle_seek_event(MpegTSBase * base, GstPad * pad, GstEvent * event);
 G_END_DECLS
 
 #endif /* GST_MPEG_TS_BASE_H */
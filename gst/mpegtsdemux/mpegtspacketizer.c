@@ -79,40 +79,53 @@ static gchar *get_encoding_and_convert (const gchar * text, guint length);
 #define VERSION_NUMBER_UNSET 255
 #define TABLE_ID_UNSET 0xFF
 
-static gint
-mpegts_packetizer_stream_subtable_compare (gconstpointer a, gconstpointer b)
-{
-  MpegTSPacketizerStreamSubtable *asub, *bsub;
-
-  asub = (MpegTSPacketizerStreamSubtable *) a;
-  bsub = (MpegTSPacketizerStreamSubtable *) b;
-
-  if (asub->table_id == bsub->table_id &&
-      asub->subtable_extension == bsub->subtable_extension)
-    return 0;
-  return -1;
-}
-
 static MpegTSPacketizerStreamSubtable *
 mpegts_packetizer_stream_subtable_new (guint8 table_id,
     guint16 subtable_extension)
 {
   MpegTSPacketizerStreamSubtable *subtable;
 
-  subtable = g_new0 (MpegTSPacketizerStreamSubtable, 1);
+  subtable = g_slice_new0 (MpegTSPacketizerStreamSubtable);
   subtable->version_number = VERSION_NUMBER_UNSET;
   subtable->table_id = table_id;
   subtable->subtable_extension = subtable_extension;
-  subtable->crc = 0;
   return subtable;
 }
 
+static void
+mpegts_packetizer_stream_subtable_free (MpegTSPacketizerStreamSubtable *
+    subtable)
+{
+  g_free (subtable->crc);
+  g_slice_free (MpegTSPacketizerStreamSubtable, subtable);
+}
+
+/* Looks up the subtable without allocating anything, this is called for
+ * every complete section */
+static MpegTSPacketizerStreamSubtable *
+mpegts_packetizer_stream_find_subtable (MpegTSPacketizerStream * stream,
+    guint8 table_id, guint16 subtable_extension)
+{
+  GSList *tmp;
+
+  for (tmp = stream->subtables; tmp; tmp = tmp->next) {
+    MpegTSPacketizerStreamSubtable *subtable =
+        (MpegTSPacketizerStreamSubtable *) tmp->data;
+
+    if (subtable->table_id == table_id &&
+        subtable->subtable_extension == subtable_extension)
+      return subtable;
+  }
+
+  return NULL;
+}
+
 static MpegTSPacketizerStream *
 mpegts_packetizer_stream_new (void)
 {
   MpegTSPacketizerStream *stream;
 
-  stream = (MpegTSPacketizerStream *) g_new0 (MpegTSPacketizerStream, 1);
+  stream = g_slice_new0 (MpegTSPacketizerStream);
   stream->section_adapter = gst_adapter_new ();
   stream->continuity_counter = CONTINUITY_UNSET;
   stream->subtables = NULL;
@@ -125,9 +138,10 @@ mpegts_packetizer_stream_free (MpegTSPacketizerStream * stream)
 {
   gst_adapter_clear (stream->section_adapter);
   g_object_unref (stream->section_adapter);
-  g_slist_foreach (stream->subtables, (GFunc) g_free, NULL);
+  g_slist_foreach (stream->subtables,
+      (GFunc) mpegts_packetizer_stream_subtable_free, NULL);
   g_slist_free (stream->subtables);
-  g_free (stream);
+  g_slice_free (MpegTSPacketizerStream, stream);
 }
 
 static void
@@ -159,6 +173,7 @@ mpegts_packetizer_init (MpegTSPacketizer2 * packetizer)
   packetizer->empty = TRUE;
   packetizer->streams = g_new0 (MpegTSPacketizerStream *, 8192);
   packetizer->know_packet_size = FALSE;
+  packetizer->pid_filter = g_new0 (guint8, 1024);
 }
 
 static void
@@ -180,6 +195,7 @@ mpegts_packetizer_dispose (GObject * object)
       }
       g_free (packetizer->streams);
     }
+    g_free (packetizer->pid_filter);
 
     gst_adapter_clear (packetizer->adapter);
     g_object_unref (packetizer->adapter);
@@ -264,6 +280,26 @@ mpegts_packetizer_parse_adaptation_field_control (MpegTSPacketizer2 *
   return TRUE;
 }
 
+/* Parses what follows the 4 bytes packet header, the header fields of
+ * @packet must already be set */
+static gboolean
+mpegts_packetizer_parse_payload (MpegTSPacketizer2 * packetizer,
+    MpegTSPacketizerPacket * packet)
+{
+  packet->data = packet->data_start + 4;
+
+  if (packet->adaptation_field_control & 0x02)
+    if (!mpegts_packetizer_parse_adaptation_field_control (packetizer, packet))
+      return FALSE;
+
+  if (packet->adaptation_field_control & 0x01)
+    packet->payload = packet->data;
+  else
+    packet->payload = NULL;
+
+  return TRUE;
+}
+
 static gboolean
 mpegts_packetizer_parse_packet (MpegTSPacketizer2 * packetizer,
     MpegTSPacketizerPacket * packet)
@@ -279,20 +315,8 @@ mpegts_packetizer_parse_packet (MpegTSPacketizer2 * packetizer,
 
   packet->adaptation_field_control = (*data >> 4) & 0x03;
   packet->continuity_counter = *data & 0x0F;
-  data += 1;
-
-  packet->data = data;
 
-  if (packet->adaptation_field_control & 0x02)
-    if (!mpegts_packetizer_parse_adaptation_field_control (packetizer, packet))
-      return FALSE;
-
-  if (packet->adaptation_field_control & 0x01)
-    packet->payload = packet->data;
-  else
-    packet->payload = NULL;
-
-  return TRUE;
+  return mpegts_packetizer_parse_payload (packetizer, packet);
 }
 
 static gboolean
@@ -301,8 +325,8 @@ mpegts_packetizer_parse_section_header (MpegTSPacketizer2 * packetizer,
 {
   guint8 tmp;
   guint8 *data, *crc_data;
+  guint8 section_number, last_section_number;
   MpegTSPacketizerStreamSubtable *subtable;
-  GSList *subtable_list = NULL;
 
   section->complete = TRUE;
   /* get the section buffer, pass the ownership to the caller */
@@ -318,15 +342,11 @@ mpegts_packetizer_parse_section_header (MpegTSPacketizer2 * packetizer,
   else
     section->subtable_extension = GST_READ_UINT16_BE (data + 2);
 
-  subtable = mpegts_packetizer_stream_subtable_new (section->table_id,
-      section->subtable_extension);
-
-  subtable_list = g_slist_find_custom (stream->subtables, subtable,
-      mpegts_packetizer_stream_subtable_compare);
-  if (subtable_list) {
-    g_free (subtable);
-    subtable = (MpegTSPacketizerStreamSubtable *) (subtable_list->data);
-  } else {
+  subtable = mpegts_packetizer_stream_find_subtable (stream,
+      section->table_id, section->subtable_extension);
+  if (subtable == NULL) {
+    subtable = mpegts_packetizer_stream_subtable_new (section->table_id,
+        section->subtable_extension);
     stream->subtables = g_slist_prepend (stream->subtables, subtable);
   }
 
@@ -339,6 +359,8 @@ mpegts_packetizer_parse_section_header (MpegTSPacketizer2 * packetizer,
   tmp = *data++;
   section->version_number = (tmp >> 1) & 0x1F;
   section->current_next_indicator = tmp & 0x01;
+  section_number = *data++;
+  last_section_number = *data++;
 
   if (!section->current_next_indicator)
     goto not_applicable;
@@ -348,12 +370,22 @@ mpegts_packetizer_parse_section_header (MpegTSPacketizer2 * packetizer,
       GST_BUFFER_DATA (section->buffer) + GST_BUFFER_SIZE (section->buffer) - 4;
   section->crc = GST_READ_UINT32_BE (crc_data);
 
-  if (section->version_number == subtable->version_number &&
-      section->crc == subtable->crc)
+  /* Sections of a subtable (like the EIT schedule) are repeated in a cycle,
+   * remember the CRC of each of them so unchanged ones are skipped before
+   * being parsed */
+  if (section->version_number != subtable->version_number ||
+      last_section_number != subtable->last_section_number ||
+      subtable->crc == NULL) {
+    g_free (subtable->crc);
+    subtable->crc = g_new0 (guint32, last_section_number + 1);
+    subtable->version_number = section->version_number;
+    subtable->last_section_number = last_section_number;
+  } else if (section_number <= last_section_number &&
+      subtable->crc[section_number] == section->crc)
     goto not_applicable;
 
-  subtable->version_number = section->version_number;
-  subtable->crc = section->crc;
+  if (section_number <= last_section_number)
+    subtable->crc[section_number] = section->crc;
   stream->section_table_id = section->table_id;
 
   return TRUE;
@@ -2093,6 +2125,27 @@ mpegts_packetizer_remove_stream (MpegTSPacketizer2 * packetizer, gint16 pid)
   }
 }
 
+/* Packets of pids for which @drop is set are discarded by
+ * mpegts_packetizer_next_batch() before they reach the caller. The filter
+ * is kept across mpegts_packetizer_clear(). */
+void
+mpegts_packetizer_filter_pid (MpegTSPacketizer2 * packetizer, guint16 pid,
+    gboolean drop)
+{
+  GST_DEBUG ("%s packets for PID %d", drop ? "Dropping" : "Accepting", pid);
+
+  if (drop)
+    MPEGTS_BIT_SET (packetizer->pid_filter, pid);
+  else
+    MPEGTS_BIT_UNSET (packetizer->pid_filter, pid);
+}
+
+void
+mpegts_packetizer_reset_pid_filter (MpegTSPacketizer2 * packetizer)
+{
+  memset (packetizer->pid_filter, 0, 1024);
+}
+
 MpegTSPacketizer2 *
 mpegts_packetizer_new (void)
 {
@@ -2273,6 +2326,205 @@ mpegts_packetizer_clear_packet (MpegTSPacketizer2 * packetizer,
   memset (packet, 0, sizeof (MpegTSPacketizerPacket));
 }
 
+/* Puts the data of @buffer starting at @skip back in front of the adapter.
+ * Takes ownership of @buffer */
+static void
+mpegts_packetizer_push_back (MpegTSPacketizer2 * packetizer,
+    GstBuffer * buffer, guint skip)
+{
+  GstBuffer *tmpbuf = NULL;
+
+  if (packetizer->adapter->size)
+    tmpbuf = gst_adapter_take_buffer (packetizer->adapter,
+        packetizer->adapter->size);
+  if (skip < GST_BUFFER_SIZE (buffer))
+    gst_adapter_push (packetizer->adapter, gst_buffer_create_sub (buffer,
+            skip, GST_BUFFER_SIZE (buffer) - skip));
+  gst_buffer_unref (buffer);
+  if (tmpbuf)
+    gst_adapter_push (packetizer->adapter, tmpbuf);
+}
+
+/**
+ * mpegts_packetizer_next_batch:
+ * @packetizer: a #MpegTSPacketizer2
+ * @batch: the #MpegTSPacketizerBatch to fill
+ *
+ * Takes up to %MPEGTS_PACKETIZER_BATCH_SIZE packets out of the adapter at
+ * once, validates their sync bytes and extracts the header fields of all of
+ * them in a single pass. Packets of pids dropped with
+ * mpegts_packetizer_filter_pid() are skipped. No buffer is created for the
+ * individual packets,
+ * use mpegts_packetizer_batch_get_packet() for the ones that are actually
+ * needed.
+ *
+ * Returns: PACKET_OK if @batch contains at least one packet, else
+ * PACKET_NEED_MORE. @batch must be cleared with
+ * mpegts_packetizer_clear_batch() after use.
+ */
+MpegTSPacketizerPacketReturn
+mpegts_packetizer_next_batch (MpegTSPacketizer2 * packetizer,
+    MpegTSPacketizerBatch * batch)
+{
+  guint8 *data;
+  guint packet_size, sync_offset, avail, n, i, j;
+  guint8 sync;
+
+  batch->buffer = NULL;
+  batch->n_packets = 0;
+
+  if (G_UNLIKELY (!packetizer->know_packet_size)) {
+    if (!mpegts_try_discover_packet_size (packetizer))
+      return PACKET_NEED_MORE;
+  }
+
+  packet_size = packetizer->packet_size;
+  /* M2TS packets don't start with the sync byte, all other variants do */
+  sync_offset = (packet_size == MPEGTS_M2TS_PACKETSIZE) ? 4 : 0;
+
+  while ((avail = packetizer->adapter->size) >= packet_size) {
+    GstBuffer *head = (GstBuffer *) packetizer->adapter->buflist->data;
+    guint headsize = GST_BUFFER_SIZE (head) - packetizer->adapter->skip;
+
+    n = MIN (avail / packet_size, MPEGTS_PACKETIZER_BATCH_SIZE);
+    /* Don't go past the first buffer of the adapter so that the batch (and
+     * hence the packets and the PES payload downstream) is a sub-buffer of
+     * the input and no copy is needed. A packet straddling two input
+     * buffers is taken on its own. */
+    if (headsize >= packet_size)
+      n = MIN (n, headsize / packet_size);
+    else
+      n = 1;
+
+    batch->buffer = gst_adapter_take_buffer (packetizer->adapter,
+        n * packet_size);
+    batch->offset = packetizer->offset;
+    batch->packet_size = packet_size;
+    data = GST_BUFFER_DATA (batch->buffer) + sync_offset;
+
+    /* Extract all headers without branching, sync bytes are accumulated and
+     * only looked at individually if one of them is wrong. Headers of
+     * filtered pids get overwritten by the next packet. */
+    sync = 0;
+    for (i = 0, j = 0; i < n; i++) {
+      guint32 word = GST_READ_UINT32_BE (data + i * packet_size);
+      MpegTSPacketizerPacketHeader *header = &batch->headers[j];
+
+      sync |= (word >> 24) ^ 0x47;
+      header->payload_unit_start_indicator = (word >> 22) & 0x01;
+      header->pid = (word >> 8) & 0x1FFF;
+      header->adaptation_field_control = (word >> 4) & 0x03;
+      header->continuity_counter = word & 0x0F;
+      header->index = i;
+      j += !MPEGTS_BIT_IS_SET (packetizer->pid_filter, header->pid);
+    }
+
+    if (G_UNLIKELY (sync)) {
+      /* Find the first packet which lost sync */
+      for (i = 0; data[i * packet_size] == 0x47; i++);
+
+      if (i == 0) {
+        guint skip;
+
+        GST_LOG ("Lost sync %d", packet_size);
+        /* Find the next 0x47 in the packet */
+        for (skip = 1; skip < packet_size - sync_offset; skip++)
+          if (data[skip] == 0x47)
+            break;
+        if (G_UNLIKELY (skip == packet_size - sync_offset)) {
+          GST_ERROR ("REALLY lost the sync");
+          skip = packet_size;
+        }
+        /* Drop the data before it and try again */
+        mpegts_packetizer_push_back (packetizer, batch->buffer, skip);
+        batch->buffer = NULL;
+        packetizer->offset += skip;
+        continue;
+      }
+
+      /* Only keep the packets before the one which lost sync, it will be
+       * handled by the next call */
+      GST_LOG ("Lost sync at packet %d of %d", i, n);
+      gst_buffer_ref (batch->buffer);
+      mpegts_packetizer_push_back (packetizer, batch->buffer, i * packet_size);
+      n = i;
+      while (j > 0 && batch->headers[j - 1].index >= n)
+        j--;
+    }
+
+    GST_DEBUG ("offset %" G_GUINT64_FORMAT ", %d packets, %d filtered",
+        batch->offset, n, n - j);
+    packetizer->offset += n * packet_size;
+    batch->n_packets = j;
+    if (G_UNLIKELY (j == 0)) {
+      /* everything was filtered out */
+      gst_buffer_unref (batch->buffer);
+      batch->buffer = NULL;
+      continue;
+    }
+    return PACKET_OK;
+  }
+
+  return PACKET_NEED_MORE;
+}
+
+/**
+ * mpegts_packetizer_batch_get_packet:
+ * @packetizer: a #MpegTSPacketizer2
+ * @batch: a #MpegTSPacketizerBatch filled by mpegts_packetizer_next_batch()
+ * @index: index of the packet header in @batch
+ * @packet: the #MpegTSPacketizerPacket to fill
+ *
+ * Fills @packet with a sub-buffer of @batch and parses its adaptation field.
+ *
+ * Returns: PACKET_OK, or PACKET_BAD if the packet could not be parsed, in
+ * which case no buffer is set on @packet.
+ */
+MpegTSPacketizerPacketReturn
+mpegts_packetizer_batch_get_packet (MpegTSPacketizer2 * packetizer,
+    MpegTSPacketizerBatch * batch, guint index, MpegTSPacketizerPacket * packet)
+{
+  MpegTSPacketizerPacketHeader *header;
+  guint offset;
+
+  g_return_val_if_fail (index < batch->n_packets, PACKET_BAD);
+
+  header = &batch->headers[index];
+  offset = header->index * batch->packet_size;
+
+  packet->buffer = gst_buffer_create_sub (batch->buffer, offset,
+      batch->packet_size);
+  GST_BUFFER_OFFSET (packet->buffer) = packet->offset = batch->offset + offset;
+
+  packet->data_start = GST_BUFFER_DATA (packet->buffer);
+  if (batch->packet_size == MPEGTS_M2TS_PACKETSIZE)
+    packet->data_start += 4;
+  packet->data_end = packet->data_start + 188;
+
+  packet->pid = header->pid;
+  packet->payload_unit_start_indicator = header->payload_unit_start_indicator;
+  packet->adaptation_field_control = header->adaptation_field_control;
+  packet->continuity_counter = header->continuity_counter;
+
+  if (G_UNLIKELY (!mpegts_packetizer_parse_payload (packetizer, packet))) {
+    gst_buffer_unref (packet->buffer);
+    packet->buffer = NULL;
+    return PACKET_BAD;
+  }
+
+  return PACKET_OK;
+}
+
+void
+mpegts_packetizer_clear_batch (MpegTSPacketizer2 * packetizer,
+    MpegTSPacketizerBatch * batch)
+{
+  if (batch->buffer)
+    gst_buffer_unref (batch->buffer);
+  batch->buffer = NULL;
+  batch->n_packets = 0;
+}
+
 gboolean
 mpegts_packetizer_push_section (MpegTSPacketizer2 * packetizer,
     MpegTSPacketizerPacket * packet, MpegTSPacketizerSection * section)
@@ -36,9 +36,15 @@
 #define MPEGTS_MIN_PACKETSIZE MPEGTS_NORMAL_PACKETSIZE
 #define MPEGTS_MAX_PACKETSIZE MPEGTS_ATSC_PACKETSIZE
 
+#define MPEGTS_AFC_RANDOM_ACCESS_FLAG	0x40
 #define MPEGTS_AFC_PCR_FLAG	0x10
 #define MPEGTS_AFC_OPCR_FLAG	0x08
 
+/* Helpers for bit arrays indexed by pid (8192 bits => 1024 bytes) */
+#define MPEGTS_BIT_SET(field, offs)    ((field)[(offs) >> 3] |=  (1 << ((offs) & 0x7)))
+#define MPEGTS_BIT_UNSET(field, offs)  ((field)[(offs) >> 3] &= ~(1 << ((offs) & 0x7)))
+#define MPEGTS_BIT_IS_SET(field, offs) ((field)[(offs) >> 3] &   (1 << ((offs) & 0x7)))
+
 G_BEGIN_DECLS
 
 #define GST_TYPE_MPEGTS_PACKETIZER \
@@ -79,6 +85,10 @@ struct _MpegTSPacketizer2 {
   /* current offset of the tip of the adapter */
   guint64 offset;
   gboolean empty;
+
+  /* bit array of pids whose packets are dropped by
+   * mpegts_packetizer_next_batch() */
+  guint8 *pid_filter;
 };
 
 struct _MpegTSPacketizer2Class {
@@ -125,9 +135,39 @@ typedef struct
    * section_syntax_indicator is 0, sub_table_extension will be set to 0 */
   guint16 subtable_extension;
   guint8 version_number;
-  guint32 crc;
+  guint8 last_section_number;
+  /* crc of each section of the subtable, indexed by section_number */
+  guint32 *crc;
 } MpegTSPacketizerStreamSubtable;
 
+/* Maximum number of packets handled by one mpegts_packetizer_next_batch()
+ * call */
+#define MPEGTS_PACKETIZER_BATCH_SIZE 128
+
+/* Packet header fields extracted for a whole batch in one pass, without
+ * creating a GstBuffer per packet */
+typedef struct
+{
+  guint16 pid;
+  guint8 payload_unit_start_indicator;
+  guint8 adaptation_field_control;
+  guint8 continuity_counter;
+  /* position of the packet in the batch buffer */
+  guint8 index;
+} MpegTSPacketizerPacketHeader;
+
+typedef struct
+{
+  /* contains all the packets of the batch, owned by the batch */
+  GstBuffer *buffer;
+  /* offset of the first packet */
+  guint64 offset;
+  guint16 packet_size;
+  /* number of entries in headers, packets of filtered pids are skipped */
+  guint n_packets;
+  MpegTSPacketizerPacketHeader headers[MPEGTS_PACKETIZER_BATCH_SIZE];
+} MpegTSPacketizerBatch;
+
 typedef enum {
   PACKET_BAD       = FALSE,
   PACKET_OK        = TRUE,
@@ -144,8 +184,17 @@ MpegTSPacketizerPacketReturn mpegts_packetizer_next_packet (MpegTSPacketizer2 *p
   MpegTSPacketizerPacket *packet);
 void mpegts_packetizer_clear_packet (MpegTSPacketizer2 *packetizer,
   MpegTSPacketizerPacket *packet);
+MpegTSPacketizerPacketReturn mpegts_packetizer_next_batch (MpegTSPacketizer2 *packetizer,
+  MpegTSPacketizerBatch *batch);
+MpegTSPacketizerPacketReturn mpegts_packetizer_batch_get_packet (MpegTSPacketizer2 *packetizer,
+  MpegTSPacketizerBatch *batch, guint index, MpegTSPacketizerPacket *packet);
+void mpegts_packetizer_clear_batch (MpegTSPacketizer2 *packetizer,
+  MpegTSPacketizerBatch *batch);
 void mpegts_packetizer_remove_stream(MpegTSPacketizer2 *packetizer,
   gint16 pid);
+void mpegts_packetizer_filter_pid (MpegTSPacketizer2 *packetizer,
+  guint16 pid, gboolean drop);
+void mpegts_packetizer_reset_pid_filter (MpegTSPacketizer2 *packetizer);
 
 gboolean mpegts_packetizer_push_section (MpegTSPacketizer2 *packetzer,
   MpegTSPacketizerPacket *packet, MpegTSPacketizerSection *section);
@@ -69,12 +69,46 @@ typedef enum
                                  * Drop all incoming buffers */
 } PendingPacketState;
 
+typedef struct _TSDemuxProgram TSDemuxProgram;
 typedef struct _TSDemuxStream TSDemuxStream;
 
+struct _TSDemuxProgram
+{
+  MpegTSBaseProgram program;
+
+  gboolean newsegment_pushed;
+
+  /* Latest PCR seen on the pcr_pid (GstClockTime) */
+  GstClockTime last_pcr;
+
+  /* Output thread, only used with program-threads */
+  GstTask *task;
+  GStaticRecMutex task_lock;
+  /* protects the fields below */
+  GMutex *queue_lock;
+  GCond *queue_cond;
+  /* TSDemuxOutputItem */
+  GQueue queue;
+  gboolean flushing;
+  GstFlowReturn last_flow;
+  guint dropped;
+};
+
+/* Data or event queued for a program output thread */
+typedef struct
+{
+  TSDemuxStream *stream;
+  GstPad *pad;
+  GstMiniObject *object;
+} TSDemuxOutputItem;
+
 struct _TSDemuxStream
 {
   MpegTSBaseStream stream;
 
+  /* The program the stream belongs to */
+  TSDemuxProgram *program;
+
   GstPad *pad;
 
   /* set to FALSE before a push and TRUE after */
@@ -83,6 +117,10 @@ struct _TSDemuxStream
   /* the return of the latest push */
   GstFlowReturn flow_return;
 
+  /* Data was dropped by the program output queue, flag the next buffer
+   * DISCONT */
+  gboolean discont;
+
   /* Output data */
   PendingPacketState state;
   /* Pending buffers array. */
@@ -160,9 +198,67 @@ enum
   ARG_0,
   PROP_PROGRAM_NUMBER,
   PROP_EMIT_STATS,
+  PROP_PES_OUTPUT,
+  PROP_PROGRAM_NUMBERS,
+  PROP_PROGRAM_THREADS,
+  PROP_PROGRAM_QUEUE_SIZE,
+  PROP_INDEX_LOCATION,
   /* FILL ME */
 };
 
+#define DEFAULT_PROGRAM_NUMBERS NULL
+#define DEFAULT_PROGRAM_THREADS FALSE
+#define DEFAULT_PROGRAM_QUEUE_SIZE 200
+#define DEFAULT_INDEX_LOCATION NULL
+
+/* Minimum interval between two PCR entries of the index. Keyframes are
+ * always indexed */
+#define TS_DEMUX_INDEX_INTERVAL (500 * GST_MSECOND)
+
+/* Sidecar index file:
+ *   magic "TSIX", version (32bit), upstream size (64bit), first PCR (64bit),
+ *   number of entries (32bit)
+ * followed by the entries:
+ *   time (64bit), offset (64bit), flags (8bit)
+ * All values are big endian */
+#define TS_DEMUX_INDEX_MAGIC 0x54534958     /* "TSIX" */
+#define TS_DEMUX_INDEX_VERSION 1
+#define TS_DEMUX_INDEX_HEADER_SIZE 28
+#define TS_DEMUX_INDEX_ENTRY_SIZE 17
+
+typedef struct
+{
+  GstClockTime time;
+  guint64 offset;
+  GstAssocFlags flags;
+} TSDemuxIndexEntry;
+
+#define DEFAULT_PES_OUTPUT TS_DEMUX_PES_OUTPUT_AUTO
+
+#define GST_TYPE_TS_DEMUX_PES_OUTPUT (gst_ts_demux_pes_output_get_type ())
+static GType
+gst_ts_demux_pes_output_get_type (void)
+{
+  static GType gtype = 0;
+
+  if (gtype == 0) {
+    static const GEnumValue values[] = {
+      {TS_DEMUX_PES_OUTPUT_AUTO,
+          "Buffer lists if downstream handles them, else contiguous buffers",
+          "auto"},
+      {TS_DEMUX_PES_OUTPUT_CONTIGUOUS,
+          "One contiguous buffer per PES packet", "contiguous"},
+      {TS_DEMUX_PES_OUTPUT_BUFFER_LIST,
+            "Buffer lists of sub-buffers of the input (no copy)",
+          "buffer-list"},
+      {0, NULL, NULL}
+    };
+
+    gtype = g_enum_register_static ("GstTSDemuxPesOutput", values);
+  }
+  return gtype;
+}
+
 /* Pad functions */
 static const GstQueryType *gst_ts_demux_srcpad_query_types (GstPad * pad);
 static gboolean gst_ts_demux_srcpad_query (GstPad * pad, GstQuery * query);
@@ -192,6 +288,12 @@ static GstFlowReturn
 process_pcr (MpegTSBase * base, guint64 initoff, GstClockTime * pcr,
     guint numpcr, gboolean isinitial);
 static gboolean push_event (MpegTSBase * base, GstEvent * event);
+static GstStateChangeReturn gst_ts_demux_change_state (GstElement * element,
+    GstStateChange transition);
+static void gst_ts_demux_set_index (GstElement * element, GstIndex * index);
+static GstIndex *gst_ts_demux_get_index (GstElement * element);
+static GstFlowReturn gst_ts_demux_seek (MpegTSBase * base, GstEvent * event,
+    guint64 * offset);
 static void _extra_init (GType type);
 
 GST_BOILERPLATE_FULL (GstTSDemux, gst_ts_demux, MpegTSBase,
@@ -235,8 +337,14 @@ static void
 gst_ts_demux_class_init (GstTSDemuxClass * klass)
 {
   GObjectClass *gobject_class;
+  GstElementClass *element_class;
   MpegTSBaseClass *ts_class;
 
+  element_class = GST_ELEMENT_CLASS (klass);
+  element_class->change_state = GST_DEBUG_FUNCPTR (gst_ts_demux_change_state);
+  element_class->set_index = GST_DEBUG_FUNCPTR (gst_ts_demux_set_index);
+  element_class->get_index = GST_DEBUG_FUNCPTR (gst_ts_demux_get_index);
+
   gobject_class = G_OBJECT_CLASS (klass);
   gobject_class->set_property = gst_ts_demux_set_property;
   gobject_class->get_property = gst_ts_demux_get_property;
@@ -252,6 +360,37 @@ gst_ts_demux_class_init (GstTSDemuxClass * klass)
           "Emit messages for every pcr/opcr/pts/dts", FALSE,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_PES_OUTPUT,
+      g_param_spec_enum ("pes-output", "PES output",
+          "How the payload of PES packets is pushed downstream",
+          GST_TYPE_TS_DEMUX_PES_OUTPUT, DEFAULT_PES_OUTPUT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PROGRAM_NUMBERS,
+      g_param_spec_string ("program-numbers", "Program numbers",
+          "Comma separated list of programs to demux simultaneously, "
+          "\"all\" for all programs (overrides program-number). Changes only "
+          "apply to the programs whose PMT changes afterwards",
+          DEFAULT_PROGRAM_NUMBERS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PROGRAM_THREADS,
+      g_param_spec_boolean ("program-threads", "Program threads",
+          "Push the output of each program from its own thread",
+          DEFAULT_PROGRAM_THREADS, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_PROGRAM_QUEUE_SIZE,
+      g_param_spec_uint ("program-queue-size", "Program queue size",
+          "Maximum number of PES packets queued for a program thread, "
+          "further data of that program is dropped", 1, G_MAXUINT,
+          DEFAULT_PROGRAM_QUEUE_SIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_INDEX_LOCATION,
+      g_param_spec_string ("index-location", "Index location",
+          "File to load the seek index from and to save it to (pull mode "
+          "only, NULL = don't use a file)", DEFAULT_INDEX_LOCATION,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
 
   ts_class = GST_MPEGTS_BASE_CLASS (klass);
   ts_class->push = GST_DEBUG_FUNCPTR (gst_ts_demux_push);
@@ -261,26 +400,111 @@ gst_ts_demux_class_init (GstTSDemuxClass * klass)
   ts_class->stream_added = gst_ts_demux_stream_added;
   ts_class->stream_removed = gst_ts_demux_stream_removed;
   ts_class->find_timestamps = GST_DEBUG_FUNCPTR (find_timestamps);
+  ts_class->seek = GST_DEBUG_FUNCPTR (gst_ts_demux_seek);
 }
 
 static void
 gst_ts_demux_init (GstTSDemux * demux, GstTSDemuxClass * klass)
 {
-  demux->need_newsegment = TRUE;
   demux->program_number = -1;
+  demux->pes_output = DEFAULT_PES_OUTPUT;
+  demux->program_threads = DEFAULT_PROGRAM_THREADS;
+  demux->program_queue_size = DEFAULT_PROGRAM_QUEUE_SIZE;
   demux->duration = GST_CLOCK_TIME_NONE;
+  demux->first_pcr = GST_CLOCK_TIME_NONE;
+  demux->base_pts = GST_CLOCK_TIME_NONE;
+  gst_segment_init (&demux->segment, GST_FORMAT_TIME);
+  demux->index_entries = g_array_new (FALSE, FALSE, sizeof (TSDemuxIndexEntry));
+  GST_MPEGTS_BASE (demux)->program_size = sizeof (TSDemuxProgram);
   GST_MPEGTS_BASE (demux)->stream_size = sizeof (TSDemuxStream);
 }
 
 static void
 gst_ts_demux_finalize (GObject * object)
 {
+  GstTSDemux *demux = GST_TS_DEMUX (object);
+
+  g_free (demux->program_numbers);
+  if (demux->wanted_programs)
+    g_array_free (demux->wanted_programs, TRUE);
+  g_list_free (demux->programs);
+  g_free (demux->index_location);
+  if (demux->index)
+    gst_object_unref (demux->index);
+  g_array_free (demux->index_entries, TRUE);
+
   if (G_OBJECT_CLASS (parent_class)->finalize)
     G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
 
 
+/* call with OBJECT_LOCK */
+static void
+gst_ts_demux_parse_program_numbers (GstTSDemux * demux)
+{
+  gchar **numbers;
+  guint i;
+
+  demux->all_programs = FALSE;
+  if (demux->wanted_programs) {
+    g_array_free (demux->wanted_programs, TRUE);
+    demux->wanted_programs = NULL;
+  }
+
+  if (demux->program_numbers == NULL || *demux->program_numbers == '\0')
+    return;
+
+  if (g_ascii_strcasecmp (demux->program_numbers, "all") == 0) {
+    demux->all_programs = TRUE;
+    return;
+  }
+
+  demux->wanted_programs = g_array_new (FALSE, FALSE, sizeof (gint));
+  numbers = g_strsplit (demux->program_numbers, ",", -1);
+  for (i = 0; numbers[i]; i++) {
+    gchar *end;
+    gint number = (gint) g_ascii_strtoll (g_strstrip (numbers[i]), &end, 10);
+
+    if (*numbers[i] == '\0' || *end != '\0') {
+      GST_WARNING_OBJECT (demux, "Ignoring invalid program number '%s'",
+          numbers[i]);
+      continue;
+    }
+    g_array_append_val (demux->wanted_programs, number);
+  }
+  g_strfreev (numbers);
+}
+
+static gboolean
+gst_ts_demux_wants_program (GstTSDemux * demux, gint program_number)
+{
+  gboolean res = FALSE;
+  guint i;
+
+  GST_OBJECT_LOCK (demux);
+  if (demux->all_programs)
+    res = TRUE;
+  else if (demux->wanted_programs) {
+    for (i = 0; i < demux->wanted_programs->len; i++)
+      if (g_array_index (demux->wanted_programs, gint, i) == program_number) {
+        res = TRUE;
+        break;
+      }
+  } else
+    res = (demux->program_number == -1 ||
+        demux->program_number == program_number);
+  GST_OBJECT_UNLOCK (demux);
+
+  return res;
+}
+
+static inline gboolean
+gst_ts_demux_is_multi_program (GstTSDemux * demux)
+{
+  return demux->all_programs || demux->wanted_programs != NULL;
+}
+
 static void
 gst_ts_demux_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec)
@@ -296,6 +520,28 @@ gst_ts_demux_set_property (GObject * object, guint prop_id,
     case PROP_EMIT_STATS:
       demux->emit_statistics = g_value_get_boolean (value);
       break;
+    case PROP_PES_OUTPUT:
+      demux->pes_output = g_value_get_enum (value);
+      break;
+    case PROP_PROGRAM_NUMBERS:
+      GST_OBJECT_LOCK (demux);
+      g_free (demux->program_numbers);
+      demux->program_numbers = g_value_dup_string (value);
+      gst_ts_demux_parse_program_numbers (demux);
+      GST_OBJECT_UNLOCK (demux);
+      break;
+    case PROP_PROGRAM_THREADS:
+      demux->program_threads = g_value_get_boolean (value);
+      break;
+    case PROP_PROGRAM_QUEUE_SIZE:
+      demux->program_queue_size = g_value_get_uint (value);
+      break;
+    case PROP_INDEX_LOCATION:
+      GST_OBJECT_LOCK (demux);
+      g_free (demux->index_location);
+      demux->index_location = g_value_dup_string (value);
+      GST_OBJECT_UNLOCK (demux);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
   }
@@ -314,6 +560,25 @@ gst_ts_demux_get_property (GObject * object, guint prop_id,
     case PROP_EMIT_STATS:
       g_value_set_boolean (value, demux->emit_statistics);
       break;
+    case PROP_PES_OUTPUT:
+      g_value_set_enum (value, demux->pes_output);
+      break;
+    case PROP_PROGRAM_NUMBERS:
+      GST_OBJECT_LOCK (demux);
+      g_value_set_string (value, demux->program_numbers);
+      GST_OBJECT_UNLOCK (demux);
+      break;
+    case PROP_PROGRAM_THREADS:
+      g_value_set_boolean (value, demux->program_threads);
+      break;
+    case PROP_PROGRAM_QUEUE_SIZE:
+      g_value_set_uint (value, demux->program_queue_size);
+      break;
+    case PROP_INDEX_LOCATION:
+      GST_OBJECT_LOCK (demux);
+      g_value_set_string (value, demux->index_location);
+      GST_OBJECT_UNLOCK (demux);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
   }
@@ -370,23 +635,688 @@ wrong_format:
 
 
 static gboolean
-push_event (MpegTSBase * base, GstEvent * event)
+gst_ts_demux_srcpad_event (GstPad * pad, GstEvent * event)
 {
-  GstTSDemux *demux = (GstTSDemux *) base;
+  gboolean res;
+  MpegTSBase *base = GST_MPEGTS_BASE (gst_pad_get_parent (pad));
+
+  GST_DEBUG_OBJECT (pad, "Got event %s",
+      gst_event_type_get_name (GST_EVENT_TYPE (event)));
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_SEEK:
+      res = mpegts_base_handle_seek_event (base, pad, event);
+      break;
+    default:
+      res = gst_pad_event_default (pad, event);
+      break;
+  }
+
+  gst_object_unref (base);
+  return res;
+}
+
+static void
+gst_ts_demux_set_index (GstElement * element, GstIndex * index)
+{
+  GstTSDemux *demux = GST_TS_DEMUX (element);
+
+  GST_OBJECT_LOCK (demux);
+  if (demux->index)
+    gst_object_unref (demux->index);
+  if (index) {
+    demux->index = gst_object_ref (index);
+    gst_index_get_writer_id (index, GST_OBJECT (element), &demux->index_id);
+  } else
+    demux->index = NULL;
+  demux->own_index = FALSE;
+  GST_OBJECT_UNLOCK (demux);
+}
+
+static GstIndex *
+gst_ts_demux_get_index (GstElement * element)
+{
+  GstIndex *result = NULL;
+  GstTSDemux *demux = GST_TS_DEMUX (element);
+
+  GST_OBJECT_LOCK (demux);
+  if (demux->index)
+    result = gst_object_ref (demux->index);
+  GST_OBJECT_UNLOCK (demux);
+
+  return result;
+}
+
+/* Returns the position of the first entry at or after @offset.
+ * Call with OBJECT_LOCK */
+static guint
+gst_ts_demux_index_find (GstTSDemux * demux, guint64 offset)
+{
+  guint lo = 0, hi = demux->index_entries->len;
+
+  while (lo < hi) {
+    guint mid = lo + (hi - lo) / 2;
+
+    if (g_array_index (demux->index_entries, TSDemuxIndexEntry,
+            mid).offset < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Inserts an entry at position @pos of the sorted entries.
+ * Call with OBJECT_LOCK */
+static void
+gst_ts_demux_index_add_entry (GstTSDemux * demux, guint pos,
+    GstClockTime time, guint64 offset, GstAssocFlags flags)
+{
+  TSDemuxIndexEntry entry;
+
+  GST_LOG_OBJECT (demux, "Indexing %s%" GST_TIME_FORMAT " at offset %"
+      G_GUINT64_FORMAT, flags & GST_ASSOCIATION_FLAG_KEY_UNIT ? "keyframe " :
+      "", GST_TIME_ARGS (time), offset);
+
+  gst_index_add_association (demux->index, demux->index_id, flags,
+      GST_FORMAT_TIME, time, GST_FORMAT_BYTES, offset, NULL);
+
+  entry.time = time;
+  entry.offset = offset;
+  entry.flags = flags;
+  g_array_insert_val (demux->index_entries, pos, entry);
+}
+
+/* Adds a PCR (@flags == GST_ASSOCIATION_FLAG_NONE) or keyframe entry of the
+ * primary program to the index. Entries are kept sorted by offset so that
+ * the gaps left by seeks get filled in when that data is played later.
+ * PCR entries closer than TS_DEMUX_INDEX_INTERVAL to one of their
+ * neighbours are skipped. */
+static inline void
+gst_ts_demux_index (GstTSDemux * demux, GstClockTime time, guint64 offset,
+    GstAssocFlags flags)
+{
+  TSDemuxIndexEntry *entries;
+  guint pos, len;
+
+  if (G_UNLIKELY (!GST_CLOCK_TIME_IS_VALID (time)))
+    return;
+
+  GST_OBJECT_LOCK (demux);
+  if (demux->index == NULL)
+    goto done;
+
+  entries = (TSDemuxIndexEntry *) demux->index_entries->data;
+  len = demux->index_entries->len;
+  /* Fast path, appending while playing linearly */
+  if (len == 0 || entries[len - 1].offset < offset)
+    pos = len;
+  else
+    pos = gst_ts_demux_index_find (demux, offset);
+
+  if (pos < len && entries[pos].offset == offset)
+    goto done;
+  if (!(flags & GST_ASSOCIATION_FLAG_KEY_UNIT) &&
+      ((pos > 0 && time < entries[pos - 1].time + TS_DEMUX_INDEX_INTERVAL) ||
+          (pos < len && entries[pos].time < time + TS_DEMUX_INDEX_INTERVAL)))
+    goto done;
+
+  gst_ts_demux_index_add_entry (demux, pos, time, offset, flags);
+
+done:
+  GST_OBJECT_UNLOCK (demux);
+}
+
+/* Loads the sidecar index file if it matches the current upstream file */
+static void
+gst_ts_demux_load_index (GstTSDemux * demux)
+{
+  GstByteReader br;
+  GError *err = NULL;
+  gchar *location, *contents = NULL;
+  gsize size;
+  guint32 magic = 0, version = 0, count = 0, i;
+  guint64 total_bytes = 0, first_pcr = 0;
+
+  GST_OBJECT_LOCK (demux);
+  location = g_strdup (demux->index_location);
+  GST_OBJECT_UNLOCK (demux);
+
+  if (location == NULL || demux->index == NULL)
+    goto done;
+
+  if (!g_file_get_contents (location, &contents, &size, &err)) {
+    GST_DEBUG_OBJECT (demux, "No index loaded: %s", err->message);
+    g_error_free (err);
+    goto done;
+  }
+
+  gst_byte_reader_init (&br, (const guint8 *) contents, size);
+  if (!gst_byte_reader_get_uint32_be (&br, &magic) ||
+      !gst_byte_reader_get_uint32_be (&br, &version) ||
+      !gst_byte_reader_get_uint64_be (&br, &total_bytes) ||
+      !gst_byte_reader_get_uint64_be (&br, &first_pcr) ||
+      !gst_byte_reader_get_uint32_be (&br, &count))
+    goto invalid;
+  if (magic != TS_DEMUX_INDEX_MAGIC || version != TS_DEMUX_INDEX_VERSION ||
+      gst_byte_reader_get_remaining (&br) / TS_DEMUX_INDEX_ENTRY_SIZE < count)
+    goto invalid;
+  if (total_bytes != demux->total_bytes || first_pcr != demux->first_pcr) {
+    GST_WARNING_OBJECT (demux, "Index file %s belongs to another file",
+        location);
+    goto done;
+  }
+
+  GST_OBJECT_LOCK (demux);
+  for (i = 0; i < count; i++) {
+    guint64 time, offset;
+    guint8 flags;
+    guint pos;
+
+    time = gst_byte_reader_get_uint64_be_unchecked (&br);
+    offset = gst_byte_reader_get_uint64_be_unchecked (&br);
+    flags = gst_byte_reader_get_uint8_unchecked (&br);
+    /* Merge with what got indexed while scanning */
+    pos = gst_ts_demux_index_find (demux, offset);
+    if (pos < demux->index_entries->len &&
+        g_array_index (demux->index_entries, TSDemuxIndexEntry,
+            pos).offset == offset)
+      continue;
+    gst_ts_demux_index_add_entry (demux, pos, time, offset, flags);
+  }
+  GST_OBJECT_UNLOCK (demux);
+
+  GST_DEBUG_OBJECT (demux, "Loaded %u index entries from %s", count,
+      location);
+
+done:
+  g_free (contents);
+  g_free (location);
+  return;
+
+invalid:
+  {
+    GST_WARNING_OBJECT (demux, "Invalid index file %s", location);
+    goto done;
+  }
+}
+
+static void
+gst_ts_demux_save_index (GstTSDemux * demux)
+{
+  GError *err = NULL;
+  gchar *location;
+  guint8 *contents, *data;
+  gsize size;
   guint i;
 
-  if (G_UNLIKELY (demux->program == NULL))
-    return FALSE;
+  GST_OBJECT_LOCK (demux);
+  location = g_strdup (demux->index_location);
+  GST_OBJECT_UNLOCK (demux);
 
-  for (i = 0; i < 0x2000; i++) {
-    if (demux->program->streams[i]) {
-      if (((TSDemuxStream *) demux->program->streams[i])->pad) {
-        gst_event_ref (event);
-        gst_pad_push_event (((TSDemuxStream *) demux->program->streams[i])->pad,
-            event);
-      }
+  if (location == NULL || demux->index_entries->len == 0 ||
+      !GST_CLOCK_TIME_IS_VALID (demux->first_pcr))
+    goto done;
+
+  size = TS_DEMUX_INDEX_HEADER_SIZE +
+      demux->index_entries->len * TS_DEMUX_INDEX_ENTRY_SIZE;
+  data = contents = g_malloc (size);
+
+  GST_WRITE_UINT32_BE (data, TS_DEMUX_INDEX_MAGIC);
+  GST_WRITE_UINT32_BE (data + 4, TS_DEMUX_INDEX_VERSION);
+  GST_WRITE_UINT64_BE (data + 8, demux->total_bytes);
+  GST_WRITE_UINT64_BE (data + 16, demux->first_pcr);
+  GST_WRITE_UINT32_BE (data + 24, demux->index_entries->len);
+  data += TS_DEMUX_INDEX_HEADER_SIZE;
+
+  for (i = 0; i < demux->index_entries->len; i++) {
+    TSDemuxIndexEntry *entry =
+        &g_array_index (demux->index_entries, TSDemuxIndexEntry, i);
+
+    GST_WRITE_UINT64_BE (data, entry->time);
+    GST_WRITE_UINT64_BE (data + 8, entry->offset);
+    GST_WRITE_UINT8 (data + 16, entry->flags);
+    data += TS_DEMUX_INDEX_ENTRY_SIZE;
+  }
+
+  if (!g_file_set_contents (location, (gchar *) contents, size, &err)) {
+    GST_WARNING_OBJECT (demux, "Couldn't save index: %s", err->message);
+    g_error_free (err);
+  } else
+    GST_DEBUG_OBJECT (demux, "Saved %u index entries to %s",
+        demux->index_entries->len, location);
+  g_free (contents);
+
+done:
+  g_free (location);
+}
+
+/* Whether the average bitrate of the file is known */
+static inline gboolean
+gst_ts_demux_can_estimate (GstTSDemux * demux)
+{
+  MpegTSBase *base = (MpegTSBase *) demux;
+
+  return GST_CLOCK_TIME_IS_VALID (demux->duration) && demux->duration != 0 &&
+      demux->total_bytes > base->initial_sync_point;
+}
+
+/* Estimates the number of bytes of @duration from the average bitrate, as
+ * a whole number of packets */
+static guint64
+gst_ts_demux_estimate_bytes (GstTSDemux * demux, GstClockTime duration)
+{
+  MpegTSBase *base = (MpegTSBase *) demux;
+  guint64 bytes;
+
+  bytes = gst_util_uint64_scale (MIN (duration, demux->duration),
+      demux->total_bytes - base->initial_sync_point, demux->duration);
+
+  return bytes - bytes % base->packetsize;
+}
+
+/* Finds the offset to resume from to reach the running @target time
+ * (relative to the start of the file). @target is updated with the time
+ * of the index entry when @keyframe is TRUE */
+static guint64
+gst_ts_demux_find_offset (GstTSDemux * demux, GstClockTime * target,
+    gboolean keyframe)
+{
+  MpegTSBase *base = (MpegTSBase *) demux;
+  GstIndexEntry *entry = NULL, *last = NULL;
+  gint64 time, offset;
+
+  if (!GST_CLOCK_TIME_IS_VALID (demux->first_pcr))
+    return base->initial_sync_point;
+
+  GST_OBJECT_LOCK (demux);
+  if (demux->index) {
+    entry = gst_index_get_assoc_entry (demux->index, demux->index_id,
+        GST_INDEX_LOOKUP_BEFORE, GST_ASSOCIATION_FLAG_KEY_UNIT,
+        GST_FORMAT_TIME, demux->first_pcr + *target);
+    if (entry == NULL)
+      entry = gst_index_get_assoc_entry (demux->index, demux->index_id,
+          GST_INDEX_LOOKUP_BEFORE, GST_ASSOCIATION_FLAG_NONE,
+          GST_FORMAT_TIME, demux->first_pcr + *target);
+    /* Nothing indexed after the target: it is past the indexed range and
+     * the last entry before it is the closest known position */
+    if (entry && gst_index_get_assoc_entry (demux->index, demux->index_id,
+            GST_INDEX_LOOKUP_AFTER, GST_ASSOCIATION_FLAG_NONE,
+            GST_FORMAT_TIME, demux->first_pcr + *target) == NULL)
+      last = gst_index_get_assoc_entry (demux->index, demux->index_id,
+          GST_INDEX_LOOKUP_BEFORE, GST_ASSOCIATION_FLAG_NONE,
+          GST_FORMAT_TIME, demux->first_pcr + *target);
+  }
+  if (last && gst_ts_demux_can_estimate (demux) &&
+      gst_index_entry_assoc_map (last, GST_FORMAT_BYTES, &offset) &&
+      gst_index_entry_assoc_map (last, GST_FORMAT_TIME, &time)) {
+    GST_OBJECT_UNLOCK (demux);
+
+    /* Going through everything from there would read all the data up to
+     * the target, estimate from it instead */
+    offset += gst_ts_demux_estimate_bytes (demux,
+        demux->first_pcr + *target - time);
+    if (offset >= demux->total_bytes)
+      offset = demux->total_bytes - base->packetsize;
+
+    GST_DEBUG_OBJECT (demux, "Estimated offset %" G_GINT64_FORMAT " from the "
+        "last index entry %" GST_TIME_FORMAT, offset, GST_TIME_ARGS (time));
+
+    return offset;
+  }
+  if (entry && gst_index_entry_assoc_map (entry, GST_FORMAT_BYTES, &offset) &&
+      gst_index_entry_assoc_map (entry, GST_FORMAT_TIME, &time)) {
+    GST_OBJECT_UNLOCK (demux);
+
+    GST_DEBUG_OBJECT (demux, "Found index entry %" GST_TIME_FORMAT
+        " at offset %" G_GINT64_FORMAT, GST_TIME_ARGS (time), offset);
+    if (keyframe && time >= demux->first_pcr)
+      *target = time - demux->first_pcr;
+    return offset;
+  }
+  GST_OBJECT_UNLOCK (demux);
+
+  /* Nothing indexed yet there, estimate from the average bitrate */
+  if (!gst_ts_demux_can_estimate (demux))
+    return base->initial_sync_point;
+
+  offset = gst_ts_demux_estimate_bytes (demux, *target);
+
+  GST_DEBUG_OBJECT (demux, "Estimated offset %" G_GINT64_FORMAT, offset);
+
+  return base->initial_sync_point + offset;
+}
+
+/* Drops the pending data of @stream, call with the STREAM_LOCK */
+static void
+gst_ts_demux_stream_flush (TSDemuxStream * stream)
+{
+  guint8 i;
+
+  for (i = 0; i < stream->nbpending; i++)
+    gst_buffer_unref (stream->pendingbuffers[i]);
+  memset (stream->pendingbuffers, 0, sizeof (stream->pendingbuffers));
+  stream->nbpending = 0;
+
+  if (stream->current) {
+    g_list_foreach (stream->currentlist, (GFunc) gst_mini_object_unref, NULL);
+    g_list_free (stream->currentlist);
+    stream->currentlist = NULL;
+    gst_buffer_list_iterator_free (stream->currentit);
+    stream->currentit = NULL;
+    gst_buffer_list_unref (stream->current);
+    stream->current = NULL;
+  }
+
+  stream->state = PENDING_PACKET_EMPTY;
+  stream->pts = GST_CLOCK_TIME_NONE;
+  stream->flow_return = GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_ts_demux_seek (MpegTSBase * base, GstEvent * event, guint64 * offset)
+{
+  GstTSDemux *demux = GST_TS_DEMUX (base);
+  GstSeekFlags flags;
+  GstSeekType start_type, stop_type;
+  GstFormat format;
+  GstClockTime target;
+  gdouble rate;
+  gint64 start, stop;
+  GList *ptmp, *tmp;
+
+  gst_event_parse_seek (event, &rate, &format, &flags, &start_type, &start,
+      &stop_type, &stop);
+
+  if (rate <= 0.0) {
+    GST_WARNING_OBJECT (demux, "Negative rate not supported");
+    return GST_FLOW_ERROR;
+  }
+
+  gst_segment_set_seek (&demux->segment, rate, format, flags, start_type,
+      start, stop_type, stop, NULL);
+
+  target = demux->segment.start;
+  *offset = gst_ts_demux_find_offset (demux, &target,
+      flags & GST_SEEK_FLAG_KEY_UNIT);
+  if (flags & GST_SEEK_FLAG_KEY_UNIT)
+    demux->segment.start = demux->segment.last_stop = demux->segment.time =
+        target;
+
+  GST_DEBUG_OBJECT (demux, "seeking to %" GST_TIME_FORMAT " offset %"
+      G_GUINT64_FORMAT, GST_TIME_ARGS (demux->segment.start), *offset);
+
+  /* Restart from scratch, with a new newsegment on all programs */
+  for (ptmp = demux->programs; ptmp; ptmp = ptmp->next) {
+    TSDemuxProgram *program = (TSDemuxProgram *) ptmp->data;
+
+    for (tmp = program->program.stream_list; tmp; tmp = tmp->next)
+      gst_ts_demux_stream_flush ((TSDemuxStream *) tmp->data);
+    program->newsegment_pushed = FALSE;
+    program->last_pcr = GST_CLOCK_TIME_NONE;
+  }
+
+  return GST_FLOW_OK;
+}
+
+static void
+gst_ts_demux_output_item_free (TSDemuxOutputItem * item)
+{
+  gst_mini_object_unref (item->object);
+  gst_object_unref (item->pad);
+  g_slice_free (TSDemuxOutputItem, item);
+}
+
+/* Combines the flow returns of the pads of a program, call with the
+ * queue_lock of the program */
+static GstFlowReturn
+gst_ts_demux_program_combine_flows (TSDemuxProgram * program,
+    TSDemuxStream * stream, GstFlowReturn ret)
+{
+  GList *tmp;
+
+  stream->flow_return = ret;
+  if (ret != GST_FLOW_NOT_LINKED)
+    return ret;
+
+  for (tmp = program->program.stream_list; tmp; tmp = tmp->next) {
+    stream = (TSDemuxStream *) tmp->data;
+    if (stream->pad && stream->flow_return != GST_FLOW_NOT_LINKED)
+      return stream->flow_return;
+  }
+
+  return GST_FLOW_NOT_LINKED;
+}
+
+static void
+gst_ts_demux_program_loop (TSDemuxProgram * program)
+{
+  TSDemuxOutputItem *item;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  g_mutex_lock (program->queue_lock);
+  while (!program->flushing && g_queue_is_empty (&program->queue))
+    g_cond_wait (program->queue_cond, program->queue_lock);
+  if (program->flushing) {
+    g_mutex_unlock (program->queue_lock);
+    goto pause;
+  }
+  item = (TSDemuxOutputItem *) g_queue_pop_head (&program->queue);
+  g_mutex_unlock (program->queue_lock);
+
+  if (GST_IS_EVENT (item->object)) {
+    gst_pad_push_event (item->pad,
+        GST_EVENT_CAST (gst_mini_object_ref (item->object)));
+  } else {
+    if (GST_IS_BUFFER_LIST (item->object))
+      ret = gst_pad_push_list (item->pad,
+          GST_BUFFER_LIST_CAST (gst_mini_object_ref (item->object)));
+    else
+      ret = gst_pad_push (item->pad,
+          GST_BUFFER_CAST (gst_mini_object_ref (item->object)));
+    GST_LOG_OBJECT (item->pad, "Returned %s", gst_flow_get_name (ret));
+
+    g_mutex_lock (program->queue_lock);
+    ret = program->last_flow =
+        gst_ts_demux_program_combine_flows (program, item->stream, ret);
+    g_mutex_unlock (program->queue_lock);
+  }
+  gst_ts_demux_output_item_free (item);
+
+  if (ret == GST_FLOW_WRONG_STATE || ret < GST_FLOW_UNEXPECTED)
+    goto pause;
+
+  return;
+
+pause:
+  {
+    GST_DEBUG ("Pausing task of program %d, reason %s",
+        program->program.program_number, gst_flow_get_name (ret));
+    gst_task_pause (program->task);
+  }
+}
+
+static void
+gst_ts_demux_program_set_flushing (TSDemuxProgram * program,
+    gboolean flushing)
+{
+  g_mutex_lock (program->queue_lock);
+  program->flushing = flushing;
+  if (flushing) {
+    g_queue_foreach (&program->queue, (GFunc) gst_ts_demux_output_item_free,
+        NULL);
+    g_queue_clear (&program->queue);
+    g_cond_signal (program->queue_cond);
+  } else
+    program->last_flow = GST_FLOW_OK;
+  g_mutex_unlock (program->queue_lock);
+
+  if (flushing)
+    gst_task_pause (program->task);
+  else
+    gst_task_start (program->task);
+}
+
+static void
+gst_ts_demux_program_start_thread (GstTSDemux * demux,
+    TSDemuxProgram * program)
+{
+  GST_DEBUG_OBJECT (demux, "Starting output thread of program %d",
+      program->program.program_number);
+
+  program->queue_lock = g_mutex_new ();
+  program->queue_cond = g_cond_new ();
+  g_queue_init (&program->queue);
+  program->flushing = FALSE;
+  program->last_flow = GST_FLOW_OK;
+  program->dropped = 0;
+
+  g_static_rec_mutex_init (&program->task_lock);
+  program->task = gst_task_create ((GstTaskFunction) gst_ts_demux_program_loop,
+      program);
+  gst_task_set_lock (program->task, &program->task_lock);
+  gst_task_start (program->task);
+}
+
+static void
+gst_ts_demux_program_stop_thread (GstTSDemux * demux,
+    TSDemuxProgram * program)
+{
+  if (program->task == NULL)
+    return;
+
+  GST_DEBUG_OBJECT (demux, "Stopping output thread of program %d",
+      program->program.program_number);
+
+  gst_ts_demux_program_set_flushing (program, TRUE);
+  gst_task_join (program->task);
+  gst_object_unref (program->task);
+  program->task = NULL;
+  g_static_rec_mutex_free (&program->task_lock);
+
+  g_mutex_free (program->queue_lock);
+  program->queue_lock = NULL;
+  g_cond_free (program->queue_cond);
+  program->queue_cond = NULL;
+}
+
+/* Sets the DISCONT flag on @object, a buffer or the first buffer of a
+ * buffer list */
+static GstMiniObject *
+gst_ts_demux_mark_discont (GstMiniObject * object)
+{
+  GstBuffer *buf;
+
+  if (GST_IS_BUFFER (object)) {
+    buf = gst_buffer_make_metadata_writable (GST_BUFFER_CAST (object));
+    GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DISCONT);
+    object = GST_MINI_OBJECT_CAST (buf);
+  } else {
+    GstBufferList *list;
+    GstBufferListIterator *it;
+
+    list = gst_buffer_list_make_writable (GST_BUFFER_LIST_CAST (object));
+    it = gst_buffer_list_iterate (list);
+    if (gst_buffer_list_iterator_next_group (it) &&
+        (buf = gst_buffer_list_iterator_steal (it))) {
+      buf = gst_buffer_make_metadata_writable (buf);
+      GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DISCONT);
+      gst_buffer_list_iterator_take (it, buf);
+    }
+    gst_buffer_list_iterator_free (it);
+    object = GST_MINI_OBJECT_CAST (list);
+  }
+
+  return object;
+}
+
+/* Queues data or a serialized event for the output thread of the program.
+ * Takes ownership of @object */
+static GstFlowReturn
+gst_ts_demux_program_queue (GstTSDemux * demux, TSDemuxProgram * program,
+    TSDemuxStream * stream, GstMiniObject * object)
+{
+  TSDemuxOutputItem *item;
+  GstFlowReturn ret;
+
+  g_mutex_lock (program->queue_lock);
+  if (G_UNLIKELY (program->flushing)) {
+    g_mutex_unlock (program->queue_lock);
+    gst_mini_object_unref (object);
+    return GST_FLOW_WRONG_STATE;
+  }
+
+  /* A slow program must not hold back the others, drop its data instead of
+   * blocking. Events are always queued. */
+  if (!GST_IS_EVENT (object) &&
+      g_queue_get_length (&program->queue) >= demux->program_queue_size) {
+    if (program->dropped++ == 0)
+      GST_WARNING_OBJECT (stream->pad, "Queue of program %d is full, "
+          "dropping data", program->program.program_number);
+    stream->discont = TRUE;
+    g_mutex_unlock (program->queue_lock);
+    gst_mini_object_unref (object);
+    return GST_FLOW_OK;
+  }
+
+  if (G_UNLIKELY (stream->discont) && !GST_IS_EVENT (object)) {
+    object = gst_ts_demux_mark_discont (object);
+    stream->discont = FALSE;
+  }
+
+  item = g_slice_new (TSDemuxOutputItem);
+  item->stream = stream;
+  item->pad = gst_object_ref (stream->pad);
+  item->object = object;
+  g_queue_push_tail (&program->queue, item);
+  g_cond_signal (program->queue_cond);
+
+  /* Only errors are fatal for the other programs */
+  ret = program->last_flow;
+  g_mutex_unlock (program->queue_lock);
+
+  return ret < GST_FLOW_UNEXPECTED ? ret : GST_FLOW_OK;
+}
+
+static void
+push_event_program (GstTSDemux * demux, TSDemuxProgram * program,
+    GstEvent * event)
+{
+  GList *tmp;
+
+  if (program->task) {
+    if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_START)
+      gst_ts_demux_program_set_flushing (program, TRUE);
+    else if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP)
+      gst_ts_demux_program_set_flushing (program, FALSE);
+  }
+
+  for (tmp = program->program.stream_list; tmp; tmp = tmp->next) {
+    TSDemuxStream *stream = (TSDemuxStream *) tmp->data;
+    if (stream->pad) {
+      gst_event_ref (event);
+      /* Keep serialized events in order with the data */
+      if (program->task && GST_EVENT_IS_SERIALIZED (event) &&
+          GST_EVENT_TYPE (event) != GST_EVENT_FLUSH_STOP)
+        gst_ts_demux_program_queue (demux, program, stream,
+            GST_MINI_OBJECT_CAST (event));
+      else
+        gst_pad_push_event (stream->pad, event);
     }
   }
+}
+
+static gboolean
+push_event (MpegTSBase * base, GstEvent * event)
+{
+  GstTSDemux *demux = (GstTSDemux *) base;
+  GList *tmp;
+
+  if (G_UNLIKELY (demux->programs == NULL))
+    return FALSE;
+
+  for (tmp = demux->programs; tmp; tmp = tmp->next)
+    push_event_program (demux, (TSDemuxProgram *) tmp->data, event);
 
   return TRUE;
 }
@@ -395,7 +1325,7 @@ static GstFlowReturn
 tsdemux_combine_flows (GstTSDemux * demux, TSDemuxStream * stream,
     GstFlowReturn ret)
 {
-  guint i;
+  GList *ptmp, *tmp;
 
   /* Store the value */
   stream->flow_return = ret;
@@ -404,10 +1334,13 @@ tsdemux_combine_flows (GstTSDemux * demux, TSDemuxStream * stream,
   if (ret != GST_FLOW_NOT_LINKED)
     goto done;
 
-  /* Only return NOT_LINKED if all other pads returned NOT_LINKED */
-  for (i = 0; i < 0x2000; i++) {
-    if (demux->program->streams[i]) {
-      stream = (TSDemuxStream *) demux->program->streams[i];
+  /* Only return NOT_LINKED if all other pads of all programs returned
+   * NOT_LINKED */
+  for (ptmp = demux->programs; ptmp; ptmp = ptmp->next) {
+    MpegTSBaseProgram *program = (MpegTSBaseProgram *) ptmp->data;
+
+    for (tmp = program->stream_list; tmp; tmp = tmp->next) {
+      stream = (TSDemuxStream *) tmp->data;
       if (stream->pad) {
         ret = stream->flow_return;
         /* some other return value (must be SUCCESS but we can return
@@ -416,9 +1349,9 @@ tsdemux_combine_flows (GstTSDemux * demux, TSDemuxStream * stream,
           goto done;
       }
     }
-    /* if we get here, all other pads were unlinked and we return
-     * NOT_LINKED then */
   }
+  /* if we get here, all other pads were unlinked and we return
+   * NOT_LINKED then */
 
 done:
   return ret;
@@ -533,7 +1466,7 @@ create_pad_for_stream (MpegTSBase * base, MpegTSBaseStream * bstream,
     case ST_DSMCC_B:
     case ST_DSMCC_C:
     case ST_DSMCC_D:
-      base->is_pes[bstream->pid] = FALSE;
+      MPEGTS_BIT_UNSET (base->is_pes, bstream->pid);
       break;
     case ST_AUDIO_AAC:
       template = gst_static_pad_template_get (&audio_template);
@@ -675,6 +1608,7 @@ create_pad_for_stream (MpegTSBase * base, MpegTSBaseStream * bstream,
     gst_pad_set_caps (pad, caps);
     gst_pad_set_query_type_function (pad, gst_ts_demux_srcpad_query_types);
     gst_pad_set_query_function (pad, gst_ts_demux_srcpad_query);
+    gst_pad_set_event_function (pad, gst_ts_demux_srcpad_event);
     gst_caps_unref (caps);
   }
 
@@ -689,6 +1623,7 @@ gst_ts_demux_stream_added (MpegTSBase * base, MpegTSBaseStream * bstream,
 {
   TSDemuxStream *stream = (TSDemuxStream *) bstream;
 
+  stream->program = (TSDemuxProgram *) program;
   if (!stream->pad) {
     /* Create the pad */
     if (bstream->stream_type != 0xff)
@@ -715,7 +1650,20 @@ gst_ts_demux_stream_removed (MpegTSBase * base, MpegTSBaseStream * bstream)
 static void
 activate_pad_for_stream (GstTSDemux * tsdemux, TSDemuxStream * stream)
 {
-  if (stream->pad) {
+  GstPad *existing;
+
+  if (stream->pad && (existing =
+          gst_element_get_static_pad (GST_ELEMENT_CAST (tsdemux),
+              GST_PAD_NAME (stream->pad)))) {
+    /* The pid is shared with another program which already exposes it */
+    GST_DEBUG_OBJECT (tsdemux, "Pad %s:%s already exposed",
+        GST_DEBUG_PAD_NAME (existing));
+    if (existing != stream->pad) {
+      gst_object_unref (stream->pad);
+      stream->pad = NULL;
+    }
+    gst_object_unref (existing);
+  } else if (stream->pad) {
     GST_DEBUG_OBJECT (tsdemux, "Activating pad %s:%s for stream %p",
         GST_DEBUG_PAD_NAME (stream->pad), stream);
     gst_pad_set_active (stream->pad, TRUE);
@@ -729,58 +1677,105 @@ static void
 gst_ts_demux_program_started (MpegTSBase * base, MpegTSBaseProgram * program)
 {
   GstTSDemux *demux = GST_TS_DEMUX (base);
+  TSDemuxProgram *tsprogram = (TSDemuxProgram *) program;
+  GList *tmp;
 
-  if (demux->program_number == -1 ||
-      demux->program_number == program->program_number) {
-    guint i;
+  if (gst_ts_demux_wants_program (demux, program->program_number)) {
 
     GST_LOG ("program %d started", program->program_number);
-    demux->program_number = program->program_number;
-    demux->program = program;
+    if (!gst_ts_demux_is_multi_program (demux))
+      demux->program_number = program->program_number;
+    if (demux->program == NULL)
+      demux->program = program;
+    tsprogram->last_pcr = GST_CLOCK_TIME_NONE;
+    if (!g_list_find (demux->programs, program))
+      demux->programs = g_list_append (demux->programs, program);
 
     /* Activate all stream pads, the pads will already have been created */
 
     /* FIXME : Actually, we don't want to activate *ALL* streams !
      * For example, we don't want to expose HDV AUX private streams, we will just
      * be using them directly for seeking and metadata. */
-    if (base->mode != BASE_MODE_SCANNING)
-      for (i = 0; i < 0x2000; i++)
-        if (program->streams[i])
-          activate_pad_for_stream (demux,
-              (TSDemuxStream *) program->streams[i]);
+    for (tmp = program->stream_list; tmp; tmp = tmp->next) {
+      /* Streams might be shared with a program we previously ignored */
+      mpegts_packetizer_filter_pid (base->packetizer,
+          ((MpegTSBaseStream *) tmp->data)->pid, FALSE);
+      if (base->mode != BASE_MODE_SCANNING)
+        activate_pad_for_stream (demux, (TSDemuxStream *) tmp->data);
+    }
+
+    if (demux->program_threads && base->mode != BASE_MODE_SCANNING &&
+        tsprogram->task == NULL)
+      gst_ts_demux_program_start_thread (demux, tsprogram);
 
     /* Inform scanner we have got our program */
-    demux->current_program_number = program->program_number;
+    if (program == demux->program)
+      demux->current_program_number = program->program_number;
+  } else {
+    /* Not a program we are interested in, drop its packets in the
+     * packetizer unless they are shared with a program we output */
+    for (tmp = program->stream_list; tmp; tmp = tmp->next) {
+      guint16 pid = ((MpegTSBaseStream *) tmp->data)->pid;
+      GList *ptmp;
+
+      for (ptmp = demux->programs; ptmp; ptmp = ptmp->next)
+        if (((MpegTSBaseProgram *) ptmp->data)->streams[pid])
+          break;
+      if (ptmp == NULL)
+        mpegts_packetizer_filter_pid (base->packetizer, pid, TRUE);
+    }
   }
 }
 
 static void
 gst_ts_demux_program_stopped (MpegTSBase * base, MpegTSBaseProgram * program)
 {
-  guint i;
+  GList *tmp;
   GstTSDemux *demux = GST_TS_DEMUX (base);
   TSDemuxStream *localstream = NULL;
 
   GST_LOG ("program %d stopped", program->program_number);
 
-  if (program != demux->program)
+  if (!g_list_find (demux->programs, program))
     return;
 
-  for (i = 0; i < 0x2000; i++) {
-    if (demux->program->streams[i]) {
-      localstream = (TSDemuxStream *) program->streams[i];
-      if (localstream->pad) {
-        GST_DEBUG ("HAVE PAD %s:%s", GST_DEBUG_PAD_NAME (localstream->pad));
-        if (gst_pad_is_active (localstream->pad))
-          gst_element_remove_pad (GST_ELEMENT_CAST (demux), localstream->pad);
-        else
-          gst_object_unref (localstream->pad);
-        localstream->pad = NULL;
-      }
+  /* This runs in the streaming thread, the output thread might be blocked
+   * downstream in a full queue or a prerolled sink. Flush to unblock it
+   * before joining it. */
+  if (((TSDemuxProgram *) program)->task) {
+    for (tmp = program->stream_list; tmp; tmp = tmp->next) {
+      localstream = (TSDemuxStream *) tmp->data;
+      if (localstream->pad)
+        gst_pad_push_event (localstream->pad, gst_event_new_flush_start ());
+    }
+    gst_ts_demux_program_stop_thread (demux, (TSDemuxProgram *) program);
+    for (tmp = program->stream_list; tmp; tmp = tmp->next) {
+      localstream = (TSDemuxStream *) tmp->data;
+      if (localstream->pad)
+        gst_pad_push_event (localstream->pad, gst_event_new_flush_stop ());
     }
   }
-  demux->program = NULL;
-  demux->program_number = -1;
+
+  for (tmp = program->stream_list; tmp; tmp = tmp->next) {
+    localstream = (TSDemuxStream *) tmp->data;
+    if (localstream->pad) {
+      GST_DEBUG ("HAVE PAD %s:%s", GST_DEBUG_PAD_NAME (localstream->pad));
+      if (gst_pad_is_active (localstream->pad))
+        gst_element_remove_pad (GST_ELEMENT_CAST (demux), localstream->pad);
+      else
+        gst_object_unref (localstream->pad);
+      localstream->pad = NULL;
+    }
+  }
+  demux->programs = g_list_remove (demux->programs, program);
+  if (program == demux->program)
+    demux->program =
+        demux->programs ? (MpegTSBaseProgram *) demux->programs->data : NULL;
+  if (!gst_ts_demux_is_multi_program (demux))
+    demux->program_number = -1;
+
+  /* The next program to start can be any of them, stop filtering */
+  mpegts_packetizer_reset_pid_filter (base->packetizer);
 }
 
 static gboolean
@@ -921,10 +1916,14 @@ find_timestamps (MpegTSBase * base, guint64 initoff, guint64 * offset)
   }
 
   demux->duration = final - initial;
+  demux->first_pcr = initial;
+  demux->total_bytes = total_bytes;
 
   GST_DEBUG ("Done, duration:%" GST_TIME_FORMAT,
       GST_TIME_ARGS (demux->duration));
 
+  gst_ts_demux_load_index (demux);
+
 beach:
 
   mpegts_packetizer_clear (base->packetizer);
@@ -1340,16 +2339,77 @@ gst_ts_demux_queue_data (GstTSDemux * demux, TSDemuxStream * stream,
   return;
 }
 
+/* Whether the payload of a PES packet should be merged into one buffer
+ * before pushing it instead of pushing the list of sub-buffers */
+static gboolean
+gst_ts_demux_stream_needs_merge (GstTSDemux * demux, TSDemuxStream * stream)
+{
+  gboolean res = FALSE;
+  GstPad *peer;
+
+  switch (demux->pes_output) {
+    case TS_DEMUX_PES_OUTPUT_CONTIGUOUS:
+      res = TRUE;
+      break;
+    case TS_DEMUX_PES_OUTPUT_BUFFER_LIST:
+      res = FALSE;
+      break;
+    case TS_DEMUX_PES_OUTPUT_AUTO:
+    default:
+      /* Without a chain_list function, the core would merge each group of
+       * the list anyway */
+      peer = gst_pad_get_peer (stream->pad);
+      if (peer) {
+        res = (GST_PAD_CHAINLISTFUNC (peer) == NULL);
+        gst_object_unref (peer);
+      }
+      break;
+  }
+
+  return res;
+}
+
+/* Merges the payload @buffers of a PES packet into a single buffer with the
+ * metadata of the first one. Takes ownership of @buffers */
+static GstBuffer *
+gst_ts_demux_merge_buffers (GList * buffers)
+{
+  GstBuffer *outbuf;
+  GList *tmp;
+  guint size = 0;
+  guint8 *data;
+
+  for (tmp = buffers; tmp; tmp = tmp->next)
+    size += GST_BUFFER_SIZE (tmp->data);
+
+  outbuf = gst_buffer_new_and_alloc (size);
+  gst_buffer_copy_metadata (outbuf, (GstBuffer *) buffers->data,
+      GST_BUFFER_COPY_ALL);
+
+  data = GST_BUFFER_DATA (outbuf);
+  for (tmp = buffers; tmp; tmp = tmp->next) {
+    GstBuffer *buf = (GstBuffer *) tmp->data;
+
+    memcpy (data, GST_BUFFER_DATA (buf), GST_BUFFER_SIZE (buf));
+    data += GST_BUFFER_SIZE (buf);
+    gst_buffer_unref (buf);
+  }
+  g_list_free (buffers);
+
+  return outbuf;
+}
+
 static GstFlowReturn
 gst_ts_demux_push_pending_data (GstTSDemux * demux, TSDemuxStream * stream)
 {
   GstFlowReturn res = GST_FLOW_OK;
   MpegTSBaseStream *bs = (MpegTSBaseStream *) stream;
+  TSDemuxProgram *program = stream->program;
+  GstBuffer *buffer = NULL;
 
-
-  guint i;
+  GList *tmp;
   GstClockTime tinypts = GST_CLOCK_TIME_NONE;
-  GstClockTime stop = GST_CLOCK_TIME_NONE;
+  GstClockTime start, stop = GST_CLOCK_TIME_NONE;
   GstEvent *newsegmentevent;
 
   GST_DEBUG ("stream:%p, pid:0x%04x stream_type:%d state:%d pad:%s:%s",
@@ -1370,46 +2430,75 @@ gst_ts_demux_push_pending_data (GstTSDemux * demux, TSDemuxStream * stream)
   if (stream->state == PENDING_PACKET_BUFFER) {
     GST_LOG ("BUFFER: pushing out pending data");
     stream->currentlist = g_list_reverse (stream->currentlist);
-    gst_buffer_list_iterator_add_list (stream->currentit, stream->currentlist);
+    if (stream->pad && stream->currentlist && stream->currentlist->next == NULL) {
+      /* PES packet contained in a single TS packet, no list needed */
+      buffer = (GstBuffer *) stream->currentlist->data;
+      g_list_free (stream->currentlist);
+    } else if (stream->pad && stream->currentlist &&
+        gst_ts_demux_stream_needs_merge (demux, stream)) {
+      buffer = gst_ts_demux_merge_buffers (stream->currentlist);
+    } else {
+      gst_buffer_list_iterator_add_list (stream->currentit,
+          stream->currentlist);
+    }
+    stream->currentlist = NULL;
     gst_buffer_list_iterator_free (stream->currentit);
+    if (buffer) {
+      /* the (empty) list is not used */
+      gst_buffer_list_unref (stream->current);
+      stream->current = NULL;
+    }
 
 
     if (stream->pad) {
 
-      if (demux->need_newsegment) {
-
-        for (i = 0; i < 0x2000; i++) {
-
-          if (demux->program->streams[i]) {
-            if ((!GST_CLOCK_TIME_IS_VALID (tinypts))
-                || (((TSDemuxStream *) demux->program->streams[i])->pts <
-                    tinypts))
-              tinypts = ((TSDemuxStream *) demux->program->streams[i])->pts;
-          }
+      if (!program->newsegment_pushed) {
 
+        for (tmp = program->program.stream_list; tmp; tmp = tmp->next) {
+          TSDemuxStream *pstream = (TSDemuxStream *) tmp->data;
 
+          if ((!GST_CLOCK_TIME_IS_VALID (tinypts)) || (pstream->pts < tinypts))
+            tinypts = pstream->pts;
         }
 
-        if (GST_CLOCK_TIME_IS_VALID (demux->duration))
-          stop = tinypts + demux->duration;
+        /* The segment configured by seeks is relative to the first pts */
+        if (!GST_CLOCK_TIME_IS_VALID (demux->base_pts))
+          demux->base_pts = tinypts;
+        start = demux->base_pts + demux->segment.start;
+        if (GST_CLOCK_TIME_IS_VALID (demux->segment.stop))
+          stop = demux->base_pts + demux->segment.stop;
+        else if (GST_CLOCK_TIME_IS_VALID (demux->duration))
+          stop = demux->base_pts + demux->duration;
 
         GST_DEBUG ("Sending newsegment event");
         newsegmentevent =
-            gst_event_new_new_segment (0, 1.0, GST_FORMAT_TIME, tinypts, stop,
-            0);
+            gst_event_new_new_segment (0, demux->segment.rate,
+            GST_FORMAT_TIME, start, stop, demux->segment.start);
 
-        push_event ((MpegTSBase *) demux, newsegmentevent);
+        push_event_program (demux, program, newsegmentevent);
+        gst_event_unref (newsegmentevent);
 
-        demux->need_newsegment = FALSE;
+        program->newsegment_pushed = TRUE;
       }
 
-      GST_DEBUG_OBJECT (stream->pad, "Pushing buffer list ");
-
-      res = gst_pad_push_list (stream->pad, stream->current);
-      GST_DEBUG_OBJECT (stream->pad, "Returned %s", gst_flow_get_name (res));
-      /* FIXME : combine flow returns */
-      res = tsdemux_combine_flows (demux, stream, res);
-      GST_DEBUG_OBJECT (stream->pad, "combined %s", gst_flow_get_name (res));
+      if (program->task) {
+        /* the output thread of the program pushes it */
+        res = gst_ts_demux_program_queue (demux, program, stream,
+            buffer ? GST_MINI_OBJECT_CAST (buffer) :
+            GST_MINI_OBJECT_CAST (stream->current));
+      } else {
+        if (buffer) {
+          GST_DEBUG_OBJECT (stream->pad, "Pushing buffer of size %d",
+              GST_BUFFER_SIZE (buffer));
+          res = gst_pad_push (stream->pad, buffer);
+        } else {
+          GST_DEBUG_OBJECT (stream->pad, "Pushing buffer list ");
+          res = gst_pad_push_list (stream->pad, stream->current);
+        }
+        GST_DEBUG_OBJECT (stream->pad, "Returned %s", gst_flow_get_name (res));
+        res = tsdemux_combine_flows (demux, stream, res);
+        GST_DEBUG_OBJECT (stream->pad, "combined %s", gst_flow_get_name (res));
+      }
     } else {
       gst_buffer_list_unref (stream->current);
     }
@@ -1458,6 +2547,23 @@ gst_ts_demux_handle_packet (GstTSDemux * demux, TSDemuxStream * stream,
     res = gst_ts_demux_push_pending_data (demux, stream);
 
   if (packet->adaptation_field_control & 0x2) {
+    TSDemuxProgram *program = stream->program;
+    gboolean has_pcr = packet->afc_flags & MPEGTS_AFC_PCR_FLAG &&
+        packet->pid == program->program.pcr_pid;
+
+    if (has_pcr)
+      program->last_pcr = PCRTIME_TO_GSTTIME (packet->pcr);
+    if ((MpegTSBaseProgram *) program == demux->program) {
+      /* A keyframe starts in this packet, its entry also covers the PCR */
+      if (packet->afc_flags & MPEGTS_AFC_RANDOM_ACCESS_FLAG &&
+          packet->payload_unit_start_indicator)
+        gst_ts_demux_index (demux, program->last_pcr, packet->offset,
+            GST_ASSOCIATION_FLAG_KEY_UNIT);
+      else if (has_pcr)
+        gst_ts_demux_index (demux, program->last_pcr, packet->offset,
+            GST_ASSOCIATION_FLAG_NONE);
+    }
+
     if (packet->afc_flags & MPEGTS_AFC_PCR_FLAG)
       gst_ts_demux_record_pcr (demux, stream, packet->pcr,
           GST_BUFFER_OFFSET (packet->buffer));
@@ -1479,23 +2585,98 @@ gst_ts_demux_push (MpegTSBase * base, MpegTSPacketizerPacket * packet,
     MpegTSPacketizerSection * section)
 {
   GstTSDemux *demux = GST_TS_DEMUX_CAST (base);
-  TSDemuxStream *stream = NULL;
-  GstFlowReturn res = GST_FLOW_OK;
-
-  if (G_LIKELY (demux->program)) {
-    stream = (TSDemuxStream *) demux->program->streams[packet->pid];
+  TSDemuxStream *stream = NULL, *first = NULL;
+  GstFlowReturn res = GST_FLOW_OK, ret;
+  GList *tmp;
+
+  for (tmp = demux->programs; tmp; tmp = tmp->next) {
+    MpegTSPacketizerPacket copy;
+
+    stream = (TSDemuxStream *)
+        ((MpegTSBaseProgram *) tmp->data)->streams[packet->pid];
+    if (stream == NULL)
+      continue;
+    if (first == NULL) {
+      first = stream;
+      continue;
+    }
 
-    if (stream) {
-      res = gst_ts_demux_handle_packet (demux, stream, packet, section);
-    } else if (packet->buffer)
-      gst_buffer_unref (packet->buffer);
-  } else {
-    if (packet->buffer)
-      gst_buffer_unref (packet->buffer);
+    /* The pid is shared by several programs, each of them needs its own
+     * buffer (the payload data itself is shared) */
+    copy = *packet;
+    copy.buffer = gst_buffer_create_sub (packet->buffer, 0,
+        GST_BUFFER_SIZE (packet->buffer));
+    GST_BUFFER_OFFSET (copy.buffer) = packet->offset;
+    ret = gst_ts_demux_handle_packet (demux, stream, &copy, section);
+    if (ret != GST_FLOW_OK)
+      res = ret;
   }
+
+  if (first) {
+    ret = gst_ts_demux_handle_packet (demux, first, packet, section);
+    if (ret != GST_FLOW_OK)
+      res = ret;
+  } else if (packet->buffer)
+    gst_buffer_unref (packet->buffer);
+
   return res;
 }
 
+static GstStateChangeReturn
+gst_ts_demux_change_state (GstElement * element, GstStateChange transition)
+{
+  GstTSDemux *demux = GST_TS_DEMUX (element);
+  GstStateChangeReturn ret;
+  GList *tmp;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      gst_segment_init (&demux->segment, GST_FORMAT_TIME);
+      demux->base_pts = GST_CLOCK_TIME_NONE;
+      demux->first_pcr = GST_CLOCK_TIME_NONE;
+      demux->total_bytes = 0;
+      /* Without an index set by the application, use our own */
+      if (demux->index == NULL) {
+        GstIndex *index = gst_index_factory_make ("memindex");
+
+        if (index) {
+          gst_ts_demux_set_index (element, index);
+          gst_object_unref (index);
+          demux->own_index = TRUE;
+        }
+      }
+      GST_OBJECT_LOCK (demux);
+      g_array_set_size (demux->index_entries, 0);
+      GST_OBJECT_UNLOCK (demux);
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      /* The sink pad is deactivated now so nothing gets queued anymore, and
+       * the deactivated source pads make blocked pushes return */
+      for (tmp = demux->programs; tmp; tmp = tmp->next)
+        gst_ts_demux_program_stop_thread (demux, (TSDemuxProgram *) tmp->data);
+      gst_ts_demux_save_index (demux);
+      GST_OBJECT_LOCK (demux);
+      if (demux->own_index) {
+        gst_object_unref (demux->index);
+        demux->index = NULL;
+        demux->own_index = FALSE;
+      }
+      GST_OBJECT_UNLOCK (demux);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
 gboolean
 gst_ts_demux_plugin_init (GstPlugin * plugin)
 {
@@ -49,6 +49,13 @@ G_BEGIN_DECLS
 typedef struct _GstTSDemux GstTSDemux;
 typedef struct _GstTSDemuxClass GstTSDemuxClass;
 
+typedef enum
+{
+  TS_DEMUX_PES_OUTPUT_AUTO,
+  TS_DEMUX_PES_OUTPUT_CONTIGUOUS,
+  TS_DEMUX_PES_OUTPUT_BUFFER_LIST
+} TSDemuxPesOutput;
+
 struct _GstTSDemux
 {
   MpegTSBase parent;
@@ -57,12 +64,36 @@ struct _GstTSDemux
    * accessed from the application thread and the streaming thread */
   guint program_number;		/* Required program number (ignore:-1) */
   gboolean emit_statistics;
+  TSDemuxPesOutput pes_output;
+  gchar *program_numbers;	/* Programs exposed simultaneously */
+  gboolean program_threads;	/* One output thread per program */
+  guint program_queue_size;	/* Max queued items per program thread */
+  gchar *index_location;	/* Sidecar file of the seek index */
 
   /*< private >*/
   MpegTSBaseProgram *program;	/* Current program */
   guint	current_program_number;
-  gboolean need_newsegment;
   GstClockTime duration;	/* Total duration */
+  GstClockTime first_pcr;	/* First PCR of the file (pull mode) */
+  gint64 total_bytes;		/* Upstream size (pull mode) */
+
+  /* Configured by seeks, relative to base_pts */
+  GstSegment segment;
+  GstClockTime base_pts;
+
+  /* PCR/keyframe to offset index */
+  GstIndex *index;
+  gint index_id;
+  gboolean own_index;
+  /* Copy of the index entries sorted by offset, also used for the
+   * sidecar file */
+  GArray *index_entries;
+
+  /* multi-program mode, parsed from program_numbers */
+  gboolean all_programs;
+  GArray *wanted_programs;
+  /* All programs being output, the first one is also program */
+  GList *programs;
 };
 
 struct _GstTSDemuxClass
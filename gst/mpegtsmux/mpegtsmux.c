@@ -102,9 +102,17 @@ enum
   ARG_PROG_MAP,
   ARG_M2TS_MODE,
   ARG_PAT_INTERVAL,
-  ARG_PMT_INTERVAL
+  ARG_PMT_INTERVAL,
+  ARG_ALIGNMENT,
+  ARG_PCR_INTERVAL,
+  ARG_BITRATE,
+  ARG_SEGMENT_DURATION
 };
 
+#define DEFAULT_ALIGNMENT 0
+#define DEFAULT_BITRATE 0
+#define DEFAULT_SEGMENT_DURATION 0
+
 static GstStaticPadTemplate mpegtsmux_sink_factory =
     GST_STATIC_PAD_TEMPLATE ("sink_%d",
     GST_PAD_SINK,
@@ -140,7 +148,13 @@ static void gst_mpegtsmux_get_property (GObject * object, guint prop_id,
 static void mpegtsmux_dispose (GObject * object);
 static gboolean new_packet_cb (guint8 * data, guint len, void *user_data,
     gint64 new_pcr);
+static guint8 *alloc_packet_cb (void *user_data);
+static void mpegtsmux_reset_output (MpegTsMux * mux);
+static GstFlowReturn mpegtsmux_push_output (MpegTsMux * mux,
+    gboolean drain);
 static void release_buffer_cb (guint8 * data, void *user_data);
+static void mpegtsmux_reset_segments (MpegTsMux * mux);
+static void mpegtsmux_reset_streams (MpegTsMux * mux);
 
 static void mpegtsdemux_prepare_srcpad (MpegTsMux * mux);
 static GstFlowReturn mpegtsmux_collected (GstCollectPads * pads,
@@ -207,6 +221,34 @@ mpegtsmux_class_init (MpegTsMuxClass * klass)
           "Set the interval (in ticks of the 90kHz clock) for writing out the PMT table",
           1, G_MAXUINT, TSMUX_DEFAULT_PMT_INTERVAL,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (G_OBJECT_CLASS (klass), ARG_ALIGNMENT,
+      g_param_spec_uint ("alignment", "packet alignment",
+          "Number of packets per output buffer (e.g. 7 for UDP), "
+          "0 to output all the packets of an input buffer at once",
+          0, G_MAXUINT, DEFAULT_ALIGNMENT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (G_OBJECT_CLASS (klass), ARG_PCR_INTERVAL,
+      g_param_spec_uint ("pcr-interval", "PCR interval",
+          "Set the maximum interval (in ticks of the 90kHz clock) between two "
+          "PCRs of a program", 1, G_MAXUINT, TSMUX_DEFAULT_PCR_INTERVAL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (G_OBJECT_CLASS (klass), ARG_BITRATE,
+      g_param_spec_uint ("bitrate", "Bitrate",
+          "Constant output bitrate in bits per second, stuffed with null "
+          "packets (0 = variable bitrate)", 0, G_MAXUINT, DEFAULT_BITRATE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (G_OBJECT_CLASS (klass),
+      ARG_SEGMENT_DURATION, g_param_spec_uint64 ("segment-duration",
+          "Segment duration",
+          "Target duration (in nanoseconds) of the segments the output is "
+          "split into at keyframes, each one starting with a PAT and PMT and "
+          "announced with a GstMpegTsMuxSegment element message when "
+          "complete (0 = disabled)", 0, G_MAXUINT64, DEFAULT_SEGMENT_DURATION,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 }
 
 static void
@@ -223,21 +265,36 @@ mpegtsmux_init (MpegTsMux * mux, MpegTsMuxClass * g_class)
 
   mux->tsmux = tsmux_new ();
   tsmux_set_write_func (mux->tsmux, new_packet_cb, mux);
+  tsmux_set_alloc_func (mux->tsmux, alloc_packet_cb, mux);
 
   mux->programs = g_new0 (TsMuxProgram *, MAX_PROG_NUMBER);
   mux->first = TRUE;
   mux->last_flow_ret = GST_FLOW_OK;
-  mux->adapter = gst_adapter_new ();
   mux->m2ts_mode = FALSE;
   mux->pat_interval = TSMUX_DEFAULT_PAT_INTERVAL;
   mux->pmt_interval = TSMUX_DEFAULT_PMT_INTERVAL;
+  mux->pcr_interval = TSMUX_DEFAULT_PCR_INTERVAL;
+  mux->bitrate = DEFAULT_BITRATE;
   mux->first_pcr = TRUE;
   mux->last_ts = 0;
   mux->is_delta = TRUE;
 
+  mux->heap = g_ptr_array_new ();
+  mux->refill = NULL;
+
   mux->prog_map = NULL;
   mux->streamheader = NULL;
   mux->streamheader_sent = FALSE;
+
+  mux->alignment = DEFAULT_ALIGNMENT;
+  mux->out_buffer = NULL;
+  mux->out_list = NULL;
+  mpegtsmux_reset_output (mux);
+
+  mux->segment_duration = DEFAULT_SEGMENT_DURATION;
+  mux->segment_video = FALSE;
+  mux->segment_msgs = NULL;
+  mpegtsmux_reset_segments (mux);
 }
 
 static void
@@ -245,11 +302,14 @@ mpegtsmux_dispose (GObject * object)
 {
   MpegTsMux *mux = GST_MPEG_TSMUX (object);
 
-  if (mux->adapter) {
-    gst_adapter_clear (mux->adapter);
-    g_object_unref (mux->adapter);
-    mux->adapter = NULL;
+  mpegtsmux_reset_output (mux);
+  mpegtsmux_reset_segments (mux);
+  if (mux->heap) {
+    g_ptr_array_free (mux->heap, TRUE);
+    mux->heap = NULL;
   }
+  g_slist_free (mux->refill);
+  mux->refill = NULL;
   if (mux->collect) {
     gst_object_unref (mux->collect);
     mux->collect = NULL;
@@ -322,6 +382,22 @@ gst_mpegtsmux_set_property (GObject * object, guint prop_id,
         walk = g_slist_next (walk);
       }
       break;
+    case ARG_ALIGNMENT:
+      mux->alignment = g_value_get_uint (value);
+      break;
+    case ARG_PCR_INTERVAL:
+      mux->pcr_interval = g_value_get_uint (value);
+      if (mux->tsmux)
+        tsmux_set_pcr_interval (mux->tsmux, mux->pcr_interval);
+      break;
+    case ARG_BITRATE:
+      mux->bitrate = g_value_get_uint (value);
+      if (mux->tsmux)
+        tsmux_set_bitrate (mux->tsmux, mux->bitrate);
+      break;
+    case ARG_SEGMENT_DURATION:
+      mux->segment_duration = g_value_get_uint64 (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -347,6 +423,18 @@ gst_mpegtsmux_get_property (GObject * object, guint prop_id,
     case ARG_PMT_INTERVAL:
       g_value_set_uint (value, mux->pmt_interval);
       break;
+    case ARG_ALIGNMENT:
+      g_value_set_uint (value, mux->alignment);
+      break;
+    case ARG_PCR_INTERVAL:
+      g_value_set_uint (value, mux->pcr_interval);
+      break;
+    case ARG_BITRATE:
+      g_value_set_uint (value, mux->bitrate);
+      break;
+    case ARG_SEGMENT_DURATION:
+      g_value_set_uint64 (value, mux->segment_duration);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -565,89 +653,284 @@ no_stream:
   return ret;
 }
 
+/* Heap order: streams without a timestamp yet first, so that we push
+ * enough buffers from them to reach a timestamp, then the oldest timestamp */
+static inline gboolean
+mpegtsmux_pad_data_before (MpegTsPadData * a, MpegTsPadData * b)
+{
+  if (a->last_ts == GST_CLOCK_TIME_NONE || b->last_ts == GST_CLOCK_TIME_NONE) {
+    if (a->last_ts != b->last_ts)
+      return a->last_ts == GST_CLOCK_TIME_NONE;
+  } else if (a->last_ts != b->last_ts)
+    return a->last_ts < b->last_ts;
+
+  return a->pid < b->pid;
+}
+
+static inline void
+mpegtsmux_heap_set (GPtrArray * heap, guint idx, MpegTsPadData * ts_data)
+{
+  g_ptr_array_index (heap, idx) = ts_data;
+  ts_data->heap_index = idx;
+}
+
+static void
+mpegtsmux_heap_sift_up (GPtrArray * heap, guint idx)
+{
+  MpegTsPadData *ts_data = g_ptr_array_index (heap, idx);
+
+  while (idx > 0) {
+    guint parent = (idx - 1) / 2;
+    MpegTsPadData *p = g_ptr_array_index (heap, parent);
+
+    if (!mpegtsmux_pad_data_before (ts_data, p))
+      break;
+    mpegtsmux_heap_set (heap, idx, p);
+    idx = parent;
+  }
+  mpegtsmux_heap_set (heap, idx, ts_data);
+}
+
+static void
+mpegtsmux_heap_sift_down (GPtrArray * heap, guint idx)
+{
+  MpegTsPadData *ts_data = g_ptr_array_index (heap, idx);
+
+  while (2 * idx + 1 < heap->len) {
+    guint child = 2 * idx + 1;
+    MpegTsPadData *c = g_ptr_array_index (heap, child);
+
+    if (child + 1 < heap->len &&
+        mpegtsmux_pad_data_before (g_ptr_array_index (heap, child + 1), c))
+      c = g_ptr_array_index (heap, ++child);
+    if (!mpegtsmux_pad_data_before (c, ts_data))
+      break;
+    mpegtsmux_heap_set (heap, idx, c);
+    idx = child;
+  }
+  mpegtsmux_heap_set (heap, idx, ts_data);
+}
+
+static void
+mpegtsmux_heap_push (GPtrArray * heap, MpegTsPadData * ts_data)
+{
+  g_ptr_array_add (heap, ts_data);
+  mpegtsmux_heap_sift_up (heap, heap->len - 1);
+}
+
+static void
+mpegtsmux_heap_remove (GPtrArray * heap, MpegTsPadData * ts_data)
+{
+  guint idx = ts_data->heap_index;
+  MpegTsPadData *last;
+
+  g_return_if_fail (idx < heap->len);
+
+  last = g_ptr_array_remove_index (heap, heap->len - 1);
+  ts_data->heap_index = -1;
+  if (last == ts_data)
+    return;
+
+  mpegtsmux_heap_set (heap, idx, last);
+  if (idx > 0 && mpegtsmux_pad_data_before (last,
+          g_ptr_array_index (heap, (idx - 1) / 2)))
+    mpegtsmux_heap_sift_up (heap, idx);
+  else
+    mpegtsmux_heap_sift_down (heap, idx);
+}
+
+/* Peeks and prepares the next buffer of @ts_data, returns FALSE at EOS */
+static gboolean
+mpegtsmux_queue_buffer (MpegTsMux * mux, MpegTsPadData * ts_data)
+{
+  GstCollectData *c_data = (GstCollectData *) ts_data;
+  GstBuffer *buf;
+
+  ts_data->queued_buf = buf = gst_collect_pads_peek (mux->collect, c_data);
+  if (buf == NULL)
+    return FALSE;
+
+  if (ts_data->prepare_func) {
+    buf = ts_data->prepare_func (buf, ts_data, mux);
+    if (buf) {                  /* Take the prepared buffer instead */
+      gst_buffer_unref (ts_data->queued_buf);
+      ts_data->queued_buf = buf;
+    } else {                    /* If data preparation returned NULL, use unprepared one */
+      buf = ts_data->queued_buf;
+    }
+  }
+  if (GST_BUFFER_TIMESTAMP (buf) != GST_CLOCK_TIME_NONE) {
+    /* Ignore timestamps that go backward for now. FIXME: Handle all
+     * incoming PTS */
+    if (ts_data->last_ts == GST_CLOCK_TIME_NONE ||
+        ts_data->last_ts < GST_BUFFER_TIMESTAMP (buf)) {
+      ts_data->cur_ts = ts_data->last_ts =
+          gst_segment_to_running_time (&c_data->segment,
+          GST_FORMAT_TIME, GST_BUFFER_TIMESTAMP (buf));
+    } else {
+      GST_DEBUG_OBJECT (mux, "Ignoring PTS that has gone backward");
+    }
+  } else
+    ts_data->cur_ts = GST_CLOCK_TIME_NONE;
+
+  GST_DEBUG_OBJECT (mux, "Pulled buffer with ts %" GST_TIME_FORMAT
+      " (uncorrected ts %" GST_TIME_FORMAT " %" G_GUINT64_FORMAT
+      ") for PID 0x%04x",
+      GST_TIME_ARGS (ts_data->cur_ts),
+      GST_TIME_ARGS (GST_BUFFER_TIMESTAMP (buf)),
+      GST_BUFFER_TIMESTAMP (buf), ts_data->pid);
+
+  return TRUE;
+}
+
+/* Only the streams whose buffer was consumed by the previous call need a new
+ * buffer, the others stay in the heap, which gives the next stream to mux
+ * in O(log n) */
 static MpegTsPadData *
 mpegtsmux_choose_best_stream (MpegTsMux * mux)
 {
   MpegTsPadData *best = NULL;
-  GstCollectData *c_best = NULL;
-  GSList *walk;
 
-  for (walk = mux->collect->data; walk != NULL; walk = g_slist_next (walk)) {
-    GstCollectData *c_data = (GstCollectData *) walk->data;
-    MpegTsPadData *ts_data = (MpegTsPadData *) walk->data;
+  while (mux->refill) {
+    MpegTsPadData *ts_data = (MpegTsPadData *) mux->refill->data;
 
-    if (ts_data->eos == FALSE) {
-      if (ts_data->queued_buf == NULL) {
-        GstBuffer *buf;
-
-        ts_data->queued_buf = buf =
-            gst_collect_pads_peek (mux->collect, c_data);
-
-        if (buf != NULL) {
-          if (ts_data->prepare_func) {
-            buf = ts_data->prepare_func (buf, ts_data, mux);
-            if (buf) {          /* Take the prepared buffer instead */
-              gst_buffer_unref (ts_data->queued_buf);
-              ts_data->queued_buf = buf;
-            } else {            /* If data preparation returned NULL, use unprepared one */
-              buf = ts_data->queued_buf;
-            }
-          }
-          if (GST_BUFFER_TIMESTAMP (buf) != GST_CLOCK_TIME_NONE) {
-            /* Ignore timestamps that go backward for now. FIXME: Handle all
-             * incoming PTS */
-            if (ts_data->last_ts == GST_CLOCK_TIME_NONE ||
-                ts_data->last_ts < GST_BUFFER_TIMESTAMP (buf)) {
-              ts_data->cur_ts = ts_data->last_ts =
-                  gst_segment_to_running_time (&c_data->segment,
-                  GST_FORMAT_TIME, GST_BUFFER_TIMESTAMP (buf));
-            } else {
-              GST_DEBUG_OBJECT (mux, "Ignoring PTS that has gone backward");
-            }
-          } else
-            ts_data->cur_ts = GST_CLOCK_TIME_NONE;
-
-          GST_DEBUG_OBJECT (mux, "Pulled buffer with ts %" GST_TIME_FORMAT
-              " (uncorrected ts %" GST_TIME_FORMAT " %" G_GUINT64_FORMAT
-              ") for PID 0x%04x",
-              GST_TIME_ARGS (ts_data->cur_ts),
-              GST_TIME_ARGS (GST_BUFFER_TIMESTAMP (buf)),
-              GST_BUFFER_TIMESTAMP (buf), ts_data->pid);
-
-          /* Choose a stream we've never seen a timestamp for to ensure
-           * we push enough buffers from it to reach a timestamp */
-          if (ts_data->last_ts == GST_CLOCK_TIME_NONE) {
-            best = ts_data;
-            c_best = c_data;
-          }
-        } else {
-          ts_data->eos = TRUE;
-          continue;
-        }
-      }
+    mux->refill = g_slist_delete_link (mux->refill, mux->refill);
 
-      /* If we don't yet have a best pad, take this one, otherwise take
-       * whichever has the oldest timestamp */
-      if (best != NULL) {
-        if (ts_data->last_ts != GST_CLOCK_TIME_NONE &&
-            best->last_ts != GST_CLOCK_TIME_NONE &&
-            ts_data->last_ts < best->last_ts) {
-          best = ts_data;
-          c_best = c_data;
-        }
-      } else {
-        best = ts_data;
-        c_best = c_data;
-      }
-    }
+    if (ts_data->eos || ts_data->queued_buf != NULL)
+      continue;
+
+    if (mpegtsmux_queue_buffer (mux, ts_data))
+      mpegtsmux_heap_push (mux->heap, ts_data);
+    else
+      ts_data->eos = TRUE;
   }
-  if (c_best) {
-    gst_buffer_unref (gst_collect_pads_pop (mux->collect, c_best));
+
+  if (mux->heap->len) {
+    best = g_ptr_array_index (mux->heap, 0);
+    mpegtsmux_heap_remove (mux->heap, best);
+    gst_buffer_unref (gst_collect_pads_pop (mux->collect,
+            (GstCollectData *) best));
+    /* needs a new buffer next time */
+    mux->refill = g_slist_prepend (mux->refill, best);
   }
 
   return best;
 }
 
+/* Drops the queued buffers and the timing of the streams so that muxing
+ * starts over from the next data, the streams themselves are kept */
+static void
+mpegtsmux_reset_streams (MpegTsMux * mux)
+{
+  GSList *walk;
+
+  for (walk = mux->collect->data; walk; walk = walk->next) {
+    MpegTsPadData *ts_data = MPEG_TS_PAD_DATA (walk->data);
+
+    if (ts_data->queued_buf) {
+      gst_buffer_unref (ts_data->queued_buf);
+      ts_data->queued_buf = NULL;
+    }
+    ts_data->last_ts = ts_data->cur_ts = GST_CLOCK_TIME_NONE;
+    ts_data->heap_index = -1;
+    ts_data->eos = FALSE;
+  }
+  g_ptr_array_set_size (mux->heap, 0);
+  g_slist_free (mux->refill);
+  mux->refill = NULL;
+  mux->first = TRUE;
+  mux->last_ts = 0;
+  mpegtsmux_reset_output (mux);
+
+  /* and the CBR output clock, which restarts with the next data */
+  tsmux_set_bitrate (mux->tsmux, mux->bitrate);
+}
+
+static void
+mpegtsmux_reset_segments (MpegTsMux * mux)
+{
+  GList *walk;
+
+  for (walk = mux->segment_msgs; walk; walk = g_list_next (walk))
+    gst_structure_free ((GstStructure *) walk->data);
+  g_list_free (mux->segment_msgs);
+  mux->segment_msgs = NULL;
+
+  mux->segment_index = 0;
+  mux->segment_start = GST_CLOCK_TIME_NONE;
+  mux->segment_end = GST_CLOCK_TIME_NONE;
+  mux->segment_offset = 0;
+}
+
+/* Queues the message describing the current segment, which ends at @end and
+ * at @end_offset in the output */
+static void
+mpegtsmux_close_segment (MpegTsMux * mux, GstClockTime end,
+    guint64 end_offset)
+{
+  GstStructure *s;
+  GstClockTime duration = 0;
+
+  if (!GST_CLOCK_TIME_IS_VALID (mux->segment_start) ||
+      end_offset <= mux->segment_offset)
+    return;
+
+  if (GST_CLOCK_TIME_IS_VALID (end) && end > mux->segment_start)
+    duration = end - mux->segment_start;
+
+  GST_INFO_OBJECT (mux, "Segment %u: running time %" GST_TIME_FORMAT
+      " duration %" GST_TIME_FORMAT " offset %" G_GUINT64_FORMAT " size %"
+      G_GUINT64_FORMAT, mux->segment_index,
+      GST_TIME_ARGS (mux->segment_start), GST_TIME_ARGS (duration),
+      mux->segment_offset, end_offset - mux->segment_offset);
+
+  s = gst_structure_new ("GstMpegTsMuxSegment",
+      "index", G_TYPE_UINT, mux->segment_index,
+      "running-time", G_TYPE_UINT64, mux->segment_start,
+      "duration", G_TYPE_UINT64, duration,
+      "offset", G_TYPE_UINT64, mux->segment_offset,
+      "size", G_TYPE_UINT64, end_offset - mux->segment_offset, NULL);
+  mux->segment_msgs = g_list_append (mux->segment_msgs, s);
+}
+
+/* Posts the messages of the segments that have been pushed entirely */
+static void
+mpegtsmux_post_segments (MpegTsMux * mux)
+{
+  while (mux->segment_msgs) {
+    GstStructure *s = (GstStructure *) mux->segment_msgs->data;
+    guint64 end;
+
+    end = g_value_get_uint64 (gst_structure_get_value (s, "offset")) +
+        g_value_get_uint64 (gst_structure_get_value (s, "size"));
+    if (end > mux->out_bytes)
+      break;
+
+    mux->segment_msgs =
+        g_list_delete_link (mux->segment_msgs, mux->segment_msgs);
+    gst_element_post_message (GST_ELEMENT_CAST (mux),
+        gst_message_new_element (GST_OBJECT_CAST (mux), s));
+  }
+}
+
+/* Ends the current segment and starts a new one at running time @ts with
+ * the next packet. The new segment starts with a PAT and PMT and a new
+ * output buffer, so that it can be decoded on its own */
+static gboolean
+mpegtsmux_start_segment (MpegTsMux * mux, GstClockTime ts)
+{
+  guint64 offset = mux->out_bytes + (mux->out_offset - mux->out_start);
+
+  mpegtsmux_close_segment (mux, ts, offset);
+
+  mux->segment_index++;
+  mux->segment_start = ts;
+  mux->segment_offset = offset;
+
+  mux->is_delta = FALSE;
+  return tsmux_write_si (mux->tsmux);
+}
+
 #define COLLECT_DATA_PAD(collect_data) (((GstCollectData *)(collect_data))->pad)
 
 static GstFlowReturn
@@ -659,10 +942,23 @@ mpegtsmux_collected (GstCollectPads * pads, MpegTsMux * mux)
   GST_DEBUG_OBJECT (mux, "Pads collected");
 
   if (G_UNLIKELY (mux->first)) {
+    GSList *walk;
+
     ret = mpegtsmux_create_streams (mux);
     if (G_UNLIKELY (ret != GST_FLOW_OK))
       return ret;
 
+    /* All the streams need a buffer to start with */
+    for (walk = mux->collect->data; walk; walk = walk->next) {
+      MpegTsPadData *ts_data = MPEG_TS_PAD_DATA (walk->data);
+
+      if (g_slist_find (mux->refill, ts_data) == NULL &&
+          ts_data->heap_index == -1)
+        mux->refill = g_slist_prepend (mux->refill, ts_data);
+      if (ts_data->stream->is_video_stream)
+        mux->segment_video = TRUE;
+    }
+
     mpegtsdemux_prepare_srcpad (mux);
 
     mux->first = FALSE;
@@ -675,6 +971,7 @@ mpegtsmux_collected (GstCollectPads * pads, MpegTsMux * mux)
     GstBuffer *buf = best->queued_buf;
     gint64 pts = -1;
     gboolean delta = TRUE;
+    gboolean split = FALSE;
 
     if (prog == NULL) {
       GST_ELEMENT_ERROR (mux, STREAM, MUX,
@@ -710,11 +1007,40 @@ mpegtsmux_collected (GstCollectPads * pads, MpegTsMux * mux)
           G_GINT64_FORMAT, GST_TIME_ARGS (best->cur_ts), pts);
     }
 
+    if (mux->segment_duration && GST_CLOCK_TIME_IS_VALID (best->cur_ts)) {
+      GstClockTime end = best->cur_ts;
+
+      /* Segments start at video keyframes, or at any buffer of the PCR
+       * stream if there is no video */
+      if (best->stream->is_video_stream ? !delta :
+          (!mux->segment_video && prog->pcr_stream == best->stream)) {
+        if (!GST_CLOCK_TIME_IS_VALID (mux->segment_start))
+          mux->segment_start = best->cur_ts;
+        else if (best->cur_ts >= mux->segment_start + mux->segment_duration)
+          split = TRUE;
+      }
+
+      if (GST_BUFFER_DURATION_IS_VALID (buf))
+        end += GST_BUFFER_DURATION (buf);
+      if (!GST_CLOCK_TIME_IS_VALID (mux->segment_end) ||
+          end > mux->segment_end)
+        mux->segment_end = end;
+    }
+
     tsmux_stream_add_data (best->stream, GST_BUFFER_DATA (buf),
         GST_BUFFER_SIZE (buf), buf, pts, -1, !delta);
     best->queued_buf = NULL;
 
-    mux->is_delta = delta;
+    if (split) {
+      if (!mpegtsmux_start_segment (mux, best->cur_ts)) {
+        GST_DEBUG_OBJECT (mux, "Failed to write segment tables");
+        GST_ELEMENT_ERROR (mux, STREAM, MUX,
+            ("Failed writing output data to stream %04x", best->stream->id),
+            (NULL));
+        goto write_fail;
+      }
+    } else
+      mux->is_delta = delta;
     while (tsmux_stream_bytes_in_buffer (best->stream) > 0) {
       if (!tsmux_write_stream_packet (mux->tsmux, best->stream)) {
         /* Failed writing data for some reason. Set appropriate error */
@@ -728,9 +1054,15 @@ mpegtsmux_collected (GstCollectPads * pads, MpegTsMux * mux)
     if (prog->pcr_stream == best->stream) {
       mux->last_ts = best->last_ts;
     }
+
+    ret = mpegtsmux_push_output (mux, FALSE);
   } else {
     /* FIXME: Drain all remaining streams */
     /* At EOS */
+    if (mux->segment_duration)
+      mpegtsmux_close_segment (mux, mux->segment_end,
+          mux->out_bytes + (mux->out_ready - mux->out_start));
+    mpegtsmux_push_output (mux, TRUE);
     gst_pad_push_event (mux->srcpad, gst_event_new_eos ());
   }
 
@@ -773,6 +1105,9 @@ mpegtsmux_request_new_pad (GstElement * element,
   pad_data->free_func = NULL;
   pad_data->prog_id = -1;
   pad_data->prog = NULL;
+  pad_data->heap_index = -1;
+  if (!mux->first)
+    mux->refill = g_slist_prepend (mux->refill, pad_data);
 
   if (G_UNLIKELY (!gst_element_add_pad (element, pad)))
     goto could_not_add;
@@ -804,6 +1139,14 @@ mpegtsmux_release_pad (GstElement * element, GstPad * pad)
   GST_DEBUG_OBJECT (mux, "Pad %" GST_PTR_FORMAT " being released", pad);
 
   if (mux->collect) {
+    MpegTsPadData *pad_data =
+        (MpegTsPadData *) gst_pad_get_element_private (pad);
+
+    if (pad_data) {
+      if (pad_data->heap_index != -1)
+        mpegtsmux_heap_remove (mux->heap, pad_data);
+      mux->refill = g_slist_remove (mux->refill, pad_data);
+    }
     gst_collect_pads_remove_pad (mux->collect, pad);
   }
 
@@ -812,8 +1155,170 @@ mpegtsmux_release_pad (GstElement * element, GstPad * pad)
 }
 
 static void
-new_packet_common_init (MpegTsMux * mux, GstBuffer * buf, guint8 * data,
-    guint len)
+mpegtsmux_reset_output (MpegTsMux * mux)
+{
+  if (mux->out_buffer) {
+    gst_buffer_unref (mux->out_buffer);
+    mux->out_buffer = NULL;
+  }
+  if (mux->out_list) {
+    gst_buffer_list_iterator_free (mux->out_it);
+    mux->out_it = NULL;
+    gst_buffer_list_unref (mux->out_list);
+    mux->out_list = NULL;
+  }
+  mux->out_start = mux->out_ready = mux->out_offset = 0;
+  mux->out_keyframe = -1;
+  mux->group_packets = 0;
+  mux->group_ts = GST_CLOCK_TIME_NONE;
+  mux->group_delta = TRUE;
+  mux->first_pcr = TRUE;
+  mux->out_bytes = 0;
+}
+
+/* Called when the TsMux needs memory for a new packet, returns a pointer
+ * into the output chunk */
+static guint8 *
+alloc_packet_cb (void *user_data)
+{
+  MpegTsMux *mux = (MpegTsMux *) user_data;
+  guint packet_size;
+  guint8 *data;
+
+  packet_size = mux->m2ts_mode ? M2TS_PACKET_LENGTH : NORMAL_TS_PACKET_LENGTH;
+
+  if (G_UNLIKELY (mux->out_buffer == NULL ||
+          mux->out_offset + packet_size > GST_BUFFER_SIZE (mux->out_buffer))) {
+    GstBuffer *chunk;
+    guint pending = mux->out_offset - mux->out_start;
+
+    /* Start a new chunk and move the packets not output yet into it. The
+     * buffers already output keep the previous chunk alive */
+    chunk = gst_buffer_new_and_alloc (pending +
+        MPEGTSMUX_CHUNK_PACKETS * packet_size);
+    if (G_UNLIKELY (chunk == NULL)) {
+      GST_ELEMENT_ERROR (mux, STREAM, MUX,
+          ("Failed allocating output buffer"), (NULL));
+      mux->last_flow_ret = GST_FLOW_ERROR;
+      return NULL;
+    }
+    GST_LOG_OBJECT (mux, "New output chunk of %d bytes, moving %u pending "
+        "bytes", GST_BUFFER_SIZE (chunk), pending);
+
+    if (mux->out_buffer) {
+      memcpy (GST_BUFFER_DATA (chunk),
+          GST_BUFFER_DATA (mux->out_buffer) + mux->out_start, pending);
+      gst_buffer_unref (mux->out_buffer);
+    }
+    if (mux->out_keyframe != -1)
+      mux->out_keyframe -= mux->out_start;
+    mux->out_ready -= mux->out_start;
+    mux->out_offset = pending;
+    mux->out_start = 0;
+    mux->out_buffer = chunk;
+  }
+
+  data = GST_BUFFER_DATA (mux->out_buffer) + mux->out_offset;
+  if (mux->m2ts_mode) {
+    /* leave space for writing the timestamp later */
+    GST_WRITE_UINT32_BE (data, 0);
+    data += 4;
+  }
+
+  return data;
+}
+
+/* Moves the current output buffer to the list of buffers to push */
+static void
+mpegtsmux_output_group (MpegTsMux * mux)
+{
+  GstBuffer *buf;
+
+  if (mux->out_ready == mux->out_start)
+    return;
+
+  buf = gst_buffer_create_sub (mux->out_buffer, mux->out_start,
+      mux->out_ready - mux->out_start);
+  gst_buffer_set_caps (buf, GST_PAD_CAPS (mux->srcpad));
+  GST_BUFFER_TIMESTAMP (buf) = mux->group_ts;
+  GST_BUFFER_OFFSET (buf) = mux->out_bytes;
+  GST_BUFFER_OFFSET_END (buf) = mux->out_bytes + GST_BUFFER_SIZE (buf);
+  mux->out_bytes += GST_BUFFER_SIZE (buf);
+  if (mux->group_delta) {
+    GST_LOG_OBJECT (mux, "marking as delta unit");
+    GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+  } else
+    GST_DEBUG_OBJECT (mux, "marking as non-delta unit");
+
+  GST_LOG_OBJECT (mux, "Outputting %d packets", mux->group_packets);
+
+  if (mux->out_list == NULL) {
+    mux->out_list = gst_buffer_list_new ();
+    mux->out_it = gst_buffer_list_iterate (mux->out_list);
+  }
+  gst_buffer_list_iterator_add_group (mux->out_it);
+  gst_buffer_list_iterator_add (mux->out_it, buf);
+
+  mux->out_start = mux->out_ready;
+  mux->group_packets = 0;
+}
+
+/* The packet at out_ready is complete and can be output with @ts */
+static void
+mpegtsmux_packet_ready (MpegTsMux * mux, GstClockTime ts)
+{
+  gboolean keyframe = (mux->out_ready == mux->out_keyframe);
+
+  if (keyframe) {
+    /* keyframes start a new buffer */
+    mpegtsmux_output_group (mux);
+    mux->out_keyframe = -1;
+  }
+
+  if (mux->group_packets == 0) {
+    mux->group_ts = ts;
+    mux->group_delta = !keyframe;
+  }
+
+  mux->out_ready +=
+      mux->m2ts_mode ? M2TS_PACKET_LENGTH : NORMAL_TS_PACKET_LENGTH;
+  mux->group_packets++;
+
+  if (mux->alignment && mux->group_packets >= mux->alignment)
+    mpegtsmux_output_group (mux);
+}
+
+/* Pushes the output buffers, including the incomplete one if @drain is TRUE
+ * or with automatic alignment */
+static GstFlowReturn
+mpegtsmux_push_output (MpegTsMux * mux, gboolean drain)
+{
+  GstBufferList *list;
+  GstFlowReturn ret;
+
+  if (drain || mux->alignment == 0)
+    mpegtsmux_output_group (mux);
+
+  if (mux->out_list == NULL)
+    return GST_FLOW_OK;
+
+  list = mux->out_list;
+  gst_buffer_list_iterator_free (mux->out_it);
+  mux->out_it = NULL;
+  mux->out_list = NULL;
+
+  ret = gst_pad_push_list (mux->srcpad, list);
+  if (G_UNLIKELY (ret != GST_FLOW_OK))
+    mux->last_flow_ret = ret;
+
+  if (mux->segment_msgs)
+    mpegtsmux_post_segments (mux);
+
+  return ret;
+}
+
+static void
+new_packet_common_init (MpegTsMux * mux, guint8 * data, guint len)
 {
   /* Packets should be at least 188 bytes, but check anyway */
   g_return_if_fail (len >= 2);
@@ -822,23 +1327,22 @@ new_packet_common_init (MpegTsMux * mux, GstBuffer * buf, guint8 * data,
     guint pid = ((data[1] & 0x1f) << 8) | data[2];
     /* if it's a PAT or a PMT */
     if (pid == 0x00 || (pid >= TSMUX_START_PMT_PID && pid < TSMUX_START_ES_PID)) {
-      mux->streamheader =
-          g_list_append (mux->streamheader, gst_buffer_copy (buf));
+      GstBuffer *buf;
+      guint packet_size =
+          mux->m2ts_mode ? M2TS_PACKET_LENGTH : NORMAL_TS_PACKET_LENGTH;
+
+      buf = gst_buffer_new_and_alloc (packet_size);
+      memcpy (GST_BUFFER_DATA (buf), data + len - packet_size, packet_size);
+      mux->streamheader = g_list_append (mux->streamheader, buf);
     } else if (mux->streamheader) {
       mpegtsdemux_set_header_on_caps (mux);
       mux->streamheader_sent = TRUE;
     }
   }
 
-  /* Set the caps on the buffer only after possibly setting the stream headers
-   * into the pad caps above */
-  gst_buffer_set_caps (buf, GST_PAD_CAPS (mux->srcpad));
-
-  if (mux->is_delta) {
-    GST_LOG_OBJECT (mux, "marking as delta unit");
-    GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
-  } else {
-    GST_DEBUG_OBJECT (mux, "marking as non-delta unit");
+  if (!mux->is_delta) {
+    /* First packet after a keyframe */
+    mux->out_keyframe = mux->out_offset;
     mux->is_delta = TRUE;
   }
 }
@@ -846,49 +1350,42 @@ new_packet_common_init (MpegTsMux * mux, GstBuffer * buf, guint8 * data,
 static gboolean
 new_packet_m2ts (MpegTsMux * mux, guint8 * data, guint len, gint64 new_pcr)
 {
-  GstBuffer *buf, *out_buf;
-  GstFlowReturn ret;
-  int chunk_bytes;
+  guint8 *chunk = GST_BUFFER_DATA (mux->out_buffer);
+  guint packet_offset = mux->out_offset;
+  guint chunk_bytes;
 
   GST_LOG_OBJECT (mux, "Have buffer with new_pcr=%" G_GINT64_FORMAT " size %d",
       new_pcr, len);
 
-  buf = gst_buffer_new_and_alloc (M2TS_PACKET_LENGTH);
-  if (G_UNLIKELY (buf == NULL)) {
-    GST_ELEMENT_ERROR (mux, STREAM, MUX,
-        ("Failed allocating output buffer"), (NULL));
-    mux->last_flow_ret = GST_FLOW_ERROR;
-    return FALSE;
-  }
-
-  new_packet_common_init (mux, buf, data, len);
-
-  /* copies the TS data of 188 bytes to the m2ts buffer at an offset
-     of 4 bytes to leave space for writing the timestamp later */
-  memcpy (GST_BUFFER_DATA (buf) + 4, data, len);
+  mux->out_offset += M2TS_PACKET_LENGTH;
 
   if (new_pcr < 0) {
-    /* If theres no pcr in current ts packet then just add the packet
-       to the adapter for later output when we see a PCR */
+    /* If theres no pcr in current ts packet then just leave the packet
+       in the chunk for later output when we see a PCR */
     GST_LOG_OBJECT (mux, "Accumulating non-PCR packet");
-    gst_adapter_push (mux->adapter, buf);
     return TRUE;
   }
 
-  chunk_bytes = gst_adapter_available (mux->adapter);
+  chunk_bytes = packet_offset - mux->out_ready;
 
-  /* We have a new PCR, output anything in the adapter */
+  /* We have a new PCR, output everything up to it */
   if (mux->first_pcr) {
     /* We can't generate sensible timestamps for anything that might
-     * be in the adapter preceding the first PCR and will hit a divide
-     * by zero, so empty the adapter. This is probably a null op. */
-    gst_adapter_clear (mux->adapter);
-    /* Warn if we threw anything away */
+     * precede the first PCR and will hit a divide by zero, so drop it.
+     * This is probably a null op. */
     if (chunk_bytes) {
       GST_ELEMENT_WARNING (mux, STREAM, MUX,
           ("Discarding %d bytes from stream preceding first PCR",
               chunk_bytes / M2TS_PACKET_LENGTH * NORMAL_TS_PACKET_LENGTH),
           (NULL));
+      memmove (chunk + mux->out_ready, chunk + packet_offset,
+          M2TS_PACKET_LENGTH);
+      if (mux->out_keyframe == packet_offset)
+        mux->out_keyframe = mux->out_ready;
+      else if (mux->out_keyframe != -1 && mux->out_keyframe >= mux->out_ready)
+        mux->out_keyframe = -1;
+      packet_offset = mux->out_ready;
+      mux->out_offset = packet_offset + M2TS_PACKET_LENGTH;
       chunk_bytes = 0;
     }
     mux->first_pcr = FALSE;
@@ -908,11 +1405,11 @@ new_packet_m2ts (MpegTsMux * mux, guint8 * data, guint len, gint64 new_pcr)
     GST_LOG_OBJECT (mux, "Processing pending packets with ts_rate %"
         G_GUINT64_FORMAT, ts_rate);
 
-    while (1) {
+    while (mux->out_ready < packet_offset) {
       guint64 cur_pcr;
 
-      /* Loop, pulling packets of the adapter, updating their 4 byte
-       * timestamp header and pushing */
+      /* Loop over the pending packets, updating their 4 byte
+       * timestamp header */
 
       /* The header is the bottom 30 bits of the PCR, apparently not
        * encoded into base + ext as in the packets themselves, so
@@ -920,38 +1417,23 @@ new_packet_m2ts (MpegTsMux * mux, guint8 * data, guint len, gint64 new_pcr)
       cur_pcr = (mux->previous_pcr +
           gst_util_uint64_scale (pcr_bytes, CLOCK_FREQ_SCR, ts_rate));
 
-      out_buf = gst_adapter_take_buffer (mux->adapter, M2TS_PACKET_LENGTH);
-      if (G_UNLIKELY (!out_buf))
-        break;
-      gst_buffer_set_caps (out_buf, GST_PAD_CAPS (mux->srcpad));
-      GST_BUFFER_TIMESTAMP (out_buf) = MPEG_SYS_TIME_TO_GSTTIME (cur_pcr);
-
       /* Write the 4 byte timestamp value, bottom 30 bits only = PCR */
-      GST_WRITE_UINT32_BE (GST_BUFFER_DATA (out_buf), cur_pcr & 0x3FFFFFFF);
+      GST_WRITE_UINT32_BE (chunk + mux->out_ready, cur_pcr & 0x3FFFFFFF);
 
       GST_LOG_OBJECT (mux, "Outputting a packet of length %d PCR %"
           G_GUINT64_FORMAT, M2TS_PACKET_LENGTH, cur_pcr);
-      ret = gst_pad_push (mux->srcpad, out_buf);
-      if (G_UNLIKELY (ret != GST_FLOW_OK)) {
-        mux->last_flow_ret = ret;
-        return FALSE;
-      }
+      mpegtsmux_packet_ready (mux, MPEG_SYS_TIME_TO_GSTTIME (cur_pcr));
       pcr_bytes += M2TS_PACKET_LENGTH;
     }
   }
 
   /* Finally, output the passed in packet */
   /* Only write the bottom 30 bits of the PCR */
-  GST_WRITE_UINT32_BE (GST_BUFFER_DATA (buf), new_pcr & 0x3FFFFFFF);
-  GST_BUFFER_TIMESTAMP (buf) = MPEG_SYS_TIME_TO_GSTTIME (new_pcr);
+  GST_WRITE_UINT32_BE (chunk + packet_offset, new_pcr & 0x3FFFFFFF);
 
   GST_LOG_OBJECT (mux, "Outputting a packet of length %d PCR %"
       G_GUINT64_FORMAT, M2TS_PACKET_LENGTH, new_pcr);
-  ret = gst_pad_push (mux->srcpad, buf);
-  if (G_UNLIKELY (ret != GST_FLOW_OK)) {
-    mux->last_flow_ret = ret;
-    return FALSE;
-  }
+  mpegtsmux_packet_ready (mux, MPEG_SYS_TIME_TO_GSTTIME (new_pcr));
 
   mux->previous_pcr = new_pcr;
 
@@ -961,27 +1443,11 @@ new_packet_m2ts (MpegTsMux * mux, guint8 * data, guint len, gint64 new_pcr)
 static gboolean
 new_packet_normal_ts (MpegTsMux * mux, guint8 * data, guint len, gint64 new_pcr)
 {
-  GstBuffer *buf;
-  GstFlowReturn ret;
-
   /* Output a normal TS packet */
   GST_LOG_OBJECT (mux, "Outputting a packet of length %d", len);
-  buf = gst_buffer_new_and_alloc (len);
-  if (G_UNLIKELY (buf == NULL)) {
-    mux->last_flow_ret = GST_FLOW_ERROR;
-    return FALSE;
-  }
-
-  new_packet_common_init (mux, buf, data, len);
 
-  memcpy (GST_BUFFER_DATA (buf), data, len);
-  GST_BUFFER_TIMESTAMP (buf) = mux->last_ts;
-
-  ret = gst_pad_push (mux->srcpad, buf);
-  if (G_UNLIKELY (ret != GST_FLOW_OK)) {
-    mux->last_flow_ret = ret;
-    return FALSE;
-  }
+  mux->out_offset += NORMAL_TS_PACKET_LENGTH;
+  mpegtsmux_packet_ready (mux, mux->last_ts);
 
   return TRUE;
 }
@@ -989,10 +1455,12 @@ new_packet_normal_ts (MpegTsMux * mux, guint8 * data, guint len, gint64 new_pcr)
 static gboolean
 new_packet_cb (guint8 * data, guint len, void *user_data, gint64 new_pcr)
 {
-  /* Called when the TsMux has prepared a packet for output. Return FALSE
-   * on error */
+  /* Called when the TsMux has written a packet to the output chunk. Return
+   * FALSE on error */
   MpegTsMux *mux = (MpegTsMux *) user_data;
 
+  new_packet_common_init (mux, data, len);
+
   if (mux->m2ts_mode == TRUE) {
     return new_packet_m2ts (mux, data, len, new_pcr);
   }
@@ -1073,8 +1541,8 @@ mpegtsmux_change_state (GstElement * element, GstStateChange transition)
       gst_collect_pads_stop (mux->collect);
       break;
     case GST_STATE_CHANGE_READY_TO_NULL:
-      if (mux->adapter)
-        gst_adapter_clear (mux->adapter);
+      mpegtsmux_reset_output (mux);
+      mpegtsmux_reset_segments (mux);
       break;
     default:
       break;
@@ -1083,6 +1551,9 @@ mpegtsmux_change_state (GstElement * element, GstStateChange transition)
   ret = GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
 
   switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_READY:
+      mpegtsmux_reset_streams (mux);
+      break;
     default:
       break;
   }
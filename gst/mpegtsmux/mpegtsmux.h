@@ -85,7 +85,6 @@
 
 #include <gst/gst.h>
 #include <gst/base/gstcollectpads.h>
-#include <gst/base/gstadapter.h>
 
 G_BEGIN_DECLS
 
@@ -116,18 +115,60 @@ struct MpegTsMux {
 
   gboolean first;
   GstFlowReturn last_flow_ret;
-  GstAdapter *adapter;
   gint64 previous_pcr;
   gboolean m2ts_mode;
   gboolean first_pcr;
   guint pat_interval;
   guint pmt_interval;
+  guint pcr_interval;
+  guint bitrate;
 
   GstClockTime last_ts;
   gboolean is_delta;
 
   GList *streamheader;
   gboolean streamheader_sent;
+
+  /* MpegTsPadData with a queued buffer, as a min-heap on last_ts */
+  GPtrArray *heap;
+  /* MpegTsPadData that need a new queued buffer */
+  GSList *refill;
+
+  /* Number of packets per output buffer, 0 = one buffer per input buffer */
+  guint alignment;
+
+  /* Chunk the muxer writes its packets into, the output buffers are
+   * sub-buffers of it. Packets before out_start have been output, the ones
+   * between out_start and out_ready make up the current output buffer, the
+   * ones after out_ready still need a timestamp (m2ts mode). */
+  GstBuffer *out_buffer;
+  guint out_start;
+  guint out_ready;
+  guint out_offset;
+  /* Offset of the first packet of a keyframe, or -1 */
+  guint out_keyframe;
+
+  /* Current output buffer */
+  guint group_packets;
+  GstClockTime group_ts;
+  gboolean group_delta;
+
+  /* Output buffers not pushed yet */
+  GstBufferList *out_list;
+  GstBufferListIterator *out_it;
+  /* Bytes moved to the output buffers so far */
+  guint64 out_bytes;
+
+  /* Segmenting at keyframes, 0 = disabled */
+  GstClockTime segment_duration;
+  /* Split at video keyframes, or at any PCR stream buffer without video */
+  gboolean segment_video;
+  guint segment_index;
+  GstClockTime segment_start;
+  GstClockTime segment_end;
+  guint64 segment_offset;
+  /* Segment messages to post once all their data has been pushed */
+  GList *segment_msgs;
 };
 
 struct MpegTsMuxClass  {
@@ -158,6 +199,8 @@ struct MpegTsPadData {
 
   gint prog_id; /* The program id to which it is attached to (not program pid) */ 
   TsMuxProgram *prog; /* The program to which this stream belongs to */ 
+
+  gint heap_index; /* Position in the heap of the muxer or -1 */
 };
 
 GType mpegtsmux_get_type (void);
@@ -180,6 +223,9 @@ GType mpegtsmux_get_type (void);
 #define NORMAL_TS_PACKET_LENGTH 188
 #define M2TS_PACKET_LENGTH      192
 
+/* Packets per output chunk */
+#define MPEGTSMUX_CHUNK_PACKETS 512
+
 #define MAX_PROG_NUMBER	32
 #define DEFAULT_PROG_ID	0
 
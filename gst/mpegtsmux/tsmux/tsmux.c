@@ -105,11 +105,17 @@
  * 1/8 second atm */
 #define TSMUX_PCR_OFFSET (TSMUX_CLOCK_FREQ / 8)
 
-/* Times per second to write PCR */
-#define TSMUX_DEFAULT_PCR_FREQ (25)
+/* Offset in a packet of the byte holding the last bit of the PCR base,
+ * which the PCR value refers to */
+#define TSMUX_PCR_BYTE_OFFSET 10
+
+/* The null packet PID */
+#define TSMUX_NULL_PID 0x1fff
 
 static gboolean tsmux_write_pat (TsMux * mux);
 static gboolean tsmux_write_pmt (TsMux * mux, TsMuxProgram * program);
+static gboolean tsmux_write_ts_header (guint8 * buf, TsMuxPacketInfo * pi,
+    guint * payload_len_out, guint * payload_offset_out);
 
 /**
  * tsmux_new:
@@ -135,6 +141,10 @@ tsmux_new (void)
   mux->last_pat_ts = -1;
   mux->pat_interval = TSMUX_DEFAULT_PAT_INTERVAL;
 
+  mux->pcr_interval = TSMUX_DEFAULT_PCR_INTERVAL;
+  mux->bitrate = 0;
+  mux->first_pcr = -1;
+
   return mux;
 }
 
@@ -156,6 +166,27 @@ tsmux_set_write_func (TsMux * mux, TsMuxWriteFunc func, void *user_data)
   mux->write_func_data = user_data;
 }
 
+/**
+ * tsmux_set_alloc_func:
+ * @mux: a #TsMux
+ * @func: a user callback function
+ * @user_data: user data passed to @func
+ *
+ * Set the callback function and user data to be called when @mux needs memory
+ * to write the next packet to. @func must return TSMUX_PACKET_LENGTH bytes
+ * of writable memory, or NULL on error. The write function is then called
+ * with that same memory. Without an allocation function, an internal buffer
+ * is used.
+ */
+void
+tsmux_set_alloc_func (TsMux * mux, TsMuxAllocFunc func, void *user_data)
+{
+  g_return_if_fail (mux != NULL);
+
+  mux->alloc_func = func;
+  mux->alloc_func_data = user_data;
+}
+
 /**
  * tsmux_set_pat_interval:
  * @mux: a #TsMux
@@ -175,6 +206,84 @@ tsmux_set_pat_interval (TsMux * mux, guint freq)
   mux->pat_interval = freq;
 }
 
+/**
+ * tsmux_set_pcr_interval:
+ * @mux: a #TsMux
+ * @interval: the interval between PCRs
+ *
+ * Set the maximum @interval (in cycles of the 90kHz clock) between two PCRs
+ * of a program.
+ */
+void
+tsmux_set_pcr_interval (TsMux * mux, guint interval)
+{
+  g_return_if_fail (mux != NULL);
+
+  mux->pcr_interval = interval;
+}
+
+/**
+ * tsmux_get_pcr_interval:
+ * @mux: a #TsMux
+ *
+ * Get the configured PCR interval. See also tsmux_set_pcr_interval().
+ *
+ * Returns: the configured PCR interval
+ */
+guint
+tsmux_get_pcr_interval (TsMux * mux)
+{
+  g_return_val_if_fail (mux != NULL, 0);
+
+  return mux->pcr_interval;
+}
+
+/**
+ * tsmux_set_bitrate:
+ * @mux: a #TsMux
+ * @bitrate: the output bitrate in bits per second
+ *
+ * Make @mux output a constant @bitrate, by inserting null packets when the
+ * streams don't have enough data. The PCRs are then derived from the output
+ * position and written every PCR interval, on their own packets if needed.
+ * Data is never output earlier than its timestamp allows, which keeps the
+ * decoder buffers from overflowing. A @bitrate of 0 gives variable bitrate
+ * output.
+ *
+ * This also restarts the output clock, from the timestamp of the next data.
+ */
+void
+tsmux_set_bitrate (TsMux * mux, guint bitrate)
+{
+  GList *cur;
+
+  g_return_if_fail (mux != NULL);
+
+  mux->bitrate = bitrate;
+  mux->first_pcr = -1;
+  mux->n_bytes = 0;
+
+  /* The output clock restarts with the next data */
+  for (cur = mux->programs; cur; cur = cur->next)
+    ((TsMuxProgram *) cur->data)->last_pcr = -1;
+}
+
+/**
+ * tsmux_get_bitrate:
+ * @mux: a #TsMux
+ *
+ * Get the configured output bitrate. See also tsmux_set_bitrate().
+ *
+ * Returns: the output bitrate, 0 for VBR
+ */
+guint
+tsmux_get_bitrate (TsMux * mux)
+{
+  g_return_val_if_fail (mux != NULL, 0);
+
+  return mux->bitrate;
+}
+
 /**
  * tsmux_get_pat_interval:
  * @mux: a #TsMux
@@ -356,8 +465,11 @@ tsmux_get_new_pid (TsMux * mux)
 {
   g_return_val_if_fail (mux != NULL, -1);
 
-  /* FIXME: It's possible that this next PID is already taken if a 
-   * specific PID was requested earlier. We should find a free PID */
+  /* Skip the PIDs that were requested explicitly earlier */
+  while (mux->next_stream_pid < TSMUX_MAX_PIDS - 1 &&
+      mux->streams_by_pid[mux->next_stream_pid] != NULL)
+    mux->next_stream_pid++;
+
   return mux->next_stream_pid++;
 }
 
@@ -395,6 +507,7 @@ tsmux_create_stream (TsMux * mux, TsMuxStreamType stream_type, guint16 pid)
   stream = tsmux_stream_new (new_pid, stream_type);
 
   mux->streams = g_list_prepend (mux->streams, stream);
+  mux->streams_by_pid[new_pid] = stream;
   mux->nb_streams++;
 
   return stream;
@@ -412,25 +525,31 @@ tsmux_create_stream (TsMux * mux, TsMuxStreamType stream_type, guint16 pid)
 TsMuxStream *
 tsmux_find_stream (TsMux * mux, guint16 pid)
 {
-  TsMuxStream *found = NULL;
-  GList *cur;
-
   g_return_val_if_fail (mux != NULL, NULL);
 
-  for (cur = g_list_first (mux->streams); cur != NULL; cur = g_list_next (cur)) {
-    TsMuxStream *stream = (TsMuxStream *) cur->data;
+  if (G_UNLIKELY (pid >= TSMUX_MAX_PIDS))
+    return NULL;
 
-    if (tsmux_stream_get_pid (stream) == pid) {
-      found = stream;
-      break;
-    }
+  return mux->streams_by_pid[pid];
+}
+
+static gboolean
+tsmux_get_buffer (TsMux * mux)
+{
+  if (mux->alloc_func == NULL) {
+    mux->packet_buf = mux->packet_data;
+    return TRUE;
   }
-  return found;
+
+  mux->packet_buf = mux->alloc_func (mux->alloc_func_data);
+  return mux->packet_buf != NULL;
 }
 
 static gboolean
 tsmux_packet_out (TsMux * mux)
 {
+  mux->n_bytes += TSMUX_PACKET_LENGTH;
+
   if (G_UNLIKELY (mux->write_func == NULL))
     return TRUE;
 
@@ -438,6 +557,159 @@ tsmux_packet_out (TsMux * mux)
       mux->write_func_data, mux->new_pcr);
 }
 
+/* CBR mode: the PCR (27MHz) at which byte @offset of the next packet is
+ * output */
+static gint64
+tsmux_get_cbr_pcr (TsMux * mux, guint offset)
+{
+  guint64 bits = (mux->n_bytes + offset) * 8;
+
+  /* split to avoid overflows */
+  return mux->first_pcr + (bits / mux->bitrate) * TSMUX_SYS_CLOCK_FREQ +
+      (bits % mux->bitrate) * TSMUX_SYS_CLOCK_FREQ / mux->bitrate;
+}
+
+static gboolean
+tsmux_write_null_packet (TsMux * mux)
+{
+  guint8 *buf;
+
+  if (G_UNLIKELY (!tsmux_get_buffer (mux)))
+    return FALSE;
+
+  buf = mux->packet_buf;
+  buf[0] = TSMUX_SYNC_BYTE;
+  buf[1] = TSMUX_NULL_PID >> 8;
+  buf[2] = TSMUX_NULL_PID & 0xff;
+  /* payload only, continuity counter 0 */
+  buf[3] = 0x10;
+  memset (buf + TSMUX_HEADER_LENGTH, 0xff, TSMUX_PAYLOAD_LENGTH);
+
+  return tsmux_packet_out (mux);
+}
+
+/* Writes an adaptation field only packet with the PCR of @program */
+static gboolean
+tsmux_write_pcr_packet (TsMux * mux, TsMuxProgram * program)
+{
+  TsMuxPacketInfo pi = program->pcr_stream->pi;
+  guint payload_len, payload_offs;
+  gboolean res;
+
+  /* Packets without payload repeat the continuity counter of the previous
+   * packet */
+  pi.packet_count--;
+  pi.flags = TSMUX_PACKET_FLAG_ADAPTATION | TSMUX_PACKET_FLAG_WRITE_PCR;
+  pi.packet_start_unit_indicator = FALSE;
+  pi.private_data_len = 0;
+  pi.stream_avail = 0;
+  pi.pcr = tsmux_get_cbr_pcr (mux, TSMUX_PCR_BYTE_OFFSET);
+
+  if (G_UNLIKELY (!tsmux_get_buffer (mux)))
+    return FALSE;
+  if (!tsmux_write_ts_header (mux->packet_buf, &pi, &payload_len,
+          &payload_offs))
+    return FALSE;
+
+  TS_DEBUG ("PCR packet for program %d, PCR %" G_GINT64_FORMAT,
+      program->pgm_number, pi.pcr);
+
+  program->last_pcr = pi.pcr;
+  mux->new_pcr = pi.pcr;
+  res = tsmux_packet_out (mux);
+  mux->new_pcr = -1;
+
+  return res;
+}
+
+/* CBR mode: writes the PCRs that are due. If the PCR stream of a program
+ * is @stream, its PCR is put in the next packet of @stream instead, after
+ * the PCR packets of the other programs so that it matches the position of
+ * that packet. @written is set to TRUE if a packet was written */
+static gboolean
+tsmux_write_due_pcrs (TsMux * mux, TsMuxStream * stream, gboolean * written)
+{
+  gint64 interval = mux->pcr_interval * (TSMUX_SYS_CLOCK_FREQ /
+      TSMUX_CLOCK_FREQ);
+  TsMuxProgram *stream_program = NULL;
+  GList *cur;
+  gint64 pcr;
+
+  for (cur = mux->programs; cur; cur = cur->next) {
+    TsMuxProgram *program = (TsMuxProgram *) cur->data;
+
+    if (program->pcr_stream == NULL)
+      continue;
+
+    if (program->pcr_stream == stream) {
+      stream_program = program;
+      continue;
+    }
+
+    pcr = tsmux_get_cbr_pcr (mux, TSMUX_PCR_BYTE_OFFSET);
+    if (program->last_pcr != -1 && pcr - program->last_pcr < interval)
+      continue;
+
+    if (!tsmux_write_pcr_packet (mux, program))
+      return FALSE;
+    if (written)
+      *written = TRUE;
+  }
+
+  if (stream_program) {
+    pcr = tsmux_get_cbr_pcr (mux, TSMUX_PCR_BYTE_OFFSET);
+    if (stream_program->last_pcr == -1 ||
+        pcr - stream_program->last_pcr >= interval) {
+      stream->pi.flags |=
+          TSMUX_PACKET_FLAG_ADAPTATION | TSMUX_PACKET_FLAG_WRITE_PCR;
+      stream->pi.pcr = pcr;
+      stream_program->last_pcr = pcr;
+      mux->new_pcr = pcr;
+    }
+  }
+
+  return TRUE;
+}
+
+/* CBR mode: stuffs the output until the data of @stream can be sent, which
+ * is TSMUX_PCR_OFFSET before its timestamp */
+static gboolean
+tsmux_write_cbr_stuffing (TsMux * mux, TsMuxStream * stream)
+{
+  gint64 pts = tsmux_stream_get_pts (stream);
+  gint64 target;
+
+  if (pts == -1)
+    return TRUE;
+
+  target = MAX (pts - TSMUX_PCR_OFFSET, 0) *
+      (TSMUX_SYS_CLOCK_FREQ / TSMUX_CLOCK_FREQ);
+
+  if (G_UNLIKELY (mux->first_pcr == -1)) {
+    /* Start the output clock with the first data */
+    mux->first_pcr = target;
+    mux->n_bytes = 0;
+    return TRUE;
+  }
+
+  if (tsmux_get_cbr_pcr (mux, 0) > target + TSMUX_PCR_OFFSET *
+      (TSMUX_SYS_CLOCK_FREQ / TSMUX_CLOCK_FREQ)) {
+    TS_DEBUG ("Output late for PID 0x%04x, bitrate %u too low",
+        stream->pi.pid, mux->bitrate);
+  }
+
+  while (tsmux_get_cbr_pcr (mux, 0) < target) {
+    gboolean written = FALSE;
+
+    if (!tsmux_write_due_pcrs (mux, NULL, &written))
+      return FALSE;
+    if (!written && !tsmux_write_null_packet (mux))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
 /*
  * adaptation_field() {
  *   adaptation_field_length                              8 uimsbf
@@ -685,6 +957,34 @@ tsmux_write_ts_header (guint8 * buf, TsMuxPacketInfo * pi,
   return TRUE;
 }
 
+/**
+ * tsmux_write_si:
+ * @mux: a #TsMux
+ *
+ * Write the PAT and the PMTs of all the programs right away, for example at
+ * the start of a segment that has to be decodable on its own. The regular
+ * PAT/PMT intervals are not affected.
+ *
+ * Returns: TRUE if the tables could be written.
+ */
+gboolean
+tsmux_write_si (TsMux * mux)
+{
+  GList *cur;
+
+  g_return_val_if_fail (mux != NULL, FALSE);
+
+  if (!tsmux_write_pat (mux))
+    return FALSE;
+
+  for (cur = mux->programs; cur != NULL; cur = g_list_next (cur)) {
+    if (!tsmux_write_pmt (mux, (TsMuxProgram *) cur->data))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
 /**
  * tsmux_write_stream_packet:
  * @mux: a #TsMux
@@ -706,6 +1006,9 @@ tsmux_write_stream_packet (TsMux * mux, TsMuxStream * stream)
   g_return_val_if_fail (mux != NULL, FALSE);
   g_return_val_if_fail (stream != NULL, FALSE);
 
+  if (mux->bitrate && !tsmux_write_cbr_stuffing (mux, stream))
+    return FALSE;
+
   if (tsmux_stream_is_pcr (stream)) {
     gint64 cur_pcr = 0;
     gint64 cur_pts = tsmux_stream_get_pts (stream);
@@ -722,10 +1025,12 @@ tsmux_write_stream_packet (TsMux * mux, TsMuxStream * stream)
       cur_pcr = (cur_pts - TSMUX_PCR_OFFSET) *
           (TSMUX_SYS_CLOCK_FREQ / TSMUX_CLOCK_FREQ);
 
-    /* Need to decide whether to write a new PCR in this packet */
-    if (stream->last_pcr == -1 ||
-        (cur_pcr - stream->last_pcr >
-            (TSMUX_SYS_CLOCK_FREQ / TSMUX_DEFAULT_PCR_FREQ))) {
+    /* Need to decide whether to write a new PCR in this packet, in CBR
+     * mode this is done below from the output position instead */
+    if (mux->bitrate == 0 && (stream->last_pcr == -1 ||
+            (cur_pcr - stream->last_pcr >
+                mux->pcr_interval * (TSMUX_SYS_CLOCK_FREQ /
+                    TSMUX_CLOCK_FREQ)))) {
 
       stream->pi.flags |=
           TSMUX_PACKET_FLAG_ADAPTATION | TSMUX_PACKET_FLAG_WRITE_PCR;
@@ -774,6 +1079,13 @@ tsmux_write_stream_packet (TsMux * mux, TsMuxStream * stream)
     tsmux_stream_initialize_pes_packet (stream);
   pi->stream_avail = tsmux_stream_bytes_avail (stream);
 
+  /* The PAT/PMT might have been written, get the PCR for this packet */
+  if (mux->bitrate && !tsmux_write_due_pcrs (mux, stream, NULL))
+    return FALSE;
+
+  if (!tsmux_get_buffer (mux))
+    return FALSE;
+
   if (!tsmux_write_ts_header (mux->packet_buf, pi, &payload_len, &payload_offs))
     return FALSE;
 
@@ -821,6 +1133,9 @@ tsmux_write_section (TsMux * mux, TsMuxSection * section)
   payload_remain = pi->stream_avail;
 
   while (payload_remain > 0) {
+    if (G_UNLIKELY (!tsmux_get_buffer (mux)))
+      return FALSE;
+
     if (pi->packet_start_unit_indicator) {
       /* Need to write an extra single byte start pointer */
       pi->stream_avail++;
@@ -91,6 +91,7 @@ G_BEGIN_DECLS
 #define TSMUX_MAX_SECTION_LENGTH (4096)
 
 #define TSMUX_PID_AUTO ((guint16)-1)
+#define TSMUX_MAX_PIDS 0x2000
 
 #define TSMUX_START_PROGRAM_ID 0x0001
 #define TSMUX_START_PMT_PID 0x0020
@@ -100,6 +101,7 @@ typedef struct TsMuxSection TsMuxSection;
 typedef struct TsMux TsMux;
 
 typedef gboolean (*TsMuxWriteFunc) (guint8 *data, guint len, void *user_data, gint64 new_pcr);
+typedef guint8 * (*TsMuxAllocFunc) (void *user_data);
 
 struct TsMuxSection {
   TsMuxPacketInfo pi;
@@ -130,6 +132,8 @@ struct TsMuxProgram {
 struct TsMux {
   guint nb_streams;
   GList *streams;    /* TsMuxStream* array of all streams */
+  /* The same streams, indexed by PID */
+  TsMuxStream *streams_by_pid[TSMUX_MAX_PIDS];
 
   guint nb_programs;
   GList *programs;   /* TsMuxProgram* array of all programs */
@@ -147,9 +151,23 @@ struct TsMux {
   guint    pat_interval;
   gint64   last_pat_ts;
 
-  guint8 packet_buf[TSMUX_PACKET_LENGTH];
+  /* Interval between PCRs, in 90kHz ticks */
+  guint    pcr_interval;
+
+  /* Output bitrate in bits per second for CBR output, 0 for VBR. In CBR mode
+   * the PCR is derived from the number of bytes output since first_pcr */
+  guint    bitrate;
+  gint64   first_pcr;
+  guint64  n_bytes;
+
+  /* The packet being written, either packet_data or the memory returned by
+   * alloc_func */
+  guint8 *packet_buf;
+  guint8 packet_data[TSMUX_PACKET_LENGTH];
   TsMuxWriteFunc write_func;
   void *write_func_data;
+  TsMuxAllocFunc alloc_func;
+  void *alloc_func_data;
 
   /* Scratch space for writing ES_info descriptors */
   guint8 es_info_buf[TSMUX_MAX_ES_INFO_LENGTH];
@@ -162,9 +180,14 @@ void 		tsmux_free 			(TsMux *mux);
 
 /* Setting muxing session properties */
 void 		tsmux_set_write_func 		(TsMux *mux, TsMuxWriteFunc func, void *user_data);
+void 		tsmux_set_alloc_func 		(TsMux *mux, TsMuxAllocFunc func, void *user_data);
 void 		tsmux_set_pat_interval          (TsMux *mux, guint interval);
 guint 		tsmux_get_pat_interval          (TsMux *mux);
 guint16		tsmux_get_new_pid 		(TsMux *mux);
+void 		tsmux_set_pcr_interval          (TsMux *mux, guint interval);
+guint 		tsmux_get_pcr_interval          (TsMux *mux);
+void 		tsmux_set_bitrate               (TsMux *mux, guint bitrate);
+guint 		tsmux_get_bitrate               (TsMux *mux);
 
 /* pid/program management */
 TsMuxProgram *	tsmux_program_new 		(TsMux *mux);
@@ -181,6 +204,7 @@ void 		tsmux_program_set_pcr_stream 	(TsMuxProgram *program, TsMuxStream *stream
 
 /* writing stuff */
 gboolean 	tsmux_write_stream_packet 	(TsMux *mux, TsMuxStream *stream);
+gboolean 	tsmux_write_si 			(TsMux *mux);
 
 G_END_DECLS
 
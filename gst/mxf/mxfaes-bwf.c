@@ -1538,13 +1538,24 @@ mxf_bwf_get_track_number_template (MXFMetadataFileDescriptor * a,
   return (0x16 << 24) | (0x01 << 8);
 }
 
+/* The number of samples per edit unit varies with fractional rates */
+static gboolean
+mxf_bwf_is_constant_size (MXFMetadataFileDescriptor * a, GstCaps * caps,
+    gpointer mapping_data)
+{
+  BWFMappingData *md = mapping_data;
+
+  return (md->rate * md->edit_rate.d) % md->edit_rate.n == 0;
+}
+
 static MXFEssenceElementWriter mxf_bwf_essence_element_writer = {
   mxf_bwf_get_descriptor,
   mxf_bwf_update_descriptor,
   mxf_bwf_get_edit_rate,
   mxf_bwf_get_track_number_template,
   NULL,
-  {{0,}}
+  {{0,}},
+  mxf_bwf_is_constant_size
 };
 
 #define BWF_CAPS \
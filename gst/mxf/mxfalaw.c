@@ -277,13 +277,24 @@ mxf_alaw_get_track_number_template (MXFMetadataFileDescriptor * a,
   return (0x16 << 24) | (0x08 << 8);
 }
 
+/* The number of samples per edit unit varies with fractional rates */
+static gboolean
+mxf_alaw_is_constant_size (MXFMetadataFileDescriptor * a, GstCaps * caps,
+    gpointer mapping_data)
+{
+  ALawMappingData *md = mapping_data;
+
+  return (md->rate * md->edit_rate.d) % md->edit_rate.n == 0;
+}
+
 static MXFEssenceElementWriter mxf_alaw_essence_element_writer = {
   mxf_alaw_get_descriptor,
   mxf_alaw_update_descriptor,
   mxf_alaw_get_edit_rate,
   mxf_alaw_get_track_number_template,
   NULL,
-  {{0,}}
+  {{0,}},
+  mxf_alaw_is_constant_size
 };
 
 #define ALAW_CAPS \
@@ -31,7 +31,6 @@
  */
 
 /* TODO:
- *   - Seeking support: Use IndexTableSegments
  *   - Handle timecode tracks correctly (where is this documented?)
  *   - Handle drop-frame field of timecode tracks
  *   - Handle Generic container system items
@@ -110,9 +109,14 @@ enum
   PROP_0,
   PROP_PACKAGE,
   PROP_MAX_DRIFT,
-  PROP_STRUCTURE
+  PROP_STRUCTURE,
+  PROP_METADATA_THREADS,
+  PROP_GROWING_FILE
 };
 
+/* Interval for checking if a growing file has more data */
+#define GROWING_FILE_POLL_INTERVAL (200 * GST_MSECOND)
+
 static gboolean gst_mxf_demux_sink_event (GstPad * pad, GstEvent * event);
 static gboolean gst_mxf_demux_src_event (GstPad * pad, GstEvent * event);
 static const GstQueryType *gst_mxf_demux_src_query_type (GstPad * pad);
@@ -173,6 +177,32 @@ gst_mxf_demux_reset_mxf_state (GstMXFDemux * demux)
       gst_caps_unref (t->caps);
   }
   g_array_set_size (demux->essence_tracks, 0);
+
+  for (i = 0; i < demux->index_tables->len; i++) {
+    GstMXFDemuxIndexTable *t =
+        &g_array_index (demux->index_tables, GstMXFDemuxIndexTable, i);
+
+    g_array_free (t->entries, TRUE);
+  }
+  g_array_set_size (demux->index_tables, 0);
+  demux->pulled_index_tables = FALSE;
+}
+
+/* Waits until the thread pool has parsed all queued metadata sets and
+ * returns the first error, must be called without the metadata lock */
+static GstFlowReturn
+gst_mxf_demux_wait_metadata_pool (GstMXFDemux * demux)
+{
+  GstFlowReturn ret;
+
+  g_mutex_lock (demux->metadata_pool_lock);
+  while (demux->n_queued_metadata > 0)
+    g_cond_wait (demux->metadata_pool_cond, demux->metadata_pool_lock);
+  ret = demux->metadata_pool_ret;
+  demux->metadata_pool_ret = GST_FLOW_OK;
+  g_mutex_unlock (demux->metadata_pool_lock);
+
+  return ret;
 }
 
 static void
@@ -204,6 +234,8 @@ gst_mxf_demux_reset_metadata (GstMXFDemux * demux)
 {
   GST_DEBUG_OBJECT (demux, "Resetting metadata");
 
+  gst_mxf_demux_wait_metadata_pool (demux);
+
   g_static_rw_lock_writer_lock (&demux->metadata_lock);
 
   demux->update_metadata = TRUE;
@@ -218,6 +250,8 @@ gst_mxf_demux_reset_metadata (GstMXFDemux * demux)
   }
   demux->metadata = mxf_metadata_hash_table_new ();
 
+  g_ptr_array_set_size (demux->pending_descriptive_metadata, 0);
+
   g_static_rw_lock_writer_unlock (&demux->metadata_lock);
 }
 
@@ -226,10 +260,14 @@ gst_mxf_demux_reset (GstMXFDemux * demux)
 {
   GST_DEBUG_OBJECT (demux, "cleaning up MXF demuxer");
 
+  /* The queued metadata sets point to the primer packs of the partitions */
+  gst_mxf_demux_wait_metadata_pool (demux);
+
   demux->flushing = FALSE;
 
   demux->footer_partition_pack_offset = 0;
   demux->offset = 0;
+  demux->file_finished = FALSE;
 
   demux->pull_footer_metadata = TRUE;
 
@@ -253,18 +291,6 @@ gst_mxf_demux_reset (GstMXFDemux * demux)
     demux->random_index_pack = NULL;
   }
 
-  if (demux->pending_index_table_segments) {
-    GList *l;
-
-    for (l = demux->pending_index_table_segments; l; l = l->next) {
-      MXFIndexTableSegment *s = l->data;
-      mxf_index_table_segment_reset (s);
-      g_free (s);
-    }
-    g_list_free (demux->pending_index_table_segments);
-    demux->pending_index_table_segments = NULL;
-  }
-
   gst_mxf_demux_reset_mxf_state (demux);
   gst_mxf_demux_reset_metadata (demux);
 }
@@ -330,6 +356,43 @@ gst_mxf_demux_pull_range (GstMXFDemux * demux, guint64 offset,
   return ret;
 }
 
+/* Whether the end of the file is only the end of the data written so far */
+static gboolean
+gst_mxf_demux_is_growing (GstMXFDemux * demux)
+{
+  return demux->random_access && demux->growing_file && !demux->file_finished;
+}
+
+static void
+gst_mxf_demux_wait_for_data (GstMXFDemux * demux)
+{
+  GTimeVal timeout;
+
+  g_get_current_time (&timeout);
+  g_time_val_add (&timeout, GROWING_FILE_POLL_INTERVAL / GST_USECOND);
+
+  GST_LOG_OBJECT (demux, "Waiting for more data at offset %" G_GUINT64_FORMAT,
+      demux->offset);
+
+  GST_OBJECT_LOCK (demux);
+  if (!demux->growing_unblock)
+    g_cond_timed_wait (demux->growing_cond, GST_OBJECT_GET_LOCK (demux),
+        &timeout);
+  GST_OBJECT_UNLOCK (demux);
+}
+
+/* While @unblock is TRUE the streaming thread doesn't wait for more data,
+ * so that it can be paused or stopped */
+static void
+gst_mxf_demux_set_unblock (GstMXFDemux * demux, gboolean unblock)
+{
+  GST_OBJECT_LOCK (demux);
+  demux->growing_unblock = unblock;
+  if (unblock)
+    g_cond_signal (demux->growing_cond);
+  GST_OBJECT_UNLOCK (demux);
+}
+
 static gboolean
 gst_mxf_demux_push_src_event (GstMXFDemux * demux, GstEvent * event)
 {
@@ -414,8 +477,13 @@ gst_mxf_demux_handle_partition_pack (GstMXFDemux * demux, const MXFUL * key,
     partition.this_partition = demux->offset + demux->run_in;
   }
 
-  if (partition.type == MXF_PARTITION_PACK_HEADER)
+  if (partition.type == MXF_PARTITION_PACK_HEADER) {
     demux->footer_partition_pack_offset = partition.footer_partition;
+  } else if (partition.type == MXF_PARTITION_PACK_FOOTER
+      && !demux->file_finished) {
+    GST_DEBUG_OBJECT (demux, "Found footer partition, file is complete");
+    demux->file_finished = TRUE;
+  }
 
   for (l = demux->partitions; l; l = l->next) {
     GstMXFDemuxPartition *tmp = l->data;
@@ -484,6 +552,204 @@ gst_mxf_demux_handle_primer_pack (GstMXFDemux * demux, const MXFUL * key,
   return GST_FLOW_OK;
 }
 
+static void
+gst_mxf_demux_pending_metadata_free (GstMXFDemuxPendingMetadata * pending)
+{
+  gst_buffer_unref (pending->buffer);
+  g_slice_free (GstMXFDemuxPendingMetadata, pending);
+}
+
+static GstMXFDemuxPendingMetadata *
+gst_mxf_demux_pending_metadata_new (GstMXFDemux * demux, guint8 scheme,
+    guint32 type, GstBuffer * buffer)
+{
+  GstMXFDemuxPendingMetadata *pending =
+      g_slice_new (GstMXFDemuxPendingMetadata);
+
+  pending->scheme = scheme;
+  pending->type = type;
+  pending->primer = &demux->current_partition->primer;
+  pending->offset = demux->offset;
+  pending->buffer = gst_buffer_ref (buffer);
+
+  return pending;
+}
+
+/* Takes ownership of metadata, must be called with the metadata lock
+ * taken for writing */
+static GstFlowReturn
+gst_mxf_demux_add_metadata (GstMXFDemux * demux, MXFMetadataBase * metadata)
+{
+  MXFMetadataBase *old;
+
+  old = g_hash_table_lookup (demux->metadata, &metadata->instance_uid);
+
+  if (old && G_TYPE_FROM_INSTANCE (old) != G_TYPE_FROM_INSTANCE (metadata)) {
+#ifndef GST_DISABLE_GST_DEBUG
+    gchar str[48];
+#endif
+
+    GST_DEBUG_OBJECT (demux,
+        "Metadata with instance uid %s already exists and has different type '%s',"
+        " expected '%s'",
+        mxf_uuid_to_string (&metadata->instance_uid, str),
+        g_type_name (G_TYPE_FROM_INSTANCE (old)),
+        g_type_name (G_TYPE_FROM_INSTANCE (metadata)));
+    gst_mini_object_unref (GST_MINI_OBJECT (metadata));
+    return GST_FLOW_ERROR;
+  } else if (old && old->offset >= metadata->offset) {
+#ifndef GST_DISABLE_GST_DEBUG
+    gchar str[48];
+#endif
+
+    GST_DEBUG_OBJECT (demux,
+        "Metadata with instance uid %s already exists and is newer",
+        mxf_uuid_to_string (&metadata->instance_uid, str));
+    gst_mini_object_unref (GST_MINI_OBJECT (metadata));
+    return GST_FLOW_OK;
+  }
+
+  demux->update_metadata = TRUE;
+
+  if (MXF_IS_METADATA_PREFACE (metadata)) {
+    demux->preface = MXF_METADATA_PREFACE (metadata);
+  }
+
+  gst_mxf_demux_reset_linked_metadata (demux);
+
+  g_hash_table_replace (demux->metadata, &metadata->instance_uid, metadata);
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_mxf_demux_parse_metadata (GstMXFDemux * demux, guint16 type,
+    MXFPrimerPack * primer, guint64 offset, GstBuffer * buffer)
+{
+  MXFMetadata *metadata;
+  GstFlowReturn ret;
+
+  metadata = mxf_metadata_new (type, primer, offset,
+      GST_BUFFER_DATA (buffer), GST_BUFFER_SIZE (buffer));
+
+  if (!metadata) {
+    GST_WARNING_OBJECT (demux,
+        "Unknown or unhandled metadata of type 0x%04x", type);
+    return GST_FLOW_OK;
+  }
+
+  g_static_rw_lock_writer_lock (&demux->metadata_lock);
+  ret = gst_mxf_demux_add_metadata (demux, MXF_METADATA_BASE (metadata));
+  g_static_rw_lock_writer_unlock (&demux->metadata_lock);
+
+  return ret;
+}
+
+static void
+gst_mxf_demux_metadata_pool_func (GstMXFDemuxPendingMetadata * pending,
+    GstMXFDemux * demux)
+{
+  GstFlowReturn ret;
+
+  ret = gst_mxf_demux_parse_metadata (demux, pending->type, pending->primer,
+      pending->offset, pending->buffer);
+  gst_mxf_demux_pending_metadata_free (pending);
+
+  g_mutex_lock (demux->metadata_pool_lock);
+  if (ret != GST_FLOW_OK && demux->metadata_pool_ret == GST_FLOW_OK)
+    demux->metadata_pool_ret = ret;
+  demux->n_queued_metadata--;
+  if (demux->n_queued_metadata == 0)
+    g_cond_broadcast (demux->metadata_pool_cond);
+  g_mutex_unlock (demux->metadata_pool_lock);
+}
+
+/* Parses the pending descriptive metadata once a DM segment of a package
+ * refers to a DM framework that is not known yet. Must be called with the
+ * metadata lock taken for writing */
+static GstFlowReturn
+gst_mxf_demux_resolve_descriptive_metadata (GstMXFDemux * demux)
+{
+  MXFMetadataContentStorage *storage = demux->preface->content_storage;
+  GPtrArray *segments;
+  GstFlowReturn ret = GST_FLOW_OK;
+  guint i, j, k;
+
+  if (demux->pending_descriptive_metadata->len == 0)
+    return GST_FLOW_OK;
+
+  segments = g_ptr_array_new ();
+
+  for (i = 0; i < storage->n_packages; i++) {
+    MXFMetadataGenericPackage *package = storage->packages[i];
+
+    if (!package)
+      continue;
+
+    for (j = 0; j < package->n_tracks; j++) {
+      MXFMetadataTrack *track = package->tracks[j];
+      MXFMetadataSequence *sequence;
+
+      if (!track || !track->sequence)
+        continue;
+
+      sequence = track->sequence;
+      for (k = 0; k < sequence->n_structural_components; k++) {
+        MXFMetadataStructuralComponent *component =
+            sequence->structural_components[k];
+
+        if (component && MXF_IS_METADATA_DM_SEGMENT (component)
+            && !MXF_METADATA_DM_SEGMENT (component)->dm_framework)
+          g_ptr_array_add (segments, component);
+      }
+    }
+  }
+
+  if (segments->len == 0)
+    goto done;
+
+  GST_DEBUG_OBJECT (demux, "Parsing %u descriptive metadata sets",
+      demux->pending_descriptive_metadata->len);
+
+  for (i = 0; i < demux->pending_descriptive_metadata->len; i++) {
+    GstMXFDemuxPendingMetadata *pending =
+        g_ptr_array_index (demux->pending_descriptive_metadata, i);
+    MXFDescriptiveMetadata *m;
+
+    m = mxf_descriptive_metadata_new (pending->scheme, pending->type,
+        pending->primer, pending->offset, GST_BUFFER_DATA (pending->buffer),
+        GST_BUFFER_SIZE (pending->buffer));
+
+    if (!m) {
+      GST_WARNING_OBJECT (demux,
+          "Unknown or unhandled descriptive metadata of scheme 0x%02x and type 0x%06x",
+          pending->scheme, pending->type);
+      continue;
+    }
+
+    if ((ret = gst_mxf_demux_add_metadata (demux,
+                MXF_METADATA_BASE (m))) != GST_FLOW_OK)
+      break;
+  }
+  g_ptr_array_set_size (demux->pending_descriptive_metadata, 0);
+
+  if (ret != GST_FLOW_OK)
+    goto done;
+
+  for (i = 0; i < segments->len; i++) {
+    MXFMetadataBase *m = g_ptr_array_index (segments, i);
+
+    m->resolved = MXF_METADATA_BASE_RESOLVE_STATE_NONE;
+    if (!mxf_metadata_base_resolve (m, demux->metadata))
+      GST_WARNING_OBJECT (demux, "Couldn't resolve DM segment");
+  }
+
+done:
+  g_ptr_array_free (segments, TRUE);
+
+  return ret;
+}
+
 static GstFlowReturn
 gst_mxf_demux_resolve_references (GstMXFDemux * demux)
 {
@@ -493,6 +759,9 @@ gst_mxf_demux_resolve_references (GstMXFDemux * demux)
   GstStructure *structure;
   GstTagList *taglist;
 
+  if ((ret = gst_mxf_demux_wait_metadata_pool (demux)) != GST_FLOW_OK)
+    return ret;
+
   g_static_rw_lock_writer_lock (&demux->metadata_lock);
 
   GST_DEBUG_OBJECT (demux, "Resolve metadata references");
@@ -504,25 +773,30 @@ gst_mxf_demux_resolve_references (GstMXFDemux * demux)
     return GST_FLOW_ERROR;
   }
 
-  g_hash_table_iter_init (&iter, demux->metadata);
-  while (g_hash_table_iter_next (&iter, NULL, (gpointer) & m)) {
-    m->resolved = MXF_METADATA_BASE_RESOLVE_STATE_NONE;
+  if (!demux->preface) {
+    GST_ERROR_OBJECT (demux, "No preface yet");
+    ret = GST_FLOW_ERROR;
+    goto error;
   }
 
   g_hash_table_iter_init (&iter, demux->metadata);
   while (g_hash_table_iter_next (&iter, NULL, (gpointer) & m)) {
-    gboolean resolved;
-
-    resolved = mxf_metadata_base_resolve (m, demux->metadata);
+    m->resolved = MXF_METADATA_BASE_RESOLVE_STATE_NONE;
+  }
 
-    /* Resolving can fail for anything but the preface, as the preface
-     * will resolve everything required */
-    if (!resolved && MXF_IS_METADATA_PREFACE (m)) {
-      ret = GST_FLOW_ERROR;
-      goto error;
-    }
+  /* The preface resolves everything that is required, sets that are not
+   * referenced from it are never resolved */
+  if (!mxf_metadata_base_resolve (MXF_METADATA_BASE (demux->preface),
+          demux->metadata)) {
+    ret = GST_FLOW_ERROR;
+    goto error;
   }
 
+  if ((ret = gst_mxf_demux_resolve_descriptive_metadata (demux)) !=
+      GST_FLOW_OK)
+    goto error;
+
+  demux->update_metadata = FALSE;
   demux->metadata_resolved = TRUE;
 
   taglist = gst_tag_list_new ();
@@ -1211,8 +1485,6 @@ gst_mxf_demux_handle_metadata (GstMXFDemux * demux, const MXFUL * key,
     GstBuffer * buffer)
 {
   guint16 type;
-  MXFMetadata *metadata = NULL, *old = NULL;
-  GstFlowReturn ret = GST_FLOW_OK;
 
   type = GST_READ_UINT16_BE (key->u + 13);
 
@@ -1236,61 +1508,27 @@ gst_mxf_demux_handle_metadata (GstMXFDemux * demux, const MXFUL * key,
     return GST_FLOW_OK;
   }
 
-  metadata =
-      mxf_metadata_new (type, &demux->current_partition->primer, demux->offset,
-      GST_BUFFER_DATA (buffer), GST_BUFFER_SIZE (buffer));
+  if (demux->metadata_threads > 0) {
+    GstMXFDemuxPendingMetadata *pending;
 
-  if (!metadata) {
-    GST_WARNING_OBJECT (demux,
-        "Unknown or unhandled metadata of type 0x%04x", type);
-    return GST_FLOW_OK;
-  }
+    if (!demux->metadata_pool)
+      demux->metadata_pool =
+          g_thread_pool_new ((GFunc) gst_mxf_demux_metadata_pool_func, demux,
+          demux->metadata_threads, FALSE, NULL);
 
-  old =
-      g_hash_table_lookup (demux->metadata,
-      &MXF_METADATA_BASE (metadata)->instance_uid);
+    pending = gst_mxf_demux_pending_metadata_new (demux, 0, type, buffer);
 
-  if (old && G_TYPE_FROM_INSTANCE (old) != G_TYPE_FROM_INSTANCE (metadata)) {
-#ifndef GST_DISABLE_GST_DEBUG
-    gchar str[48];
-#endif
+    g_mutex_lock (demux->metadata_pool_lock);
+    demux->n_queued_metadata++;
+    g_mutex_unlock (demux->metadata_pool_lock);
 
-    GST_DEBUG_OBJECT (demux,
-        "Metadata with instance uid %s already exists and has different type '%s',"
-        " expected '%s'",
-        mxf_uuid_to_string (&MXF_METADATA_BASE (metadata)->instance_uid, str),
-        g_type_name (G_TYPE_FROM_INSTANCE (old)),
-        g_type_name (G_TYPE_FROM_INSTANCE (metadata)));
-    gst_mini_object_unref (GST_MINI_OBJECT (metadata));
-    return GST_FLOW_ERROR;
-  } else if (old
-      && MXF_METADATA_BASE (old)->offset >=
-      MXF_METADATA_BASE (metadata)->offset) {
-#ifndef GST_DISABLE_GST_DEBUG
-    gchar str[48];
-#endif
+    g_thread_pool_push (demux->metadata_pool, pending, NULL);
 
-    GST_DEBUG_OBJECT (demux,
-        "Metadata with instance uid %s already exists and is newer",
-        mxf_uuid_to_string (&MXF_METADATA_BASE (metadata)->instance_uid, str));
-    gst_mini_object_unref (GST_MINI_OBJECT (metadata));
     return GST_FLOW_OK;
   }
 
-  g_static_rw_lock_writer_lock (&demux->metadata_lock);
-  demux->update_metadata = TRUE;
-
-  if (MXF_IS_METADATA_PREFACE (metadata)) {
-    demux->preface = MXF_METADATA_PREFACE (metadata);
-  }
-
-  gst_mxf_demux_reset_linked_metadata (demux);
-
-  g_hash_table_replace (demux->metadata,
-      &MXF_METADATA_BASE (metadata)->instance_uid, metadata);
-  g_static_rw_lock_writer_unlock (&demux->metadata_lock);
-
-  return ret;
+  return gst_mxf_demux_parse_metadata (demux, type,
+      &demux->current_partition->primer, demux->offset, buffer);
 }
 
 static GstFlowReturn
@@ -1299,8 +1537,7 @@ gst_mxf_demux_handle_descriptive_metadata (GstMXFDemux * demux,
 {
   guint32 type;
   guint8 scheme;
-  GstFlowReturn ret = GST_FLOW_OK;
-  MXFDescriptiveMetadata *m = NULL, *old = NULL;
+  GstMXFDemuxPendingMetadata *pending;
 
   scheme = GST_READ_UINT8 (key->u + 12);
   type = GST_READ_UINT24_BE (key->u + 13);
@@ -1325,58 +1562,14 @@ gst_mxf_demux_handle_descriptive_metadata (GstMXFDemux * demux,
     return GST_FLOW_OK;
   }
 
-  m = mxf_descriptive_metadata_new (scheme, type,
-      &demux->current_partition->primer, demux->offset,
-      GST_BUFFER_DATA (buffer), GST_BUFFER_SIZE (buffer));
-
-  if (!m) {
-    GST_WARNING_OBJECT (demux,
-        "Unknown or unhandled descriptive metadata of scheme 0x%02x and type 0x%06x",
-        scheme, type);
-    return GST_FLOW_OK;
-  }
-
-  old =
-      g_hash_table_lookup (demux->metadata,
-      &MXF_METADATA_BASE (m)->instance_uid);
-
-  if (old && G_TYPE_FROM_INSTANCE (old) != G_TYPE_FROM_INSTANCE (m)) {
-#ifndef GST_DISABLE_GST_DEBUG
-    gchar str[48];
-#endif
-
-    GST_DEBUG_OBJECT (demux,
-        "Metadata with instance uid %s already exists and has different type '%s',"
-        " expected '%s'",
-        mxf_uuid_to_string (&MXF_METADATA_BASE (m)->instance_uid, str),
-        g_type_name (G_TYPE_FROM_INSTANCE (old)),
-        g_type_name (G_TYPE_FROM_INSTANCE (m)));
-    gst_mini_object_unref (GST_MINI_OBJECT (m));
-    return GST_FLOW_ERROR;
-  } else if (old
-      && MXF_METADATA_BASE (old)->offset >= MXF_METADATA_BASE (m)->offset) {
-#ifndef GST_DISABLE_GST_DEBUG
-    gchar str[48];
-#endif
-
-    GST_DEBUG_OBJECT (demux,
-        "Metadata with instance uid %s already exists and is newer",
-        mxf_uuid_to_string (&MXF_METADATA_BASE (m)->instance_uid, str));
-    gst_mini_object_unref (GST_MINI_OBJECT (m));
-    return GST_FLOW_OK;
-  }
+  /* Parsed only if a DM segment of the played package needs it */
+  pending = gst_mxf_demux_pending_metadata_new (demux, scheme, type, buffer);
 
   g_static_rw_lock_writer_lock (&demux->metadata_lock);
-
-  demux->update_metadata = TRUE;
-  gst_mxf_demux_reset_linked_metadata (demux);
-
-  g_hash_table_replace (demux->metadata, &MXF_METADATA_BASE (m)->instance_uid,
-      m);
-
+  g_ptr_array_add (demux->pending_descriptive_metadata, pending);
   g_static_rw_lock_writer_unlock (&demux->metadata_lock);
 
-  return ret;
+  return GST_FLOW_OK;
 }
 
 static GstFlowReturn
@@ -1498,37 +1691,258 @@ gst_mxf_demux_pad_set_component (GstMXFDemux * demux, GstMXFDemuxPad * pad,
         source_track->edit_rate.n * pad->material_track->edit_rate.d,
         source_track->edit_rate.d * pad->material_track->edit_rate.n);
 
-    if (pad->current_component_duration != -1)
-      pad->current_component_duration =
-          gst_util_uint64_scale (pad->current_component_duration,
-          source_track->edit_rate.n * pad->material_track->edit_rate.d,
-          source_track->edit_rate.d * pad->material_track->edit_rate.n);
-  } else {
-    pad->current_component_start += pad->current_component->start_position;
-  }
-  pad->current_essence_track_position = pad->current_component_start;
+    if (pad->current_component_duration != -1)
+      pad->current_component_duration =
+          gst_util_uint64_scale (pad->current_component_duration,
+          source_track->edit_rate.n * pad->material_track->edit_rate.d,
+          source_track->edit_rate.d * pad->material_track->edit_rate.n);
+  } else {
+    pad->current_component_start += pad->current_component->start_position;
+  }
+  pad->current_essence_track_position = pad->current_component_start;
+
+
+  if (!gst_caps_is_equal (GST_PAD_CAPS (pad), pad->current_essence_track->caps)) {
+    gst_pad_set_caps (GST_PAD_CAST (pad), pad->current_essence_track->caps);
+  }
+
+  if (update) {
+    if (pad->tags) {
+      if (pad->current_essence_track->tags)
+        gst_tag_list_insert (pad->tags, pad->current_essence_track->tags,
+            GST_TAG_MERGE_REPLACE);
+    } else {
+      if (pad->current_essence_track->tags)
+        pad->tags = gst_tag_list_copy (pad->current_essence_track->tags);
+    }
+  }
+
+  if (ret == GST_FLOW_UNEXPECTED) {
+    pad->current_essence_track_position += pad->current_component_duration;
+  }
+
+  return ret;
+}
+
+static GstMXFDemuxIndexTable *
+gst_mxf_demux_get_index_table (GstMXFDemux * demux, guint32 body_sid)
+{
+  guint i;
+
+  for (i = 0; i < demux->index_tables->len; i++) {
+    GstMXFDemuxIndexTable *t =
+        &g_array_index (demux->index_tables, GstMXFDemuxIndexTable, i);
+
+    if (t->body_sid == body_sid)
+      return t;
+  }
+
+  return NULL;
+}
+
+/* Whether the edit units of @table can be converted to the ones of
+ * @etrack. The index edit rate is usually the picture rate, while the
+ * edit rate of sound tracks can be their sampling rate */
+static gboolean
+gst_mxf_demux_index_table_is_usable (GstMXFDemuxIndexTable * table,
+    GstMXFDemuxEssenceTrack * etrack)
+{
+  return etrack->source_track && table->edit_rate.n > 0
+      && table->edit_rate.d > 0 && etrack->source_track->edit_rate.n > 0
+      && etrack->source_track->edit_rate.d > 0;
+}
+
+/* Converts @position in edit units of @etrack to the edit unit of @table
+ * that contains it */
+static gint64
+gst_mxf_demux_index_table_position (GstMXFDemuxIndexTable * table,
+    GstMXFDemuxEssenceTrack * etrack, gint64 position)
+{
+  MXFFraction *rate = &etrack->source_track->edit_rate;
+
+  return gst_util_uint64_scale (position,
+      (guint64) table->edit_rate.n * rate->d,
+      (guint64) table->edit_rate.d * rate->n);
+}
+
+/* Converts the edit unit @position of @table to the edit units of @etrack,
+ * giving the position of its start */
+static gint64
+gst_mxf_demux_index_table_track_position (GstMXFDemuxIndexTable * table,
+    GstMXFDemuxEssenceTrack * etrack, gint64 position)
+{
+  MXFFraction *rate = &etrack->source_track->edit_rate;
+
+  return gst_util_uint64_scale (position,
+      (guint64) rate->n * table->edit_rate.d,
+      (guint64) rate->d * table->edit_rate.n);
+}
+
+static void
+gst_mxf_demux_add_index_table_segment (GstMXFDemux * demux,
+    MXFIndexTableSegment * segment)
+{
+  GstMXFDemuxIndexTable *table;
+  guint i;
+
+  table = gst_mxf_demux_get_index_table (demux, segment->body_sid);
+  if (!table) {
+    GstMXFDemuxIndexTable t = { 0, };
+
+    t.body_sid = segment->body_sid;
+    t.index_sid = segment->index_sid;
+    t.edit_rate = segment->index_edit_rate;
+    t.entries = g_array_new (FALSE, TRUE, sizeof (GstMXFDemuxIndexEntry));
+    g_array_append_val (demux->index_tables, t);
+    table = &g_array_index (demux->index_tables, GstMXFDemuxIndexTable,
+        demux->index_tables->len - 1);
+  }
+
+  /* Constant size edit units, no entries needed. Entries of later segments
+   * that describe the same edit units take precedence */
+  if (segment->edit_unit_byte_count != 0 && segment->n_index_entries == 0) {
+    GST_DEBUG_OBJECT (demux, "Index table for body_sid %u has edit units of "
+        "%u bytes", table->body_sid, segment->edit_unit_byte_count);
+    if (table->n_entries == 0)
+      table->edit_unit_byte_count = segment->edit_unit_byte_count;
+    if (segment->index_start_position >= 0 && segment->index_duration > 0)
+      table->cbe_duration = MAX (table->cbe_duration,
+          segment->index_start_position + segment->index_duration);
+    return;
+  }
+
+  if (segment->index_start_position < 0 ||
+      segment->index_start_position + segment->n_index_entries > G_MAXINT) {
+    GST_WARNING_OBJECT (demux, "Invalid index table segment start position %"
+        G_GINT64_FORMAT, segment->index_start_position);
+    return;
+  }
+
+  GST_DEBUG_OBJECT (demux, "Adding %u index entries from %" G_GINT64_FORMAT
+      " for body_sid %u", segment->n_index_entries,
+      segment->index_start_position, table->body_sid);
+
+  table->edit_unit_byte_count = 0;
+
+  if (table->entries->len <
+      segment->index_start_position + segment->n_index_entries)
+    g_array_set_size (table->entries,
+        segment->index_start_position + segment->n_index_entries);
+
+  for (i = 0; i < segment->n_index_entries; i++) {
+    MXFIndexEntry *e = &segment->index_entries[i];
+    GstMXFDemuxIndexEntry *entry =
+        &g_array_index (table->entries, GstMXFDemuxIndexEntry,
+        segment->index_start_position + i);
+
+    if (!entry->initialized)
+      table->n_entries++;
+
+    entry->stream_offset = e->stream_offset;
+    /* Random access flag */
+    entry->keyframe = (e->flags & 0x80) != 0;
+    entry->initialized = TRUE;
+  }
+}
+
+/* Extends the durations of the essence tracks of a growing file to the edit
+ * units indexed so far and posts the new duration */
+static void
+gst_mxf_demux_update_growing_duration (GstMXFDemux * demux)
+{
+  GstClockTime duration = 0;
+  guint i;
+
+  g_static_rw_lock_writer_lock (&demux->metadata_lock);
+  for (i = 0; i < demux->essence_tracks->len; i++) {
+    GstMXFDemuxEssenceTrack *t =
+        &g_array_index (demux->essence_tracks, GstMXFDemuxEssenceTrack, i);
+    GstMXFDemuxIndexTable *table;
+    gint64 indexed;
+
+    table = gst_mxf_demux_get_index_table (demux, t->body_sid);
+    if (!table || !gst_mxf_demux_index_table_is_usable (table, t))
+      continue;
+
+    if (table->edit_unit_byte_count)
+      indexed = table->cbe_duration;
+    else
+      indexed = table->entries->len;
+    indexed = gst_mxf_demux_index_table_track_position (table, t, indexed);
+
+    if (indexed > t->duration)
+      t->duration = indexed;
+
+    if (t->duration > 0)
+      duration = MAX (duration, gst_util_uint64_scale (t->duration,
+              GST_SECOND * t->source_track->edit_rate.d,
+              t->source_track->edit_rate.n));
+  }
+  g_static_rw_lock_writer_unlock (&demux->metadata_lock);
+
+  if (duration == 0 || (demux->segment.duration != -1
+          && duration <= (GstClockTime) demux->segment.duration))
+    return;
+
+  GST_DEBUG_OBJECT (demux, "Growing file duration %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (duration));
+  gst_segment_set_duration (&demux->segment, GST_FORMAT_TIME, duration);
+  gst_element_post_message (GST_ELEMENT_CAST (demux),
+      gst_message_new_duration (GST_OBJECT_CAST (demux), GST_FORMAT_TIME,
+          duration));
+}
+
+/* Returns the edit unit of the essence element at the current offset from
+ * the index table of its essence container, or -1 */
+static gint64
+gst_mxf_demux_find_index_position (GstMXFDemux * demux,
+    GstMXFDemuxEssenceTrack * etrack)
+{
+  GstMXFDemuxPartition *p = demux->current_partition;
+  GstMXFDemuxIndexTable *table;
+  GstMXFDemuxIndexEntry *entry;
+  guint64 stream_offset;
+  guint low, high;
+
+  table = gst_mxf_demux_get_index_table (demux, etrack->body_sid);
+  if (!table || !gst_mxf_demux_index_table_is_usable (table, etrack))
+    return -1;
+
+  if (!p || p->partition.body_sid != etrack->body_sid
+      || p->essence_container_offset == 0)
+    return -1;
+
+  stream_offset = p->partition.body_offset + demux->offset - demux->run_in -
+      p->partition.this_partition - p->essence_container_offset;
 
+  if (table->edit_unit_byte_count)
+    return gst_mxf_demux_index_table_track_position (table, etrack,
+        stream_offset / table->edit_unit_byte_count);
 
-  if (!gst_caps_is_equal (GST_PAD_CAPS (pad), pad->current_essence_track->caps)) {
-    gst_pad_set_caps (GST_PAD_CAST (pad), pad->current_essence_track->caps);
-  }
+  if (table->entries->len == 0)
+    return -1;
 
-  if (update) {
-    if (pad->tags) {
-      if (pad->current_essence_track->tags)
-        gst_tag_list_insert (pad->tags, pad->current_essence_track->tags,
-            GST_TAG_MERGE_REPLACE);
-    } else {
-      if (pad->current_essence_track->tags)
-        pad->tags = gst_tag_list_copy (pad->current_essence_track->tags);
-    }
-  }
+  /* Last edit unit starting before the element */
+  low = 0;
+  high = table->entries->len - 1;
+  while (low < high) {
+    guint mid = low + (high - low + 1) / 2;
 
-  if (ret == GST_FLOW_UNEXPECTED) {
-    pad->current_essence_track_position += pad->current_component_duration;
+    entry = &g_array_index (table->entries, GstMXFDemuxIndexEntry, mid);
+    if (!entry->initialized)
+      return -1;
+
+    if (entry->stream_offset <= stream_offset)
+      low = mid;
+    else
+      high = mid - 1;
   }
 
-  return ret;
+  entry = &g_array_index (table->entries, GstMXFDemuxIndexEntry, low);
+  if (!entry->initialized || entry->stream_offset > stream_offset)
+    return -1;
+
+  return gst_mxf_demux_index_table_track_position (table, etrack, low);
 }
 
 static GstFlowReturn
@@ -1606,6 +2020,9 @@ gst_mxf_demux_handle_generic_container_essence_element (GstMXFDemux * demux,
       }
     }
 
+    if (etrack->position == -1)
+      etrack->position = gst_mxf_demux_find_index_position (demux, etrack);
+
     if (etrack->position == -1) {
       GST_WARNING_OBJECT (demux, "Essence track position not in index");
       return GST_FLOW_OK;
@@ -1658,11 +2075,14 @@ gst_mxf_demux_handle_generic_container_essence_element (GstMXFDemux * demux,
       index->offset = demux->offset - demux->run_in;
       index->keyframe = keyframe;
     } else {
-      GstMXFDemuxIndex index;
+      GstMXFDemuxIndex *index;
 
-      index.offset = demux->offset - demux->run_in;
-      index.keyframe = keyframe;
-      g_array_insert_val (etrack->offsets, etrack->position, index);
+      /* The position might come from the index table, after a gap */
+      g_array_set_size (etrack->offsets, etrack->position + 1);
+      index =
+          &g_array_index (etrack->offsets, GstMXFDemuxIndex, etrack->position);
+      index->offset = demux->offset - demux->run_in;
+      index->keyframe = keyframe;
     }
   }
 
@@ -1790,13 +2210,13 @@ gst_mxf_demux_handle_generic_container_essence_element (GstMXFDemux * demux,
         if (ret != GST_FLOW_OK && ret != GST_FLOW_UNEXPECTED) {
           GST_ERROR_OBJECT (demux, "Switching component failed");
         }
-      } else if (etrack->duration > 0
+      } else if (etrack->duration > 0 && !gst_mxf_demux_is_growing (demux)
           && pad->current_essence_track_position >= etrack->duration) {
         GST_DEBUG_OBJECT (demux,
             "Current component position after end of essence track");
         ret = GST_FLOW_UNEXPECTED;
       }
-    } else if (etrack->duration > 0
+    } else if (etrack->duration > 0 && !gst_mxf_demux_is_growing (demux)
         && pad->current_essence_track_position == etrack->duration) {
       GST_DEBUG_OBJECT (demux, "At the end of the essence track");
       ret = GST_FLOW_UNEXPECTED;
@@ -1916,24 +2336,28 @@ gst_mxf_demux_handle_index_table_segment (GstMXFDemux * demux,
           GST_BUFFER_SIZE (buffer))) {
 
     GST_ERROR_OBJECT (demux, "Parsing index table segment failed");
+    g_free (segment);
     return GST_FLOW_ERROR;
   }
 
-  demux->pending_index_table_segments =
-      g_list_prepend (demux->pending_index_table_segments, segment);
+  gst_mxf_demux_add_index_table_segment (demux, segment);
+  mxf_index_table_segment_reset (segment);
+  g_free (segment);
 
+  if (gst_mxf_demux_is_growing (demux))
+    gst_mxf_demux_update_growing_duration (demux);
 
   return GST_FLOW_OK;
 }
 
+/* Pulls the key and the length of the KLV packet at @offset, @data_offset is
+ * set to the offset of the value from @offset */
 static GstFlowReturn
-gst_mxf_demux_pull_klv_packet (GstMXFDemux * demux, guint64 offset, MXFUL * key,
-    GstBuffer ** outbuf, guint * read)
+gst_mxf_demux_pull_klv_header (GstMXFDemux * demux, guint64 offset,
+    MXFUL * key, guint * data_offset, guint64 * length)
 {
   GstBuffer *buffer = NULL;
   const guint8 *data;
-  guint64 data_offset = 0;
-  guint64 length;
   GstFlowReturn ret = GST_FLOW_OK;
 
   memset (key, 0, sizeof (MXFUL));
@@ -1949,12 +2373,12 @@ gst_mxf_demux_pull_klv_packet (GstMXFDemux * demux, guint64 offset, MXFUL * key,
 
   /* Decode BER encoded packet length */
   if ((data[16] & 0x80) == 0) {
-    length = data[16];
-    data_offset = 17;
+    *length = data[16];
+    *data_offset = 17;
   } else {
     guint slen = data[16] & 0x7f;
 
-    data_offset = 16 + 1 + slen;
+    *data_offset = 16 + 1 + slen;
 
     gst_buffer_unref (buffer);
     buffer = NULL;
@@ -1972,16 +2396,33 @@ gst_mxf_demux_pull_klv_packet (GstMXFDemux * demux, guint64 offset, MXFUL * key,
       goto beach;
     data = GST_BUFFER_DATA (buffer);
 
-    length = 0;
+    *length = 0;
     while (slen) {
-      length = (length << 8) | *data;
+      *length = (*length << 8) | *data;
       data++;
       slen--;
     }
   }
 
-  gst_buffer_unref (buffer);
-  buffer = NULL;
+beach:
+  if (buffer)
+    gst_buffer_unref (buffer);
+
+  return ret;
+}
+
+static GstFlowReturn
+gst_mxf_demux_pull_klv_packet (GstMXFDemux * demux, guint64 offset, MXFUL * key,
+    GstBuffer ** outbuf, guint * read)
+{
+  GstBuffer *buffer = NULL;
+  guint data_offset = 0;
+  guint64 length;
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  if ((ret = gst_mxf_demux_pull_klv_header (demux, offset, key, &data_offset,
+              &length)) != GST_FLOW_OK)
+    goto beach;
 
   /* GStreamer's buffer sizes are stored in a guint so we
    * limit ourself to G_MAXUINT large buffers */
@@ -2075,6 +2516,323 @@ gst_mxf_demux_pull_random_index_pack (GstMXFDemux * demux)
   demux->offset = old_offset;
 }
 
+/* Skips the fill packets starting at @offset */
+static GstFlowReturn
+gst_mxf_demux_pull_skip_fill (GstMXFDemux * demux, guint64 * offset)
+{
+  GstFlowReturn ret;
+  guint data_offset;
+  guint64 length;
+  MXFUL key;
+
+  while ((ret = gst_mxf_demux_pull_klv_header (demux, *offset, &key,
+              &data_offset, &length)) == GST_FLOW_OK && mxf_is_fill (&key))
+    *offset += data_offset + length;
+
+  return ret;
+}
+
+/* Pulls what's needed from the partition @p without going through its
+ * header metadata: the partition pack if it's only known from the random
+ * index pack, the index table segments if @index is TRUE and the offset of
+ * the essence container */
+static GstFlowReturn
+gst_mxf_demux_pull_partition (GstMXFDemux * demux, GstMXFDemuxPartition * p,
+    gboolean index)
+{
+  GstMXFDemuxPartition *old_partition = demux->current_partition;
+  guint64 old_offset = demux->offset;
+  GstBuffer *buffer = NULL;
+  GstFlowReturn ret;
+  guint64 offset, end;
+  guint read = 0;
+  MXFUL key;
+
+  offset = demux->run_in + p->partition.this_partition;
+
+  ret = gst_mxf_demux_pull_klv_packet (demux, offset, &key, &buffer, &read);
+  if (ret != GST_FLOW_OK)
+    goto out;
+
+  if (!mxf_is_partition_pack (&key)) {
+    GST_WARNING_OBJECT (demux, "No partition pack at offset %"
+        G_GUINT64_FORMAT, offset);
+    ret = GST_FLOW_ERROR;
+    goto out;
+  }
+
+  if (p->partition.major_version == 0) {
+    demux->offset = offset;
+    if ((ret = gst_mxf_demux_handle_partition_pack (demux, &key,
+                buffer)) != GST_FLOW_OK)
+      goto out;
+  }
+  demux->current_partition = p;
+  offset += read;
+
+  /* The header metadata starts with the primer pack, after the fill */
+  if (p->partition.header_byte_count > 0) {
+    if ((ret = gst_mxf_demux_pull_skip_fill (demux, &offset)) != GST_FLOW_OK)
+      goto out;
+    offset += p->partition.header_byte_count;
+  }
+
+  if (p->partition.index_byte_count > 0) {
+    if ((ret = gst_mxf_demux_pull_skip_fill (demux, &offset)) != GST_FLOW_OK)
+      goto out;
+
+    end = offset + p->partition.index_byte_count;
+    while (index && offset < end) {
+      gst_buffer_unref (buffer);
+      buffer = NULL;
+
+      ret = gst_mxf_demux_pull_klv_packet (demux, offset, &key, &buffer,
+          &read);
+      if (ret != GST_FLOW_OK)
+        goto out;
+
+      if (mxf_is_index_table_segment (&key)) {
+        demux->offset = offset;
+        gst_mxf_demux_handle_index_table_segment (demux, &key, buffer);
+      }
+      offset += read;
+    }
+    offset = end;
+  }
+
+  if (p->partition.body_sid != 0 && p->essence_container_offset == 0) {
+    if ((ret = gst_mxf_demux_pull_skip_fill (demux, &offset)) != GST_FLOW_OK)
+      goto out;
+    p->essence_container_offset =
+        offset - demux->run_in - p->partition.this_partition;
+  }
+
+out:
+  if (buffer)
+    gst_buffer_unref (buffer);
+
+  demux->offset = old_offset;
+  demux->current_partition = old_partition;
+
+  return ret;
+}
+
+/* Whether the index tables cover all the essence tracks */
+static gboolean
+gst_mxf_demux_index_tables_are_complete (GstMXFDemux * demux)
+{
+  guint i;
+
+  if (demux->essence_tracks->len == 0)
+    return FALSE;
+
+  for (i = 0; i < demux->essence_tracks->len; i++) {
+    GstMXFDemuxEssenceTrack *t =
+        &g_array_index (demux->essence_tracks, GstMXFDemuxEssenceTrack, i);
+    GstMXFDemuxIndexTable *table;
+
+    table = gst_mxf_demux_get_index_table (demux, t->body_sid);
+    if (!table)
+      return FALSE;
+    if (table->edit_unit_byte_count ||
+        !gst_mxf_demux_index_table_is_usable (table, t))
+      continue;
+    /* the content package of the last edit unit of the track */
+    if (t->duration <= 0 || table->entries->len <=
+        gst_mxf_demux_index_table_position (table, t, t->duration - 1) ||
+        table->n_entries != table->entries->len)
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Pulls the index table segments of the partitions until they cover all the
+ * essence tracks. Complete files usually have the full index in the footer
+ * partition, so start with the last one */
+static void
+gst_mxf_demux_pull_index_tables (GstMXFDemux * demux)
+{
+  GList *l;
+  guint i;
+
+  if (demux->pulled_index_tables)
+    return;
+  demux->pulled_index_tables = TRUE;
+
+  /* The footer partition might be unknown without random index pack */
+  if (demux->footer_partition_pack_offset != 0) {
+    GstMXFDemuxPartition *p = NULL;
+
+    for (l = demux->partitions; l; l = l->next) {
+      GstMXFDemuxPartition *tmp = l->data;
+
+      if (tmp->partition.this_partition == demux->footer_partition_pack_offset) {
+        p = tmp;
+        break;
+      }
+    }
+
+    if (!p) {
+      p = g_new0 (GstMXFDemuxPartition, 1);
+      p->partition.this_partition = demux->footer_partition_pack_offset;
+      demux->partitions =
+          g_list_insert_sorted (demux->partitions, p,
+          (GCompareFunc) gst_mxf_demux_partition_compare);
+    }
+  }
+
+  for (l = g_list_last (demux->partitions); l; l = l->prev) {
+    GstMXFDemuxPartition *p = l->data;
+
+    /* Partition packs only known from the random index pack are pulled */
+    if (p->partition.major_version != 0 && p->partition.index_byte_count == 0)
+      continue;
+
+    GST_DEBUG_OBJECT (demux, "Pulling index table segments of partition at "
+        "offset %" G_GUINT64_FORMAT, p->partition.this_partition);
+    if (gst_mxf_demux_pull_partition (demux, p, TRUE) != GST_FLOW_OK) {
+      GST_WARNING_OBJECT (demux, "Failed pulling partition");
+      continue;
+    }
+
+    if (gst_mxf_demux_index_tables_are_complete (demux))
+      break;
+  }
+
+  /* Complete index tables give the duration of the essence tracks */
+  for (i = 0; i < demux->essence_tracks->len; i++) {
+    GstMXFDemuxEssenceTrack *t =
+        &g_array_index (demux->essence_tracks, GstMXFDemuxEssenceTrack, i);
+    GstMXFDemuxIndexTable *table;
+
+    table = gst_mxf_demux_get_index_table (demux, t->body_sid);
+    if (t->duration > 0 || !table || table->entries->len == 0 ||
+        table->n_entries != table->entries->len ||
+        !gst_mxf_demux_index_table_is_usable (table, t))
+      continue;
+
+    t->duration = gst_mxf_demux_index_table_track_position (table, t,
+        table->entries->len);
+    GST_DEBUG_OBJECT (demux, "Duration of track %u from the index table: %"
+        G_GINT64_FORMAT, t->track_id, t->duration);
+  }
+}
+
+/* Returns the offset of @stream_offset in the essence container of @body_sid,
+ * binary searching the partitions by their body offset. The partition packs
+ * only known from the random index pack are pulled on the way */
+static guint64
+gst_mxf_demux_find_stream_offset (GstMXFDemux * demux, guint32 body_sid,
+    guint64 stream_offset)
+{
+  GstMXFDemuxPartition *p = NULL;
+  GPtrArray *partitions;
+  gint low, high;
+  GList *l;
+
+  partitions = g_ptr_array_new ();
+  for (l = demux->partitions; l; l = l->next) {
+    GstMXFDemuxPartition *tmp = l->data;
+
+    if (tmp->partition.body_sid == body_sid)
+      g_ptr_array_add (partitions, tmp);
+  }
+
+  low = 0;
+  high = partitions->len - 1;
+  while (low <= high) {
+    gint mid = low + (high - low) / 2;
+    GstMXFDemuxPartition *tmp = g_ptr_array_index (partitions, mid);
+
+    if (tmp->partition.major_version == 0 &&
+        gst_mxf_demux_pull_partition (demux, tmp, FALSE) != GST_FLOW_OK)
+      break;
+
+    if (tmp->partition.body_offset <= stream_offset) {
+      p = tmp;
+      low = mid + 1;
+    } else {
+      high = mid - 1;
+    }
+  }
+  g_ptr_array_free (partitions, TRUE);
+
+  if (!p)
+    return -1;
+
+  if (p->essence_container_offset == 0 &&
+      gst_mxf_demux_pull_partition (demux, p, FALSE) != GST_FLOW_OK)
+    return -1;
+
+  return p->partition.this_partition + p->essence_container_offset +
+      stream_offset - p->partition.body_offset;
+}
+
+/* Looks up the content package of the edit unit @position of @etrack in
+ * the index table and sets @position to the start of it. If @keyframe is
+ * TRUE it is moved back to the previous keyframe as decoding of long-GOP
+ * essence can only start there */
+static guint64
+gst_mxf_demux_find_index_entry (GstMXFDemux * demux,
+    GstMXFDemuxEssenceTrack * etrack, gint64 * position, gboolean keyframe)
+{
+  GstMXFDemuxIndexTable *table;
+  GstMXFDemuxIndexEntry *entry;
+  guint64 stream_offset, offset;
+  gint64 pos;
+
+  table = gst_mxf_demux_get_index_table (demux, etrack->body_sid);
+  if (!table || !gst_mxf_demux_index_table_is_usable (table, etrack))
+    return -1;
+
+  if (etrack->duration > 0 && *position >= etrack->duration)
+    return -1;
+
+  /* The content package of the position */
+  pos = gst_mxf_demux_index_table_position (table, etrack, *position);
+
+  if (table->edit_unit_byte_count) {
+    stream_offset = pos * table->edit_unit_byte_count;
+  } else {
+    gint64 k;
+
+    if (pos >= table->entries->len)
+      return -1;
+
+    entry = &g_array_index (table->entries, GstMXFDemuxIndexEntry, pos);
+    if (!entry->initialized)
+      return -1;
+
+    /* Without any keyframe flagged, everything is a keyframe */
+    for (k = pos; keyframe && k >= 0; k--) {
+      GstMXFDemuxIndexEntry *e =
+          &g_array_index (table->entries, GstMXFDemuxIndexEntry, k);
+
+      if (!e->initialized)
+        break;
+      if (e->keyframe) {
+        pos = k;
+        entry = e;
+        break;
+      }
+    }
+
+    stream_offset = entry->stream_offset;
+  }
+
+  offset = gst_mxf_demux_find_stream_offset (demux, etrack->body_sid,
+      stream_offset);
+  if (offset == -1)
+    return -1;
+
+  GST_DEBUG_OBJECT (demux, "Found edit unit %" G_GINT64_FORMAT
+      " in the index table at offset %" G_GUINT64_FORMAT, pos, offset);
+
+  *position = gst_mxf_demux_index_table_track_position (table, etrack, pos);
+  return offset;
+}
+
 static void
 gst_mxf_demux_parse_footer_metadata (GstMXFDemux * demux)
 {
@@ -2251,6 +3009,18 @@ gst_mxf_demux_handle_klv_packet (GstMXFDemux * demux, const MXFUL * key,
 #endif
   GstFlowReturn ret = GST_FLOW_OK;
 
+  /* Wait for the thread pool once the header metadata is complete */
+  if (demux->metadata_pool && demux->current_partition
+      && (demux->offset >=
+          demux->run_in + demux->current_partition->primer.offset +
+          demux->current_partition->partition.header_byte_count ||
+          mxf_is_generic_container_system_item (key) ||
+          mxf_is_generic_container_essence_element (key) ||
+          mxf_is_avid_essence_container_essence_element (key))) {
+    if ((ret = gst_mxf_demux_wait_metadata_pool (demux)) != GST_FLOW_OK)
+      goto beach;
+  }
+
   if (demux->update_metadata
       && demux->preface
       && (demux->offset >=
@@ -2385,6 +3155,18 @@ gst_mxf_demux_find_essence_element (GstMXFDemux * demux,
       " of track %u with body_sid %u (keyframe %d)", *position,
       etrack->track_number, etrack->body_sid, keyframe);
 
+  /* Use the index table segments if there are some, without having to go
+   * through the essence */
+  if (demux->random_access) {
+    guint64 offset;
+
+    gst_mxf_demux_pull_index_tables (demux);
+    offset = gst_mxf_demux_find_index_entry (demux, etrack, position,
+        keyframe);
+    if (offset != -1)
+      return offset;
+  }
+
 from_index:
 
   if (etrack->duration > 0 && *position >= etrack->duration) {
@@ -2563,6 +3345,13 @@ gst_mxf_demux_pull_and_handle_klv_packet (GstMXFDemux * demux)
       gst_mxf_demux_pull_klv_packet (demux, demux->offset, &key, &buffer,
       &read);
 
+  /* Retry at the same offset once more data is written */
+  if (ret == GST_FLOW_UNEXPECTED && gst_mxf_demux_is_growing (demux)) {
+    gst_mxf_demux_wait_for_data (demux);
+    ret = GST_FLOW_OK;
+    goto beach;
+  }
+
   if (ret == GST_FLOW_UNEXPECTED && demux->src->len > 0) {
     guint i;
     GstMXFDemuxPad *p = NULL;
@@ -2709,6 +3498,12 @@ gst_mxf_demux_loop (GstPad * pad)
       gst_buffer_unref (buffer);
     }
 
+    if (ret == GST_FLOW_UNEXPECTED && gst_mxf_demux_is_growing (demux)) {
+      gst_mxf_demux_wait_for_data (demux);
+      gst_object_unref (demux);
+      return;
+    }
+
     if (G_UNLIKELY (ret != GST_FLOW_OK))
       goto pause;
 
@@ -3213,6 +4008,8 @@ gst_mxf_demux_seek_pull (GstMXFDemux * demux, GstEvent * event)
   flush = ! !(flags & GST_SEEK_FLAG_FLUSH);
   keyframe = ! !(flags & GST_SEEK_FLAG_KEY_UNIT);
 
+  gst_mxf_demux_set_unblock (demux, TRUE);
+
   if (flush) {
     GstEvent *e;
 
@@ -3230,6 +4027,8 @@ gst_mxf_demux_seek_pull (GstMXFDemux * demux, GstEvent * event)
   /* Take the stream lock */
   GST_PAD_STREAM_LOCK (demux->sinkpad);
 
+  gst_mxf_demux_set_unblock (demux, FALSE);
+
   if (flush) {
     GstEvent *e;
 
@@ -3284,11 +4083,11 @@ gst_mxf_demux_seek_pull (GstMXFDemux * demux, GstEvent * event)
       } else {
         new_offset = MIN (off, new_offset);
         if (position != p->current_essence_track_position) {
-          p->last_flow -=
+          p->last_stop -=
               gst_util_uint64_scale (p->current_essence_track_position -
               position,
               GST_SECOND * p->current_essence_track->source_track->edit_rate.d,
-              p->current_essence_track->source_track->edit_rate.d);
+              p->current_essence_track->source_track->edit_rate.n);
         }
         p->current_essence_track_position = position;
       }
@@ -3498,6 +4297,12 @@ gst_mxf_demux_src_query (GstPad * pad, GstQuery * query)
       }
       g_static_rw_lock_reader_unlock (&demux->metadata_lock);
 
+      /* The metadata of growing files is usually not up to date */
+      if (format == GST_FORMAT_TIME && gst_mxf_demux_is_growing (demux)
+          && demux->segment.duration != -1
+          && demux->segment.duration > duration)
+        duration = demux->segment.duration;
+
       GST_DEBUG_OBJECT (pad,
           "Returning duration %" G_GINT64_FORMAT " in format %s", duration,
           gst_format_get_name (format));
@@ -3584,10 +4389,12 @@ gst_mxf_demux_sink_activate_pull (GstPad * sinkpad, gboolean active)
 
   if (active) {
     demux->random_access = TRUE;
+    gst_mxf_demux_set_unblock (demux, FALSE);
     gst_object_unref (demux);
     return gst_pad_start_task (sinkpad, (GstTaskFunction) gst_mxf_demux_loop,
         sinkpad);
   } else {
+    gst_mxf_demux_set_unblock (demux, TRUE);
     demux->random_access = FALSE;
     gst_object_unref (demux);
     return gst_pad_stop_task (sinkpad);
@@ -3781,6 +4588,10 @@ gst_mxf_demux_query (GstElement * element, GstQuery * query)
       }
       g_static_rw_lock_reader_unlock (&demux->metadata_lock);
 
+      if (gst_mxf_demux_is_growing (demux) && demux->segment.duration != -1
+          && demux->segment.duration > duration)
+        duration = demux->segment.duration;
+
       if (duration == -1) {
         GST_DEBUG_OBJECT (demux, "No duration known (yet)");
         goto done;
@@ -3881,6 +4692,15 @@ gst_mxf_demux_set_property (GObject * object, guint prop_id,
     case PROP_MAX_DRIFT:
       demux->max_drift = g_value_get_uint64 (value);
       break;
+    case PROP_METADATA_THREADS:
+      demux->metadata_threads = g_value_get_uint (value);
+      if (demux->metadata_pool && demux->metadata_threads > 0)
+        g_thread_pool_set_max_threads (demux->metadata_pool,
+            demux->metadata_threads, NULL);
+      break;
+    case PROP_GROWING_FILE:
+      demux->growing_file = g_value_get_boolean (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -3900,6 +4720,12 @@ gst_mxf_demux_get_property (GObject * object, guint prop_id,
     case PROP_MAX_DRIFT:
       g_value_set_uint64 (value, demux->max_drift);
       break;
+    case PROP_METADATA_THREADS:
+      g_value_set_uint (value, demux->metadata_threads);
+      break;
+    case PROP_GROWING_FILE:
+      g_value_set_boolean (value, demux->growing_file);
+      break;
     case PROP_STRUCTURE:{
       GstStructure *s;
 
@@ -3930,6 +4756,11 @@ gst_mxf_demux_finalize (GObject * object)
 
   gst_mxf_demux_reset (demux);
 
+  if (demux->metadata_pool) {
+    g_thread_pool_free (demux->metadata_pool, FALSE, TRUE);
+    demux->metadata_pool = NULL;
+  }
+
   if (demux->adapter) {
     g_object_unref (demux->adapter);
     demux->adapter = NULL;
@@ -3949,10 +4780,16 @@ gst_mxf_demux_finalize (GObject * object)
   demux->src = NULL;
   g_array_free (demux->essence_tracks, TRUE);
   demux->essence_tracks = NULL;
+  g_array_free (demux->index_tables, TRUE);
+  demux->index_tables = NULL;
 
   g_hash_table_destroy (demux->metadata);
+  g_ptr_array_free (demux->pending_descriptive_metadata, TRUE);
 
   g_static_rw_lock_free (&demux->metadata_lock);
+  g_mutex_free (demux->metadata_pool_lock);
+  g_cond_free (demux->metadata_pool_cond);
+  g_cond_free (demux->growing_cond);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -3999,6 +4836,18 @@ gst_mxf_demux_class_init (GstMXFDemuxClass * klass)
           "Structural metadata of the MXF file",
           GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_METADATA_THREADS,
+      g_param_spec_uint ("metadata-threads", "Metadata threads",
+          "Number of threads used for parsing header metadata sets "
+          "(0 = parse in the streaming thread)", 0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_GROWING_FILE,
+      g_param_spec_boolean ("growing-file", "Growing file",
+          "Wait for more data at the end of files without footer partition, "
+          "which are still being written (pull mode only)", FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   gstelement_class->change_state =
       GST_DEBUG_FUNCPTR (gst_mxf_demux_change_state);
   gstelement_class->query = GST_DEBUG_FUNCPTR (gst_mxf_demux_query);
@@ -4029,10 +4878,18 @@ gst_mxf_demux_init (GstMXFDemux * demux, GstMXFDemuxClass * g_class)
 
   demux->adapter = gst_adapter_new ();
   g_static_rw_lock_init (&demux->metadata_lock);
+  demux->metadata_pool_lock = g_mutex_new ();
+  demux->metadata_pool_cond = g_cond_new ();
+  demux->growing_cond = g_cond_new ();
+  demux->pending_descriptive_metadata =
+      g_ptr_array_new_with_free_func ((GDestroyNotify)
+      gst_mxf_demux_pending_metadata_free);
 
   demux->src = g_ptr_array_new ();
   demux->essence_tracks =
       g_array_new (FALSE, FALSE, sizeof (GstMXFDemuxEssenceTrack));
+  demux->index_tables =
+      g_array_new (FALSE, FALSE, sizeof (GstMXFDemuxIndexTable));
 
   gst_segment_init (&demux->segment, GST_FORMAT_TIME);
 
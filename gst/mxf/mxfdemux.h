@@ -61,6 +61,39 @@ typedef struct
   gboolean keyframe;
 } GstMXFDemuxIndex;
 
+typedef struct
+{
+  guint64 stream_offset;
+  gboolean keyframe;
+  gboolean initialized;
+} GstMXFDemuxIndexEntry;
+
+/* Edit units of an essence container, built from its index table segments */
+typedef struct
+{
+  guint32 body_sid;
+  guint32 index_sid;
+  MXFFraction edit_rate;
+
+  /* Offsets in the essence container, either computed from a constant edit
+   * unit size or looked up in the entries */
+  guint32 edit_unit_byte_count;
+  gint64 cbe_duration;          /* edit units of the constant size segments */
+  GArray *entries;
+  guint n_entries;              /* initialized entries */
+} GstMXFDemuxIndexTable;
+
+/* Metadata set that is parsed later, either by the thread pool or, for
+ * descriptive metadata, once a DM segment refers to it */
+typedef struct
+{
+  guint8 scheme;
+  guint32 type;
+  MXFPrimerPack *primer;
+  guint64 offset;
+  GstBuffer *buffer;
+} GstMXFDemuxPendingMetadata;
+
 typedef struct
 {
   guint32 body_sid;
@@ -149,10 +182,16 @@ struct _GstMXFDemux
   GstMXFDemuxPartition *current_partition;
 
   GArray *essence_tracks;
-  GList *pending_index_table_segments;
+  GArray *index_tables;
+  gboolean pulled_index_tables;
 
   GArray *random_index_pack;
 
+  /* Growing file */
+  gboolean file_finished;
+  GCond *growing_cond;          /* Interrupts waiting for more data */
+  gboolean growing_unblock;     /* Protected by the object lock */
+
   /* Metadata */
   GStaticRWLock metadata_lock;
   gboolean update_metadata;
@@ -161,6 +200,14 @@ struct _GstMXFDemux
   gboolean metadata_resolved;
   MXFMetadataPreface *preface;
   GHashTable *metadata;
+  GPtrArray *pending_descriptive_metadata;
+
+  /* Header metadata sets parsed by the thread pool */
+  GThreadPool *metadata_pool;
+  GMutex *metadata_pool_lock;   /* Protects the two fields below */
+  GCond *metadata_pool_cond;    /* Signals that all queued sets are parsed */
+  guint n_queued_metadata;
+  GstFlowReturn metadata_pool_ret;
 
   MXFUMID current_package_uid;
   MXFMetadataGenericPackage *current_package;
@@ -169,6 +216,8 @@ struct _GstMXFDemux
   /* Properties */
   gchar *requested_package_string;
   GstClockTime max_drift;
+  guint metadata_threads;
+  gboolean growing_file;
 };
 
 struct _GstMXFDemuxClass
@@ -213,13 +213,21 @@ mxf_dv_dif_get_track_number_template (MXFMetadataFileDescriptor * a,
   return (0x18 << 24) | (0x01 << 8);
 }
 
+static gboolean
+mxf_dv_dif_is_constant_size (MXFMetadataFileDescriptor * a, GstCaps * caps,
+    gpointer mapping_data)
+{
+  return TRUE;
+}
+
 static MXFEssenceElementWriter mxf_dv_dif_essence_element_writer = {
   mxf_dv_dif_get_descriptor,
   mxf_dv_dif_update_descriptor,
   mxf_dv_dif_get_edit_rate,
   mxf_dv_dif_get_track_number_template,
   NULL,
-  {{0,}}
+  {{0,}},
+  mxf_dv_dif_is_constant_size
 };
 
 void
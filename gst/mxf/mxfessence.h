@@ -42,6 +42,8 @@ typedef struct {
    guint32 (*get_track_number_template) (MXFMetadataFileDescriptor *a, GstCaps *caps, gpointer mapping_data);
    const GstPadTemplate *pad_template;
    MXFUL data_definition;
+   /* Optional, whether all edit units have the same size. Called after get_edit_rate */
+   gboolean (*is_constant_size) (MXFMetadataFileDescriptor *a, GstCaps *caps, gpointer mapping_data);
 } MXFEssenceElementWriter;
 
 void mxf_essence_element_handler_register (const MXFEssenceElementHandler *handler);
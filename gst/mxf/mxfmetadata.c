@@ -3701,11 +3701,10 @@ mxf_metadata_dm_segment_resolve (MXFMetadataBase * m, GHashTable * metadata)
       return FALSE;
     }
   } else {
-    GST_ERROR ("Couldn't find DM framework");
-    return FALSE;
+    /* Descriptive metadata might not be parsed yet */
+    GST_DEBUG ("Couldn't find DM framework");
   }
 
-
   return
       MXF_METADATA_BASE_CLASS (mxf_metadata_dm_segment_parent_class)->resolve
       (m, metadata);
@@ -52,9 +52,15 @@ static GstStaticPadTemplate src_templ = GST_STATIC_PAD_TEMPLATE ("src",
     GST_STATIC_CAPS ("application/mxf")
     );
 
+#define DEFAULT_PARTITION_INTERVAL (10 * GST_SECOND)
+
+/* Index entries that fit into the 16 bit length of the local tag */
+#define MAX_INDEX_ENTRIES ((G_MAXUINT16 - 8) / 11)
+
 enum
 {
-  PROP_0
+  PROP_0,
+  PROP_PARTITION_INTERVAL
 };
 
 GST_BOILERPLATE (GstMXFMux, gst_mxf_mux, GstElement, GST_TYPE_ELEMENT);
@@ -128,6 +134,13 @@ gst_mxf_mux_class_init (GstMXFMuxClass * klass)
   gobject_class->set_property = gst_mxf_mux_set_property;
   gobject_class->get_property = gst_mxf_mux_get_property;
 
+  g_object_class_install_property (gobject_class, PROP_PARTITION_INTERVAL,
+      g_param_spec_uint64 ("partition-interval", "Partition interval",
+          "Interval in nanoseconds between body partitions, each with the "
+          "index table segments of the previous one (0 = single body partition)",
+          0, G_MAXUINT64, DEFAULT_PARTITION_INTERVAL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   gstelement_class->change_state = GST_DEBUG_FUNCPTR (gst_mxf_mux_change_state);
   gstelement_class->request_new_pad =
       GST_DEBUG_FUNCPTR (gst_mxf_mux_request_new_pad);
@@ -150,6 +163,12 @@ gst_mxf_mux_init (GstMXFMux * mux, GstMXFMuxClass * g_class)
   gst_collect_pads_set_function (mux->collect,
       (GstCollectPadsFunction) GST_DEBUG_FUNCPTR (gst_mxf_mux_collected), mux);
 
+  mux->index_entries = g_array_new (FALSE, TRUE, sizeof (MXFIndexEntry));
+  mux->temporal_offsets = g_array_new (FALSE, TRUE, sizeof (gint8));
+  mux->random_index_pack =
+      g_array_new (FALSE, FALSE, sizeof (MXFRandomIndexPackEntry));
+  mux->partition_interval = DEFAULT_PARTITION_INTERVAL;
+
   gst_mxf_mux_reset (mux);
 }
 
@@ -169,6 +188,10 @@ gst_mxf_mux_finalize (GObject * object)
 
   gst_object_unref (mux->collect);
 
+  g_array_free (mux->index_entries, TRUE);
+  g_array_free (mux->temporal_offsets, TRUE);
+  g_array_free (mux->random_index_pack, TRUE);
+
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
 
@@ -176,9 +199,12 @@ static void
 gst_mxf_mux_set_property (GObject * object,
     guint prop_id, const GValue * value, GParamSpec * pspec)
 {
-  //GstMXFMux *mux = GST_MXF_MUX (object);
+  GstMXFMux *mux = GST_MXF_MUX (object);
 
   switch (prop_id) {
+    case PROP_PARTITION_INTERVAL:
+      mux->partition_interval = g_value_get_uint64 (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -189,9 +215,12 @@ static void
 gst_mxf_mux_get_property (GObject * object,
     guint prop_id, GValue * value, GParamSpec * pspec)
 {
-  //GstMXFMux *mux = GST_MXF_MUX (object);
+  GstMXFMux *mux = GST_MXF_MUX (object);
 
   switch (prop_id) {
+    case PROP_PARTITION_INTERVAL:
+      g_value_set_uint64 (value, mux->partition_interval);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -229,6 +258,19 @@ gst_mxf_mux_reset (GstMXFMux * mux)
   mux->last_gc_timestamp = 0;
   mux->last_gc_position = 0;
   mux->offset = 0;
+
+  mux->essence_offset = 0;
+  g_array_set_size (mux->index_entries, 0);
+  mux->index_start_position = 0;
+  mux->partition_start_position = 0;
+  mux->vbe_index = FALSE;
+  mux->edit_unit_byte_count = 0;
+  mux->index_disabled = FALSE;
+  mux->index_pad = NULL;
+  mux->index_pad_first_timestamp = GST_CLOCK_TIME_NONE;
+  g_array_set_size (mux->temporal_offsets, 0);
+  mux->last_keyframe_position = -1;
+  g_array_set_size (mux->random_index_pack, 0);
 }
 
 static gboolean
@@ -937,7 +979,7 @@ gst_mxf_mux_create_metadata (GstMXFMux * mux)
 
     cstorage->essence_container_data[0]->linked_package =
         MXF_METADATA_SOURCE_PACKAGE (cstorage->packages[1]);
-    cstorage->essence_container_data[0]->index_sid = 0;
+    cstorage->essence_container_data[0]->index_sid = 2;
     cstorage->essence_container_data[0]->body_sid = 1;
   }
 
@@ -1083,6 +1125,300 @@ gst_mxf_mux_write_header_metadata (GstMXFMux * mux)
   return ret;
 }
 
+static GstFlowReturn
+gst_mxf_mux_push_buffers (GstMXFMux * mux, GList * buffers)
+{
+  GstFlowReturn ret = GST_FLOW_OK;
+  GList *l;
+
+  for (l = buffers; l; l = l->next) {
+    GstBuffer *buf = l->data;
+
+    l->data = NULL;
+    if ((ret = gst_mxf_mux_push (mux, buf)) != GST_FLOW_OK) {
+      GST_ERROR_OBJECT (mux, "Failed pushing buffer: %s",
+          gst_flow_get_name (ret));
+      g_list_foreach (l->next, (GFunc) gst_mini_object_unref, NULL);
+      break;
+    }
+  }
+
+  g_list_free (buffers);
+
+  return ret;
+}
+
+static GstBuffer *
+gst_mxf_mux_create_index_table_segment (GstMXFMux * mux, gint64 start,
+    guint32 edit_unit_byte_count, gint64 duration, MXFIndexEntry * entries,
+    guint n_entries)
+{
+  MXFMetadataEssenceContainerData *ecd =
+      mux->preface->content_storage->essence_container_data[0];
+  MXFIndexTableSegment segment;
+
+  memset (&segment, 0, sizeof (MXFIndexTableSegment));
+  mxf_uuid_init (&segment.instance_id, NULL);
+  memcpy (&segment.index_edit_rate, &mux->min_edit_rate, sizeof (MXFFraction));
+  segment.index_start_position = start;
+  segment.index_duration = duration;
+  segment.edit_unit_byte_count = edit_unit_byte_count;
+  segment.index_sid = ecd->index_sid;
+  segment.body_sid = ecd->body_sid;
+  segment.n_index_entries = n_entries;
+  segment.index_entries = entries;
+
+  return mxf_index_table_segment_to_buffer (&segment);
+}
+
+/* Chooses the kind of index table from the essence mappings. A table
+ * can't mix segments with constant and variable edit unit sizes, so this is
+ * done once for the whole file */
+static void
+gst_mxf_mux_init_index (GstMXFMux * mux)
+{
+  GSList *l;
+
+  mux->vbe_index = FALSE;
+  mux->index_pad = NULL;
+  for (l = mux->collect->data; l; l = l->next) {
+    GstMXFMuxPad *cpad = l->data;
+
+    if (cpad->writer->is_constant_size == NULL ||
+        !cpad->writer->is_constant_size (cpad->descriptor,
+            GST_PAD_CAPS (cpad->collect.pad), cpad->mapping_data))
+      mux->vbe_index = TRUE;
+
+    if (mux->index_pad == NULL &&
+        mxf_metadata_track_identifier_parse (&cpad->writer->data_definition)
+        == MXF_METADATA_TRACK_PICTURE_ESSENCE)
+      mux->index_pad = cpad;
+  }
+
+  GST_DEBUG_OBJECT (mux, "Writing a %s index table",
+      mux->vbe_index ? "VBE" : "CBE");
+}
+
+/* Sets the keyframe and temporal offsets of the first @n_entries entries
+ * that are not indexed yet */
+static void
+gst_mxf_mux_update_index_offsets (GstMXFMux * mux, MXFIndexEntry * entries,
+    guint n_entries)
+{
+  guint i;
+
+  for (i = 0; i < n_entries; i++) {
+    gint64 position = mux->index_start_position + i;
+
+    if (entries[i].flags & 0x80)
+      mux->last_keyframe_position = position;
+    entries[i].key_frame_offset = (mux->last_keyframe_position < 0) ? 0 :
+        MAX (mux->last_keyframe_position - position, G_MININT8);
+    entries[i].temporal_offset = (i < mux->temporal_offsets->len) ?
+        g_array_index (mux->temporal_offsets, gint8, i) : 0;
+  }
+
+  g_array_remove_range (mux->temporal_offsets, 0,
+      MIN (n_entries, mux->temporal_offsets->len));
+}
+
+/* Creates the index table segments for the content packages that are not
+ * indexed yet. With a CBE index they're described by their size only. If
+ * they turn out not to have a constant size, the remaining content packages
+ * are not indexed. With a VBE index, the content packages from the last
+ * keyframe on are kept for the next partition unless @last */
+static GList *
+gst_mxf_mux_create_index_table_segments (GstMXFMux * mux, gboolean last,
+    guint64 * index_byte_count)
+{
+  MXFIndexEntry *entries = (MXFIndexEntry *) mux->index_entries->data;
+  guint n_entries = mux->index_entries->len;
+  GList *buffers = NULL, *l;
+  guint i;
+
+  *index_byte_count = 0;
+
+  if (n_entries == 0)
+    return NULL;
+
+  if (!mux->vbe_index) {
+    guint64 size = mux->essence_offset - entries[n_entries - 1].stream_offset;
+    gboolean constant = !mux->index_disabled && size > 0
+        && size <= G_MAXUINT32 && (mux->edit_unit_byte_count == 0
+        || size == mux->edit_unit_byte_count);
+
+    for (i = 0; constant && i < n_entries; i++) {
+      guint64 next = (i + 1 < n_entries) ? entries[i + 1].stream_offset :
+          mux->essence_offset;
+
+      constant = (entries[i].flags & 0x80)
+          && next - entries[i].stream_offset == size;
+    }
+
+    if (constant) {
+      mux->edit_unit_byte_count = size;
+      buffers = g_list_prepend (buffers,
+          gst_mxf_mux_create_index_table_segment (mux,
+              mux->index_start_position, size, n_entries, NULL, 0));
+    } else if (!mux->index_disabled) {
+      GST_WARNING_OBJECT (mux, "Content packages don't have a constant size, "
+          "not indexing the remaining ones");
+      mux->index_disabled = TRUE;
+    }
+    goto done;
+  }
+
+  /* The next pictures can still be displayed before the last keyframe */
+  if (!last) {
+    while (n_entries > 0 && !(entries[n_entries - 1].flags & 0x80))
+      n_entries--;
+    if (n_entries > 0)
+      n_entries--;
+  }
+
+  gst_mxf_mux_update_index_offsets (mux, entries, n_entries);
+
+  for (i = 0; i < n_entries; i += MAX_INDEX_ENTRIES) {
+    guint n = MIN (n_entries - i, MAX_INDEX_ENTRIES);
+
+    buffers = g_list_prepend (buffers,
+        gst_mxf_mux_create_index_table_segment (mux,
+            mux->index_start_position + i, 0, n, entries + i, n));
+  }
+
+done:
+  mux->index_start_position += n_entries;
+  g_array_remove_range (mux->index_entries, 0, n_entries);
+
+  buffers = g_list_reverse (buffers);
+  for (l = buffers; l; l = l->next)
+    *index_byte_count += GST_BUFFER_SIZE (l->data);
+
+  return buffers;
+}
+
+/* Writes a body partition with the index table segments of the previous
+ * body partition, up to its last GOP */
+static GstFlowReturn
+gst_mxf_mux_write_body_partition (GstMXFMux * mux)
+{
+  MXFMetadataEssenceContainerData *ecd =
+      mux->preface->content_storage->essence_container_data[0];
+  MXFRandomIndexPackEntry entry;
+  GstBuffer *buf;
+  GList *segments;
+  guint64 index_byte_count;
+  GstFlowReturn ret;
+
+  segments = gst_mxf_mux_create_index_table_segments (mux, FALSE,
+      &index_byte_count);
+  mux->partition_start_position = mux->last_gc_position;
+
+  mux->partition.type = MXF_PARTITION_PACK_BODY;
+  mux->partition.this_partition = mux->offset;
+  mux->partition.prev_partition =
+      g_array_index (mux->random_index_pack, MXFRandomIndexPackEntry,
+      mux->random_index_pack->len - 1).offset;
+  mux->partition.footer_partition = 0;
+  mux->partition.header_byte_count = 0;
+  mux->partition.index_byte_count = index_byte_count;
+  mux->partition.index_sid = segments ? ecd->index_sid : 0;
+  mux->partition.body_offset = mux->essence_offset;
+  mux->partition.body_sid = ecd->body_sid;
+
+  entry.offset = mux->offset;
+  entry.body_sid = ecd->body_sid;
+  g_array_append_val (mux->random_index_pack, entry);
+
+  buf = mxf_partition_pack_to_buffer (&mux->partition);
+  if ((ret = gst_mxf_mux_push (mux, buf)) != GST_FLOW_OK) {
+    GST_ERROR_OBJECT (mux, "Failed pushing body partition: %s",
+        gst_flow_get_name (ret));
+    g_list_foreach (segments, (GFunc) gst_mini_object_unref, NULL);
+    g_list_free (segments);
+    return ret;
+  }
+
+  return gst_mxf_mux_push_buffers (mux, segments);
+}
+
+/* Records the temporal offset of a picture of the index track: the entry
+ * of its display position gets the offset to its stored position */
+static void
+gst_mxf_mux_update_temporal_offset (GstMXFMux * mux, GstClockTime timestamp)
+{
+  gint64 position = mux->last_gc_position, display;
+  guint i;
+
+  if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+    return;
+  if (!GST_CLOCK_TIME_IS_VALID (mux->index_pad_first_timestamp))
+    mux->index_pad_first_timestamp = timestamp;
+  /* leading pictures of an open GOP */
+  if (timestamp < mux->index_pad_first_timestamp)
+    return;
+
+  display = gst_util_uint64_scale_round (timestamp -
+      mux->index_pad_first_timestamp, mux->min_edit_rate.n,
+      GST_SECOND * mux->min_edit_rate.d);
+  if (display == position || display < mux->index_start_position)
+    return;
+
+  i = display - mux->index_start_position;
+  if (i >= mux->temporal_offsets->len)
+    g_array_set_size (mux->temporal_offsets, i + 1);
+  g_array_index (mux->temporal_offsets, gint8, i) =
+      CLAMP (position - display, G_MININT8, G_MAXINT8);
+}
+
+/* Adds the essence element that is written next to the index entry of its
+ * content package. A new content package might start a new body partition,
+ * which only happens at keyframes so that the pictures of a GOP are in the
+ * same index table segments */
+static GstFlowReturn
+gst_mxf_mux_update_index (GstMXFMux * mux, GstMXFMuxPad * cpad,
+    gboolean keyframe, GstClockTime timestamp)
+{
+  gint64 position = mux->last_gc_position;
+  MXFIndexEntry entry;
+  GstFlowReturn ret;
+
+  if (position < mux->index_start_position + mux->index_entries->len) {
+    if (!keyframe)
+      g_array_index (mux->index_entries, MXFIndexEntry,
+          position - mux->index_start_position).flags &= ~0x80;
+    if (cpad == mux->index_pad && mux->vbe_index)
+      gst_mxf_mux_update_temporal_offset (mux, timestamp);
+    return GST_FLOW_OK;
+  }
+
+  /* The pads are sorted, pictures are the first element of the content
+   * packages */
+  if (mux->partition_interval > 0 && mux->index_entries->len > 0 && keyframe
+      && gst_util_uint64_scale (position - mux->partition_start_position,
+          GST_SECOND * mux->min_edit_rate.d,
+          mux->min_edit_rate.n) >= mux->partition_interval) {
+    if ((ret = gst_mxf_mux_write_body_partition (mux)) != GST_FLOW_OK)
+      return ret;
+  }
+
+  /* Content packages without elements start where the next one starts */
+  memset (&entry, 0, sizeof (MXFIndexEntry));
+  entry.stream_offset = mux->essence_offset;
+  entry.flags = 0x80;
+  while (mux->index_start_position + mux->index_entries->len < position)
+    g_array_append_val (mux->index_entries, entry);
+
+  if (!keyframe)
+    entry.flags = 0x00;
+  g_array_append_val (mux->index_entries, entry);
+
+  if (cpad == mux->index_pad && mux->vbe_index)
+    gst_mxf_mux_update_temporal_offset (mux, timestamp);
+
+  return GST_FLOW_OK;
+}
+
 static const guint8 _gc_essence_element_ul[] = {
   0x06, 0x0e, 0x2b, 0x34, 0x01, 0x02, 0x01, 0x00,
   0x0d, 0x01, 0x03, 0x01, 0x00, 0x00, 0x00, 0x00
@@ -1096,6 +1432,9 @@ gst_mxf_mux_handle_buffer (GstMXFMux * mux, GstMXFMuxPad * cpad)
   GstBuffer *packet;
   GstFlowReturn ret = GST_FLOW_OK;
   guint8 slen, ber[9];
+  guint size;
+  gboolean keyframe;
+  GstClockTime timestamp;
   gboolean flush =
       (cpad->collect.abidata.ABI.eos && !cpad->have_complete_edit_unit
       && cpad->collect.buffer == NULL);
@@ -1120,6 +1459,9 @@ gst_mxf_mux_handle_buffer (GstMXFMux * mux, GstMXFMuxPad * cpad)
         cpad->source_track->parent.track_id, cpad->pos);
   }
 
+  keyframe = !buf || !GST_BUFFER_FLAG_IS_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+  timestamp = buf ? GST_BUFFER_TIMESTAMP (buf) : GST_CLOCK_TIME_NONE;
+
   ret = cpad->write_func (buf, GST_PAD_CAPS (cpad->collect.pad),
       cpad->mapping_data, cpad->adapter, &outbuf, flush);
   if (ret != GST_FLOW_OK && ret != GST_FLOW_CUSTOM_SUCCESS) {
@@ -1151,15 +1493,24 @@ gst_mxf_mux_handle_buffer (GstMXFMux * mux, GstMXFMuxPad * cpad)
       GST_BUFFER_SIZE (buf));
   gst_buffer_unref (buf);
 
+  if ((ret =
+          gst_mxf_mux_update_index (mux, cpad, keyframe,
+              timestamp)) != GST_FLOW_OK) {
+    gst_buffer_unref (packet);
+    return ret;
+  }
+
   GST_DEBUG_OBJECT (cpad->collect.pad, "Pushing buffer of size %u for track %u",
       GST_BUFFER_SIZE (packet), cpad->source_track->parent.track_id);
 
+  size = GST_BUFFER_SIZE (packet);
   if ((ret = gst_mxf_mux_push (mux, packet)) != GST_FLOW_OK) {
     GST_ERROR_OBJECT (cpad->collect.pad,
         "Failed pushing buffer for track %u, reason %s",
         cpad->source_track->parent.track_id, gst_flow_get_name (ret));
     return ret;
   }
+  mux->essence_offset += size;
 
   cpad->pos++;
   cpad->last_timestamp =
@@ -1169,26 +1520,6 @@ gst_mxf_mux_handle_buffer (GstMXFMux * mux, GstMXFMuxPad * cpad)
   return ret;
 }
 
-static GstFlowReturn
-gst_mxf_mux_write_body_partition (GstMXFMux * mux)
-{
-  GstBuffer *buf;
-
-  mux->partition.type = MXF_PARTITION_PACK_BODY;
-  mux->partition.this_partition = mux->offset;
-  mux->partition.prev_partition = 0;
-  mux->partition.footer_partition = 0;
-  mux->partition.header_byte_count = 0;
-  mux->partition.index_byte_count = 0;
-  mux->partition.index_sid = 0;
-  mux->partition.body_offset = 0;
-  mux->partition.body_sid =
-      mux->preface->content_storage->essence_container_data[0]->body_sid;
-
-  buf = mxf_partition_pack_to_buffer (&mux->partition);
-  return gst_mxf_mux_push (mux, buf);
-}
-
 static GstFlowReturn
 gst_mxf_mux_handle_eos (GstMXFMux * mux)
 {
@@ -1281,43 +1612,41 @@ gst_mxf_mux_handle_eos (GstMXFMux * mux)
   }
 
   {
-    guint64 body_partition = mux->partition.this_partition;
-    guint32 body_sid = mux->partition.body_sid;
     guint64 footer_partition = mux->offset;
-    GArray *rip;
     GstFlowReturn ret;
     MXFRandomIndexPackEntry entry;
+    GList *segments;
+    guint64 index_byte_count;
+
+    segments =
+        gst_mxf_mux_create_index_table_segments (mux, TRUE, &index_byte_count);
 
     mux->partition.type = MXF_PARTITION_PACK_FOOTER;
     mux->partition.closed = TRUE;
     mux->partition.complete = TRUE;
     mux->partition.this_partition = mux->offset;
-    mux->partition.prev_partition = body_partition;
+    mux->partition.prev_partition =
+        g_array_index (mux->random_index_pack, MXFRandomIndexPackEntry,
+        mux->random_index_pack->len - 1).offset;
     mux->partition.footer_partition = mux->offset;
     mux->partition.header_byte_count = 0;
-    mux->partition.index_byte_count = 0;
-    mux->partition.index_sid = 0;
+    mux->partition.index_byte_count = index_byte_count;
+    mux->partition.index_sid = segments ?
+        mux->preface->content_storage->essence_container_data[0]->index_sid : 0;
     mux->partition.body_offset = 0;
     mux->partition.body_sid = 0;
 
     gst_mxf_mux_write_header_metadata (mux);
+    gst_mxf_mux_push_buffers (mux, segments);
 
-    rip = g_array_sized_new (FALSE, FALSE, sizeof (MXFRandomIndexPackEntry), 3);
-    entry.offset = 0;
-    entry.body_sid = 0;
-    g_array_append_val (rip, entry);
-    entry.offset = body_partition;
-    entry.body_sid = body_sid;
-    g_array_append_val (rip, entry);
     entry.offset = footer_partition;
     entry.body_sid = 0;
-    g_array_append_val (rip, entry);
+    g_array_append_val (mux->random_index_pack, entry);
 
-    packet = mxf_random_index_pack_to_buffer (rip);
+    packet = mxf_random_index_pack_to_buffer (mux->random_index_pack);
     if ((ret = gst_mxf_mux_push (mux, packet)) != GST_FLOW_OK) {
       GST_ERROR_OBJECT (mux, "Failed pushing random index pack");
     }
-    g_array_free (rip, TRUE);
 
     /* Rewrite header partition with updated values */
     if (gst_pad_push_event (mux->srcpad,
@@ -1407,8 +1736,15 @@ gst_mxf_mux_collected (GstCollectPads * pads, gpointer user_data)
     if (ret != GST_FLOW_OK)
       goto error;
 
+    {
+      MXFRandomIndexPackEntry entry = { 0, 0 };
+
+      g_array_append_val (mux->random_index_pack, entry);
+    }
+
     /* Sort pads, we will always write in that order */
     mux->collect->data = g_slist_sort (mux->collect->data, _sort_mux_pads);
+    gst_mxf_mux_init_index (mux);
 
     /* Write body partition */
     ret = gst_mxf_mux_write_body_partition (mux);
@@ -92,7 +92,32 @@ typedef struct _GstMXFMux {
   guint64 last_gc_position;
   GstClockTime last_gc_timestamp;
 
+  /* Index table of the content packages that are not indexed yet. The
+   * last GOP before a body partition is only indexed with the next one, as
+   * the leading pictures of an open GOP can change its temporal offsets */
+  guint64 essence_offset;
+  GArray *index_entries;
+  gint64 index_start_position;
+  gint64 partition_start_position;
+  /* Whether the content packages are described by index entries (VBE)
+   * or by their constant size (CBE), chosen from the essence mappings
+   * before the first content package */
+  gboolean vbe_index;
+  guint32 edit_unit_byte_count;
+  gboolean index_disabled;
+  /* Picture track the temporal offsets are taken from */
+  GstMXFMuxPad *index_pad;
+  GstClockTime index_pad_first_timestamp;
+  /* gint8 temporal offsets from index_start_position on */
+  GArray *temporal_offsets;
+  gint64 last_keyframe_position;
+
+  GArray *random_index_pack;
+
   gchar *application;
+
+  /* Properties */
+  GstClockTime partition_interval;
 } GstMXFMux;
 
 typedef struct _GstMXFMuxClass {
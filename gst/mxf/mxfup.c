@@ -550,13 +550,21 @@ mxf_up_get_track_number_template (MXFMetadataFileDescriptor * a,
   return (0x15 << 24) | (0x02 << 8);
 }
 
+static gboolean
+mxf_up_is_constant_size (MXFMetadataFileDescriptor * a, GstCaps * caps,
+    gpointer mapping_data)
+{
+  return TRUE;
+}
+
 static MXFEssenceElementWriter mxf_up_essence_element_writer = {
   mxf_up_get_descriptor,
   mxf_up_update_descriptor,
   mxf_up_get_edit_rate,
   mxf_up_get_track_number_template,
   NULL,
-  {{0,}}
+  {{0,}},
+  mxf_up_is_constant_size
 };
 
 void
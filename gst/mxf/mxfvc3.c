@@ -223,13 +223,22 @@ mxf_vc3_get_track_number_template (MXFMetadataFileDescriptor * a,
   return (0x15 << 24) | (0x05 << 8);
 }
 
+static gboolean
+mxf_vc3_is_constant_size (MXFMetadataFileDescriptor * a, GstCaps * caps,
+    gpointer mapping_data)
+{
+  /* the frame size only depends on the compression ID */
+  return TRUE;
+}
+
 static MXFEssenceElementWriter mxf_vc3_essence_element_writer = {
   mxf_vc3_get_descriptor,
   mxf_vc3_update_descriptor,
   mxf_vc3_get_edit_rate,
   mxf_vc3_get_track_number_template,
   NULL,
-  {{0,}}
+  {{0,}},
+  mxf_vc3_is_constant_size
 };
 
 void
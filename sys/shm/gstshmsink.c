@@ -25,6 +25,7 @@
 #endif
 
 #include "gstshmsink.h"
+#include "gstshm-marshal.h"
 
 #include <gst/gst.h>
 
@@ -35,6 +36,8 @@ enum
 {
   SIGNAL_CLIENT_CONNECTED,
   SIGNAL_CLIENT_DISCONNECTED,
+  SIGNAL_SET_CLIENT_POLICY,
+  SIGNAL_GET_CLIENT_STATS,
   LAST_SIGNAL
 };
 
@@ -45,17 +48,33 @@ enum
   PROP_SOCKET_PATH,
   PROP_PERMS,
   PROP_SHM_SIZE,
-  PROP_WAIT_FOR_CONNECTION
+  PROP_WAIT_FOR_CONNECTION,
+  PROP_SLOT_SIZE,
+  PROP_BUFFERS,
+  PROP_ZERO_COPY_BUFFERS,
+  PROP_COPIED_BUFFERS,
+  PROP_CLIENT_POLICY,
+  PROP_CLIENT_MAX_PENDING,
+  PROP_CLIENT_MAX_DROPS,
+  PROP_USE_RING
 };
 
 struct GstShmClient
 {
   ShmClient *client;
   GstPollFD pollfd;
+  /* signalled when the client acks buffers through its ring */
+  GstPollFD ringpollfd;
 };
 
 #define DEFAULT_SIZE ( 256 * 1024 )
 #define DEFAULT_WAIT_FOR_CONNECTION (TRUE)
+#define DEFAULT_SLOT_SIZE (0)
+#define DEFAULT_BUFFERS (0)
+#define DEFAULT_USE_RING (FALSE)
+#define DEFAULT_CLIENT_POLICY (SP_POLICY_BLOCK)
+#define DEFAULT_CLIENT_MAX_PENDING (0)
+#define DEFAULT_CLIENT_MAX_DROPS (1)
 /* Default is user read/write, group read */
 #define DEFAULT_PERMS ( S_IRUSR | S_IWUSR | S_IRGRP )
 
@@ -70,6 +89,28 @@ static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
 
 GST_BOILERPLATE (GstShmSink, gst_shm_sink, GstBaseSink, GST_TYPE_BASE_SINK);
 
+GType
+gst_shm_sink_client_policy_get_type (void)
+{
+  static GType policy_type = 0;
+  static const GEnumValue policies[] = {
+    {SP_POLICY_BLOCK, "Wait until the client releases a buffer", "block"},
+    {SP_POLICY_DROP_NEWEST, "Don't send new buffers to the client",
+        "drop-newest"},
+    {SP_POLICY_DROP_OLDEST, "Queue new buffers for the client and drop "
+          "the oldest queued one", "drop-oldest"},
+    {SP_POLICY_DISCONNECT, "Drop new buffers and disconnect the client "
+          "after max-drops in a row", "disconnect"},
+    {0, NULL, NULL}
+  };
+
+  if (!policy_type) {
+    policy_type =
+        g_enum_register_static ("GstShmSinkClientPolicy", policies);
+  }
+  return policy_type;
+}
+
 static void gst_shm_sink_finalize (GObject * object);
 static void gst_shm_sink_set_property (GObject * object, guint prop_id,
     const GValue * value, GParamSpec * pspec);
@@ -86,7 +127,13 @@ static gboolean gst_shm_sink_event (GstBaseSink * bsink, GstEvent * event);
 static gboolean gst_shm_sink_unlock (GstBaseSink * bsink);
 static gboolean gst_shm_sink_unlock_stop (GstBaseSink * bsink);
 
+static gboolean gst_shm_sink_set_client_policy (GstShmSink * self, gint fd,
+    ShmClientPolicy policy, guint max_pending, guint max_drops);
+static GstStructure *gst_shm_sink_get_client_stats (GstShmSink * self,
+    gint fd);
+
 static gpointer pollthread_func (gpointer data);
+static void gst_shm_sink_setup_slots (GstShmSink * self, guint size);
 
 static guint signals[LAST_SIGNAL] = { 0 };
 
@@ -112,6 +159,12 @@ gst_shm_sink_init (GstShmSink * self, GstShmSinkClass * g_class)
   self->size = DEFAULT_SIZE;
   self->wait_for_connection = DEFAULT_WAIT_FOR_CONNECTION;
   self->perms = DEFAULT_PERMS;
+  self->slot_size = DEFAULT_SLOT_SIZE;
+  self->buffers = DEFAULT_BUFFERS;
+  self->client_policy = DEFAULT_CLIENT_POLICY;
+  self->client_max_pending = DEFAULT_CLIENT_MAX_PENDING;
+  self->client_max_drops = DEFAULT_CLIENT_MAX_DROPS;
+  self->use_ring = DEFAULT_USE_RING;
 }
 
 static void
@@ -162,6 +215,67 @@ gst_shm_sink_class_init (GstShmSinkClass * klass)
           DEFAULT_WAIT_FOR_CONNECTION,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property (gobject_class, PROP_SLOT_SIZE,
+      g_param_spec_uint ("slot-size",
+          "Size of the buffer slots",
+          "Split the shared memory area in slots of this size, for streams "
+          "with buffers of a fixed maximum size such as raw video. "
+          "Allocating and releasing buffers is then constant time and the "
+          "area can't get fragmented (0 = variable size buffers)",
+          0, G_MAXUINT, DEFAULT_SLOT_SIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_BUFFERS,
+      g_param_spec_uint ("buffers",
+          "Number of buffers",
+          "Size the shared memory area to hold this many buffers of the "
+          "size requested upstream (or slot-size if bigger), and make buffer "
+          "allocations wait for a free one instead of falling back to normal "
+          "memory (0 = use shm-size and don't wait)",
+          0, G_MAXUINT, DEFAULT_BUFFERS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_ZERO_COPY_BUFFERS,
+      g_param_spec_uint64 ("zero-copy-buffers",
+          "Zero-copy buffers",
+          "Number of buffers rendered that were already in shared memory",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_COPIED_BUFFERS,
+      g_param_spec_uint64 ("copied-buffers",
+          "Copied buffers",
+          "Number of buffers rendered that had to be copied to shared memory",
+          0, G_MAXUINT64, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CLIENT_POLICY,
+      g_param_spec_enum ("client-policy",
+          "Client policy",
+          "What to do when a new client holds client-max-pending buffers",
+          GST_TYPE_SHM_SINK_CLIENT_POLICY, DEFAULT_CLIENT_POLICY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CLIENT_MAX_PENDING,
+      g_param_spec_uint ("client-max-pending",
+          "Client maximum pending buffers",
+          "Number of buffers a new client can hold before its policy applies "
+          "(0 = unlimited)", 0, G_MAXUINT, DEFAULT_CLIENT_MAX_PENDING,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_CLIENT_MAX_DROPS,
+      g_param_spec_uint ("client-max-drops",
+          "Client maximum drops",
+          "Number of buffers dropped in a row before disconnecting a new "
+          "client with the disconnect policy", 1, G_MAXUINT, DEFAULT_CLIENT_MAX_DROPS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_USE_RING,
+      g_param_spec_boolean ("use-ring",
+          "Use a ring",
+          "Pass the buffers to new clients through a ring in shared memory "
+          "and wake them up only when it stops being empty, instead of "
+          "sending a message on the socket for every buffer (needs eventfd)",
+          DEFAULT_USE_RING, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   signals[SIGNAL_CLIENT_CONNECTED] = g_signal_new ("client-connected",
       GST_TYPE_SHM_SINK, G_SIGNAL_RUN_LAST, 0, NULL, NULL,
       g_cclosure_marshal_VOID__INT, G_TYPE_NONE, 1, G_TYPE_INT);
@@ -170,6 +284,44 @@ gst_shm_sink_class_init (GstShmSinkClass * klass)
       GST_TYPE_SHM_SINK, G_SIGNAL_RUN_LAST, 0, NULL, NULL,
       g_cclosure_marshal_VOID__INT, G_TYPE_NONE, 1, G_TYPE_INT);
 
+  /**
+   * GstShmSink::set-client-policy:
+   * @shmsink: the shmsink element
+   * @fd: the fd of the client, as given by #GstShmSink::client-connected
+   * @policy: what to do when the client holds @max_pending buffers
+   * @max_pending: number of buffers the client can hold, 0 for unlimited
+   * @max_drops: consecutive drops before disconnecting the client with the
+   * disconnect policy
+   *
+   * Changes the policy of a connected client.
+   *
+   * Returns: %FALSE if there is no such client
+   */
+  signals[SIGNAL_SET_CLIENT_POLICY] = g_signal_new ("set-client-policy",
+      GST_TYPE_SHM_SINK, G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+      G_STRUCT_OFFSET (GstShmSinkClass, set_client_policy), NULL, NULL,
+      __gst_shm_marshal_BOOLEAN__INT_ENUM_UINT_UINT, G_TYPE_BOOLEAN, 4,
+      G_TYPE_INT, GST_TYPE_SHM_SINK_CLIENT_POLICY, G_TYPE_UINT, G_TYPE_UINT);
+
+  /**
+   * GstShmSink::get-client-stats:
+   * @shmsink: the shmsink element
+   * @fd: the fd of the client
+   *
+   * Gets the statistics of a connected client: the number of buffers sent,
+   * acked, dropped, pending and queued and the average and maximum time
+   * between sending a buffer and its ack.
+   *
+   * Returns: a #GstStructure to free, or %NULL if there is no such client
+   */
+  signals[SIGNAL_GET_CLIENT_STATS] = g_signal_new ("get-client-stats",
+      GST_TYPE_SHM_SINK, G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+      G_STRUCT_OFFSET (GstShmSinkClass, get_client_stats), NULL, NULL,
+      __gst_shm_marshal_BOXED__INT, GST_TYPE_STRUCTURE, 1, G_TYPE_INT);
+
+  klass->set_client_policy = gst_shm_sink_set_client_policy;
+  klass->get_client_stats = gst_shm_sink_get_client_stats;
+
   GST_DEBUG_CATEGORY_INIT (shmsink_debug, "shmsink", 0, "Shared Memory Sink");
 }
 
@@ -212,15 +364,10 @@ gst_shm_sink_set_property (GObject * object, guint prop_id,
       break;
     case PROP_SHM_SIZE:
       GST_OBJECT_LOCK (object);
-      if (self->pipe) {
-        if (sp_writer_resize (self->pipe, g_value_get_uint (value)) < 0)
-          GST_DEBUG_OBJECT (self, "Resized shared memory area from %u to "
-              "%u bytes", self->size, g_value_get_uint (value));
-        else
-          GST_WARNING_OBJECT (self, "Could not resize shared memory area from"
-              "%u to %u bytes", self->size, g_value_get_uint (value));
-      }
       self->size = g_value_get_uint (value);
+      /* the slots might not fit anymore */
+      if (self->pipe)
+        gst_shm_sink_setup_slots (self, 0);
       GST_OBJECT_UNLOCK (object);
       break;
     case PROP_WAIT_FOR_CONNECTION:
@@ -229,6 +376,43 @@ gst_shm_sink_set_property (GObject * object, guint prop_id,
       GST_OBJECT_UNLOCK (object);
       g_cond_broadcast (self->cond);
       break;
+    case PROP_SLOT_SIZE:
+      GST_OBJECT_LOCK (object);
+      self->slot_size = g_value_get_uint (value);
+      if (self->pipe)
+        gst_shm_sink_setup_slots (self, 0);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_CLIENT_POLICY:
+      GST_OBJECT_LOCK (object);
+      self->client_policy = g_value_get_enum (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_CLIENT_MAX_PENDING:
+      GST_OBJECT_LOCK (object);
+      self->client_max_pending = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_CLIENT_MAX_DROPS:
+      GST_OBJECT_LOCK (object);
+      self->client_max_drops = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_USE_RING:
+      GST_OBJECT_LOCK (object);
+      self->use_ring = g_value_get_boolean (value);
+      if (self->pipe && sp_writer_set_use_rings (self->pipe, self->use_ring))
+        GST_WARNING_OBJECT (object, "Rings are not supported");
+      GST_OBJECT_UNLOCK (object);
+      break;
+    case PROP_BUFFERS:
+      GST_OBJECT_LOCK (object);
+      self->buffers = g_value_get_uint (value);
+      if (self->pipe)
+        gst_shm_sink_setup_slots (self, 0);
+      GST_OBJECT_UNLOCK (object);
+      g_cond_broadcast (self->cond);
+      break;
     default:
       break;
   }
@@ -263,6 +447,30 @@ gst_shm_sink_get_property (GObject * object, guint prop_id,
     case PROP_WAIT_FOR_CONNECTION:
       g_value_set_boolean (value, self->wait_for_connection);
       break;
+    case PROP_SLOT_SIZE:
+      g_value_set_uint (value, self->slot_size);
+      break;
+    case PROP_BUFFERS:
+      g_value_set_uint (value, self->buffers);
+      break;
+    case PROP_ZERO_COPY_BUFFERS:
+      g_value_set_uint64 (value, self->zero_copy_buffers);
+      break;
+    case PROP_COPIED_BUFFERS:
+      g_value_set_uint64 (value, self->copied_buffers);
+      break;
+    case PROP_CLIENT_POLICY:
+      g_value_set_enum (value, self->client_policy);
+      break;
+    case PROP_CLIENT_MAX_PENDING:
+      g_value_set_uint (value, self->client_max_pending);
+      break;
+    case PROP_CLIENT_MAX_DROPS:
+      g_value_set_uint (value, self->client_max_drops);
+      break;
+    case PROP_USE_RING:
+      g_value_set_boolean (value, self->use_ring);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -273,6 +481,51 @@ gst_shm_sink_get_property (GObject * object, guint prop_id,
 
 
 
+/* Sets up the slots of the shm area for buffers of @size bytes, with the
+ * object lock taken. With a number of buffers, the area is resized to hold
+ * them and the slots only ever grow, otherwise the slot size is used as
+ * is within shm-size */
+static void
+gst_shm_sink_setup_slots (GstShmSink * self, guint size)
+{
+  guint slot_size = self->slot_size;
+  guint area_size = self->size;
+
+  if (self->buffers) {
+    slot_size = MAX (slot_size, size);
+    if (self->cur_buffers == self->buffers)
+      slot_size = MAX (slot_size, self->cur_slot_size);
+    if (slot_size == 0)
+      return;
+    if (slot_size > G_MAXUINT / self->buffers) {
+      GST_WARNING_OBJECT (self, "%u buffers of %u bytes is too much shared "
+          "memory", self->buffers, slot_size);
+      return;
+    }
+    area_size = slot_size * self->buffers;
+  } else if (slot_size > area_size) {
+    GST_WARNING_OBJECT (self, "Slots of %u bytes don't fit in %u bytes of "
+        "shared memory, using variable size buffers", slot_size, area_size);
+    slot_size = 0;
+  }
+
+  if (area_size == self->cur_size && slot_size == self->cur_slot_size &&
+      self->buffers == self->cur_buffers)
+    return;
+
+  if (sp_writer_resize_slots (self->pipe, area_size, slot_size) < 0) {
+    GST_WARNING_OBJECT (self, "Could not set up %u bytes of shared memory "
+        "with slots of %u bytes", area_size, slot_size);
+    return;
+  }
+
+  GST_DEBUG_OBJECT (self, "Using %u bytes of shared memory with slots of %u "
+      "bytes", area_size, slot_size);
+  self->cur_size = area_size;
+  self->cur_slot_size = slot_size;
+  self->cur_buffers = self->buffers;
+}
+
 static gboolean
 gst_shm_sink_start (GstBaseSink * bsink)
 {
@@ -297,6 +550,16 @@ gst_shm_sink_start (GstBaseSink * bsink)
     return FALSE;
   }
 
+  self->cur_size = self->size;
+  self->cur_slot_size = 0;
+  self->cur_buffers = 0;
+  self->zero_copy_buffers = 0;
+  self->copied_buffers = 0;
+  gst_shm_sink_setup_slots (self, 0);
+
+  if (self->use_ring && sp_writer_set_use_rings (self->pipe, TRUE))
+    GST_WARNING_OBJECT (self, "Rings are not supported, using the socket");
+
   sp_set_data (self->pipe, self);
   g_free (self->socket_path);
   self->socket_path = g_strdup (sp_writer_get_path (self->pipe));
@@ -365,7 +628,8 @@ gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
   int rv;
 
   GST_OBJECT_LOCK (self);
-  while (self->wait_for_connection && !self->clients) {
+  while ((self->wait_for_connection && !self->clients) ||
+      !sp_writer_can_send (self->pipe)) {
     g_cond_wait (self->cond, GST_OBJECT_GET_LOCK (self));
     if (self->unlock) {
       GST_OBJECT_UNLOCK (self);
@@ -379,6 +643,32 @@ gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
   if (rv == -1) {
     ShmBlock *block = NULL;
     gchar *shmbuf = NULL;
+
+    if (self->buffers)
+      gst_shm_sink_setup_slots (self, GST_BUFFER_SIZE (buf));
+
+    if (self->cur_slot_size && GST_BUFFER_SIZE (buf) > self->cur_slot_size) {
+      guint slot_size = self->cur_slot_size;
+
+      GST_OBJECT_UNLOCK (self);
+      GST_ELEMENT_ERROR (self, RESOURCE, NO_SPACE_LEFT,
+          ("Buffer too big for the shared memory slots"),
+          ("Buffer of %u bytes, slots of %u bytes", GST_BUFFER_SIZE (buf),
+              slot_size));
+      return GST_FLOW_ERROR;
+    }
+
+    if (GST_BUFFER_SIZE (buf) > self->cur_size) {
+      guint area_size = self->cur_size;
+
+      GST_OBJECT_UNLOCK (self);
+      GST_ELEMENT_ERROR (self, RESOURCE, NO_SPACE_LEFT,
+          ("Buffer too big for the shared memory area"),
+          ("Buffer of %u bytes, area of %u bytes", GST_BUFFER_SIZE (buf),
+              area_size));
+      return GST_FLOW_ERROR;
+    }
+
     while ((block = sp_writer_alloc_block (self->pipe,
                 GST_BUFFER_SIZE (buf))) == NULL) {
       g_cond_wait (self->cond, GST_OBJECT_GET_LOCK (self));
@@ -401,6 +691,11 @@ gst_shm_sink_render (GstBaseSink * bsink, GstBuffer * buf)
     memcpy (shmbuf, GST_BUFFER_DATA (buf), GST_BUFFER_SIZE (buf));
     sp_writer_send_buf (self->pipe, shmbuf, GST_BUFFER_SIZE (buf));
     sp_writer_free_block (block);
+    self->copied_buffers++;
+    GST_LOG_OBJECT (self, "Copied buffer of %u bytes to shared memory",
+        GST_BUFFER_SIZE (buf));
+  } else {
+    self->zero_copy_buffers++;
   }
 
   GST_OBJECT_UNLOCK (self);
@@ -421,6 +716,8 @@ gst_shm_sink_free_buffer (gpointer data)
   GST_OBJECT_LOCK (self);
   sp_writer_free_block (block);
   GST_OBJECT_UNLOCK (self);
+  /* wake up allocations waiting for a free block */
+  g_cond_broadcast (self->cond);
   g_object_unref (self);
 }
 
@@ -434,7 +731,22 @@ gst_shm_sink_buffer_alloc (GstBaseSink * sink, guint64 offset, guint size,
   gpointer buf = NULL;
 
   GST_OBJECT_LOCK (self);
-  block = sp_writer_alloc_block (self->pipe, size);
+  if (self->buffers) {
+    /* Act as a pool of buffers: wait until one is released */
+    gst_shm_sink_setup_slots (self, size);
+    if (size <= self->cur_size &&
+        (!self->cur_slot_size || size <= self->cur_slot_size)) {
+      while ((block = sp_writer_alloc_block (self->pipe, size)) == NULL) {
+        g_cond_wait (self->cond, GST_OBJECT_GET_LOCK (self));
+        if (self->unlock) {
+          GST_OBJECT_UNLOCK (self);
+          return GST_FLOW_WRONG_STATE;
+        }
+      }
+    }
+  } else {
+    block = sp_writer_alloc_block (self->pipe, size);
+  }
   if (block) {
     buf = sp_writer_block_get_buf (block);
     g_object_ref (self);
@@ -496,6 +808,9 @@ pollthread_func (gpointer data)
 
       GST_OBJECT_LOCK (self);
       client = sp_writer_accept_client (self->pipe);
+      if (client)
+        sp_writer_client_set_policy (client, self->client_policy,
+            self->client_max_pending, self->client_max_drops);
       GST_OBJECT_UNLOCK (self);
 
       if (!client) {
@@ -511,7 +826,15 @@ pollthread_func (gpointer data)
       gclient->pollfd.fd = sp_writer_get_client_fd (client);
       gst_poll_add_fd (self->poll, &gclient->pollfd);
       gst_poll_fd_ctl_read (self->poll, &gclient->pollfd, TRUE);
+      gst_poll_fd_init (&gclient->ringpollfd);
+      gclient->ringpollfd.fd = sp_writer_get_client_ring_fd (client);
+      if (gclient->ringpollfd.fd >= 0) {
+        gst_poll_add_fd (self->poll, &gclient->ringpollfd);
+        gst_poll_fd_ctl_read (self->poll, &gclient->ringpollfd, TRUE);
+      }
+      GST_OBJECT_LOCK (self);
       self->clients = g_list_prepend (self->clients, gclient);
+      GST_OBJECT_UNLOCK (self);
       g_signal_emit (self, signals[SIGNAL_CLIENT_CONNECTED], 0,
           gclient->pollfd.fd);
       /* we need to call gst_poll_wait before calling gst_poll_* status
@@ -548,14 +871,31 @@ pollthread_func (gpointer data)
           goto close_client;
         }
       }
+
+      if (gclient->ringpollfd.fd >= 0 &&
+          gst_poll_fd_can_read (self->poll, &gclient->ringpollfd)) {
+        int rv;
+
+        GST_OBJECT_LOCK (self);
+        rv = sp_writer_recv_ring (self->pipe, gclient->client);
+        GST_OBJECT_UNLOCK (self);
+
+        if (rv < 0) {
+          GST_WARNING_OBJECT (self, "One client has a bad ack in its ring,"
+              " closing (retval: %d)", rv);
+          goto close_client;
+        }
+      }
       continue;
     close_client:
       GST_OBJECT_LOCK (self);
       sp_writer_close_client (self->pipe, gclient->client);
+      self->clients = g_list_remove (self->clients, gclient);
       GST_OBJECT_UNLOCK (self);
 
       gst_poll_remove_fd (self->poll, &gclient->pollfd);
-      self->clients = g_list_remove (self->clients, gclient);
+      if (gclient->ringpollfd.fd >= 0)
+        gst_poll_remove_fd (self->poll, &gclient->ringpollfd);
 
       g_signal_emit (self, signals[SIGNAL_CLIENT_DISCONNECTED], 0,
           gclient->pollfd.fd);
@@ -570,6 +910,72 @@ pollthread_func (gpointer data)
   return NULL;
 }
 
+/* Called with the object lock */
+static struct GstShmClient *
+gst_shm_sink_find_client (GstShmSink * self, gint fd)
+{
+  GList *item;
+
+  for (item = self->clients; item; item = item->next) {
+    struct GstShmClient *gclient = item->data;
+
+    if (gclient->pollfd.fd == fd)
+      return gclient;
+  }
+
+  return NULL;
+}
+
+static gboolean
+gst_shm_sink_set_client_policy (GstShmSink * self, gint fd,
+    ShmClientPolicy policy, guint max_pending, guint max_drops)
+{
+  struct GstShmClient *gclient;
+
+  GST_OBJECT_LOCK (self);
+  gclient = gst_shm_sink_find_client (self, fd);
+  if (gclient)
+    sp_writer_client_set_policy (gclient->client, policy, max_pending,
+        max_drops);
+  GST_OBJECT_UNLOCK (self);
+
+  if (!gclient)
+    return FALSE;
+
+  /* The writer might be waiting for this client */
+  g_cond_broadcast (self->cond);
+
+  return TRUE;
+}
+
+static GstStructure *
+gst_shm_sink_get_client_stats (GstShmSink * self, gint fd)
+{
+  struct GstShmClient *gclient;
+  ShmClientStats stats;
+
+  GST_OBJECT_LOCK (self);
+  gclient = gst_shm_sink_find_client (self, fd);
+  if (gclient)
+    sp_writer_client_get_stats (gclient->client, &stats);
+  GST_OBJECT_UNLOCK (self);
+
+  if (!gclient)
+    return NULL;
+
+  return gst_structure_new ("GstShmSinkClientStats",
+      "sent", G_TYPE_UINT64, (guint64) stats.sent,
+      "acked", G_TYPE_UINT64, (guint64) stats.acked,
+      "dropped", G_TYPE_UINT64, (guint64) stats.dropped,
+      "pending", G_TYPE_UINT, stats.pending,
+      "queued", G_TYPE_UINT, stats.queued,
+      "average-latency", G_TYPE_UINT64, stats.acked ?
+      (guint64) (stats.total_latency / stats.acked * GST_USECOND) :
+      G_GUINT64_CONSTANT (0),
+      "max-latency", G_TYPE_UINT64,
+      (guint64) (stats.max_latency * GST_USECOND), NULL);
+}
+
 static gboolean
 gst_shm_sink_event (GstBaseSink * bsink, GstEvent * event)
 {
@@ -38,6 +38,8 @@ G_BEGIN_DECLS
   (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_SHM_SINK))
 #define GST_IS_SHM_SINK_CLASS(klass) \
   (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_SHM_SINK))
+#define GST_TYPE_SHM_SINK_CLIENT_POLICY \
+  (gst_shm_sink_client_policy_get_type())
 typedef struct _GstShmSink GstShmSink;
 typedef struct _GstShmSinkClass GstShmSinkClass;
 
@@ -51,6 +53,12 @@ struct _GstShmSink
 
   guint perms;
   guint size;
+  guint slot_size;
+  guint buffers;
+  /* size and slots in use in the shm area, 0 for variable size blocks */
+  guint cur_size;
+  guint cur_slot_size;
+  guint cur_buffers;
 
   GList *clients;
 
@@ -63,14 +71,30 @@ struct _GstShmSink
   gboolean unlock;
 
   GCond *cond;
+
+  /* Policy of new clients */
+  ShmClientPolicy client_policy;
+  guint client_max_pending;
+  guint client_max_drops;
+  gboolean use_ring;
+
+  /* Rendered buffers that were already in shared memory, or copied to it */
+  guint64 zero_copy_buffers;
+  guint64 copied_buffers;
 };
 
 struct _GstShmSinkClass
 {
   GstBaseSinkClass parent_class;
+
+  /* actions */
+  gboolean (*set_client_policy) (GstShmSink * self, gint fd,
+      ShmClientPolicy policy, guint max_pending, guint max_drops);
+  GstStructure * (*get_client_stats) (GstShmSink * self, gint fd);
 };
 
 GType gst_shm_sink_get_type (void);
+GType gst_shm_sink_client_policy_get_type (void);
 
 G_END_DECLS
 #endif /* __GST_SHM_SINK_H__ */
@@ -140,6 +140,7 @@ gst_shm_src_init (GstShmSrc * self, GstShmSrcClass * g_class)
 {
   self->poll = gst_poll_new (TRUE);
   gst_poll_fd_init (&self->pollfd);
+  gst_poll_fd_init (&self->ringpollfd);
 }
 
 static void
@@ -254,6 +255,9 @@ gst_shm_src_stop_reading (GstShmSrc * self)
 
   gst_poll_remove_fd (self->poll, &self->pollfd);
   gst_poll_fd_init (&self->pollfd);
+  if (self->ringpollfd.fd >= 0)
+    gst_poll_remove_fd (self->poll, &self->ringpollfd);
+  gst_poll_fd_init (&self->ringpollfd);
 
   gst_poll_set_flushing (self->poll, TRUE);
 }
@@ -304,6 +308,16 @@ gst_shm_src_create (GstPushSrc * psrc, GstBuffer ** outbuf)
   struct GstShmBuffer *gsb;
 
   do {
+    /* The ring fd is only signalled when the ring stops being empty, so it
+     * must be emptied before waiting */
+    if (self->ringpollfd.fd >= 0) {
+      GST_OBJECT_LOCK (self);
+      rv = sp_client_recv_ring (self->pipe->pipe, &buf);
+      GST_OBJECT_UNLOCK (self);
+      if (buf)
+        break;
+    }
+
     if (gst_poll_wait (self->poll, GST_CLOCK_TIME_NONE) < 0) {
       if (errno == EBUSY)
         return GST_FLOW_WRONG_STATE;
@@ -338,6 +352,14 @@ gst_shm_src_create (GstPushSrc * psrc, GstBuffer ** outbuf)
             ("Error reading control data: %d", rv));
         return GST_FLOW_ERROR;
       }
+
+      if (self->ringpollfd.fd < 0 &&
+          sp_client_get_ring_fd (self->pipe->pipe) >= 0) {
+        GST_DEBUG_OBJECT (self, "Got a ring from the pipe");
+        self->ringpollfd.fd = sp_client_get_ring_fd (self->pipe->pipe);
+        gst_poll_add_fd (self->poll, &self->ringpollfd);
+        gst_poll_fd_ctl_read (self->poll, &self->ringpollfd, TRUE);
+      }
     }
   } while (buf == NULL);
 
@@ -52,7 +52,8 @@ struct _GstShmSrc
   GstShmPipe *pipe;
   GstPoll *poll;
   GstPollFD pollfd;
-
+  /* signalled when the ring of the pipe gets buffers, if it has one */
+  GstPollFD ringpollfd;
 
   GstFlowReturn flow_return;
   gboolean unlocked;
@@ -41,6 +41,16 @@ struct _ShmAllocSpace
 
   /* chained list of the blocks contained in this space */
   ShmAllocBlock *blocks;
+
+  /* With fixed size slots, the space is split in n_slots blocks of
+   * slot_size bytes and the list above is not used. slot_size is 0 for
+   * variable size blocks */
+  unsigned long slot_size;
+  unsigned long n_slots;
+  ShmAllocBlock *slots;
+  /* stack of the indexes of the free slots */
+  unsigned long *free_slots;
+  unsigned long n_free;
 };
 
 /* A single block of data */
@@ -73,13 +83,69 @@ shm_alloc_space_new (size_t size)
   return self;
 }
 
+/* Creates a space split in slots of @slot_size bytes, allocating a block,
+ * freeing it and finding it from an offset are then constant time and
+ * the space can't get fragmented */
+ShmAllocSpace *
+shm_alloc_space_new_slots (size_t size, unsigned long slot_size)
+{
+  ShmAllocSpace *self;
+  unsigned long i;
+
+  if (slot_size == 0)
+    return shm_alloc_space_new (size);
+
+  self = shm_alloc_space_new (size);
+  self->slot_size = slot_size;
+  self->n_slots = size / slot_size;
+
+  if (self->n_slots == 0)
+    return self;
+
+  self->slots = spalloc_alloc (sizeof (ShmAllocBlock) * self->n_slots);
+  memset (self->slots, 0, sizeof (ShmAllocBlock) * self->n_slots);
+  self->free_slots = spalloc_alloc (sizeof (unsigned long) * self->n_slots);
+
+  /* Hand out the slots from the start of the area first */
+  for (i = 0; i < self->n_slots; i++) {
+    self->slots[i].space = self;
+    self->slots[i].offset = i * slot_size;
+    self->free_slots[i] = self->n_slots - 1 - i;
+  }
+  self->n_free = self->n_slots;
+
+  return self;
+}
+
 void
 shm_alloc_space_free (ShmAllocSpace * self)
 {
   assert (self && self->blocks == NULL);
+  assert (self->n_free == self->n_slots);
+
+  if (self->n_slots) {
+    spalloc_free1 (sizeof (ShmAllocBlock) * self->n_slots, self->slots);
+    spalloc_free1 (sizeof (unsigned long) * self->n_slots, self->free_slots);
+  }
   spalloc_free (ShmAllocSpace, self);
 }
 
+static ShmAllocBlock *
+shm_alloc_space_alloc_slot (ShmAllocSpace * self, unsigned long size)
+{
+  ShmAllocBlock *block;
+
+  if (size > self->slot_size || self->n_free == 0)
+    return NULL;
+
+  /* The most recently freed slot is the most likely to be in the cache */
+  block = &self->slots[self->free_slots[--self->n_free]];
+  block->size = size;
+  block->use_count = 1;
+
+  return block;
+}
+
 
 ShmAllocBlock *
 shm_alloc_space_alloc_block (ShmAllocSpace * self, unsigned long size)
@@ -89,6 +155,8 @@ shm_alloc_space_alloc_block (ShmAllocSpace * self, unsigned long size)
   ShmAllocBlock *prev_item = NULL;
   unsigned long prev_end_offset = 0;
 
+  if (self->slot_size)
+    return shm_alloc_space_alloc_slot (self, size);
 
   for (item = self->blocks; item; item = item->next) {
     unsigned long max_size = 0;
@@ -140,6 +208,11 @@ shm_alloc_space_free_block (ShmAllocBlock * block)
   ShmAllocBlock *prev_item = NULL;
   ShmAllocSpace *self = block->space;
 
+  if (self->slot_size) {
+    self->free_slots[self->n_free++] = block - self->slots;
+    return;
+  }
+
   for (item = self->blocks; item; item = item->next) {
     if (item == block) {
       if (prev_item)
@@ -159,6 +232,17 @@ shm_alloc_space_block_get (ShmAllocSpace * self, unsigned long offset)
 {
   ShmAllocBlock *block = NULL;
 
+  if (self->slot_size) {
+    unsigned long idx = offset / self->slot_size;
+
+    if (idx >= self->n_slots)
+      return NULL;
+    block = &self->slots[idx];
+    if (block->use_count > 0 && (block->offset + block->size) > offset)
+      return block;
+    return NULL;
+  }
+
   for (block = self->blocks; block; block = block->next) {
     if (block->offset <= offset && (block->offset + block->size) > offset)
       return block;
@@ -54,6 +54,8 @@ typedef struct _ShmAllocSpace ShmAllocSpace;
 typedef struct _ShmAllocBlock ShmAllocBlock;
 
 ShmAllocSpace *shm_alloc_space_new (size_t size);
+ShmAllocSpace *shm_alloc_space_new_slots (size_t size,
+    unsigned long slot_size);
 void shm_alloc_space_free (ShmAllocSpace * self);
 
 
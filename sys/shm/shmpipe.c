@@ -40,6 +40,11 @@
 #include <limits.h>
 #include <sys/mman.h>
 #include <assert.h>
+#include <time.h>
+#include <stdint.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #include "shmalloc.h"
 
@@ -61,9 +66,20 @@
  * type 4: ack buffer
  * offset
  *
+ * type 5: new rings
+ * No payload, followed by a message with the fds of the rings area, of the
+ * eventfd signalled for new buffers and of the eventfd signalled for acks
+ *
  * Type 4 goes from the client to the server
  * The rest are from the server to the client
- * The client should never write in the SHM
+ * The client should never write in the SHM, except in the rings area
+ *
+ * Once a client has rings, the buffers and their acks go through two single
+ * producer single consumer rings in a shared memory area of their own. The
+ * consumer of a ring is only woken up through its eventfd when the ring
+ * becomes non-empty, so a burst of buffers costs a single wakeup. The socket
+ * is still used for the shm area changes: a buffer in an area the client
+ * hasn't heard of yet stays in the ring until the socket message arrives.
  */
 
 
@@ -74,9 +90,54 @@ enum
   COMMAND_NEW_SHM_AREA = 1,
   COMMAND_CLOSE_SHM_AREA = 2,
   COMMAND_NEW_BUFFER = 3,
-  COMMAND_ACK_BUFFER = 4
+  COMMAND_ACK_BUFFER = 4,
+  COMMAND_NEW_RINGS = 5
+};
+
+/* Number of entries of a ring, a power of 2 */
+#define RING_SIZE 256
+
+struct RingEntry
+{
+  int area_id;
+  unsigned long offset;
+  unsigned long size;
+};
+
+/* head is only written by the producer and tail by the consumer, each on
+ * its own cache line */
+struct Ring
+{
+  volatile unsigned int head;
+  char pad0[64 - sizeof (unsigned int)];
+  volatile unsigned int tail;
+  char pad1[64 - sizeof (unsigned int)];
+  struct RingEntry entries[RING_SIZE];
 };
 
+/* Shared by a writer and one of its clients, mapped read/write by both */
+struct RingArea
+{
+  /* from the writer to the client */
+  struct Ring buffers;
+  /* from the client to the writer */
+  struct Ring acks;
+};
+
+typedef struct _ShmRings ShmRings;
+
+struct _ShmRings
+{
+  struct RingArea *area;
+  int shm_fd;
+  /* signalled when the buffers ring becomes non-empty */
+  int buffers_efd;
+  /* signalled when the acks ring becomes non-empty */
+  int acks_efd;
+};
+
+#define RINGS_N_FDS 3
+
 typedef struct _ShmArea ShmArea;
 typedef struct _ShmBuffer ShmBuffer;
 
@@ -110,6 +171,9 @@ struct _ShmBuffer
 
   ShmBuffer *next;
 
+  /* When it was sent, in microseconds */
+  unsigned long long send_time;
+
   int num_clients;
   int clients[0];
 };
@@ -132,12 +196,50 @@ struct _ShmPipe
   ShmClient *clients;
 
   mode_t perms;
+  /* Size of the fixed slots of the areas, 0 for variable size blocks */
+  unsigned long slot_size;
+
+  /* writer: give rings to the new clients */
+  int use_rings;
+  /* client: the rings from the writer, if any */
+  ShmRings *rings;
+  int max_area_id;
+};
+
+typedef struct _ShmQueued ShmQueued;
+
+/* A buffer not sent to a client yet because it holds as many buffers as it
+ * can. The client has never seen it, so it can be freed at any time */
+struct _ShmQueued
+{
+  ShmArea *area;
+  unsigned long offset;
+  unsigned long size;
+  ShmAllocBlock *ablock;
+
+  ShmQueued *next;
 };
 
 struct _ShmClient
 {
   int fd;
 
+  ShmClientPolicy policy;
+  /* Number of buffers the client can hold, 0 for no limit */
+  unsigned int max_pending;
+  /* Consecutive drops before disconnecting with SP_POLICY_DISCONNECT */
+  unsigned int max_drops;
+  unsigned int drops;
+  int disconnected;
+
+  ShmClientStats stats;
+
+  /* Buffers to send once it acknowledges some, oldest first */
+  ShmQueued *queue;
+  ShmQueued *queue_tail;
+
+  ShmRings *rings;
+
   ShmClient *next;
 };
 
@@ -173,13 +275,194 @@ struct CommandBuffer
   } payload;
 };
 
-static ShmArea *sp_open_shm (char *path, int id, mode_t perms, size_t size);
+static ShmArea *sp_open_shm (char *path, int id, mode_t perms, size_t size,
+    unsigned long slot_size);
 static void sp_close_shm (ShmArea * area);
 static int sp_shmbuf_dec (ShmPipe * self, ShmBuffer * buf,
     ShmBuffer * prev_buf);
 static void sp_shm_area_dec (ShmPipe * self, ShmArea * area);
+static int sp_writer_clear_queue (ShmPipe * self, ShmClient * client);
+
+static unsigned long long
+sp_get_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Removes @fd from the clients holding @buf, returns 1 if it held it */
+static int
+sp_shmbuf_remove_client (ShmBuffer * buf, int fd)
+{
+  int i;
+
+  for (i = 0; i < buf->num_clients; i++) {
+    if (buf->clients[i] == fd) {
+      buf->clients[i] = -1;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void
+sp_rings_free (ShmRings * rings)
+{
+  if (rings->area != MAP_FAILED)
+    munmap (rings->area, sizeof (struct RingArea));
+  if (rings->shm_fd >= 0)
+    close (rings->shm_fd);
+  if (rings->buffers_efd >= 0)
+    close (rings->buffers_efd);
+  if (rings->acks_efd >= 0)
+    close (rings->acks_efd);
+  spalloc_free (ShmRings, rings);
+}
+
+/* Maps the rings from their fds: the shm area, then the eventfds */
+static ShmRings *
+sp_rings_open (int *fds)
+{
+  ShmRings *rings = spalloc_new (ShmRings);
+
+  rings->shm_fd = fds[0];
+  rings->buffers_efd = fds[1];
+  rings->acks_efd = fds[2];
+
+  rings->area = mmap (NULL, sizeof (struct RingArea), PROT_READ | PROT_WRITE,
+      MAP_SHARED, rings->shm_fd, 0);
+
+  if (rings->area == MAP_FAILED) {
+    sp_rings_free (rings);
+    return NULL;
+  }
+
+  return rings;
+}
+
+static ShmRings *
+sp_rings_new (void)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  int fds[RINGS_N_FDS] = { -1, -1, -1 };
+  char tmppath[32];
+  int i = 0;
+
+  do {
+    snprintf (tmppath, sizeof (tmppath), "/shmpipe.%5d.ring.%d", getpid (),
+        i++);
+    fds[0] = shm_open (tmppath, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  } while (fds[0] < 0 && errno == EEXIST);
+
+  if (fds[0] < 0)
+    goto error;
+
+  /* Only shared by passing its fd */
+  shm_unlink (tmppath);
+
+  /* The new area is zeroed, so the rings are empty */
+  if (ftruncate (fds[0], sizeof (struct RingArea)))
+    goto error;
+
+  fds[1] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fds[2] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fds[1] < 0 || fds[2] < 0)
+    goto error;
+
+  return sp_rings_open (fds);
+
+error:
+  for (i = 0; i < RINGS_N_FDS; i++)
+    if (fds[i] >= 0)
+      close (fds[i]);
+#endif
+  return NULL;
+}
+
+static void
+sp_notify (int efd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  eventfd_write (efd, 1);
+#endif
+}
+
+static void
+sp_clear_notify (int efd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  eventfd_t value;
+
+  eventfd_read (efd, &value);
+#endif
+}
+
+/* The full barriers make sure that either the consumer sees a new entry
+ * before going to sleep, or the producer sees that the consumer emptied the
+ * ring and wakes it up */
+static int
+sp_ring_push (struct Ring *ring, const struct RingEntry *entry, int efd)
+{
+  unsigned int head = ring->head;
+
+  if (head - ring->tail >= RING_SIZE)
+    return 0;
+
+  ring->entries[head % RING_SIZE] = *entry;
+  __sync_synchronize ();
+  ring->head = head + 1;
+  __sync_synchronize ();
+
+  if (ring->tail == head)
+    sp_notify (efd);
+
+  return 1;
+}
+
+static int
+sp_ring_is_full (struct Ring *ring)
+{
+  return ring->head - ring->tail >= RING_SIZE;
+}
+
+static struct RingEntry *
+sp_ring_peek (struct Ring *ring)
+{
+  unsigned int tail = ring->tail;
+
+  __sync_synchronize ();
+  if (ring->head == tail)
+    return NULL;
+  __sync_synchronize ();
+
+  return &ring->entries[tail % RING_SIZE];
+}
+
+static void
+sp_ring_advance (struct Ring *ring)
+{
+  __sync_synchronize ();
+  ring->tail = ring->tail + 1;
+}
 
+/* Returns the next entry, clearing the eventfd of the ring before deciding
+ * that it is empty so that no wakeup is lost */
+static struct RingEntry *
+sp_ring_peek_or_clear (struct Ring *ring, int efd)
+{
+  struct RingEntry *entry = sp_ring_peek (ring);
+
+  if (entry)
+    return entry;
+
+  sp_clear_notify (efd);
 
+  return sp_ring_peek (ring);
+}
 
 #define RETURN_ERROR(format, ...) do {                  \
   fprintf (stderr, format, __VA_ARGS__);                \
@@ -231,7 +514,7 @@ sp_writer_create (const char *path, size_t size, mode_t perms)
   if (listen (self->main_socket, LISTEN_BACKLOG) < 0)
     RETURN_ERROR ("listen() failed (%d): %s\n", errno, strerror (errno));
 
-  self->shm_area = sp_open_shm (NULL, ++self->next_area_id, perms, size);
+  self->shm_area = sp_open_shm (NULL, ++self->next_area_id, perms, size, 0);
 
   self->perms = perms;
 
@@ -254,12 +537,15 @@ sp_writer_create (const char *path, size_t size, mode_t perms)
  * sp_open_shm:
  * @path: Path of the shm area for a reader,
  *  NULL if this is a writer (then it will allocate its own path)
+ * @slot_size: Size of the fixed slots the area of a writer is split into,
+ *  0 for variable size blocks
  *
  * Opens a ShmArea
  */
 
 static ShmArea *
-sp_open_shm (char *path, int id, mode_t perms, size_t size)
+sp_open_shm (char *path, int id, mode_t perms, size_t size,
+    unsigned long slot_size)
 {
   ShmArea *area = spalloc_new (ShmArea);
   char tmppath[32];
@@ -314,7 +600,8 @@ sp_open_shm (char *path, int id, mode_t perms, size_t size)
   area->id = id;
 
   if (!path)
-    area->allocspace = shm_alloc_space_new (area->shm_area_len);
+    area->allocspace = shm_alloc_space_new_slots (area->shm_area_len,
+        slot_size);
 
   return area;
 }
@@ -421,6 +708,11 @@ sp_close (ShmPipe * self)
   while (self->clients)
     sp_writer_close_client (self, self->clients);
 
+  if (self->rings) {
+    sp_rings_free (self->rings);
+    self->rings = NULL;
+  }
+
   sp_dec (self);
 }
 
@@ -451,8 +743,10 @@ send_command (int fd, struct CommandBuffer *cb, unsigned short int type,
   return 1;
 }
 
-int
-sp_writer_resize (ShmPipe * self, size_t size)
+/* Replaces the current area by a new one of @size bytes, the old area
+ * stays around until all its buffers are released */
+static int
+sp_writer_switch_area (ShmPipe * self, size_t size)
 {
   ShmArea *newarea;
   ShmArea *old_current;
@@ -460,10 +754,8 @@ sp_writer_resize (ShmPipe * self, size_t size)
   int c = 0;
   int pathlen;
 
-  if (self->shm_area->shm_area_len == size)
-    return 0;
-
-  newarea = sp_open_shm (NULL, ++self->next_area_id, self->perms, size);
+  newarea = sp_open_shm (NULL, ++self->next_area_id, self->perms, size,
+      self->slot_size);
 
   if (!newarea)
     return -1;
@@ -477,6 +769,10 @@ sp_writer_resize (ShmPipe * self, size_t size)
   for (client = self->clients; client; client = client->next) {
     struct CommandBuffer cb = { 0 };
 
+    /* The client unmaps the old area once it holds no buffer of it, so the
+     * buffers queued for it can't be sent anymore */
+    client->stats.dropped += sp_writer_clear_queue (self, client);
+
     if (!send_command (client->fd, &cb, COMMAND_CLOSE_SHM_AREA,
             old_current->id))
       continue;
@@ -498,6 +794,42 @@ sp_writer_resize (ShmPipe * self, size_t size)
   return c;
 }
 
+int
+sp_writer_resize (ShmPipe * self, size_t size)
+{
+  if (self->shm_area->shm_area_len == size)
+    return 0;
+
+  return sp_writer_switch_area (self, size);
+}
+
+/* Makes the blocks be allocated from fixed slots of @slot_size bytes,
+ * or variable size blocks if it is 0 */
+int
+sp_writer_set_slot_size (ShmPipe * self, size_t slot_size)
+{
+  return sp_writer_resize_slots (self, self->shm_area->shm_area_len,
+      slot_size);
+}
+
+/* Changes both the size of the area and the size of its slots at once */
+int
+sp_writer_resize_slots (ShmPipe * self, size_t size, size_t slot_size)
+{
+  unsigned long old_slot_size = self->slot_size;
+  int ret;
+
+  if (self->shm_area->shm_area_len == size && old_slot_size == slot_size)
+    return 0;
+
+  self->slot_size = slot_size;
+  ret = sp_writer_switch_area (self, size);
+  if (ret < 0)
+    self->slot_size = old_slot_size;
+
+  return ret;
+}
+
 ShmBlock *
 sp_writer_alloc_block (ShmPipe * self, size_t size)
 {
@@ -539,7 +871,160 @@ sp_writer_free_block (ShmBlock * block)
   spalloc_free (ShmBlock, block);
 }
 
-/* Returns the number of client this has successfully been sent to */
+static ShmBuffer *
+sp_shmbuf_new (ShmArea * area, unsigned long offset, size_t size,
+    ShmAllocBlock * ablock, int num_clients)
+{
+  ShmBuffer *sb;
+
+  sb = spalloc_alloc (sizeof (ShmBuffer) + sizeof (int) * num_clients);
+  memset (sb, 0, sizeof (ShmBuffer));
+  memset (sb->clients, -1, sizeof (int) * num_clients);
+  sb->shm_area = area;
+  sb->offset = offset;
+  sb->size = size;
+  sb->num_clients = num_clients;
+  sb->ablock = ablock;
+
+  return sb;
+}
+
+/* Adds @sb to the buffers waiting for the acks of the @c clients it was
+ * sent to */
+static void
+sp_writer_add_shmbuf (ShmPipe * self, ShmBuffer * sb, int c)
+{
+  sp_shm_area_inc (sb->shm_area);
+  shm_alloc_space_block_inc (sb->ablock);
+
+  sb->use_count = c;
+  sb->send_time = sp_get_time ();
+
+  sb->next = self->buffers;
+  self->buffers = sb;
+}
+
+/* Sends the buffer at @offset in @area to @client, returns 0 if it failed */
+static int
+sp_writer_send_to_client (ShmClient * client, ShmArea * area,
+    unsigned long offset, unsigned long size)
+{
+  struct CommandBuffer cb = { 0 };
+
+  if (client->rings) {
+    struct RingEntry entry;
+
+    entry.area_id = area->id;
+    entry.offset = offset;
+    entry.size = size;
+    return sp_ring_push (&client->rings->area->buffers, &entry,
+        client->rings->buffers_efd);
+  }
+
+  cb.payload.buffer.offset = offset;
+  cb.payload.buffer.size = size;
+
+  return send_command (client->fd, &cb, COMMAND_NEW_BUFFER, area->id);
+}
+
+static void
+sp_writer_client_sent (ShmClient * client)
+{
+  client->drops = 0;
+  client->stats.sent++;
+  client->stats.pending++;
+}
+
+/* Whether @client holds as many buffers as it can or its ring is full */
+static int
+sp_writer_client_is_full (ShmClient * client)
+{
+  if (client->max_pending && client->stats.pending >= client->max_pending)
+    return 1;
+
+  return client->rings && sp_ring_is_full (&client->rings->area->buffers);
+}
+
+static void
+sp_writer_queue_buf (ShmClient * client, ShmArea * area,
+    unsigned long offset, unsigned long size, ShmAllocBlock * ablock)
+{
+  ShmQueued *queued = spalloc_new (ShmQueued);
+
+  queued->area = area;
+  queued->offset = offset;
+  queued->size = size;
+  queued->ablock = ablock;
+  queued->next = NULL;
+  sp_shm_area_inc (area);
+  shm_alloc_space_block_inc (ablock);
+
+  if (client->queue_tail)
+    client->queue_tail->next = queued;
+  else
+    client->queue = queued;
+  client->queue_tail = queued;
+  client->stats.queued++;
+}
+
+static ShmQueued *
+sp_writer_dequeue (ShmClient * client)
+{
+  ShmQueued *queued = client->queue;
+
+  client->queue = queued->next;
+  if (!client->queue)
+    client->queue_tail = NULL;
+  client->stats.queued--;
+
+  return queued;
+}
+
+static void
+sp_queued_free (ShmPipe * self, ShmQueued * queued)
+{
+  shm_alloc_space_block_dec (queued->ablock);
+  sp_shm_area_dec (self, queued->area);
+  spalloc_free (ShmQueued, queued);
+}
+
+/* Drops the buffers queued for @client, returns how many there were */
+static int
+sp_writer_clear_queue (ShmPipe * self, ShmClient * client)
+{
+  int n = 0;
+
+  while (client->queue) {
+    sp_queued_free (self, sp_writer_dequeue (client));
+    n++;
+  }
+
+  return n;
+}
+
+/* Sends the queued buffers of @client as long as it can take them */
+static void
+sp_writer_flush_queue (ShmPipe * self, ShmClient * client)
+{
+  while (client->queue && !client->disconnected &&
+      !sp_writer_client_is_full (client)) {
+    ShmQueued *queued = sp_writer_dequeue (client);
+
+    if (sp_writer_send_to_client (client, queued->area, queued->offset,
+            queued->size)) {
+      ShmBuffer *sb = sp_shmbuf_new (queued->area, queued->offset,
+          queued->size, queued->ablock, 1);
+
+      sb->clients[0] = client->fd;
+      sp_writer_add_shmbuf (self, sb, 1);
+      sp_writer_client_sent (client);
+    }
+    sp_queued_free (self, queued);
+  }
+}
+
+/* Returns the number of client this has successfully been sent or queued
+ * to */
 
 int
 sp_writer_send_buf (ShmPipe * self, char *buf, size_t size)
@@ -569,39 +1054,121 @@ sp_writer_send_buf (ShmPipe * self, char *buf, size_t size)
   if (!ablock)
     return -1;
 
-  sb = spalloc_alloc (sizeof (ShmBuffer) + sizeof (int) * self->num_clients);
-  memset (sb, 0, sizeof (ShmBuffer));
-  memset (sb->clients, -1, sizeof (int) * self->num_clients);
-  sb->shm_area = area;
-  sb->offset = offset;
-  sb->size = size;
-  sb->num_clients = self->num_clients;
-  sb->ablock = ablock;
+  sb = sp_shmbuf_new (area, offset, size, ablock, self->num_clients);
 
   for (client = self->clients; client; client = client->next) {
-    struct CommandBuffer cb = { 0 };
-    cb.payload.buffer.offset = offset;
-    cb.payload.buffer.size = bsize;
-    if (!send_command (client->fd, &cb, COMMAND_NEW_BUFFER, self->shm_area->id))
+    if (client->disconnected)
       continue;
+
+    /* The buffers queued before this one go first */
+    sp_writer_flush_queue (self, client);
+
+    if (client->queue || sp_writer_client_is_full (client)) {
+      /* Nothing is lost for a blocking client, the app waits for
+       * sp_writer_can_send() before sending more */
+      if (client->policy == SP_POLICY_BLOCK) {
+        sp_writer_queue_buf (client, area, offset, bsize, ablock);
+        c++;
+        continue;
+      }
+
+      if (client->policy == SP_POLICY_DROP_OLDEST) {
+        /* The client never saw the queued buffers, the oldest one can go
+         * right away */
+        sp_writer_queue_buf (client, area, offset, bsize, ablock);
+        if (client->stats.queued >
+            (client->max_pending ? client->max_pending : RING_SIZE)) {
+          sp_queued_free (self, sp_writer_dequeue (client));
+          client->stats.dropped++;
+        }
+        c++;
+        continue;
+      }
+
+      client->stats.dropped++;
+      if (client->policy == SP_POLICY_DISCONNECT &&
+          ++client->drops >= client->max_drops) {
+        /* The owner of the client fd closes it when it sees the hangup */
+        shutdown (client->fd, SHUT_RDWR);
+        client->disconnected = 1;
+      }
+      continue;
+    }
+
+    if (!sp_writer_send_to_client (client, area, offset, bsize))
+      continue;
+
     sb->clients[i++] = client->fd;
+    sp_writer_client_sent (client);
     c++;
   }
 
-  if (c == 0) {
+  if (i == 0) {
     spalloc_free1 (sizeof (ShmBuffer) + sizeof (int) * sb->num_clients, sb);
-    return 0;
+    return c;
   }
 
-  sp_shm_area_inc (area);
-  shm_alloc_space_block_inc (ablock);
+  sp_writer_add_shmbuf (self, sb, i);
 
-  sb->use_count = c;
+  return c;
+}
 
-  sb->next = self->buffers;
-  self->buffers = sb;
+/* Sends the fds of the rings in the ancillary data of a 1 byte message */
+static int
+sp_send_fds (int fd, int *fds)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE (sizeof (int) * RINGS_N_FDS)];
+  char dummy = 0;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = &dummy;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (int) * RINGS_N_FDS);
+  memcpy (CMSG_DATA (cmsg), fds, sizeof (int) * RINGS_N_FDS);
+
+  return sendmsg (fd, &msg, MSG_NOSIGNAL) == 1;
+}
 
-  return c;
+static int
+sp_recv_fds (int fd, int *fds)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  char control[CMSG_SPACE (sizeof (int) * RINGS_N_FDS)];
+  char dummy;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = &dummy;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+
+  if (recvmsg (fd, &msg, MSG_CMSG_CLOEXEC) != 1)
+    return 0;
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN (sizeof (int) * RINGS_N_FDS))
+    return 0;
+
+  memcpy (fds, CMSG_DATA (cmsg), sizeof (int) * RINGS_N_FDS);
+
+  return 1;
 }
 
 static int
@@ -643,15 +1210,31 @@ sp_client_recv (ShmPipe * self, char **buf)
       }
 
       newarea = sp_open_shm (area_name, cb.area_id, 0,
-          cb.payload.new_shm_area.size);
+          cb.payload.new_shm_area.size, 0);
       free (area_name);
       if (!newarea)
         return -4;
 
       newarea->next = self->shm_area;
       self->shm_area = newarea;
+      if (newarea->id > self->max_area_id)
+        self->max_area_id = newarea->id;
       break;
 
+    case COMMAND_NEW_RINGS:
+    {
+      int fds[RINGS_N_FDS];
+
+      if (self->rings)
+        return -5;
+      if (!sp_recv_fds (self->main_socket, fds))
+        return -6;
+      self->rings = sp_rings_open (fds);
+      if (!self->rings)
+        return -7;
+      break;
+    }
+
     case COMMAND_CLOSE_SHM_AREA:
       for (area = self->shm_area; area; area = area->next) {
         if (area->id == cb.area_id) {
@@ -679,10 +1262,36 @@ sp_client_recv (ShmPipe * self, char **buf)
   return 0;
 }
 
+/* Handles the ack of the buffer at @offset in the area @area_id */
+static int
+sp_writer_ack (ShmPipe * self, ShmClient * client, int area_id,
+    unsigned long offset)
+{
+  ShmBuffer *buf = NULL, *prev_buf = NULL;
+
+  for (buf = self->buffers; buf; buf = buf->next) {
+    if (buf->shm_area->id == area_id && buf->offset == offset &&
+        sp_shmbuf_remove_client (buf, client->fd)) {
+      unsigned long long latency = sp_get_time () - buf->send_time;
+
+      client->stats.acked++;
+      client->stats.pending--;
+      client->stats.total_latency += latency;
+      if (latency > client->stats.max_latency)
+        client->stats.max_latency = latency;
+      sp_shmbuf_dec (self, buf, prev_buf);
+      sp_writer_flush_queue (self, client);
+      return 0;
+    }
+    prev_buf = buf;
+  }
+
+  return -2;
+}
+
 int
 sp_writer_recv (ShmPipe * self, ShmClient * client)
 {
-  ShmBuffer *buf = NULL, *prev_buf = NULL;
   struct CommandBuffer cb;
 
   if (!recv_command (client->fd, &cb))
@@ -690,32 +1299,63 @@ sp_writer_recv (ShmPipe * self, ShmClient * client)
 
   switch (cb.type) {
     case COMMAND_ACK_BUFFER:
+      return sp_writer_ack (self, client, cb.area_id,
+          cb.payload.ack_buffer.offset);
+    default:
+      return -99;
+  }
 
-      for (buf = self->buffers; buf; buf = buf->next) {
-        if (buf->shm_area->id == cb.area_id &&
-            buf->offset == cb.payload.ack_buffer.offset) {
-          sp_shmbuf_dec (self, buf, prev_buf);
-          break;
-        }
-        prev_buf = buf;
-      }
+  return 0;
+}
 
-      if (!buf)
-        return -2;
+/* Handles all the acks in the ring of @client */
+int
+sp_writer_recv_ring (ShmPipe * self, ShmClient * client)
+{
+  struct Ring *ring;
+  struct RingEntry *entry;
 
-      break;
-    default:
-      return -99;
+  if (!client->rings)
+    return -1;
+
+  ring = &client->rings->area->acks;
+  while ((entry = sp_ring_peek_or_clear (ring, client->rings->acks_efd))) {
+    int area_id = entry->area_id;
+    unsigned long offset = entry->offset;
+
+    sp_ring_advance (ring);
+    if (sp_writer_ack (self, client, area_id, offset) < 0)
+      return -2;
   }
 
   return 0;
 }
 
+int
+sp_writer_get_client_ring_fd (ShmClient * client)
+{
+  return client->rings ? client->rings->acks_efd : -1;
+}
+
+int
+sp_writer_set_use_rings (ShmPipe * self, int use_rings)
+{
+#ifndef HAVE_SYS_EVENTFD_H
+  if (use_rings)
+    return -1;
+#endif
+
+  self->use_rings = use_rings;
+
+  return 0;
+}
+
 int
 sp_client_recv_finish (ShmPipe * self, char *buf)
 {
   ShmArea *shm_area = NULL;
   unsigned long offset;
+  int area_id;
   struct CommandBuffer cb = { 0 };
 
   for (shm_area = self->shm_area; shm_area; shm_area = shm_area->next) {
@@ -727,12 +1367,77 @@ sp_client_recv_finish (ShmPipe * self, char *buf)
   assert (shm_area);
 
   offset = buf - shm_area->shm_area_buf;
+  area_id = shm_area->id;
 
   sp_shm_area_dec (self, shm_area);
 
+  if (self->rings) {
+    struct RingEntry entry;
+
+    entry.area_id = area_id;
+    entry.offset = offset;
+    entry.size = 0;
+    if (sp_ring_push (&self->rings->area->acks, &entry,
+            self->rings->acks_efd))
+      return 1;
+  }
+
   cb.payload.ack_buffer.offset = offset;
-  return send_command (self->main_socket, &cb, COMMAND_ACK_BUFFER,
-      self->shm_area->id);
+  return send_command (self->main_socket, &cb, COMMAND_ACK_BUFFER, area_id);
+}
+
+/* Gets the next buffer from the ring, returns 0 if there is none */
+long int
+sp_client_recv_ring (ShmPipe * self, char **buf)
+{
+  struct Ring *ring;
+  struct RingEntry *entry;
+
+  if (!self->rings)
+    return 0;
+
+  ring = &self->rings->area->buffers;
+  while ((entry = sp_ring_peek_or_clear (ring, self->rings->buffers_efd))) {
+    ShmArea *area;
+    long int size = entry->size;
+
+    /* Wait for the socket message announcing its area */
+    if (entry->area_id > self->max_area_id)
+      return 0;
+
+    for (area = self->shm_area; area; area = area->next)
+      if (area->id == entry->area_id)
+        break;
+
+    if (!area) {
+      struct RingEntry ack = *entry;
+
+      /* Its area was closed in the meantime, give it back */
+      sp_ring_advance (ring);
+      if (!sp_ring_push (&self->rings->area->acks, &ack,
+              self->rings->acks_efd)) {
+        struct CommandBuffer cb = { 0 };
+
+        cb.payload.ack_buffer.offset = ack.offset;
+        send_command (self->main_socket, &cb, COMMAND_ACK_BUFFER,
+            ack.area_id);
+      }
+      continue;
+    }
+
+    *buf = area->shm_area_buf + entry->offset;
+    sp_shm_area_inc (area);
+    sp_ring_advance (ring);
+    return size;
+  }
+
+  return 0;
+}
+
+int
+sp_client_get_ring_fd (ShmPipe * self)
+{
+  return self->rings ? self->rings->buffers_efd : -1;
 }
 
 ShmPipe *
@@ -794,7 +1499,28 @@ sp_writer_accept_client (ShmPipe * self)
   }
 
   client = spalloc_new (ShmClient);
+  memset (client, 0, sizeof (ShmClient));
   client->fd = fd;
+  client->policy = SP_POLICY_BLOCK;
+
+  if (self->use_rings)
+    client->rings = sp_rings_new ();
+
+  if (client->rings) {
+    int fds[RINGS_N_FDS];
+
+    fds[0] = client->rings->shm_fd;
+    fds[1] = client->rings->buffers_efd;
+    fds[2] = client->rings->acks_efd;
+
+    if (!send_command (fd, &cb, COMMAND_NEW_RINGS, self->shm_area->id) ||
+        !sp_send_fds (fd, fds)) {
+      fprintf (stderr, "Sending rings failed: %s", strerror (errno));
+      sp_rings_free (client->rings);
+      spalloc_free (ShmClient, client);
+      goto error;
+    }
+  }
 
   /* Prepend ot linked list */
   client->next = self->clients;
@@ -838,20 +1564,19 @@ sp_writer_close_client (ShmPipe * self, ShmClient * client)
   close (client->fd);
 
 again:
+  prev_buf = NULL;
   for (buffer = self->buffers; buffer; buffer = buffer->next) {
-    int i;
-
-    for (i = 0; i < buffer->num_clients; i++) {
-      if (buffer->clients[i] == client->fd) {
-        buffer->clients[i] = -1;
-        if (!sp_shmbuf_dec (self, buffer, prev_buf))
-          goto again;
-        break;
-      }
-      prev_buf = buffer;
-    }
+    if (sp_shmbuf_remove_client (buffer, client->fd) &&
+        !sp_shmbuf_dec (self, buffer, prev_buf))
+      goto again;
+    prev_buf = buffer;
   }
 
+  sp_writer_clear_queue (self, client);
+
+  if (client->rings)
+    sp_rings_free (client->rings);
+
   for (item = self->clients; item; item = item->next) {
     if (item == client)
       break;
@@ -884,9 +1609,48 @@ sp_writer_get_client_fd (ShmClient * client)
 int
 sp_writer_pending_writes (ShmPipe * self)
 {
+  ShmClient *client;
+
+  for (client = self->clients; client; client = client->next)
+    if (client->queue)
+      return 1;
+
   return (self->buffers != NULL);
 }
 
+/* Returns 0 if a client with SP_POLICY_BLOCK holds as many buffers as it
+ * can, has a full ring or still has buffers queued */
+int
+sp_writer_can_send (ShmPipe * self)
+{
+  ShmClient *client;
+
+  for (client = self->clients; client; client = client->next) {
+    if (client->policy != SP_POLICY_BLOCK || client->disconnected)
+      continue;
+    if (client->queue || sp_writer_client_is_full (client))
+      return 0;
+  }
+
+  return 1;
+}
+
+void
+sp_writer_client_set_policy (ShmClient * client, ShmClientPolicy policy,
+    unsigned int max_pending, unsigned int max_drops)
+{
+  client->policy = policy;
+  client->max_pending = max_pending;
+  client->max_drops = max_drops;
+  client->drops = 0;
+}
+
+void
+sp_writer_client_get_stats (ShmClient * client, ShmClientStats * stats)
+{
+  *stats = client->stats;
+}
+
 const char *
 sp_writer_get_path (ShmPipe * pipe)
 {
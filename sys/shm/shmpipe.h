@@ -52,6 +52,31 @@
  * message and <0 if there was an error. If there was an error, one must close
  * it with sp_close(). If was valid buffer was received, the client must release
  * it with sp_client_recv_finish() when it is done reading from it.
+ *
+ * By default, every buffer is sent to every client and its block is held
+ * until all of them have acknowledged it, so a slow client holds memory
+ * until the writer can't allocate anymore. sp_writer_client_set_policy()
+ * limits the number of buffers a client can hold and decides what happens
+ * when it is reached: the writer waits (sp_writer_can_send() returns 0), the
+ * new buffer is not sent to it, the new buffers are queued until it
+ * acknowledges one and the oldest queued buffer is dropped once there are
+ * more than its limit (they were never sent, so a client that doesn't
+ * acknowledge anything holds at most twice its limit), or the client is
+ * disconnected after a number of consecutive drops (its socket is shut down,
+ * which the app sees as an error on it).
+ *
+ * With sp_writer_set_use_rings(), the clients accepted afterwards exchange
+ * the buffers and their acks through rings in shared memory instead of
+ * one socket message each (this needs eventfd, it fails without it). The
+ * writer must then also select() on the fd from
+ * sp_writer_get_client_ring_fd() and call sp_writer_recv_ring() when it is
+ * readable. A client gets its rings through sp_client_recv(), it must then
+ * also select() on the fd from sp_client_get_ring_fd() and take the buffers
+ * with sp_client_recv_ring() until it returns 0, and it must do so before
+ * sleeping as the fd is only signalled when the ring stops being empty.
+ * The buffers for a client with a full ring are queued like the ones for a
+ * client that holds as many buffers as it can, for a client with
+ * SP_POLICY_BLOCK sp_writer_can_send() returns 0 until they are sent.
  */
 
 
@@ -72,6 +97,27 @@ typedef struct _ShmClient ShmClient;
 typedef struct _ShmPipe ShmPipe;
 typedef struct _ShmBlock ShmBlock;
 
+typedef enum
+{
+  SP_POLICY_BLOCK,
+  SP_POLICY_DROP_NEWEST,
+  SP_POLICY_DROP_OLDEST,
+  SP_POLICY_DISCONNECT
+} ShmClientPolicy;
+
+typedef struct
+{
+  unsigned long sent;
+  unsigned long acked;
+  unsigned long dropped;
+  unsigned int pending;
+  /* Buffers waiting to be sent */
+  unsigned int queued;
+  /* Time between sending a buffer and its ack, in microseconds */
+  unsigned long long total_latency;
+  unsigned long long max_latency;
+} ShmClientStats;
+
 ShmPipe *sp_writer_create (const char *path, size_t size, mode_t perms);
 const char *sp_writer_get_path (ShmPipe *pipe);
 void sp_close (ShmPipe * self);
@@ -80,6 +126,8 @@ void sp_set_data (ShmPipe * self, void *data);
 
 int sp_writer_setperms_shm (ShmPipe * self, mode_t perms);
 int sp_writer_resize (ShmPipe * self, size_t size);
+int sp_writer_set_slot_size (ShmPipe * self, size_t slot_size);
+int sp_writer_resize_slots (ShmPipe * self, size_t size, size_t slot_size);
 
 int sp_get_fd (ShmPipe * self);
 int sp_writer_get_client_fd (ShmClient * client);
@@ -94,11 +142,22 @@ ShmClient * sp_writer_accept_client (ShmPipe * self);
 void sp_writer_close_client (ShmPipe *self, ShmClient * client);
 int sp_writer_recv (ShmPipe * self, ShmClient * client);
 
+int sp_writer_set_use_rings (ShmPipe * self, int use_rings);
+int sp_writer_get_client_ring_fd (ShmClient * client);
+int sp_writer_recv_ring (ShmPipe * self, ShmClient * client);
+
 int sp_writer_pending_writes (ShmPipe * self);
+int sp_writer_can_send (ShmPipe * self);
+
+void sp_writer_client_set_policy (ShmClient * client, ShmClientPolicy policy,
+    unsigned int max_pending, unsigned int max_drops);
+void sp_writer_client_get_stats (ShmClient * client, ShmClientStats * stats);
 
 ShmPipe *sp_client_open (const char *path);
 long int sp_client_recv (ShmPipe * self, char **buf);
 int sp_client_recv_finish (ShmPipe * self, char *buf);
+int sp_client_get_ring_fd (ShmPipe * self);
+long int sp_client_recv_ring (ShmPipe * self, char **buf);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,223 @@
+/* GStreamer
+ *
+ * unit test for colorspace
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <gst/check/gstcheck.h>
+#include <gst/video/video.h>
+#include <string.h>
+
+/* Not a multiple of the band alignment, so the last band is shorter */
+#define WIDTH 320
+#define HEIGHT 250
+
+static GstPad *mysrcpad, *mysinkpad;
+
+static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static GstBuffer *
+create_frame (GstVideoFormat format, gint width, gint height)
+{
+  GstBuffer *buf;
+  GRand *rand;
+  guint i;
+
+  buf = gst_buffer_new_and_alloc (gst_video_format_get_size (format, width,
+          height));
+  /* the same frame for every conversion */
+  rand = g_rand_new_with_seed (0x4242);
+  for (i = 0; i < GST_BUFFER_SIZE (buf); i++)
+    GST_BUFFER_DATA (buf)[i] = g_rand_int_range (rand, 0, 256);
+  g_rand_free (rand);
+
+  gst_buffer_set_caps (buf, GST_PAD_CAPS (mysrcpad));
+
+  return buf;
+}
+
+static GstElement *
+setup_colorspace (gint dither, guint n_threads)
+{
+  GstElement *csp;
+
+  csp = gst_check_setup_element ("colorspace");
+  g_object_set (csp, "n-threads", n_threads, "dither", dither, NULL);
+  mysrcpad = gst_check_setup_src_pad (csp, &srctemplate, NULL);
+  mysinkpad = gst_check_setup_sink_pad (csp, &sinktemplate, NULL);
+  gst_pad_set_active (mysrcpad, TRUE);
+  gst_pad_set_active (mysinkpad, TRUE);
+  gst_pad_use_fixed_caps (mysinkpad);
+
+  fail_unless (gst_element_set_state (csp, GST_STATE_PLAYING) ==
+      GST_STATE_CHANGE_SUCCESS);
+
+  return csp;
+}
+
+static void
+cleanup_colorspace (GstElement * csp)
+{
+  fail_unless (gst_element_set_state (csp, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS);
+  gst_pad_set_active (mysrcpad, FALSE);
+  gst_pad_set_active (mysinkpad, FALSE);
+  gst_check_teardown_src_pad (csp);
+  gst_check_teardown_sink_pad (csp);
+  gst_check_teardown_element (csp);
+}
+
+/* Negotiates @csp to convert from @from to @to and converts a frame */
+static GstBuffer *
+push_frame (GstVideoFormat from, GstVideoFormat to, gint width, gint height)
+{
+  GstCaps *caps;
+  GstBuffer *outbuf;
+
+  caps = gst_video_format_new_caps (to, width, height, 25, 1, 1, 1);
+  fail_unless (gst_pad_set_caps (mysinkpad, caps));
+  gst_caps_unref (caps);
+  caps = gst_video_format_new_caps (from, width, height, 25, 1, 1, 1);
+  fail_unless (gst_pad_set_caps (mysrcpad, caps));
+  gst_caps_unref (caps);
+
+  fail_unless_equals_int (gst_pad_push (mysrcpad, create_frame (from, width,
+              height)), GST_FLOW_OK);
+  fail_unless_equals_int (g_list_length (buffers), 1);
+  outbuf = gst_buffer_ref (buffers->data);
+  fail_unless_equals_int (GST_BUFFER_SIZE (outbuf),
+      gst_video_format_get_size (to, width, height));
+  gst_check_drop_buffers ();
+
+  return outbuf;
+}
+
+/* Converts a frame from @from to @to with @n_threads threads */
+static GstBuffer *
+convert_frame (GstVideoFormat from, GstVideoFormat to, gint dither,
+    guint n_threads)
+{
+  GstElement *csp;
+  GstBuffer *outbuf;
+
+  csp = setup_colorspace (dither, n_threads);
+  outbuf = push_frame (from, to, WIDTH, HEIGHT);
+  cleanup_colorspace (csp);
+
+  return outbuf;
+}
+
+/* The output of a conversion in bands must be identical to the one of
+ * a single thread */
+static void
+check_bands (GstVideoFormat from, GstVideoFormat to, gint dither)
+{
+  GstBuffer *single, *banded;
+
+  single = convert_frame (from, to, dither, 1);
+  banded = convert_frame (from, to, dither, 4);
+
+  fail_unless (memcmp (GST_BUFFER_DATA (single), GST_BUFFER_DATA (banded),
+          GST_BUFFER_SIZE (single)) == 0,
+      "banded output differs when converting from %d to %d", from, to);
+
+  gst_buffer_unref (single);
+  gst_buffer_unref (banded);
+}
+
+GST_START_TEST (test_bands_fastpath)
+{
+  check_bands (GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_YUY2, 0);
+  check_bands (GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_BGRA, 0);
+  check_bands (GST_VIDEO_FORMAT_YUY2, GST_VIDEO_FORMAT_I420, 0);
+  check_bands (GST_VIDEO_FORMAT_AYUV, GST_VIDEO_FORMAT_Y42B, 0);
+  check_bands (GST_VIDEO_FORMAT_v210, GST_VIDEO_FORMAT_I420, 0);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_bands_generic)
+{
+  check_bands (GST_VIDEO_FORMAT_YUV9, GST_VIDEO_FORMAT_NV12, 0);
+  check_bands (GST_VIDEO_FORMAT_RGB, GST_VIDEO_FORMAT_Y41B, 0);
+  check_bands (GST_VIDEO_FORMAT_UYVY, GST_VIDEO_FORMAT_v308, 0);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_bands_dither)
+{
+  /* half-tone is done in bands, vertical error propagation is not */
+  check_bands (GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_RGB16, 2);
+  check_bands (GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_RGB16, 1);
+}
+
+GST_END_TEST;
+
+/* The band threads and their temporary lines are kept across caps changes,
+ * including to a bigger size */
+GST_START_TEST (test_bands_renegotiate)
+{
+  GstElement *csp;
+  GstBuffer *single, *banded;
+
+  csp = setup_colorspace (0, 4);
+  banded = push_frame (GST_VIDEO_FORMAT_I420, GST_VIDEO_FORMAT_YUY2, WIDTH,
+      HEIGHT);
+  gst_buffer_unref (banded);
+  banded = push_frame (GST_VIDEO_FORMAT_YUY2, GST_VIDEO_FORMAT_RGB,
+      2 * WIDTH, HEIGHT);
+  cleanup_colorspace (csp);
+
+  csp = setup_colorspace (0, 1);
+  single = push_frame (GST_VIDEO_FORMAT_YUY2, GST_VIDEO_FORMAT_RGB,
+      2 * WIDTH, HEIGHT);
+  cleanup_colorspace (csp);
+
+  fail_unless (memcmp (GST_BUFFER_DATA (single), GST_BUFFER_DATA (banded),
+          GST_BUFFER_SIZE (single)) == 0);
+
+  gst_buffer_unref (single);
+  gst_buffer_unref (banded);
+}
+
+GST_END_TEST;
+
+static Suite *
+colorspace_suite (void)
+{
+  Suite *s = suite_create ("colorspace");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_bands_fastpath);
+  tcase_add_test (tc_chain, test_bands_generic);
+  tcase_add_test (tc_chain, test_bands_dither);
+  tcase_add_test (tc_chain, test_bands_renegotiate);
+
+  return s;
+}
+
+GST_CHECK_MAIN (colorspace);
@@ -0,0 +1,203 @@
+/* GStreamer
+ *
+ * unit test for mpegtsmux
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <gst/check/gstcheck.h>
+#include <string.h>
+
+#define PACKET_SIZE 188
+/* One packet is then exactly 40608 ticks of the 27MHz clock */
+#define BITRATE 1000000
+#define PACKET_TICKS (PACKET_SIZE * 8 * G_GUINT64_CONSTANT (27000000) / BITRATE)
+#define N_FRAMES 10
+#define FRAME_SIZE 2000
+#define FRAME_DURATION (40 * GST_MSECOND)
+
+#define VIDEO_CAPS_STRING "video/mpeg, " \
+                          "mpegversion = (int) 2, " \
+                          "systemstream = (boolean) false, " \
+                          "width = (int) 320, " \
+                          "height = (int) 240, " \
+                          "framerate = (fraction) 25/1"
+
+static GstPad *mysrcpad, *mysinkpad;
+
+static GstStaticPadTemplate sinktemplate = GST_STATIC_PAD_TEMPLATE ("sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS ("video/mpegts"));
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS (VIDEO_CAPS_STRING));
+
+static GstElement *
+setup_mpegtsmux (void)
+{
+  GstElement *mux;
+  GstPad *sinkpad;
+
+  mux = gst_check_setup_element ("mpegtsmux");
+
+  mysrcpad = gst_pad_new_from_static_template (&srctemplate, "src");
+  sinkpad = gst_element_get_request_pad (mux, "sink_%d");
+  fail_unless (sinkpad != NULL);
+  fail_unless (gst_pad_link (mysrcpad, sinkpad) == GST_PAD_LINK_OK);
+  gst_object_unref (sinkpad);
+
+  mysinkpad = gst_check_setup_sink_pad (mux, &sinktemplate, NULL);
+  gst_pad_set_active (mysrcpad, TRUE);
+  gst_pad_set_active (mysinkpad, TRUE);
+
+  return mux;
+}
+
+static void
+cleanup_mpegtsmux (GstElement * mux)
+{
+  GstPad *sinkpad;
+
+  gst_pad_set_active (mysrcpad, FALSE);
+  gst_pad_set_active (mysinkpad, FALSE);
+
+  sinkpad = gst_pad_get_peer (mysrcpad);
+  gst_pad_unlink (mysrcpad, sinkpad);
+  gst_element_release_request_pad (mux, sinkpad);
+  gst_object_unref (sinkpad);
+  gst_object_unref (mysrcpad);
+
+  gst_check_teardown_sink_pad (mux);
+  gst_check_teardown_element (mux);
+}
+
+/* Muxes N_FRAMES frames and returns the output */
+static GByteArray *
+mux_frames (GstElement * mux)
+{
+  GByteArray *output = g_byte_array_new ();
+  GstCaps *caps;
+  GList *l;
+  guint i;
+
+  fail_unless (gst_element_set_state (mux, GST_STATE_PLAYING) ==
+      GST_STATE_CHANGE_SUCCESS);
+
+  caps = gst_caps_from_string (VIDEO_CAPS_STRING);
+  fail_unless (gst_pad_push_event (mysrcpad,
+          gst_event_new_new_segment (FALSE, 1.0, GST_FORMAT_TIME, 0, -1, 0)));
+  for (i = 0; i < N_FRAMES; i++) {
+    GstBuffer *buf = gst_buffer_new_and_alloc (FRAME_SIZE);
+
+    memset (GST_BUFFER_DATA (buf), 0, FRAME_SIZE);
+    GST_BUFFER_TIMESTAMP (buf) = i * FRAME_DURATION;
+    GST_BUFFER_DURATION (buf) = FRAME_DURATION;
+    if (i != 0)
+      GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_DELTA_UNIT);
+    gst_buffer_set_caps (buf, caps);
+    fail_unless_equals_int (gst_pad_push (mysrcpad, buf), GST_FLOW_OK);
+  }
+  gst_caps_unref (caps);
+  fail_unless (gst_pad_push_event (mysrcpad, gst_event_new_eos ()));
+
+  for (l = buffers; l; l = l->next)
+    g_byte_array_append (output, GST_BUFFER_DATA (l->data),
+        GST_BUFFER_SIZE (l->data));
+  gst_check_drop_buffers ();
+
+  fail_unless (gst_element_set_state (mux, GST_STATE_READY) ==
+      GST_STATE_CHANGE_SUCCESS);
+
+  return output;
+}
+
+/* Checks that the PCRs of @output match the position of their packet at
+ * BITRATE and returns the first one */
+static guint64
+check_pcr_spacing (GByteArray * output)
+{
+  guint64 first_pcr = 0, pcr;
+  guint i, first = 0, n_pcrs = 0;
+
+  fail_unless_equals_int (output->len % PACKET_SIZE, 0);
+
+  for (i = 0; i < output->len / PACKET_SIZE; i++) {
+    const guint8 *data = output->data + i * PACKET_SIZE;
+
+    fail_unless_equals_int (data[0], 0x47);
+    /* adaptation field with the PCR flag */
+    if (!(data[3] & 0x20) || data[4] == 0 || !(data[5] & 0x10))
+      continue;
+
+    pcr = ((guint64) GST_READ_UINT32_BE (data + 6) << 1 | data[10] >> 7) * 300
+        + ((data[10] & 0x01) << 8 | data[11]);
+
+    if (n_pcrs == 0) {
+      first_pcr = pcr;
+      first = i;
+    } else {
+      fail_unless_equals_uint64 (pcr - first_pcr, (i - first) * PACKET_TICKS);
+    }
+    n_pcrs++;
+  }
+
+  /* PCRs every 40ms over the N_FRAMES frames */
+  fail_unless (n_pcrs >= N_FRAMES / 2, "Only %u PCRs", n_pcrs);
+
+  return first_pcr;
+}
+
+GST_START_TEST (test_cbr_pcr_spacing)
+{
+  GstElement *mux;
+  GByteArray *output;
+  guint64 first_pcr;
+
+  mux = setup_mpegtsmux ();
+  g_object_set (mux, "bitrate", BITRATE, NULL);
+
+  output = mux_frames (mux);
+  first_pcr = check_pcr_spacing (output);
+  g_byte_array_free (output, TRUE);
+
+  /* Going through READY restarts the output clock from the first data */
+  output = mux_frames (mux);
+  fail_unless_equals_uint64 (check_pcr_spacing (output), first_pcr);
+  g_byte_array_free (output, TRUE);
+
+  fail_unless (gst_element_set_state (mux, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS);
+  cleanup_mpegtsmux (mux);
+}
+
+GST_END_TEST;
+
+static Suite *
+mpegtsmux_suite (void)
+{
+  Suite *s = suite_create ("mpegtsmux");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_cbr_pcr_spacing);
+
+  return s;
+}
+
+GST_CHECK_MAIN (mpegtsmux);
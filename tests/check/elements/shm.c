@@ -0,0 +1,342 @@
+/* GStreamer
+ *
+ * unit test for shmsink and its shared memory pipe
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <gst/check/gstcheck.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shmpipe.h"
+
+static GstStaticPadTemplate srctemplate = GST_STATIC_PAD_TEMPLATE ("src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY);
+
+static GMutex *connect_lock;
+static GCond *connect_cond;
+static gboolean connected;
+
+static gchar *
+get_socket_path (void)
+{
+  return g_strdup_printf ("%s/shm-test-%d", g_get_tmp_dir (), (gint) getpid ());
+}
+
+static void
+client_connected_cb (GstElement * sink, gint fd, gpointer user_data)
+{
+  g_mutex_lock (connect_lock);
+  connected = TRUE;
+  g_cond_signal (connect_cond);
+  g_mutex_unlock (connect_lock);
+}
+
+GST_START_TEST (test_shm_size_change)
+{
+  GstElement *sink;
+  GstPad *srcpad;
+  GstBuffer *buf;
+  ShmPipe *client;
+  gchar *path, *socket_path;
+  guint shm_size;
+  guint64 copied;
+  char *data;
+  long size;
+
+  connect_lock = g_mutex_new ();
+  connect_cond = g_cond_new ();
+  connected = FALSE;
+
+  path = get_socket_path ();
+  sink = gst_check_setup_element ("shmsink");
+  g_object_set (sink, "socket-path", path, "shm-size", 4096,
+      "wait-for-connection", FALSE, NULL);
+  g_signal_connect (sink, "client-connected",
+      G_CALLBACK (client_connected_cb), NULL);
+  srcpad = gst_check_setup_src_pad (sink, &srctemplate, NULL);
+  gst_pad_set_active (srcpad, TRUE);
+  fail_unless (gst_element_set_state (sink, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE);
+
+  g_object_get (sink, "socket-path", &socket_path, NULL);
+  client = sp_client_open (socket_path);
+  fail_unless (client != NULL);
+  g_mutex_lock (connect_lock);
+  while (!connected)
+    g_cond_wait (connect_cond, connect_lock);
+  g_mutex_unlock (connect_lock);
+  /* the area of 4096 bytes */
+  fail_unless_equals_int (sp_client_recv (client, &data), 0);
+
+  /* The buffer doesn't fit in the area it was started with */
+  g_object_set (sink, "shm-size", 16384, NULL);
+  g_object_get (sink, "shm-size", &shm_size, NULL);
+  fail_unless_equals_int (shm_size, 16384);
+
+  buf = gst_buffer_new_and_alloc (8192);
+  memset (GST_BUFFER_DATA (buf), 0x42, 8192);
+  fail_unless_equals_int (gst_pad_push (srcpad, buf), GST_FLOW_OK);
+
+  /* The old area is closed and the new one announced before the buffer */
+  while ((size = sp_client_recv (client, &data)) == 0);
+  fail_unless_equals_int (size, 8192);
+  fail_unless (data[0] == 0x42 && data[8191] == 0x42);
+  fail_unless (sp_client_recv_finish (client, data) > 0);
+
+  g_object_get (sink, "copied-buffers", &copied, NULL);
+  fail_unless_equals_uint64 (copied, 1);
+
+  sp_close (client);
+  fail_unless (gst_element_set_state (sink, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS);
+  gst_pad_set_active (srcpad, FALSE);
+  gst_check_teardown_src_pad (sink);
+  gst_check_teardown_element (sink);
+  g_free (socket_path);
+  g_free (path);
+  g_cond_free (connect_cond);
+  g_mutex_free (connect_lock);
+}
+
+GST_END_TEST;
+
+/* Creates a pipe of @size bytes with one client, the ShmClient of the
+ * writer side is returned in @wclient. Returns NULL if there are no rings
+ * while @use_rings is set */
+static ShmPipe *
+setup_pipe (size_t size, gboolean use_rings, ShmClient ** wclient,
+    ShmPipe ** client)
+{
+  ShmPipe *writer;
+  gchar *path;
+  char *data;
+
+  path = get_socket_path ();
+  writer = sp_writer_create (path, size, 0600);
+  fail_unless (writer != NULL);
+  /* without eventfd */
+  if (use_rings && sp_writer_set_use_rings (writer, TRUE) < 0) {
+    sp_close (writer);
+    g_free (path);
+    return NULL;
+  }
+  *client = sp_client_open (sp_writer_get_path (writer));
+  fail_unless (*client != NULL);
+  *wclient = sp_writer_accept_client (writer);
+  fail_unless (*wclient != NULL);
+  /* the area */
+  fail_unless_equals_int (sp_client_recv (*client, &data), 0);
+  /* and the rings */
+  if (use_rings) {
+    fail_unless_equals_int (sp_client_recv (*client, &data), 0);
+    fail_unless (sp_client_get_ring_fd (*client) >= 0);
+  }
+  g_free (path);
+
+  return writer;
+}
+
+/* Sends a block of @size bytes set to @value, @expected is the number of
+ * clients it should be sent to */
+static void
+send_block (ShmPipe * writer, char value, size_t size, int expected)
+{
+  ShmBlock *block;
+  char *buf;
+
+  block = sp_writer_alloc_block (writer, size);
+  fail_unless (block != NULL);
+  buf = sp_writer_block_get_buf (block);
+  memset (buf, value, size);
+  fail_unless_equals_int (sp_writer_send_buf (writer, buf, size), expected);
+  sp_writer_free_block (block);
+}
+
+static char *
+recv_block (ShmPipe * client, char value, long size)
+{
+  char *data = NULL;
+
+  fail_unless_equals_int (sp_client_recv (client, &data), size);
+  fail_unless (data[0] == value && data[size - 1] == value);
+
+  return data;
+}
+
+static void
+ack_block (ShmPipe * writer, ShmClient * wclient, ShmPipe * client,
+    char *data)
+{
+  fail_unless (sp_client_recv_finish (client, data) > 0);
+  fail_unless_equals_int (sp_writer_recv (writer, wclient), 0);
+}
+
+GST_START_TEST (test_drop_oldest)
+{
+  ShmPipe *writer, *client;
+  ShmClient *wclient;
+  ShmClientStats stats;
+  char *data;
+  char value;
+
+  writer = setup_pipe (3 * 1024, FALSE, &wclient, &client);
+  sp_writer_client_set_policy (wclient, SP_POLICY_DROP_OLDEST, 1, 1);
+
+  send_block (writer, 'a', 1024, 1);
+  data = recv_block (client, 'a', 1024);
+
+  /* The client never acks a, the new buffers are queued and the oldest
+   * queued one is freed right away, so the writer can still allocate */
+  for (value = 'b'; value <= 'k'; value++)
+    send_block (writer, value, 1024, 1);
+  sp_writer_client_get_stats (wclient, &stats);
+  fail_unless_equals_int (stats.sent, 1);
+  fail_unless_equals_int (stats.pending, 1);
+  fail_unless_equals_int (stats.queued, 1);
+  fail_unless_equals_int (stats.dropped, 9);
+  fail_unless (data[0] == 'a' && data[1023] == 'a');
+
+  /* Its ack sends the newest buffer */
+  ack_block (writer, wclient, client, data);
+  data = recv_block (client, 'k', 1024);
+  ack_block (writer, wclient, client, data);
+  sp_writer_client_get_stats (wclient, &stats);
+  fail_unless_equals_int (stats.sent, 2);
+  fail_unless_equals_int (stats.acked, 2);
+  fail_unless_equals_int (stats.pending, 0);
+  fail_unless_equals_int (stats.queued, 0);
+
+  sp_close (client);
+  sp_close (writer);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_disconnect_after_drops)
+{
+  ShmPipe *writer, *client;
+  ShmClient *wclient;
+  ShmClientStats stats;
+  char *data;
+
+  writer = setup_pipe (8 * 1024, FALSE, &wclient, &client);
+  sp_writer_client_set_policy (wclient, SP_POLICY_DISCONNECT, 1, 2);
+
+  /* Drops that are not in a row don't disconnect the client */
+  send_block (writer, 'a', 1024, 1);
+  data = recv_block (client, 'a', 1024);
+  send_block (writer, 'b', 1024, 0);
+  ack_block (writer, wclient, client, data);
+  send_block (writer, 'c', 1024, 1);
+  data = recv_block (client, 'c', 1024);
+  send_block (writer, 'd', 1024, 0);
+  ack_block (writer, wclient, client, data);
+  send_block (writer, 'e', 1024, 1);
+  data = recv_block (client, 'e', 1024);
+
+  /* max-drops in a row do */
+  send_block (writer, 'f', 1024, 0);
+  send_block (writer, 'g', 1024, 0);
+  sp_writer_client_get_stats (wclient, &stats);
+  fail_unless_equals_int (stats.sent, 3);
+  fail_unless_equals_int (stats.dropped, 4);
+  fail_unless (sp_client_recv (client, &data) < 0);
+
+  sp_close (client);
+  sp_close (writer);
+}
+
+GST_END_TEST;
+
+/* Number of entries of the rings of shmpipe.c */
+#define RING_SIZE 256
+
+GST_START_TEST (test_full_ring)
+{
+  ShmPipe *writer, *client;
+  ShmClient *wclient;
+  ShmClientStats stats;
+  char *data[RING_SIZE + 2];
+  int i;
+
+  writer = setup_pipe ((RING_SIZE + 2) * 64, TRUE, &wclient, &client);
+  if (!writer)
+    return;
+
+  /* The client doesn't read anything until its ring is full */
+  for (i = 0; i < RING_SIZE; i++) {
+    fail_unless (sp_writer_can_send (writer));
+    send_block (writer, i, 64, 1);
+  }
+  fail_unless (!sp_writer_can_send (writer));
+
+  /* A blocking client doesn't lose the buffers sent anyway */
+  send_block (writer, (char) RING_SIZE, 64, 1);
+  send_block (writer, (char) (RING_SIZE + 1), 64, 1);
+  sp_writer_client_get_stats (wclient, &stats);
+  fail_unless_equals_int (stats.sent, RING_SIZE);
+  fail_unless_equals_int (stats.queued, 2);
+  fail_unless_equals_int (stats.dropped, 0);
+
+  for (i = 0; i < RING_SIZE; i++) {
+    fail_unless_equals_int (sp_client_recv_ring (client, &data[i]), 64);
+    fail_unless (data[i][0] == (char) i && data[i][63] == (char) i);
+  }
+  fail_unless_equals_int (sp_client_recv_ring (client, &data[i]), 0);
+
+  /* Their acks send the queued ones, in order */
+  for (i = 0; i < RING_SIZE; i++)
+    fail_unless (sp_client_recv_finish (client, data[i]) > 0);
+  fail_unless_equals_int (sp_writer_recv_ring (writer, wclient), 0);
+  fail_unless (sp_writer_can_send (writer));
+
+  for (i = RING_SIZE; i < RING_SIZE + 2; i++) {
+    fail_unless_equals_int (sp_client_recv_ring (client, &data[i]), 64);
+    fail_unless (data[i][0] == (char) i && data[i][63] == (char) i);
+    fail_unless (sp_client_recv_finish (client, data[i]) > 0);
+  }
+  fail_unless_equals_int (sp_writer_recv_ring (writer, wclient), 0);
+  sp_writer_client_get_stats (wclient, &stats);
+  fail_unless_equals_int (stats.sent, RING_SIZE + 2);
+  fail_unless_equals_int (stats.acked, RING_SIZE + 2);
+  fail_unless_equals_int (stats.queued, 0);
+
+  sp_close (client);
+  sp_close (writer);
+}
+
+GST_END_TEST;
+
+static Suite *
+shm_suite (void)
+{
+  Suite *s = suite_create ("shm");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_test (tc_chain, test_shm_size_change);
+  tcase_add_test (tc_chain, test_drop_oldest);
+  tcase_add_test (tc_chain, test_disconnect_after_drops);
+  tcase_add_test (tc_chain, test_full_ring);
+
+  return s;
+}
+
+GST_CHECK_MAIN (shm);
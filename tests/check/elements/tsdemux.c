@@ -0,0 +1,584 @@
+/* GStreamer
+ *
+ * unit test for tsdemux seeking and indexing
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <gst/check/gstcheck.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The test stream has one MPEG-2 video stream. Every frame is a PES packet
+ * spread over PACKETS_PER_FRAME TS packets, the first one carrying the PCR
+ * of the frame and, for keyframes, the random access indicator. A PAT and
+ * a PMT precede every keyframe. It's big enough for the PCR scan from the
+ * end of tsdemux */
+#define PACKET_SIZE 188
+#define PMT_PID 0x0100
+#define VIDEO_PID 0x0101
+#define N_FRAMES 150
+#define PACKETS_PER_FRAME 40
+#define FRAMES_PER_KEYFRAME 25
+#define FRAME_DURATION (40 * GST_MSECOND)
+#define FIRST_PCR GST_SECOND
+
+static guint8 *ts_data;
+static gsize ts_size;
+static guint64 frame_offsets[N_FRAMES];
+static gchar *ts_location;
+
+typedef struct
+{
+  gint64 time;
+  gint64 offset;
+  GstAssocFlags flags;
+} TestIndexEntry;
+
+static guint32
+crc32_mpeg (const guint8 * data, guint len)
+{
+  guint32 crc = 0xffffffff;
+  guint i, j;
+
+  for (i = 0; i < len; i++) {
+    crc ^= data[i] << 24;
+    for (j = 0; j < 8; j++)
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+  }
+
+  return crc;
+}
+
+static guint8 *
+write_packet_header (guint8 * data, guint16 pid, gboolean pusi, guint8 afc,
+    guint8 * cc)
+{
+  data[0] = 0x47;
+  data[1] = (pusi ? 0x40 : 0x00) | ((pid >> 8) & 0x1f);
+  data[2] = pid & 0xff;
+  data[3] = (afc << 4) | (*cc & 0x0f);
+  *cc = (*cc + 1) & 0x0f;
+
+  return data + 4;
+}
+
+static void
+write_section (guint8 * data, guint16 pid, guint8 * cc,
+    const guint8 * section, guint len)
+{
+  data = write_packet_header (data, pid, TRUE, 1, cc);
+  /* pointer_field */
+  data[0] = 0;
+  memcpy (data + 1, section, len);
+  GST_WRITE_UINT32_BE (data + 1 + len, crc32_mpeg (section, len));
+}
+
+static void
+write_frame (guint8 * data, guint frame, guint8 * cc)
+{
+  guint64 pcr = (FIRST_PCR + frame * FRAME_DURATION) * 9 / 100000;
+  guint64 pts = pcr + 9000;
+
+  data = write_packet_header (data, VIDEO_PID, TRUE, 3, cc);
+
+  /* adaptation field with the PCR, pcr_extension is 0 */
+  data[0] = 7;
+  data[1] = 0x10 | (frame % FRAMES_PER_KEYFRAME == 0 ? 0x40 : 0x00);
+  data[2] = pcr >> 25;
+  data[3] = pcr >> 17;
+  data[4] = pcr >> 9;
+  data[5] = pcr >> 1;
+  data[6] = ((pcr & 1) << 7) | 0x7e;
+  data[7] = 0x00;
+  data += 8;
+
+  /* PES header with a PTS, the rest is stuffing */
+  data[0] = 0x00;
+  data[1] = 0x00;
+  data[2] = 0x01;
+  data[3] = 0xe0;
+  data[4] = 0x00;
+  data[5] = 0x00;
+  data[6] = 0x80;
+  data[7] = 0x80;
+  data[8] = 5;
+  data[9] = 0x21 | ((pts >> 29) & 0x0e);
+  data[10] = pts >> 22;
+  data[11] = ((pts >> 14) & 0xfe) | 0x01;
+  data[12] = pts >> 7;
+  data[13] = ((pts << 1) & 0xfe) | 0x01;
+}
+
+static void
+setup_ts_file (void)
+{
+  static const guint8 pat[] = {
+    0x00, 0xb0, 13, 0x00, 0x01, 0xc1, 0x00, 0x00,
+    0x00, 0x01, 0xe0 | (PMT_PID >> 8), PMT_PID & 0xff
+  };
+  static const guint8 pmt[] = {
+    0x02, 0xb0, 18, 0x00, 0x01, 0xc1, 0x00, 0x00,
+    0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff, 0xf0, 0x00,
+    0x02, 0xe0 | (VIDEO_PID >> 8), VIDEO_PID & 0xff, 0xf0, 0x00
+  };
+  guint8 pat_cc = 0, pmt_cc = 0, video_cc = 0;
+  guint8 *data;
+  guint frame, i;
+  GError *err = NULL;
+  gint fd;
+
+  ts_size = (N_FRAMES * PACKETS_PER_FRAME +
+      2 * (N_FRAMES / FRAMES_PER_KEYFRAME)) * PACKET_SIZE;
+  data = ts_data = g_malloc (ts_size);
+  memset (ts_data, 0xff, ts_size);
+
+  for (frame = 0; frame < N_FRAMES; frame++) {
+    if (frame % FRAMES_PER_KEYFRAME == 0) {
+      write_section (data, 0x0000, &pat_cc, pat, sizeof (pat));
+      data += PACKET_SIZE;
+      write_section (data, PMT_PID, &pmt_cc, pmt, sizeof (pmt));
+      data += PACKET_SIZE;
+    }
+
+    frame_offsets[frame] = data - ts_data;
+    write_frame (data, frame, &video_cc);
+    data += PACKET_SIZE;
+
+    for (i = 1; i < PACKETS_PER_FRAME; i++) {
+      write_packet_header (data, VIDEO_PID, FALSE, 1, &video_cc);
+      data += PACKET_SIZE;
+    }
+  }
+  fail_unless_equals_int (data - ts_data, ts_size);
+
+  fd = g_file_open_tmp ("tsdemux-test-XXXXXX.ts", &ts_location, &err);
+  fail_unless (fd != -1);
+  close (fd);
+  fail_unless (g_file_set_contents (ts_location, (gchar *) ts_data, ts_size,
+          &err));
+}
+
+static void
+teardown_ts_file (void)
+{
+  g_unlink (ts_location);
+  g_free (ts_location);
+  ts_location = NULL;
+  g_free (ts_data);
+  ts_data = NULL;
+}
+
+static void
+pad_added_cb (GstElement * demux, GstPad * pad, GstElement * sink)
+{
+  GstPad *sinkpad = gst_element_get_static_pad (sink, "sink");
+
+  if (!gst_pad_is_linked (sinkpad))
+    fail_unless (gst_pad_link (pad, sinkpad) == GST_PAD_LINK_OK);
+  gst_object_unref (sinkpad);
+}
+
+static GstElement *
+setup_pipeline (GstElement ** demux, GstElement ** sink)
+{
+  GstElement *pipeline, *src;
+
+  pipeline = gst_pipeline_new (NULL);
+  src = gst_element_factory_make ("filesrc", NULL);
+  *demux = gst_element_factory_make ("tsdemux", NULL);
+  *sink = gst_element_factory_make ("fakesink", NULL);
+  fail_unless (pipeline && src && *demux && *sink);
+
+  g_object_set (src, "location", ts_location, NULL);
+  gst_bin_add_many (GST_BIN (pipeline), src, *demux, *sink, NULL);
+  fail_unless (gst_element_link (src, *demux));
+  g_signal_connect (*demux, "pad-added", G_CALLBACK (pad_added_cb), *sink);
+
+  return pipeline;
+}
+
+static void
+wait_for_eos (GstElement * pipeline)
+{
+  GstBus *bus = gst_element_get_bus (pipeline);
+  GstMessage *msg;
+
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  fail_unless (msg != NULL);
+  fail_unless_equals_int (GST_MESSAGE_TYPE (msg), GST_MESSAGE_EOS);
+  gst_message_unref (msg);
+  gst_object_unref (bus);
+}
+
+static void
+do_seek (GstElement * pipeline, GstClockTime position, GstSeekFlags flags)
+{
+  fail_unless (gst_element_seek (pipeline, 1.0, GST_FORMAT_TIME,
+          GST_SEEK_FLAG_FLUSH | flags, GST_SEEK_TYPE_SET, position,
+          GST_SEEK_TYPE_NONE, -1));
+  fail_unless_equals_int (gst_element_get_state (pipeline, NULL, NULL,
+          GST_CLOCK_TIME_NONE), GST_STATE_CHANGE_SUCCESS);
+}
+
+static GMutex *entries_lock;
+
+static void
+entry_added_cb (GstIndex * index, GstIndexEntry * entry, GArray * entries)
+{
+  TestIndexEntry e;
+
+  if (entry->type != GST_INDEX_ENTRY_ASSOCIATION)
+    return;
+
+  fail_unless (gst_index_entry_assoc_map (entry, GST_FORMAT_TIME, &e.time));
+  fail_unless (gst_index_entry_assoc_map (entry, GST_FORMAT_BYTES,
+          &e.offset));
+  e.flags = GST_INDEX_ASSOC_FLAGS (entry);
+
+  g_mutex_lock (entries_lock);
+  g_array_append_val (entries, e);
+  g_mutex_unlock (entries_lock);
+}
+
+static GstIndex *
+setup_index (GstElement * demux, GArray * entries)
+{
+  GstIndex *index = gst_index_factory_make ("memindex");
+
+  fail_unless (index != NULL);
+  entries_lock = g_mutex_new ();
+  g_signal_connect (index, "entry-added", G_CALLBACK (entry_added_cb),
+      entries);
+  gst_element_set_index (demux, index);
+
+  return index;
+}
+
+static void
+cleanup_index (GstIndex * index)
+{
+  gst_object_unref (index);
+  g_mutex_free (entries_lock);
+  entries_lock = NULL;
+}
+
+/* Checks that all the entries are at the absolute offset of the packet
+ * carrying their PCR, that keyframe entries are keyframes and that no
+ * offset was indexed twice */
+static void
+check_index_entries (GArray * entries)
+{
+  guint i, j, frame;
+
+  for (i = 0; i < entries->len; i++) {
+    TestIndexEntry *e = &g_array_index (entries, TestIndexEntry, i);
+
+    for (frame = 0; frame < N_FRAMES; frame++)
+      if (frame_offsets[frame] == e->offset)
+        break;
+    fail_unless (frame < N_FRAMES, "No PCR at indexed offset %"
+        G_GINT64_FORMAT, e->offset);
+    fail_unless_equals_uint64 (e->time, FIRST_PCR + frame * FRAME_DURATION);
+    if (e->flags & GST_ASSOCIATION_FLAG_KEY_UNIT)
+      fail_unless_equals_int (frame % FRAMES_PER_KEYFRAME, 0);
+
+    for (j = 0; j < i; j++)
+      fail_unless (g_array_index (entries, TestIndexEntry, j).offset !=
+          e->offset);
+  }
+}
+
+static gboolean
+keyframe_indexed (GArray * entries, guint frame)
+{
+  guint i;
+
+  for (i = 0; i < entries->len; i++) {
+    TestIndexEntry *e = &g_array_index (entries, TestIndexEntry, i);
+
+    if (e->offset == frame_offsets[frame] &&
+        e->flags & GST_ASSOCIATION_FLAG_KEY_UNIT)
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+GST_START_TEST (test_index_offsets)
+{
+  GstElement *pipeline, *demux, *sink;
+  GArray *entries = g_array_new (FALSE, FALSE, sizeof (TestIndexEntry));
+  GstIndex *index;
+  guint frame;
+
+  pipeline = setup_pipeline (&demux, &sink);
+  index = setup_index (demux, entries);
+
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_PAUSED) !=
+      GST_STATE_CHANGE_FAILURE);
+  fail_unless_equals_int (gst_element_get_state (pipeline, NULL, NULL,
+          GST_CLOCK_TIME_NONE), GST_STATE_CHANGE_SUCCESS);
+
+  /* Only the start is indexed yet, so this plays on from an estimated
+   * offset and leaves a gap in the index */
+  do_seek (pipeline, GST_SECOND, 0);
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE);
+  wait_for_eos (pipeline);
+
+  g_mutex_lock (entries_lock);
+  check_index_entries (entries);
+  fail_unless (keyframe_indexed (entries,
+          N_FRAMES - N_FRAMES % FRAMES_PER_KEYFRAME - FRAMES_PER_KEYFRAME));
+  g_mutex_unlock (entries_lock);
+
+  /* Playing from the start again fills the gap */
+  do_seek (pipeline, 0, 0);
+  wait_for_eos (pipeline);
+
+  g_mutex_lock (entries_lock);
+  check_index_entries (entries);
+  for (frame = 0; frame < N_FRAMES; frame += FRAMES_PER_KEYFRAME)
+    fail_unless (keyframe_indexed (entries, frame), "Keyframe %u not indexed",
+        frame);
+  g_mutex_unlock (entries_lock);
+
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (pipeline);
+  cleanup_index (index);
+  g_array_free (entries, TRUE);
+}
+
+GST_END_TEST;
+
+typedef struct
+{
+  GMutex *lock;
+  gint64 offset;
+} PullData;
+
+static gboolean
+pull_probe_cb (GstPad * pad, GstBuffer * buffer, PullData * data)
+{
+  g_mutex_lock (data->lock);
+  if (data->offset == -1)
+    data->offset = GST_BUFFER_OFFSET (buffer);
+  g_mutex_unlock (data->lock);
+
+  return TRUE;
+}
+
+GST_START_TEST (test_seek_past_index)
+{
+  GstElement *pipeline, *demux, *sink;
+  GArray *entries = g_array_new (FALSE, FALSE, sizeof (TestIndexEntry));
+  GstIndex *index;
+  PullData data;
+  GstPad *pad;
+  gint64 last = 0;
+  guint i, frame = 120;
+
+  data.lock = g_mutex_new ();
+  data.offset = 0;
+
+  pipeline = setup_pipeline (&demux, &sink);
+  index = setup_index (demux, entries);
+  pad = gst_element_get_static_pad (demux, "sink");
+  gst_pad_add_buffer_probe (pad, G_CALLBACK (pull_probe_cb), &data);
+  gst_object_unref (pad);
+
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_PAUSED) !=
+      GST_STATE_CHANGE_FAILURE);
+  fail_unless_equals_int (gst_element_get_state (pipeline, NULL, NULL,
+          GST_CLOCK_TIME_NONE), GST_STATE_CHANGE_SUCCESS);
+
+  g_mutex_lock (entries_lock);
+  fail_unless (entries->len > 0);
+  for (i = 0; i < entries->len; i++)
+    last = MAX (last, g_array_index (entries, TestIndexEntry, i).offset);
+  g_mutex_unlock (entries_lock);
+  fail_unless (last < frame_offsets[frame - FRAMES_PER_KEYFRAME]);
+
+  g_mutex_lock (data.lock);
+  data.offset = -1;
+  g_mutex_unlock (data.lock);
+
+  /* The target is way past the last index entry, the first pull must be
+   * estimated from it instead of going through everything after it */
+  do_seek (pipeline, frame * FRAME_DURATION, 0);
+
+  g_mutex_lock (data.lock);
+  fail_unless (data.offset > last);
+  fail_unless_equals_int (data.offset % PACKET_SIZE, 0);
+  fail_unless (ABS (data.offset - (gint64) frame_offsets[frame]) <
+      PACKETS_PER_FRAME * PACKET_SIZE, "Pulled from %" G_GINT64_FORMAT
+      " instead of around %" G_GUINT64_FORMAT, data.offset,
+      frame_offsets[frame]);
+  g_mutex_unlock (data.lock);
+
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (pipeline);
+  cleanup_index (index);
+  g_array_free (entries, TRUE);
+  g_mutex_free (data.lock);
+}
+
+GST_END_TEST;
+
+typedef struct
+{
+  GMutex *lock;
+  gint64 time;
+} SegmentData;
+
+static gboolean
+event_probe_cb (GstPad * pad, GstEvent * event, SegmentData * data)
+{
+  if (GST_EVENT_TYPE (event) == GST_EVENT_NEWSEGMENT) {
+    g_mutex_lock (data->lock);
+    gst_event_parse_new_segment (event, NULL, NULL, NULL, NULL, NULL,
+        &data->time);
+    g_mutex_unlock (data->lock);
+  }
+
+  return TRUE;
+}
+
+GST_START_TEST (test_keyframe_seek)
+{
+  GstElement *pipeline, *demux, *sink;
+  SegmentData data;
+  GstPad *pad;
+
+  data.lock = g_mutex_new ();
+  data.time = -1;
+
+  pipeline = setup_pipeline (&demux, &sink);
+  pad = gst_element_get_static_pad (sink, "sink");
+  gst_pad_add_event_probe (pad, G_CALLBACK (event_probe_cb), &data);
+  gst_object_unref (pad);
+
+  /* Index the whole file first */
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE);
+  wait_for_eos (pipeline);
+
+  g_mutex_lock (data.lock);
+  data.time = -1;
+  g_mutex_unlock (data.lock);
+
+  /* The segment starts at the previous keyframe, FIRST_PCR is time 0 */
+  do_seek (pipeline, 2 * GST_SECOND + GST_SECOND / 2, GST_SEEK_FLAG_KEY_UNIT);
+  wait_for_eos (pipeline);
+
+  g_mutex_lock (data.lock);
+  fail_unless_equals_uint64 (data.time, 2 * GST_SECOND);
+  g_mutex_unlock (data.lock);
+
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (pipeline);
+  g_mutex_free (data.lock);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_index_file)
+{
+  GstElement *pipeline, *demux, *sink;
+  GArray *entries = g_array_new (FALSE, FALSE, sizeof (TestIndexEntry));
+  GstIndex *index;
+  GError *err = NULL;
+  gchar *index_location, *contents;
+  gsize size;
+  guint frame;
+  gint fd;
+
+  fd = g_file_open_tmp ("tsdemux-test-XXXXXX.idx", &index_location, &err);
+  fail_unless (fd != -1);
+  close (fd);
+  g_unlink (index_location);
+
+  /* Saved when going back to READY */
+  pipeline = setup_pipeline (&demux, &sink);
+  g_object_set (demux, "index-location", index_location, NULL);
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_PLAYING) !=
+      GST_STATE_CHANGE_FAILURE);
+  wait_for_eos (pipeline);
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (pipeline);
+
+  fail_unless (g_file_get_contents (index_location, &contents, &size, &err));
+  fail_unless (size > 28);
+  fail_unless (memcmp (contents, "TSIX", 4) == 0);
+  fail_unless_equals_int (GST_READ_UINT32_BE (contents + 4), 1);
+  fail_unless_equals_uint64 (GST_READ_UINT64_BE (contents + 8), ts_size);
+  fail_unless_equals_uint64 (GST_READ_UINT64_BE (contents + 16), FIRST_PCR);
+  fail_unless_equals_int (28 + GST_READ_UINT32_BE (contents + 24) * 17, size);
+  g_free (contents);
+
+  /* and loaded once the first PCR is known, before anything is played */
+  pipeline = setup_pipeline (&demux, &sink);
+  g_object_set (demux, "index-location", index_location, NULL);
+  index = setup_index (demux, entries);
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_PAUSED) !=
+      GST_STATE_CHANGE_FAILURE);
+  fail_unless_equals_int (gst_element_get_state (pipeline, NULL, NULL,
+          GST_CLOCK_TIME_NONE), GST_STATE_CHANGE_SUCCESS);
+
+  g_mutex_lock (entries_lock);
+  check_index_entries (entries);
+  for (frame = 0; frame < N_FRAMES; frame += FRAMES_PER_KEYFRAME)
+    fail_unless (keyframe_indexed (entries, frame), "Keyframe %u not loaded",
+        frame);
+  g_mutex_unlock (entries_lock);
+
+  fail_unless (gst_element_set_state (pipeline, GST_STATE_NULL) ==
+      GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (pipeline);
+  cleanup_index (index);
+  g_array_free (entries, TRUE);
+
+  g_unlink (index_location);
+  g_free (index_location);
+}
+
+GST_END_TEST;
+
+static Suite *
+tsdemux_suite (void)
+{
+  Suite *s = suite_create ("tsdemux");
+  TCase *tc_chain = tcase_create ("general");
+
+  suite_add_tcase (s, tc_chain);
+  tcase_add_checked_fixture (tc_chain, setup_ts_file, teardown_ts_file);
+
+  tcase_add_test (tc_chain, test_index_offsets);
+  tcase_add_test (tc_chain, test_seek_past_index);
+  tcase_add_test (tc_chain, test_keyframe_seek);
+  tcase_add_test (tc_chain, test_index_file);
+
+  return s;
+}
+
+GST_CHECK_MAIN (tsdemux);
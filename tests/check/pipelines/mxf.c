@@ -21,7 +21,9 @@
  */
 
 #include <gst/check/gstcheck.h>
+#include <glib/gstdio.h>
 #include <string.h>
+#include <unistd.h>
 
 static const gchar *
 get_mpeg2enc_element_name (void)
@@ -260,6 +262,294 @@ GST_START_TEST (test_multiple_av_streams)
 
 GST_END_TEST;
 
+/* Pulls of at least this size are essence elements */
+#define MIN_ESSENCE_PULL_SIZE 4096
+
+typedef struct
+{
+  gint n_essence_pulls;
+  gboolean have_buffer;
+  GstClockTime timestamp;
+  gboolean delta_unit;
+  /* Timestamps of the muxed pictures in stored order, to check the
+   * temporal offsets of a VBE index if not NULL */
+  GArray *timestamps;
+} SeekTestData;
+
+static gboolean
+count_pull_cb (GstPad * pad, GstBuffer * buffer, SeekTestData * data)
+{
+  if (GST_BUFFER_SIZE (buffer) >= MIN_ESSENCE_PULL_SIZE)
+    g_atomic_int_inc (&data->n_essence_pulls);
+
+  return TRUE;
+}
+
+static void
+preroll_handoff_cb (GstElement * sink, GstBuffer * buffer, GstPad * pad,
+    SeekTestData * data)
+{
+  if (data->have_buffer)
+    return;
+
+  data->have_buffer = TRUE;
+  data->timestamp = GST_BUFFER_TIMESTAMP (buffer);
+  data->delta_unit =
+      GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+}
+
+static gboolean
+store_timestamp_cb (GstPad * pad, GstBuffer * buffer, GArray * timestamps)
+{
+  GstClockTime timestamp = GST_BUFFER_TIMESTAMP (buffer);
+
+  g_array_append_val (timestamps, timestamp);
+
+  return TRUE;
+}
+
+static guint64
+read_ber_length (const guint8 * data, gsize size, gsize * offset)
+{
+  guint64 length = 0;
+  guint n;
+
+  fail_unless (*offset < size);
+  if (!(data[*offset] & 0x80))
+    return data[(*offset)++];
+
+  n = data[(*offset)++] & 0x7f;
+  fail_unless (n <= 8 && *offset + n <= size);
+  while (n--)
+    length = (length << 8) | data[(*offset)++];
+
+  return length;
+}
+
+/* Reads the temporal offsets of all index table segments of the file at
+ * @location, indexed by position. Missing entries are G_MININT */
+static GArray *
+read_temporal_offsets (const gchar * location)
+{
+  static const guint8 index_table_segment_key[] = {
+    0x06, 0x0e, 0x2b, 0x34, 0x02, 0x53, 0x01, 0x01,
+    0x0d, 0x01, 0x02, 0x01, 0x01, 0x10, 0x01, 0x00
+  };
+  GArray *offsets = g_array_new (FALSE, FALSE, sizeof (gint));
+  gchar *contents;
+  const guint8 *data;
+  gsize size, offset = 0;
+
+  fail_unless (g_file_get_contents (location, &contents, &size, NULL));
+  data = (const guint8 *) contents;
+
+  while (offset + 16 < size) {
+    gboolean is_index = memcmp (data + offset, index_table_segment_key,
+        16) == 0;
+    guint64 length, start = 0, end, i;
+
+    offset += 16;
+    length = read_ber_length (data, size, &offset);
+    fail_unless (offset + length <= size);
+    end = offset + length;
+
+    /* local sets: 2 byte tag, 2 byte length */
+    while (is_index && offset + 4 <= end) {
+      guint16 tag = GST_READ_UINT16_BE (data + offset);
+      guint16 len = GST_READ_UINT16_BE (data + offset + 2);
+      const guint8 *value = data + offset + 4;
+
+      fail_unless (offset + 4 + len <= end);
+      if (tag == 0x3f0c && len == 8) {
+        start = GST_READ_UINT64_BE (value);
+      } else if (tag == 0x3f0a && len >= 8) {
+        guint32 n = GST_READ_UINT32_BE (value);
+        guint32 entry_len = GST_READ_UINT32_BE (value + 4);
+
+        fail_unless (entry_len >= 11 && 8 + n * entry_len <= len);
+        for (i = 0; i < n; i++) {
+          gint missing = G_MININT;
+
+          while (offsets->len <= start + i)
+            g_array_append_val (offsets, missing);
+          g_array_index (offsets, gint, start + i) =
+              (gint8) value[8 + i * entry_len];
+        }
+      }
+      offset += 4 + len;
+    }
+    offset = end;
+  }
+
+  g_free (contents);
+
+  return offsets;
+}
+
+/* The entry at the display position of every picture leads to its stored
+ * position, in whichever partition they are */
+static void
+check_temporal_offsets (const gchar * location, GArray * timestamps)
+{
+  GArray *offsets = read_temporal_offsets (location);
+  GstClockTime first = g_array_index (timestamps, GstClockTime, 0);
+  guint i;
+
+  fail_unless (offsets->len > 0);
+  for (i = 0; i < timestamps->len; i++) {
+    GstClockTime timestamp = g_array_index (timestamps, GstClockTime, i);
+    guint display;
+
+    /* leading pictures of the first GOP are not indexed */
+    if (timestamp < first)
+      continue;
+
+    display = gst_util_uint64_scale_round (timestamp - first, 25, GST_SECOND);
+    fail_unless (display < offsets->len);
+    fail_unless_equals_int (g_array_index (offsets, gint, display),
+        (gint) i - (gint) display);
+  }
+
+  g_array_free (offsets, TRUE);
+}
+
+/* Muxes the video of @src_string into a file with body partitions every
+ * second and plays it with mxfdemux in pull mode. After seeking to
+ * @position the index table segments have to be used to find the essence
+ * instead of going through it */
+static void
+run_seek_test (const gchar * src_string, GstClockTime position,
+    GstSeekFlags flags, SeekTestData * data)
+{
+  GstElement *pipeline, *demux, *sink;
+  GstMessage *msg;
+  GstBus *bus;
+  GstPad *pad;
+  gchar *location, *pipeline_string;
+  gint fd;
+
+  fd = g_file_open_tmp ("mxf-test-XXXXXX.mxf", &location, NULL);
+  fail_unless (fd != -1);
+  close (fd);
+
+  pipeline_string = g_strdup_printf ("%s ! identity name=stored ! "
+      "mxfmux partition-interval=1000000000 ! filesink location=%s",
+      src_string, location);
+  GST_DEBUG ("Writing with pipeline '%s'", pipeline_string);
+  pipeline = gst_parse_launch (pipeline_string, NULL);
+  fail_unless (pipeline != NULL);
+  g_free (pipeline_string);
+
+  if (data->timestamps) {
+    GstElement *stored = gst_bin_get_by_name (GST_BIN (pipeline), "stored");
+
+    pad = gst_element_get_static_pad (stored, "src");
+    gst_pad_add_buffer_probe (pad, G_CALLBACK (store_timestamp_cb),
+        data->timestamps);
+    gst_object_unref (pad);
+    gst_object_unref (stored);
+  }
+
+  bus = gst_element_get_bus (pipeline);
+  fail_unless (gst_element_set_state (pipeline,
+          GST_STATE_PLAYING) != GST_STATE_CHANGE_FAILURE);
+  msg = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE,
+      GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+  fail_unless (GST_MESSAGE_TYPE (msg) == GST_MESSAGE_EOS);
+  gst_message_unref (msg);
+  fail_unless (gst_element_set_state (pipeline,
+          GST_STATE_NULL) == GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (bus);
+  gst_object_unref (pipeline);
+
+  if (data->timestamps)
+    check_temporal_offsets (location, data->timestamps);
+
+  pipeline_string = g_strdup_printf ("filesrc location=%s ! "
+      "mxfdemux name=demux ! fakesink name=sink signal-handoffs=true",
+      location);
+  pipeline = gst_parse_launch (pipeline_string, NULL);
+  fail_unless (pipeline != NULL);
+  g_free (pipeline_string);
+
+  demux = gst_bin_get_by_name (GST_BIN (pipeline), "demux");
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  fail_unless (demux != NULL && sink != NULL);
+  g_signal_connect (sink, "preroll-handoff",
+      G_CALLBACK (preroll_handoff_cb), data);
+
+  fail_unless (gst_element_set_state (pipeline,
+          GST_STATE_PAUSED) != GST_STATE_CHANGE_FAILURE);
+  fail_unless (gst_element_get_state (pipeline, NULL, NULL,
+          GST_CLOCK_TIME_NONE) == GST_STATE_CHANGE_SUCCESS);
+
+  /* Everything pulled from here on is for the seek */
+  pad = gst_element_get_static_pad (demux, "sink");
+  gst_pad_add_buffer_probe (pad, G_CALLBACK (count_pull_cb), data);
+  gst_object_unref (pad);
+  data->n_essence_pulls = 0;
+  data->have_buffer = FALSE;
+
+  fail_unless (gst_element_seek_simple (pipeline, GST_FORMAT_TIME,
+          GST_SEEK_FLAG_FLUSH | flags, position));
+  fail_unless (gst_element_get_state (pipeline, NULL, NULL,
+          GST_CLOCK_TIME_NONE) == GST_STATE_CHANGE_SUCCESS);
+  fail_unless (data->have_buffer);
+
+  fail_unless (gst_element_set_state (pipeline,
+          GST_STATE_NULL) == GST_STATE_CHANGE_SUCCESS);
+  gst_object_unref (sink);
+  gst_object_unref (demux);
+  gst_object_unref (pipeline);
+
+  g_unlink (location);
+  g_free (location);
+}
+
+GST_START_TEST (test_raw_video_seek)
+{
+  SeekTestData data = { 0, };
+
+  /* CBE index, frame 40 of 50 is in the second body partition and indexed
+   * in the footer */
+  run_seek_test ("videotestsrc num-buffers=50 ! "
+      "video/x-raw-yuv,format=(GstFourcc)v308,width=320,height=240,framerate=25/1",
+      1600 * GST_MSECOND, GST_SEEK_FLAG_ACCURATE, &data);
+
+  fail_unless_equals_uint64 (data.timestamp, 1600 * GST_MSECOND);
+  /* the element the seek went to and the one after it */
+  fail_unless (data.n_essence_pulls <= 2);
+}
+
+GST_END_TEST;
+
+GST_START_TEST (test_mpeg2_keyframe_seek)
+{
+  const gchar *mpeg2enc_name = get_mpeg2enc_element_name ();
+  SeekTestData data = { 0, };
+  gchar *src;
+
+  if (!mpeg2enc_name)
+    return;
+
+  /* VBE index, the keyframe offsets lead back to the start of the GOP and
+   * the temporal offsets to the stored pictures, also around partitions */
+  data.timestamps = g_array_new (FALSE, FALSE, sizeof (GstClockTime));
+  src = g_strdup_printf ("videotestsrc num-buffers=100 ! "
+      "video/x-raw-yuv,width=320,height=240,framerate=25/1 ! %s",
+      mpeg2enc_name);
+  run_seek_test (src, 2600 * GST_MSECOND, GST_SEEK_FLAG_KEY_UNIT, &data);
+  g_free (src);
+
+  fail_unless (GST_CLOCK_TIME_IS_VALID (data.timestamp));
+  fail_unless (data.timestamp <= 2600 * GST_MSECOND);
+  fail_unless (!data.delta_unit);
+  fail_unless (data.n_essence_pulls <= 2);
+  g_array_free (data.timestamps, TRUE);
+}
+
+GST_END_TEST;
+
 static Suite *
 mxf_suite (void)
 {
@@ -275,6 +565,8 @@ mxf_suite (void)
   tcase_add_test (tc_chain, test_jpeg2000_alaw);
   tcase_add_test (tc_chain, test_dnxhd_mp3);
   tcase_add_test (tc_chain, test_multiple_av_streams);
+  tcase_add_test (tc_chain, test_raw_video_seek);
+  tcase_add_test (tc_chain, test_mpeg2_keyframe_seek);
 
   return s;
 }